@@ -0,0 +1,115 @@
+/**
+ * @file bench-insert.c
+ * @brief Benchmark: do_insert throughput, with and without the in-memory indexes.
+ *
+ * Inserts N distinct tiny images in a fresh imgStore of N slots, once with the
+ * indexes built by do_open and once after releasing them (so that do_insert
+ * falls back to linear scans of the metadata). The linear runs are quadratic:
+ * they insert at most BENCH_LINEAR_MAX images.
+ *
+ * Usage: bench/bench-insert [N ...]   (default: 10000 100000)
+ */
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+
+#include "imgStore.h"
+#include "tests/tests.h" // create_test_store
+#include "imgst_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <vips/vips.h>
+
+#define BENCH_FILE "bench-insert.imgst"
+#define ID_SIZE 32
+
+#ifndef BENCH_LINEAR_MAX
+#define BENCH_LINEAR_MAX 10000 // images of the runs without indexes
+#endif
+
+// ======================================================================
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// ======================================================================
+/**
+ * @brief Encodes a tiny black JPEG; callers make copies distinct by
+ *        appending bytes after its end marker (ignored by decoders).
+ */
+static int tiny_jpeg(void **buffer, size_t *size)
+{
+    VipsImage *image = NULL;
+    M_REQ(vips_black(&image, 16, 16, NULL) == VIPS_ERR_NONE, ERR_IMGLIB, "vips_black failed");
+    const int err = vips_jpegsave_buffer(image, buffer, size, NULL) == VIPS_ERR_NONE ? ERR_NONE : ERR_IMGLIB;
+    g_object_unref(image);
+    return err;
+}
+
+// ======================================================================
+static int run(uint32_t nb_images, int with_indexes, const char *jpeg, size_t jpeg_size)
+{
+    imgst_file store;
+    int err = create_test_store(BENCH_FILE, nb_images);
+    M_REQ(err == ERR_NONE, err, "create_test_store failed");
+    err = do_open(BENCH_FILE, "r+b", &store);
+    M_REQ(err == ERR_NONE, err, "do_open failed");
+    if (!with_indexes) index_free(&store);
+
+    char *buffer = malloc(jpeg_size + sizeof(uint32_t));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(buffer, ERR_OUT_OF_MEMORY);
+    memcpy(buffer, jpeg, jpeg_size);
+
+    char id[ID_SIZE];
+    const double start = now();
+    for (uint32_t i = 0; i < nb_images && err == ERR_NONE; ++i) {
+        memcpy(buffer + jpeg_size, &i, sizeof(i));
+        snprintf(id, sizeof(id), "img%" PRIu32, i);
+        err = do_insert(buffer, jpeg_size + sizeof(i), id, &store);
+    }
+    const double elapsed = now() - start;
+
+    if (err == ERR_NONE) {
+        printf("%8" PRIu32 " images  %-10s %9.3f s  %10.0f inserts/s\n",
+                nb_images, with_indexes ? "indexed" : "linear", elapsed, nb_images / elapsed);
+    }
+
+    free(buffer);
+    do_close(&store);
+    remove(BENCH_FILE);
+    return err;
+}
+
+// ======================================================================
+int main(int argc, char *argv[])
+{
+    if (vips_init(argv[0])) {
+        vips_error_exit("unable to start vips");
+    }
+
+    void *jpeg = NULL;
+    size_t jpeg_size = 0;
+    int err = tiny_jpeg(&jpeg, &jpeg_size);
+
+    const char *defaults[] = { "10000", "100000" };
+    const int nb_sizes = argc > 1 ? argc - 1 : 2;
+    for (int i = 0; i < nb_sizes && err == ERR_NONE; ++i) {
+        const uint32_t nb_images = (uint32_t) strtoul(argc > 1 ? argv[i + 1] : defaults[i], NULL, 10);
+        err = run(nb_images, 1, jpeg, jpeg_size);
+        if (err == ERR_NONE) err = run(nb_images < BENCH_LINEAR_MAX ? nb_images : BENCH_LINEAR_MAX, 0, jpeg, jpeg_size);
+    }
+
+    g_free(jpeg);
+    vips_shutdown();
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[err]);
+    }
+    return err;
+}
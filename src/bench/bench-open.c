@@ -0,0 +1,166 @@
+/**
+ * @file bench-open.c
+ * @brief Benchmark: transfer of the metadata table at store creation and opening,
+ *        one record per call versus IMGST_IO_CHUNK records per call.
+ *
+ * For each store size, writes then reads the metadata table ROUNDS times with
+ * each strategy (the file stays in the page cache, so this measures the calls,
+ * not the disk), and finally times do_open and do_open_mapped on the same store,
+ * empty then full: the mapping itself does not depend on the number of images,
+ * but building the indexes of a full store does.
+ *
+ * Usage: bench/bench-open [N ...]   (default: 1000 10000 100000)
+ */
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+
+#include "imgStore.h"
+#include "tests/tests.h" // create_test_store
+#include "imgst_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#define BENCH_FILE "bench-open.imgst"
+#define ROUNDS 10
+
+// ======================================================================
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// ======================================================================
+/**
+ * @brief Transfers the metadata table as do_open/do_create used to: one record per call.
+ */
+static int transfer_per_record(imgst_file *store, FILE *file, int writing)
+{
+    for (uint32_t i = 0; i < store->header.max_files; ++i) {
+        const size_t done = writing ? fwrite(&store->metadata[i], sizeof(struct img_metadata), 1, file)
+                                    : fread(&store->metadata[i], sizeof(struct img_metadata), 1, file);
+        M_REQ(done == 1, ERR_IO, "transfer of one record failed");
+    }
+    return ERR_NONE;
+}
+
+// ======================================================================
+static int transfer_bulk(imgst_file *store, FILE *file, int writing)
+{
+    return writing ? write_metadata_table(store, file) : read_metadata_table(store, file);
+}
+
+// ======================================================================
+/**
+ * @brief Times ROUNDS transfers of the table of store, from/to the start of the metadata in BENCH_FILE.
+ */
+static int time_transfers(imgst_file *store, int writing, int (*transfer)(imgst_file *, FILE *, int),
+                          double *elapsed)
+{
+    int err = ERR_NONE;
+    const double start = now();
+    for (int round = 0; round < ROUNDS && err == ERR_NONE; ++round) {
+        FILE *file = fopen(BENCH_FILE, "r+b");
+        M_REQUIRE_NON_NULL_CUSTOM_ERR(file, ERR_IO);
+        err = fseek(file, sizeof(struct imgst_header), SEEK_SET) == 0 ? transfer(store, file, writing) : ERR_IO;
+        fclose(file);
+    }
+    *elapsed = (now() - start) / ROUNDS;
+    return err;
+}
+
+// ======================================================================
+/**
+ * @brief Times ROUNDS openings of BENCH_FILE by do_open and by do_open_mapped.
+ */
+static int time_opens(double *heap, double *mapped_open)
+{
+    int err = ERR_NONE;
+    for (int mapped = 0; mapped <= 1 && err == ERR_NONE; ++mapped) {
+        const double start = now();
+        for (int round = 0; round < ROUNDS && err == ERR_NONE; ++round) {
+            imgst_file opened;
+            err = mapped ? do_open_mapped(BENCH_FILE, "r+b", &opened) : do_open(BENCH_FILE, "r+b", &opened);
+            if (err == ERR_NONE) do_close(&opened);
+        }
+        *(mapped ? mapped_open : heap) = (now() - start) / ROUNDS;
+    }
+    return err;
+}
+
+// ======================================================================
+/**
+ * @brief Fills all the slots of store in memory, with distinct img_ids and contents.
+ */
+static void populate(imgst_file *store)
+{
+    for (uint32_t i = 0; i < store->header.max_files; ++i) {
+        img_metadata *metadata = &store->metadata[i];
+        // in no particular order, as the indexes get them
+        const uint32_t key = i * 2654435761u;
+        snprintf(metadata->img_id, MAX_IMG_ID, "img%08" PRIx32, key);
+        memcpy(metadata->SHA, &key, sizeof(key));
+        metadata->is_valid = NON_EMPTY;
+    }
+    store->header.num_files = store->header.max_files;
+}
+
+// ======================================================================
+static int run(uint32_t nb_slots)
+{
+    imgst_file store;
+    int err = create_test_store(BENCH_FILE, nb_slots);
+    M_REQ(err == ERR_NONE, err, "create_test_store failed");
+
+    double empty_heap = 0, empty_mapped = 0;
+    err = time_opens(&empty_heap, &empty_mapped);
+    M_REQ(err == ERR_NONE, err, "opening failed");
+
+    err = do_open(BENCH_FILE, "r+b", &store);
+    M_REQ(err == ERR_NONE, err, "do_open failed");
+    populate(&store); // written by the transfers
+
+    double write_record = 0, write_bulk = 0, read_record = 0, read_bulk = 0;
+    if (err == ERR_NONE) err = time_transfers(&store, 1, transfer_per_record, &write_record);
+    if (err == ERR_NONE) err = time_transfers(&store, 1, transfer_bulk, &write_bulk);
+    if (err == ERR_NONE) err = time_transfers(&store, 0, transfer_per_record, &read_record);
+    if (err == ERR_NONE) err = time_transfers(&store, 0, transfer_bulk, &read_bulk);
+    if (err == ERR_NONE) err = write_header(&store);
+    do_close(&store);
+
+    double full_heap = 0, full_mapped = 0;
+    if (err == ERR_NONE) err = time_opens(&full_heap, &full_mapped);
+
+    if (err == ERR_NONE) {
+        printf("%8" PRIu32 " slots  write %8.3f / %8.3f ms  read %8.3f / %8.3f ms  "
+               "do_open %8.3f / %8.3f ms  do_open_mapped %8.3f / %8.3f ms\n",
+               nb_slots, write_record * 1e3, write_bulk * 1e3, read_record * 1e3, read_bulk * 1e3,
+               empty_heap * 1e3, full_heap * 1e3, empty_mapped * 1e3, full_mapped * 1e3);
+    }
+
+    remove(BENCH_FILE);
+    return err;
+}
+
+// ======================================================================
+int main(int argc, char *argv[])
+{
+    const char *defaults[] = { "1000", "10000", "100000" };
+    const int nb_sizes = argc > 1 ? argc - 1 : 3;
+
+    printf("(per record / %d records per call; opening an empty / a full store)\n", IMGST_IO_CHUNK);
+    int err = ERR_NONE;
+    for (int i = 0; i < nb_sizes && err == ERR_NONE; ++i) {
+        err = run((uint32_t) strtoul(argc > 1 ? argv[i + 1] : defaults[i], NULL, 10));
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[err]);
+    }
+    return err;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file bench-resize.c
+ * @brief Benchmark: computation of the thumbnail and small versions of images,
+ *        decoding the whole original then resizing it (as lazily_resize used to)
+ *        versus shrinking on load (lazily_resize_compute).
+ *
+ * Each image is inserted in a fresh imgStore, then each version is computed
+ * ROUNDS times with each strategy. Every (image, strategy) pair runs in its own
+ * child process, so that the peak RSS reported is that of the strategy alone.
+ *
+ * Usage: bench/bench-resize [image.jpg ...]   (default: the originals of tests/data)
+ */
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+
+#include "imgStore.h"
+#include "tests/tests.h" // create_test_store
+#include "image_content.h"
+#include "imgst_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vips/vips.h>
+
+#define BENCH_FILE "bench-resize.imgst"
+#define BENCH_ID "bench"
+#define ROUNDS 10
+
+// ======================================================================
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// ======================================================================
+/**
+ * @brief Computes a resized version as lazily_resize used to: full decode, then vips_resize.
+ */
+static int decode_then_resize(int size_code, const imgst_file *store, size_t position, void **out, size_t *len)
+{
+    const uint32_t size = store->metadata[position].size[RES_ORIG];
+    void *data = malloc(size);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(data, ERR_OUT_OF_MEMORY);
+    int err = read_at(store, data, size, store->metadata[position].offset[RES_ORIG]);
+
+    VipsImage *original = NULL;
+    VipsImage *resized = NULL;
+    if (err == ERR_NONE && vips_jpegload_buffer(data, size, &original, NULL) != 0) err = ERR_IMGLIB;
+    if (err == ERR_NONE) {
+        const double h_ratio = (double) store->header.res_resized[2 * size_code] / vips_image_get_width(original);
+        const double v_ratio = (double) store->header.res_resized[2 * size_code + 1] / vips_image_get_height(original);
+        if (vips_resize(original, &resized, h_ratio < v_ratio ? h_ratio : v_ratio, NULL) != 0) err = ERR_IMGLIB;
+    }
+    if (err == ERR_NONE && vips_jpegsave_buffer(resized, out, len, NULL) != 0) err = ERR_IMGLIB;
+
+    if (resized != NULL) g_object_unref(resized);
+    if (original != NULL) g_object_unref(original);
+    free(data);
+    return err;
+}
+
+// ======================================================================
+/**
+ * @brief Times ROUNDS computations of both versions of the image in slot 0 of store.
+ */
+static int time_strategy(int (*compute)(int, const imgst_file *, size_t, void **, size_t *),
+                         const imgst_file *store, double elapsed[2])
+{
+    int err = ERR_NONE;
+    for (int size_code = RES_THUMB; size_code <= RES_SMALL && err == ERR_NONE; ++size_code) {
+        const double start = now();
+        for (int round = 0; round < ROUNDS && err == ERR_NONE; ++round) {
+            void *out = NULL;
+            size_t len = 0;
+            err = compute(size_code, store, 0, &out, &len);
+            g_free(out);
+        }
+        elapsed[size_code] = (now() - start) / ROUNDS;
+    }
+    return err;
+}
+
+// ======================================================================
+/**
+ * @brief Child process: inserts the image in a fresh store and times one strategy.
+ */
+static int run(const char *path, int shrink_on_load)
+{
+    char *buffer = NULL;
+    size_t size = 0;
+    M_REQUIRE(g_file_get_contents(path, &buffer, &size, NULL), ERR_IO, "unable to read %s", path);
+
+    imgst_file store;
+    int err = create_test_store(BENCH_FILE, 1);
+    if (err == ERR_NONE) err = do_open(BENCH_FILE, "r+b", &store);
+    if (err == ERR_NONE) {
+        err = do_insert(buffer, size, BENCH_ID, &store);
+        double elapsed[2] = { 0, 0 };
+        if (err == ERR_NONE) {
+            err = time_strategy(shrink_on_load ? lazily_resize_compute : decode_then_resize, &store, elapsed);
+        }
+        do_close(&store);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        if (err == ERR_NONE) {
+            printf("%-32s %-16s thumb %8.3f ms  small %8.3f ms  peak RSS %8ld KiB\n",
+                   path, shrink_on_load ? "shrink-on-load" : "decode+resize",
+                   elapsed[RES_THUMB] * 1e3, elapsed[RES_SMALL] * 1e3, usage.ru_maxrss);
+        }
+    }
+
+    remove(BENCH_FILE);
+    g_free(buffer);
+    return err;
+}
+
+// ======================================================================
+int main(int argc, char *argv[])
+{
+    const char *defaults[] = { "tests/data/papillon.jpg", "tests/data/coquelicots.jpg", "tests/data/foret.jpg" };
+    const int nb_images = argc > 1 ? argc - 1 : 3;
+
+    printf("(average of %d rounds, %dx%d and %dx%d boxes)\n", ROUNDS,
+           DEFAULT_RES_THUMB, DEFAULT_RES_THUMB, DEFAULT_RES_SMALL, DEFAULT_RES_SMALL);
+    fflush(stdout);
+
+    int err = ERR_NONE;
+    for (int i = 0; i < 2 * nb_images && err == ERR_NONE; ++i) {
+        const pid_t child = fork();
+        M_REQ(child >= 0, ERR_IO, "fork failed");
+        if (child == 0) {
+            if (vips_init(argv[0])) {
+                vips_error_exit("unable to start vips");
+            }
+            err = run(argc > 1 ? argv[i / 2 + 1] : defaults[i / 2], i % 2);
+            vips_shutdown();
+            if (err != ERR_NONE) {
+                fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[err]);
+            }
+            exit(err);
+        }
+
+        int status = 0;
+        waitpid(child, &status, 0);
+        err = WIFEXITED(status) ? WEXITSTATUS(status) : ERR_IO;
+    }
+    return err;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file bench-sha.c
+ * @brief Benchmark: SHA-256 throughput of the legacy SHA256() one-shot versus the
+ *        EVP interface (used by do_insert), on 1 to all the cores.
+ *
+ * Each thread hashes its own buffer of the given size for about DURATION seconds;
+ * the throughput is reported in total and per thread. Both interfaces end in the
+ * same assembly of OpenSSL, which uses the SHA extensions of the CPU if any
+ * (reported first; OPENSSL_ia32cap="~0x20000000" in the environment disables them).
+ *
+ * Usage: bench/bench-sha [size_in_KiB ...]   (default: 64 1024 8192)
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, sysconf
+
+#include "imgStore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define DURATION 1.0
+
+// ======================================================================
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// ======================================================================
+/**
+ * @brief Whether the CPU has the SHA extensions (CPUID leaf 7, EBX bit 29).
+ */
+static int cpu_has_sha(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) != 0;
+#else
+    return 0;
+#endif
+}
+
+// ======================================================================
+struct hasher {
+    int use_evp;
+    size_t size;
+    double bytes; // hashed
+    int err;
+};
+
+// ------------------------------------------------------------
+static void *hash_for_a_while(void *arg)
+{
+    struct hasher *hasher = arg;
+    unsigned char *buffer = malloc(hasher->size);
+    if (buffer == NULL) {
+        hasher->err = ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    memset(buffer, 0x5A, hasher->size);
+
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    const double start = now();
+    while (hasher->err == ERR_NONE && now() - start < DURATION) {
+        if (hasher->use_evp) {
+            if (EVP_Digest(buffer, hasher->size, SHA, NULL, EVP_sha256(), NULL) != 1) hasher->err = ERR_OUT_OF_MEMORY;
+        } else {
+            SHA256(buffer, hasher->size, SHA);
+        }
+        hasher->bytes += (double) hasher->size;
+    }
+    hasher->bytes /= now() - start;
+
+    free(buffer);
+    return NULL;
+}
+
+// ======================================================================
+static int run(size_t size, size_t nb_threads, int use_evp)
+{
+    struct hasher *hashers = calloc(nb_threads, sizeof(struct hasher));
+    pthread_t *threads = calloc(nb_threads, sizeof(pthread_t));
+    M_REQ_CLEAN(hashers != NULL && threads != NULL, ERR_OUT_OF_MEMORY, "out of memory", 2, hashers, threads);
+
+    size_t started = 0;
+    for (; started < nb_threads; ++started) {
+        hashers[started] = (struct hasher) { use_evp, size, 0.0, ERR_NONE };
+        if (pthread_create(&threads[started], NULL, hash_for_a_while, &hashers[started]) != 0) break;
+    }
+
+    double total = 0.0;
+    int err = started == nb_threads ? ERR_NONE : ERR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+        total += hashers[i].bytes;
+        if (hashers[i].err != ERR_NONE) err = hashers[i].err;
+    }
+
+    if (err == ERR_NONE) {
+        printf("%8zu KiB  %-9s %3zu thread(s)  %9.1f MB/s  %8.1f MB/s per core\n",
+               size / 1024, use_evp ? "EVP" : "SHA256()", nb_threads, total / 1e6, total / 1e6 / (double) nb_threads);
+    }
+    free(hashers);
+    free(threads);
+    return err;
+}
+
+// ======================================================================
+int main(int argc, char *argv[])
+{
+    const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%s, CPU SHA extensions: %s\n", OpenSSL_version(OPENSSL_VERSION), cpu_has_sha() ? "yes" : "no");
+
+    const char *default_sizes[] = { "64", "1024", "8192" };
+    const char **sizes = argc > 1 ? (const char **) argv + 1 : default_sizes;
+    const int nb_sizes = argc > 1 ? argc - 1 : (int) (sizeof(default_sizes) / sizeof(default_sizes[0]));
+
+    int err = ERR_NONE;
+    for (int i = 0; i < nb_sizes && err == ERR_NONE; ++i) {
+        const size_t size = strtoul(sizes[i], NULL, 10) * 1024;
+        M_REQ(size > 0, ERR_INVALID_ARGUMENT, "sizes are positive numbers of KiB");
+        for (size_t nb_threads = 1; err == ERR_NONE; nb_threads *= 2) {
+            if (nb_threads > (size_t) nb_cpus) nb_threads = (size_t) nb_cpus;
+            for (int use_evp = 0; use_evp <= 1 && err == ERR_NONE; ++use_evp) {
+                err = run(size, nb_threads, use_evp);
+            }
+            if (nb_threads >= (size_t) nb_cpus) break;
+        }
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[err]);
+    }
+    return err;
+}
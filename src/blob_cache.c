@@ -0,0 +1,258 @@
+/**
+ * @file blob_cache.c
+ * @brief Byte-bounded LRU cache of image contents, shared by threads.
+ *
+ * The low bits of the hash of a key select its shard, the high ones its bucket in the shard.
+ * The cache holds one reference to each content it lists: a content evicted while sent
+ * is freed by the last blob_release.
+ */
+
+#include "blob_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define BLOB_CACHE_MIN_BUCKETS 64 // per shard, doubled whenever there are more entries
+
+struct blob_shard {
+    pthread_mutex_t mutex;
+    struct blob **buckets;
+    size_t nb_buckets;   // a power of 2
+    struct blob *newest; // LRU list, most recently used first
+    struct blob *oldest;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct blob_cache {
+    size_t nb_shards;
+    struct blob_shard shards[];
+};
+
+/**
+ * @brief Mixes the fields of a key (splitmix64 finalizer).
+ */
+static uint64_t hash_key(const struct blob_key *key);
+
+/**
+ * @brief Tells whether two keys are equal.
+ */
+static bool same_key(const struct blob_key *a, const struct blob_key *b);
+
+/**
+ * @brief Bucket of a shard where a hash is listed.
+ */
+static struct blob **bucket_of(const struct blob_shard *shard, uint64_t hash);
+
+/**
+ * @brief Unlinks a content from the bucket and the LRU list of its shard, and drops
+ *        the reference of the cache. The lock of the shard is held.
+ */
+static void unlink_blob(struct blob_shard *shard, struct blob *blob);
+
+/**
+ * @brief Moves a content to the head of the LRU list of its shard. The lock of the shard is held.
+ */
+static void touch(struct blob_shard *shard, struct blob *blob);
+
+/**
+ * @brief Doubles the number of buckets of a shard, if memory allows. The lock of the shard is held.
+ */
+static void grow_buckets(struct blob_shard *shard);
+
+int blob_cache_create(size_t budget, size_t nb_shards, struct blob_cache **cache) {
+    M_REQUIRE_NON_NULL(cache);
+    M_REQ(nb_shards > 0, ERR_INVALID_ARGUMENT, "a blob cache needs at least one shard");
+
+    struct blob_cache *new_cache = calloc(1, sizeof(struct blob_cache) + nb_shards * sizeof(struct blob_shard));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(new_cache, ERR_OUT_OF_MEMORY);
+
+    for (size_t i = 0; i < nb_shards; ++i) {
+        struct blob_shard *shard = &new_cache->shards[i];
+        shard->buckets = calloc(BLOB_CACHE_MIN_BUCKETS, sizeof(struct blob *));
+        M_EXIT_IF_ERR_DO_SOMETHING(shard->buckets == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE,
+                                   blob_cache_destroy(new_cache));
+        shard->nb_buckets = BLOB_CACHE_MIN_BUCKETS;
+        shard->budget = budget / nb_shards;
+        pthread_mutex_init(&shard->mutex, NULL);
+        new_cache->nb_shards = i + 1;
+    }
+
+    *cache = new_cache;
+    return ERR_NONE;
+}
+
+void blob_cache_destroy(struct blob_cache *cache) {
+    if (cache == NULL) return;
+
+    for (size_t i = 0; i < cache->nb_shards; ++i) {
+        struct blob_shard *shard = &cache->shards[i];
+        while (shard->oldest != NULL) {
+            unlink_blob(shard, shard->oldest);
+        }
+        pthread_mutex_destroy(&shard->mutex);
+        free(shard->buckets);
+    }
+    free(cache);
+}
+
+struct blob *blob_alloc(uint32_t size) {
+    struct blob *blob = malloc(sizeof(struct blob) + size);
+    if (blob != NULL) {
+        blob->size = size;
+        atomic_init(&blob->refs, 1);
+        blob->cached = false;
+        blob->newer = blob->older = blob->next = NULL;
+    }
+    return blob;
+}
+
+const struct blob *blob_cache_get(struct blob_cache *cache, const struct blob_key *key) {
+    if (cache == NULL || key == NULL) return NULL;
+
+    const uint64_t hash = hash_key(key);
+    struct blob_shard *shard = &cache->shards[hash % cache->nb_shards];
+
+    pthread_mutex_lock(&shard->mutex);
+    struct blob *blob = *bucket_of(shard, hash);
+    while (blob != NULL && !(blob->hash == hash && same_key(&blob->key, key))) blob = blob->next;
+    if (blob != NULL) {
+        atomic_fetch_add(&blob->refs, 1);
+        touch(shard, blob);
+        ++shard->hits;
+    } else {
+        ++shard->misses;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return blob;
+}
+
+void blob_cache_put(struct blob_cache *cache, struct blob *blob) {
+    if (cache == NULL || blob == NULL || blob->cached) return;
+
+    blob->hash = hash_key(&blob->key);
+    struct blob_shard *shard = &cache->shards[blob->hash % cache->nb_shards];
+    if (blob->size > shard->budget) return;
+
+    pthread_mutex_lock(&shard->mutex);
+    for (struct blob *same = *bucket_of(shard, blob->hash); same != NULL; same = same->next) {
+        if (same->hash == blob->hash && same_key(&same->key, &blob->key)) {
+            unlink_blob(shard, same);
+            break;
+        }
+    }
+    while (shard->bytes + blob->size > shard->budget) {
+        unlink_blob(shard, shard->oldest);
+        ++shard->evictions;
+    }
+
+    atomic_fetch_add(&blob->refs, 1);
+    blob->cached = true;
+    struct blob **bucket = bucket_of(shard, blob->hash);
+    blob->next = *bucket;
+    *bucket = blob;
+    blob->newer = NULL;
+    blob->older = shard->newest;
+    if (shard->newest != NULL) shard->newest->newer = blob;
+    else shard->oldest = blob;
+    shard->newest = blob;
+    ++shard->entries;
+    shard->bytes += blob->size;
+
+    if (shard->entries > shard->nb_buckets) {
+        grow_buckets(shard);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void blob_release(const struct blob *blob) {
+    if (blob == NULL) return;
+
+    struct blob *released = (struct blob *) blob;
+    if (atomic_fetch_sub(&released->refs, 1) == 1) {
+        free(released);
+    }
+}
+
+void blob_cache_get_stats(struct blob_cache *cache, struct blob_cache_stats *stats) {
+    M_REQUIRE_NON_NULL_RET_VOID(cache, "null cache in blob_cache_get_stats");
+    M_REQUIRE_NON_NULL_RET_VOID(stats, "null stats in blob_cache_get_stats");
+
+    *stats = (struct blob_cache_stats) { 0, 0, 0, 0, 0, 0 };
+    for (size_t i = 0; i < cache->nb_shards; ++i) {
+        struct blob_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        stats->budget += shard->budget;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+static uint64_t hash_key(const struct blob_key *key) {
+    uint64_t hash = ((uint64_t) key->slot << 8 | (uint8_t) key->resolution) ^ (key->version * 0x9e3779b97f4a7c15ULL);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static bool same_key(const struct blob_key *a, const struct blob_key *b) {
+    return a->slot == b->slot && a->resolution == b->resolution && a->version == b->version;
+}
+
+static struct blob **bucket_of(const struct blob_shard *shard, uint64_t hash) {
+    return &shard->buckets[(hash >> 32) & (shard->nb_buckets - 1)];
+}
+
+static void unlink_blob(struct blob_shard *shard, struct blob *blob) {
+    struct blob **link = bucket_of(shard, blob->hash);
+    while (*link != blob) link = &(*link)->next;
+    *link = blob->next;
+
+    if (blob->newer != NULL) blob->newer->older = blob->older;
+    else shard->newest = blob->older;
+    if (blob->older != NULL) blob->older->newer = blob->newer;
+    else shard->oldest = blob->newer;
+
+    --shard->entries;
+    shard->bytes -= blob->size;
+    blob->cached = false;
+    blob_release(blob);
+}
+
+static void touch(struct blob_shard *shard, struct blob *blob) {
+    if (shard->newest == blob) return;
+
+    // unlinked from its place (it has a newer one)...
+    blob->newer->older = blob->older;
+    if (blob->older != NULL) blob->older->newer = blob->newer;
+    else shard->oldest = blob->newer;
+
+    // ...and linked first
+    blob->newer = NULL;
+    blob->older = shard->newest;
+    shard->newest->newer = blob;
+    shard->newest = blob;
+}
+
+static void grow_buckets(struct blob_shard *shard) {
+    struct blob **buckets = calloc(2 * shard->nb_buckets, sizeof(struct blob *));
+    if (buckets == NULL) return; // longer chains, still correct
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nb_buckets *= 2;
+    for (struct blob *blob = shard->newest; blob != NULL; blob = blob->older) {
+        struct blob **bucket = bucket_of(shard, blob->hash);
+        blob->next = *bucket;
+        *bucket = blob;
+    }
+}
@@ -0,0 +1,121 @@
+/**
+ * @file blob_cache.h
+ * @brief Byte-bounded LRU cache of image contents, shared by threads.
+ *
+ * Contents are keyed by the metadata slot of their image, their resolution and the
+ * imgst_version of the database when they were read: any insertion or deletion changes
+ * the version, so that an entry can only be found while its slot still holds the same image
+ * (stale ones are evicted in LRU order). The cache is split in shards, each one with its
+ * own lock, share of the budget and LRU list.
+ */
+#pragma once
+
+#include "imgStore.h"
+#include "error.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+/**
+ * @brief What identifies a cached content.
+ */
+struct blob_key {
+    uint32_t slot;
+    int resolution;
+    uint64_t version; // imgst_version of the database when the content was read
+};
+
+/**
+ * @brief A content, with the SHA of its image (for its entity tag). Its fields are
+ *        set before blob_cache_put, and read-only from then on.
+ */
+struct blob {
+    struct blob_key key;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t size;
+
+    // owned by the cache: the links are protected by the lock of the shard
+    atomic_uint refs;
+    uint64_t hash;                 // of the key
+    bool cached;
+    struct blob *newer, *older;    // in the LRU list of the shard
+    struct blob *next;             // in the hash bucket
+
+    char data[];
+};
+
+/**
+ * @brief Counters of a cache, summed over its shards.
+ */
+struct blob_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;    // of the cached contents
+    size_t budget;
+};
+
+struct blob_cache;
+
+/**
+ * @brief Creates an empty cache.
+ *
+ * @param budget Bytes of contents the cache may hold, split evenly among the shards
+ * @param nb_shards Number of shards, at least 1
+ * @param cache Set to the new cache
+ * @return error code, ERR_NONE if no error happened
+ */
+int blob_cache_create(size_t budget, size_t nb_shards, struct blob_cache **cache);
+
+/**
+ * @brief Frees a cache and the contents only it references.
+ *
+ * @param cache Cache to destroy (nothing is done if NULL)
+ */
+void blob_cache_destroy(struct blob_cache *cache);
+
+/**
+ * @brief Allocates a content of size bytes, to be filled then passed to blob_cache_put.
+ *
+ * @param size Size of the content
+ * @return the content, referenced once by the caller, or NULL if out of memory
+ */
+struct blob *blob_alloc(uint32_t size);
+
+/**
+ * @brief Looks a content up, and makes it the most recently used of its shard.
+ *
+ * @param cache Cache to search
+ * @param key Key of the content
+ * @return the content, referenced once more (see blob_release), or NULL if not cached
+ */
+const struct blob *blob_cache_get(struct blob_cache *cache, const struct blob_key *key);
+
+/**
+ * @brief Caches a content, replacing any one of the same key, and evicting the least
+ *        recently used ones of its shard beyond its budget. A content larger than the
+ *        budget of a shard is not cached. The caller keeps its own reference.
+ *
+ * @param cache Cache to fill
+ * @param blob Content, with its key, SHA and data set
+ */
+void blob_cache_put(struct blob_cache *cache, struct blob *blob);
+
+/**
+ * @brief Releases a reference to a content, freeing it once neither the cache nor anyone
+ *        else references it.
+ *
+ * @param blob Content returned by blob_alloc or blob_cache_get (nothing is done if NULL)
+ */
+void blob_release(const struct blob *blob);
+
+/**
+ * @brief Reads the counters of a cache.
+ *
+ * @param cache Cache whose counters to read
+ * @param stats Where to store them
+ */
+void blob_cache_get_stats(struct blob_cache *cache, struct blob_cache_stats *stats);
@@ -0,0 +1,108 @@
+/**
+ * @file buffer_pool.c
+ * @brief Process-wide pool of reusable buffers, by size classes (powers of 2).
+ *
+ * Each buffer is preceded by a small header telling its class, so that buffer_put
+ * does not need its size. Buffers larger than the largest class are not kept, and
+ * the free buffers kept altogether never exceed BUFFER_POOL_MAX_KEPT bytes.
+ */
+
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define BUFFER_POOL_MIN_SHIFT 12 // smallest class: 4 KiB
+#define BUFFER_POOL_MAX_SHIFT 24 // largest class: 16 MiB
+#define BUFFER_POOL_NB_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_KEEP 8       // free buffers kept per class
+#define BUFFER_POOL_MAX_KEPT ((size_t) 32 << 20) // bytes of free buffers kept, all classes
+
+/**
+ * @brief What precedes each buffer, aligned for any use of the buffer.
+ */
+struct buffer_header {
+    alignas(max_align_t) size_t class; // BUFFER_POOL_NB_CLASSES if not to be kept
+    struct buffer_header *next;        // in the free list of its class
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    struct buffer_header *free[BUFFER_POOL_NB_CLASSES];
+    size_t nb_free[BUFFER_POOL_NB_CLASSES];
+    size_t kept; // bytes of the free buffers
+} pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Size of the buffers of a class.
+ */
+static size_t class_size(size_t class) {
+    return (size_t) 1 << (class + BUFFER_POOL_MIN_SHIFT);
+}
+
+/**
+ * @brief Smallest class whose buffers hold size bytes, BUFFER_POOL_NB_CLASSES if none.
+ */
+static size_t class_of(size_t size) {
+    size_t class = 0;
+    while (class < BUFFER_POOL_NB_CLASSES && class_size(class) < size) ++class;
+    return class;
+}
+
+void *buffer_get(size_t size) {
+    const size_t class = class_of(size);
+    struct buffer_header *header = NULL;
+
+    if (class < BUFFER_POOL_NB_CLASSES) {
+        pthread_mutex_lock(&pool.mutex);
+        header = pool.free[class];
+        if (header != NULL) {
+            pool.free[class] = header->next;
+            --pool.nb_free[class];
+            pool.kept -= class_size(class);
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        size = class_size(class);
+    }
+    if (header == NULL) {
+        header = malloc(sizeof(struct buffer_header) + size);
+        if (header == NULL) return NULL;
+        header->class = class;
+    }
+    return header + 1;
+}
+
+void buffer_put(void *buffer) {
+    if (buffer == NULL) return;
+
+    struct buffer_header *header = (struct buffer_header *) buffer - 1;
+    const size_t class = header->class;
+    if (class < BUFFER_POOL_NB_CLASSES) {
+        pthread_mutex_lock(&pool.mutex);
+        if (pool.nb_free[class] < BUFFER_POOL_KEEP && pool.kept + class_size(class) <= BUFFER_POOL_MAX_KEPT) {
+            header->next = pool.free[class];
+            pool.free[class] = header;
+            ++pool.nb_free[class];
+            pool.kept += class_size(class);
+            header = NULL;
+        }
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    free(header);
+}
+
+void buffer_pool_trim(void) {
+    pthread_mutex_lock(&pool.mutex);
+    for (size_t class = 0; class < BUFFER_POOL_NB_CLASSES; ++class) {
+        while (pool.free[class] != NULL) {
+            struct buffer_header *header = pool.free[class];
+            pool.free[class] = header->next;
+            free(header);
+        }
+        pool.nb_free[class] = 0;
+    }
+    pool.kept = 0;
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,32 @@
+/**
+ * @file buffer_pool.h
+ * @brief Process-wide pool of reusable buffers, by size classes (powers of 2).
+ *
+ * The buffers which hold image contents for a moment (resizing, copying, reading
+ * into a caller buffer) are taken from the pool and given back to it instead of being
+ * allocated and freed each time. A few buffers of each class are kept, up to a total
+ * size, the others freed; do_close frees them all (see buffer_pool_trim).
+ */
+#pragma once
+
+#include <stddef.h> // for size_t
+
+/**
+ * @brief Takes a buffer of at least size bytes from the pool (not zeroed).
+ *
+ * @param size Number of bytes needed
+ * @return the buffer, to be given back with buffer_put, or NULL if out of memory
+ */
+void *buffer_get(size_t size);
+
+/**
+ * @brief Gives a buffer back to the pool.
+ *
+ * @param buffer Buffer returned by buffer_get (nothing is done if NULL)
+ */
+void buffer_put(void *buffer);
+
+/**
+ * @brief Frees the buffers kept by the pool.
+ */
+void buffer_pool_trim(void);
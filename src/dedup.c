@@ -1,19 +1,11 @@
 #include "dedup.h"
+#include "imgst_index.h"
 #include <stdbool.h>
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 
 #define DUPLICATE_FOUND (NB_ERR + 10)
 #define DUPLICATE_NOT_FOUND (NB_ERR + 20)
 
-/**
- * @brief Compares two SHAs, determines whether they're equal or not
- *
- * @param sha_1
- * @param sha_2
- * @return bool
- */
-static bool are_equal(const unsigned char *sha_1, const unsigned char *sha_2);
-
 /**
  * @brief Transfers all attributes from src to target except SHA, id and is_valid (as we already know they are equal in
  *        do_name_and_content_dedup
@@ -55,16 +47,6 @@ int do_name_and_content_dedup(imgst_file *imgst_file, uint32_t index) {
     return ERR_NONE;
 }
 
-static bool are_equal(const unsigned char *sha_1, const unsigned char *sha_2) {
-    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-        if (sha_1[i] != sha_2[i]) {
-            return false;
-        }
-    } // converting SHAs to strings then applying strncmp, like in tools.c's sha_to_string felt overkill
-
-    return true;
-}
-
 static void copy_attributes(img_metadata *target, const img_metadata *src) {
     M_REQUIRE_NON_NULL_RET_VOID(target, "null argument in dedup: copy_attributes");
     M_REQUIRE_NON_NULL_RET_VOID(src, "null argument in dedup: copy_attributes");
@@ -83,21 +65,16 @@ static int find_duplicate(size_t *content_duplicate_index, imgst_file *imgst_fil
     M_REQUIRE_NON_NULL(imgst_file);
     M_REQUIRE_NON_NULL(content_duplicate_index);
 
-    *content_duplicate_index = 0;
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        img_metadata *curr_metadata = &imgst_file->metadata[i];
-        if (curr_metadata->is_valid == NON_EMPTY && i != index) {
-
-            M_REQ(strncmp(curr_metadata->img_id, imgst_file->metadata[index].img_id, MAX_IMG_ID) != 0, ERR_DUPLICATE_ID,
-                  "two images with the same id located in dedup");
+    const img_metadata *target = &imgst_file->metadata[index];
 
-            if (are_equal(curr_metadata->SHA, imgst_file->metadata[index].SHA)) {
-                return DUPLICATE_FOUND;
-            }
-        }
+    M_REQ(index_find_id(imgst_file, target->img_id, index) == INDEX_NOT_FOUND, ERR_DUPLICATE_ID,
+          "two images with the same id located in dedup");
 
-        ++*content_duplicate_index;
+    const uint32_t duplicate = index_find_sha(imgst_file, target->SHA, index);
+    if (duplicate == INDEX_NOT_FOUND) {
+        return DUPLICATE_NOT_FOUND;
     }
 
-    return DUPLICATE_NOT_FOUND;
+    *content_duplicate_index = duplicate;
+    return DUPLICATE_FOUND;
 }
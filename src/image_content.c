@@ -4,6 +4,10 @@
  */
 
 #include "image_content.h"
+#include "buffer_pool.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_wal.h"
 
 #include <stdbool.h>
 #include <vips/vips.h>
@@ -19,13 +23,17 @@
 static bool size_already_exists(uint64_t possible_offset);
 
 /**
- * @brief Computes the shrinking factor (keeping aspect ratio)
+ * @brief Reads the dimensions of a JPEG image from its frame header (SOF marker),
+ *        without setting up a decoder
  *
- * @param image The image to be resized.
- * @param max_thumbnail_width The maximum width allowed for thumbnail creation.
- * @param max_thumbnail_height The maximum height allowed for thumbnail creation.
+ * @param height Pointer to save height
+ * @param width Pointer to save width
+ * @param image_buffer Pointer to image
+ * @param image_size Memory size of the image
+ * @return true if a frame header with non-zero dimensions was found before the image data
  */
-static double shrink_value(const VipsImage *image, uint32_t max_thumbnail_width, uint32_t max_thumbnail_height);
+static bool probe_jpeg_dimensions(uint32_t *height, uint32_t *width, const unsigned char *image_buffer,
+                                  size_t image_size);
 
 /**
  * @brief Reads and computes a new, resized image
@@ -37,12 +45,24 @@ static double shrink_value(const VipsImage *image, uint32_t max_thumbnail_width,
  * @param size_code Image's size_code
  * @return error code, ERR_NONE if no error happened
  */
-static int load_and_compute_image(size_t *len, size_t position, imgst_file *imgst_file, size_t size_code, void **out_data);
+static int load_and_compute_image(size_t *len, size_t position, const imgst_file *imgst_file, size_t size_code, void **out_data);
 
 /**
  * @brief Create a resized (smaller) version of an image lazily, and store it in the database.
  */
 int lazily_resize(int size_code, imgst_file *imgst_file, size_t position) {
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    lock_write(imgst_file);
+    const int err = lazily_resize_locked(size_code, imgst_file, position);
+    lock_release(imgst_file);
+    return err;
+}
+
+/**
+ * @brief Body of lazily_resize, the write lock being held.
+ */
+int lazily_resize_locked(int size_code, imgst_file *imgst_file, size_t position) {
 
     //-------------------------------------------------------------
     // I) Error handling
@@ -73,23 +93,59 @@ int lazily_resize(int size_code, imgst_file *imgst_file, size_t position) {
     //-------------------------------------------------------------
     // III) Save new image in disk
 
-    M_REQ_CLEAN(fseek(imgst_file->file, 0, SEEK_END) == 0, ERR_IO, "couldn't fseek in lazily resize", 1, out_data);
-    const long offset_new_image = ftell(imgst_file->file);
+    err = lazily_resize_store(size_code, imgst_file, position, out_data, len);
+    FREE(out_data);
+    return err;
+}
 
-    M_REQ_CLEAN(fwrite(out_data, len, 1, imgst_file->file) == 1, ERR_IO,
-                "unable to write new image to file in lazily_resize", 1, out_data);
+/**
+ * @brief Computes a resized version of an image, without modifying the database.
+ */
+int lazily_resize_compute(int size_code, const imgst_file *imgst_file, size_t position, void **out_data, size_t *len) {
 
-    imgst_file->metadata[position].offset[size_code] = offset_new_image;
-    imgst_file->metadata[position].size[size_code] = ftell(imgst_file->file) - offset_new_image;
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(out_data);
+    M_REQUIRE_NON_NULL(len);
 
-    M_REQ_CLEAN(fseek(imgst_file->file, sizeof(imgst_file->header) + position * sizeof(struct img_metadata), SEEK_SET) == 0,
-            ERR_IO, "couldn't fseek in lazily resize", 1, out_data);
+    M_REQ(position < imgst_file->header.max_files, ERR_INVALID_ARGUMENT,
+          "position out of bounds in lazily_resize_compute");
 
-    M_REQ_CLEAN(fwrite(&imgst_file->metadata[position], sizeof(struct img_metadata), 1, imgst_file->file) == 1,
-                ERR_IO, "unable to write updated metadata to file in lazily_resize", 1, out_data);
+    M_REQ(size_code == RES_THUMB || size_code == RES_SMALL, ERR_RESOLUTIONS,
+          "invalid resolutions in lazily_resize_compute");
 
-    FREE(out_data);
-    return ERR_NONE;
+    return load_and_compute_image(len, position, imgst_file, size_code, out_data);
+}
+
+/**
+ * @brief Stores a resized version of an image computed by lazily_resize_compute.
+ */
+int lazily_resize_store(int size_code, imgst_file *imgst_file, size_t position, const void *data, size_t len) {
+
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(data);
+
+    M_REQ(position < imgst_file->header.max_files, ERR_INVALID_ARGUMENT,
+          "position out of bounds in lazily_resize_store");
+
+    M_REQ(size_code == RES_THUMB || size_code == RES_SMALL, ERR_RESOLUTIONS,
+          "invalid resolutions in lazily_resize_store");
+
+    // another thread may have stored it in the meantime
+    M_EXIT_NO_ERR_IF(size_already_exists(imgst_file->metadata[position].offset[size_code]));
+
+    uint64_t offset_new_image = 0;
+    int err = append_data(imgst_file, data, len, &offset_new_image);
+    M_REQ(err == ERR_NONE, err, "unable to write new image to file in lazily_resize");
+
+    imgst_file->metadata[position].offset[size_code] = offset_new_image;
+    imgst_file->metadata[position].size[size_code] = (uint32_t) len;
+
+    err = write_metadata(imgst_file, position);
+    M_REQ(err == ERR_NONE, err, "unable to write updated metadata to file in lazily_resize");
+
+    return wal_commit(imgst_file);
 }
 
 /**
@@ -97,6 +153,13 @@ int lazily_resize(int size_code, imgst_file *imgst_file, size_t position) {
  */
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size) {
 
+    M_REQUIRE_NON_NULL(height);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(image_buffer);
+
+    // libvips only for the files whose header we do not understand
+    M_EXIT_NO_ERR_IF(probe_jpeg_dimensions(height, width, (const unsigned char *) image_buffer, image_size));
+
     VipsImage *original = NULL;
     M_EXIT_IF_ERR_DO_SOMETHING((vips_jpegload_buffer((void *) image_buffer, image_size, &original, 0, NULL) == VIPS_ERR_NONE) ? ERR_NONE : ERR_IMGLIB,
                                g_object_unref(original));
@@ -111,41 +174,76 @@ static bool size_already_exists(uint64_t possible_offset) {
     return possible_offset != 0;
 }
 
-static double shrink_value(const VipsImage *image, uint32_t max_thumbnail_width, uint32_t max_thumbnail_height) {
-    const double h_shrink = (double) max_thumbnail_width / (double) vips_image_get_height(image);
-    const double v_shrink = (double) max_thumbnail_height / (double) vips_image_get_width(image);
-    return h_shrink > v_shrink ? v_shrink : h_shrink;
+#define JPEG_MARKER_PREFIX 0xFF
+#define JPEG_SOI 0xD8 // start of image
+#define JPEG_SOS 0xDA // start of scan: the image data follows
+#define JPEG_EOI 0xD9 // end of image
+#define JPEG_TEM 0x01 // standalone marker
+#define JPEG_RST0 0xD0
+#define JPEG_RST7 0xD7
+#define JPEG_SOF0 0xC0 // frame headers are 0xC0 to 0xCF...
+#define JPEG_SOF15 0xCF
+#define JPEG_DHT 0xC4  // ...but these three, which are other segments
+#define JPEG_JPG 0xC8
+#define JPEG_DAC 0xCC
+
+static uint32_t read_be16(const unsigned char *bytes) {
+    return ((uint32_t) bytes[0] << 8) | bytes[1];
+}
+
+static bool probe_jpeg_dimensions(uint32_t *height, uint32_t *width, const unsigned char *image_buffer,
+                                  size_t image_size) {
+    if (image_size < 2 || image_buffer[0] != JPEG_MARKER_PREFIX || image_buffer[1] != JPEG_SOI) return false;
+
+    size_t pos = 2;
+    while (pos < image_size) {
+        if (image_buffer[pos] != JPEG_MARKER_PREFIX) return false;
+        while (pos < image_size && image_buffer[pos] == JPEG_MARKER_PREFIX) ++pos; // fill bytes
+        if (pos >= image_size) return false;
+
+        const unsigned char marker = image_buffer[pos++];
+        if (marker == JPEG_TEM || (marker >= JPEG_RST0 && marker <= JPEG_RST7)) continue; // no length
+        if (marker == JPEG_SOS || marker == JPEG_EOI || pos + 2 > image_size) return false;
+
+        const size_t length = read_be16(&image_buffer[pos]); // includes its own two bytes
+        if (length < 2 || pos + length > image_size) return false;
+
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF15
+            && marker != JPEG_DHT && marker != JPEG_JPG && marker != JPEG_DAC) {
+            // length, sample precision, number of lines, number of samples per line
+            if (length < 7) return false;
+            *height = read_be16(&image_buffer[pos + 3]);
+            *width = read_be16(&image_buffer[pos + 5]);
+            return *height != 0 && *width != 0; // no height here: given by a DNL segment later on
+        }
+        pos += length;
+    }
+    return false;
 }
 
-static int load_and_compute_image(size_t *len, size_t position, imgst_file *imgst_file, size_t size_code, void **out_data) {
+static int load_and_compute_image(size_t *len, size_t position, const imgst_file *imgst_file, size_t size_code, void **out_data) {
 
-    const long offset_orig_imag     = (long) imgst_file->metadata[position].offset[RES_ORIG];
+    const uint64_t offset_orig_imag = imgst_file->metadata[position].offset[RES_ORIG];
     const uint32_t size_orig_image  = imgst_file->metadata[position].size[RES_ORIG];
 
-    void *data_ptr        = calloc(size_orig_image, sizeof(char));
+    void *data_ptr        = buffer_get(size_orig_image);
     M_REQUIRE_NON_NULL_CUSTOM_ERR(data_ptr, ERR_OUT_OF_MEMORY);
-    M_REQ(fseek(imgst_file->file, offset_orig_imag, SEEK_SET) == 0, ERR_IO, "couldn't fseek in load & compute image");
-    M_REQ_CLEAN(fread(data_ptr, size_orig_image, 1, imgst_file->file) == 1, ERR_IO,
-                "unable to read original image in lazily_resize", 1, data_ptr);
-
-    VipsImage *original = NULL;
-    VipsImage *resized  = NULL;
-
-    M_REQ_CLEAN(vips_jpegload_buffer(data_ptr, size_orig_image, &original, NULL) == VIPS_ERR_NONE, ERR_IMGLIB,
-                "error_imglib in lazily_resize: vips_jpegload_buffer", 1, data_ptr);
-
-    const double ratio = shrink_value(original, imgst_file->header.res_resized[2 * size_code],
-                                      imgst_file->header.res_resized[2 * size_code + 1]);
-
-    M_EXIT_IF_ERR_DO_SOMETHING((vips_resize(original, &resized, ratio, NULL) == VIPS_ERR_NONE) ? ERR_NONE : ERR_IMGLIB,
-                               GROUP_CALLS(FREE(data_ptr), g_object_unref(original)));
-
-    g_object_unref(original);
+    M_EXIT_IF_ERR_DO_SOMETHING(read_at(imgst_file, data_ptr, size_orig_image, offset_orig_imag) == ERR_NONE ? ERR_NONE : ERR_IO,
+                               buffer_put(data_ptr));
+
+    // vips_thumbnail_buffer shrinks while decoding (JPEG DCT scaling), so that
+    // the full-size original is never decoded; the aspect ratio is kept
+    VipsImage *resized = NULL;
+    M_EXIT_IF_ERR_DO_SOMETHING(vips_thumbnail_buffer(data_ptr, size_orig_image, &resized,
+                                                     (int) imgst_file->header.res_resized[2 * size_code],
+                                                     "height", (int) imgst_file->header.res_resized[2 * size_code + 1],
+                                                     NULL) == VIPS_ERR_NONE ? ERR_NONE : ERR_IMGLIB,
+                               buffer_put(data_ptr));
 
     M_EXIT_IF_ERR_DO_SOMETHING((vips_jpegsave_buffer(resized, out_data, len, NULL) == VIPS_ERR_NONE) ? ERR_NONE : ERR_IMGLIB,
-                               GROUP_CALLS(FREE(data_ptr), g_object_unref(resized)));
+                               GROUP_CALLS(buffer_put(data_ptr), g_object_unref(resized)));
 
-    FREE(data_ptr);
+    buffer_put(data_ptr);
     g_object_unref(resized);
 
     return ERR_NONE;
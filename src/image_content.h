@@ -18,6 +18,42 @@
  */
 int lazily_resize(int size_code, imgst_file *imgst_file, size_t position);
 
+/**
+ * @brief Same as lazily_resize, for callers already holding the write lock of imgst_file.
+ *
+ * @param size_code Encodes the size of the new image. If size_code == RES_ORIG, the function does nothing.
+ * @param imgst_file Database to modify, locked in exclusive mode.
+ * @param position Position of the image to resize in the database.
+ * @return (int) Possible error code, ERR_NONE if no error happened
+ */
+int lazily_resize_locked(int size_code, imgst_file *imgst_file, size_t position);
+
+/**
+ * @brief First half of lazily_resize: reads the original image and computes its resized version,
+ *        without modifying the database (so that a shared lock is enough).
+ *
+ * @param size_code Encodes the size of the new image, RES_THUMB or RES_SMALL.
+ * @param imgst_file Database to read.
+ * @param position Position of the image to resize in the database.
+ * @param out_data Set to the new image, to be freed by the caller.
+ * @param len Set to the size of the new image.
+ * @return (int) Possible error code, ERR_NONE if no error happened
+ */
+int lazily_resize_compute(int size_code, const imgst_file *imgst_file, size_t position, void **out_data, size_t *len);
+
+/**
+ * @brief Second half of lazily_resize: appends a resized image to the database and records it
+ *        in the metadata, unless that resolution already exists. Needs the lock exclusively.
+ *
+ * @param size_code Encodes the size of the new image, RES_THUMB or RES_SMALL.
+ * @param imgst_file Database to modify.
+ * @param position Position of the image in the database.
+ * @param data New image, as computed by lazily_resize_compute.
+ * @param len Size of the new image.
+ * @return (int) Possible error code, ERR_NONE if no error happened
+ */
+int lazily_resize_store(int size_code, imgst_file *imgst_file, size_t position, const void *data, size_t len);
+
 /**
  * @brief Gets resolution of some input image
  *
@@ -6,8 +6,10 @@
  * and provides interface functions.
  *
  * The image imgStore starts with exactly one header structure
- * followed by exactly imgst_header.max_files metadata
- * structures. The actual content is not defined by these structures
+ * followed by imgst_header.max_files metadata structures: all of them,
+ * or, once the store has grown (see do_grow), the first table_files ones,
+ * the others lying in metadata segments chained from next_segment.
+ * The actual content is not defined by these structures
  * because it should be stored as raw bytes appended at the end of the
  * imgStore file and addressed by offsets in the metadata structure.
  *
@@ -23,14 +25,18 @@
                     */
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint32_t, uint64_t
+#include <stdbool.h> // for bool
+#include <stddef.h> // for size_t
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 
 #define CAT_TXT "EPFL ImgStore binary"
+#define CAT_TXT_GROWN "EPFL ImgStore binary, grown" // type of a store with metadata segments (see do_grow)
 
 /* constraints */
 #define MAX_IMGST_NAME  31      // max. size of a ImgStore name
 #define MAX_IMG_ID      127     // max. size of an image id
 #define MAX_MAX_FILES   100000
+#define MAX_GROWN_FILES 10000000 // max. number of images once grown (see do_grow)
 #define DEFAULT_MAX_FILES 10
 
 /* For is_valid in imgst_metadata */
@@ -74,22 +80,50 @@ struct imgst_header {
     uint32_t num_files;
 
     /**
-     * Max number of images in this database, must not be modified after init.
+     * Max number of images in this database, in all the metadata segments; only grows (see do_grow).
      */
-    const uint32_t max_files;
+    uint32_t max_files;
 
     /**
      * Array of maximum resolutions of "small" and "thumbnail" formats of images.
      */
     const uint16_t res_resized[2 * (NB_RES - 1)];
 
-    uint32_t unused_32;
-    uint64_t unused_64;
+    /**
+     * Number of metadata right after this header, 0 if all max_files are there (the store never grew).
+     */
+    uint32_t table_files;
+
+    /**
+     * Offset of the first metadata segment (see do_grow), 0 if none.
+     */
+    uint64_t next_segment;
 
 };
 
 typedef struct imgst_header imgst_header;
 
+/**
+ * Header of a metadata segment, followed by its nb_files metadata structures (see do_grow).
+ */
+struct imgst_segment {
+
+    /**
+     * Offset of the next metadata segment, 0 if none.
+     */
+    uint64_t next;
+
+    /**
+     * Number of metadata in this segment.
+     */
+    uint32_t nb_files;
+
+    uint32_t unused_32;
+
+};
+
+typedef struct imgst_segment imgst_segment;
+
 /**
  * The metadata of an image.
  */
@@ -150,10 +184,156 @@ struct imgst_file {
      * Array of metadata of images in the imgStore database.
      */
     img_metadata *metadata;
+
+    /**
+     * In-memory hash index from image ID to metadata slot, NULL if not built.
+     */
+    struct imgst_index *id_index;
+
+    /**
+     * In-memory hash index from content SHA to metadata slots, NULL if not built.
+     */
+    struct imgst_index *sha_index;
+
+    /**
+     * In-memory B+-tree of the valid metadata slots in img_id order, NULL if not built.
+     */
+    struct imgst_id_order *id_order;
+
+    /**
+     * In-memory set of the free metadata slots, NULL if not built.
+     */
+    struct imgst_free_slots *free_slots;
+
+    /**
+     * Mapping of the header and metadata region of the file (see do_open_mapped),
+     * NULL if the metadata was read in memory.
+     */
+    void *mapping;
+
+    /**
+     * Size in bytes of the mapping.
+     */
+    size_t mapping_size;
+
+    /**
+     * Whether stores into the mapping reach the file, or stay private to this process.
+     */
+    bool mapping_shared;
+
+    /**
+     * Offset at which the next image content is appended (end of the file), 0 if not known yet.
+     */
+    uint64_t data_end;
+
+    /**
+     * Reader/writer lock for use from several threads, NULL if locking is not enabled.
+     */
+    struct imgst_lock *lock;
+
+    /**
+     * Background generation of the resized images of inserted images, NULL if not enabled.
+     */
+    struct imgst_pregen *pregen;
+
+    /**
+     * Write-ahead log of the header and metadata updates, NULL if not enabled.
+     */
+    struct imgst_wal *wal;
+
+    /**
+     * Log of the latest insertions and deletions (see do_enable_change_log), NULL if not enabled.
+     */
+    struct imgst_changes *changes;
+
+    /**
+     * Where the metadata segments chained after the header's table are (see do_grow), NULL if none.
+     */
+    struct imgst_segment_info *segments;
+
+    /**
+     * Number of these segments.
+     */
+    uint32_t nb_segments;
 };
 
 typedef struct imgst_file imgst_file;
 
+/**
+ * An image to insert with do_insert_batch, and the outcome of its insertion.
+ */
+struct imgst_insert_item {
+
+    /**
+     * Pointer to the raw image content.
+     */
+    const char *buffer;
+
+    /**
+     * Image size.
+     */
+    size_t size;
+
+    /**
+     * Image ID.
+     */
+    const char *img_id;
+
+    /**
+     * Set by do_insert_batch: ERR_NONE if the image was inserted, the error code of do_insert else.
+     */
+    int err;
+};
+
+typedef struct imgst_insert_item imgst_insert_item;
+
+/**
+ * Space usage of an imgStore (see do_stats). Sizes are in bytes.
+ */
+struct imgst_stats {
+
+    /**
+     * Number of valid images, and of free metadata slots.
+     */
+    uint32_t num_files;
+    uint32_t free_slots;
+
+    /**
+     * Contents of the valid images, for each resolution, shared ones counted once per image.
+     */
+    uint64_t live_bytes[NB_RES];
+
+    /**
+     * Contents stored in the file: each shared content counts once.
+     */
+    uint64_t stored_bytes;
+
+    /**
+     * Saved by sharing contents among images (see do_name_and_content_dedup).
+     */
+    uint64_t dedup_bytes;
+
+    /**
+     * Size of the data region (after the metadata table: contents and metadata segments),
+     * and the part of it that neither a valid image nor a segment references.
+     */
+    uint64_t data_bytes;
+    uint64_t dead_bytes;
+
+    /**
+     * Largest unreferenced range of the data region, and the number of such ranges.
+     */
+    uint64_t largest_hole;
+    uint32_t nb_holes;
+};
+
+typedef struct imgst_stats imgst_stats;
+
+/**
+ * Images being prepared for insertion (see do_insert_batch_start).
+ */
+typedef struct imgst_insert_batch imgst_insert_batch;
+
 /**
  * @brief Prints imgStore header information.
  *
@@ -168,6 +348,13 @@ void print_header(const struct imgst_header *header);
  */
 void print_metadata(const struct img_metadata *metadata);
 
+/**
+ * @brief Prints the space usage of an imgStore.
+ *
+ * @param stats The statistics computed by do_stats.
+ */
+void print_stats(const struct imgst_stats *stats);
+
 /**
  * @brief Open imgStore file, read the header and all the metadata.
  *
@@ -177,6 +364,77 @@ void print_metadata(const struct img_metadata *metadata);
  */
 int do_open(const char *imgst_filename, const char *open_mode, struct imgst_file *imgst_file);
 
+/**
+ * @brief Open imgStore file and map its header and metadata instead of reading them.
+ *        The metadata then points into the mapping, which is shared with the file
+ *        if open_mode allows writing, private otherwise. Only the mapping is O(1):
+ *        the indexes are still built as do_open does, by a pass over the whole table
+ *        and a sort of the valid img_ids, in O(n log n) for n images.
+ *
+ * @param imgst_filename Path to the imgStore file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgst_file Structure for header, metadata and file pointer.
+ */
+int do_open_mapped(const char *imgst_filename, const char *open_mode, struct imgst_file *imgst_file);
+
+/**
+ * @brief Makes the library functions safe to call on imgst_file from several threads:
+ *        do_read and do_list then run concurrently, do_insert, do_delete and lazily_resize
+ *        exclusively. Released by do_close.
+ *
+ * @param imgst_file Opened or created database, not yet shared between threads.
+ * @return error code, ERR_NONE if no error happened
+ */
+int do_enable_locking(struct imgst_file *imgst_file);
+
+/**
+ * @brief Makes do_insert queue the computation of the thumbnail and small versions of each
+ *        inserted image to nb_threads background threads, so that they are ready before being read.
+ *        Enables locking if needed. Reads of a version being computed wait for it; versions
+ *        not computed yet are still computed by the reads. do_close waits for the queued ones.
+ *
+ * @param imgst_file Opened or created database, not yet shared between threads.
+ * @param nb_threads Number of background threads, at least 1
+ * @return error code, ERR_NONE if no error happened
+ */
+int do_enable_pregen(struct imgst_file *imgst_file, size_t nb_threads);
+
+/**
+ * @brief Makes the header and metadata updates of imgst_file go through a write-ahead log,
+ *        "<imgst_filename>.wal", appended by groups and applied to the store at checkpoints.
+ *        Each insert, delete, lazy resize or compaction step is committed as one group when
+ *        it completes. Inserts, deletes and compaction steps are durable when they return,
+ *        the groups of concurrent ones being flushed together, outside the write lock; a lazy
+ *        resize only with the next flush (a lost one is computed again).
+ *        After a crash, do_open replays the committed groups.
+ *
+ * @param imgst_file Database opened for writing, not yet shared between threads.
+ * @param imgst_filename Path to the store of imgst_file
+ * @return error code, ERR_NONE if no error happened
+ */
+int do_enable_wal(struct imgst_file *imgst_file, const char *imgst_filename);
+
+/**
+ * @brief Commits and flushes the updates logged so far but not yet durable, such as those written
+ *        through write_header and write_metadata directly, or by lazy resizes (see do_enable_wal);
+ *        does nothing without a log.
+ *
+ * @param imgst_file Database whose updates shall be durable
+ * @return error code, ERR_NONE if no error happened
+ */
+int do_sync(struct imgst_file *imgst_file);
+
+/**
+ * @brief Makes do_insert and do_delete log, in memory, the IDs they insert and delete,
+ *        so that do_list_changes can tell what changed since a version of the database.
+ *        Only the last capacity changes are kept. Released by do_close.
+ *
+ * @param imgst_file Opened or created database, not yet shared between threads.
+ * @param capacity Number of changes kept, at least 1
+ * @return error code, ERR_NONE if no error happened
+ */
+int do_enable_change_log(struct imgst_file *imgst_file, size_t capacity);
+
 /**
  * @brief Do some clean-up for imgStore file handling.
  *
@@ -203,6 +461,59 @@ typedef enum do_list_mode do_list_mode;
  */
 char *do_list(const struct imgst_file *imgst_file, do_list_mode mode);
 
+/**
+ * @brief Which images do_list_json lists: among the valid ones whose img_id starts
+ *        with prefix (in img_id order), at most limit of them after the first offset ones.
+ */
+struct imgst_list_query {
+    const char *prefix; // NULL or "" for all the images, at most MAX_IMG_ID chars
+    uint32_t offset;
+    uint32_t limit;     // 0 for no limit
+};
+
+/**
+ * @brief Where do_list_json writes its listing, one chunk after the other.
+ *
+ * @param chunk Next bytes of the listing
+ * @param size Number of bytes of chunk
+ * @param arg Argument given to do_list_json
+ * @return ERR_NONE to go on, any other error code to stop the listing
+ */
+typedef int (*imgst_list_writer)(const char *chunk, size_t size, void *arg);
+
+/**
+ * @brief Lists the img_ids of the images matching a query, in JSON:
+ *        {"Images": [<img_id>, ...], "More": <whether images past limit match>,
+ *         "Version": <imgst_version of the database listed>}.
+ *        The listing is written chunk by chunk as the metadata is read, and never held
+ *        in memory as a whole. The images are found through the sorted index of the img_ids,
+ *        in O(log n) plus the number of images listed.
+ *
+ * @param imgst_file In memory structure with header and metadata.
+ * @param query Images to list
+ * @param write Called with each chunk of the listing
+ * @param arg Passed to write
+ * @return Some error code (the first one of write, if any). 0 if no error.
+ */
+int do_list_json(const struct imgst_file *imgst_file, const struct imgst_list_query *query,
+                 imgst_list_writer write, void *arg);
+
+/**
+ * @brief Lists, in JSON and in the order they were made, the insertions and deletions made
+ *        after a version of the database (see do_enable_change_log):
+ *        {"Changes": [{"Added": <img_id>} or {"Deleted": <img_id>}, ...],
+ *         "Version": <current imgst_version>, "Resync": <whether they are unknown>}.
+ *        If the log no longer holds all of them (or since is not a version of the database),
+ *        Changes is empty and Resync true: the images shall be listed again (see do_list_json).
+ *
+ * @param imgst_file In memory structure with header and metadata, whose change log is enabled.
+ * @param since Version after which the changes are listed, as given by a former listing
+ * @param write Called with each chunk of the listing
+ * @param arg Passed to write
+ * @return Some error code (the first one of write, if any). 0 if no error.
+ */
+int do_list_changes(const struct imgst_file *imgst_file, uint32_t since, imgst_list_writer write, void *arg);
+
 /**
  * @brief Creates the imgStore called imgst_filename. Writes the header and the
  *        preallocated empty metadata array to imgStore file.
@@ -226,6 +537,19 @@ int do_create(const char *imgst_filename, struct imgst_file *mem);
  */
 int do_delete(const char *imgID, struct imgst_file *imgst_file);
 
+/**
+ * @brief Deletes, as do_delete does, all the images whose img_id is between first and last
+ *        (both included, in the order of strncmp), found through the sorted index of the img_ids.
+ *        The header is written once, at the end.
+ *
+ * @param first Lowest img_id to delete, NULL for no lower bound
+ * @param last Highest img_id to delete, NULL for no upper bound
+ * @param imgst_file The main in-memory data structure
+ * @param nb_deleted Set to the number of images deleted
+ * @return Some error code. 0 if no error.
+ */
+int do_delete_range(const char *first, const char *last, struct imgst_file *imgst_file, uint32_t *nb_deleted);
+
 /**
  * @brief Transforms resolution string to its int value.
  *
@@ -248,7 +572,64 @@ int resolution_atoi(const char *resolution);
 int do_read(const char *img_id, int resolution, char **image_buffer, uint32_t *image_size, imgst_file *imgst_file);
 
 /**
- * @brief Insert image in the imgStore file
+ * @brief Reads the content of an image from a imgStore into a buffer of the caller,
+ *        which nothing is allocated for (see buffer_get for recycled buffers).
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param buffer Where to copy the image content
+ * @param capacity Size of buffer
+ * @param image_size Location of the image size variable, set even if buffer is too small
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code (ERR_INVALID_ARGUMENT if buffer is too small). 0 if no error.
+ */
+int do_read_into(const char *img_id, int resolution, char *buffer, size_t capacity, uint32_t *image_size,
+                 imgst_file *imgst_file);
+
+/**
+ * @brief Finds where the content of an image is stored in the imgStore file,
+ *        creating the desired resolution if needed (as do_read does).
+ *        The bytes there stay valid until the next do_compact step (see do_pin).
+ *
+ * @param img_id The ID of the image to be located.
+ * @param resolution The desired resolution for the image.
+ * @param offset Location of the offset of the content in the file
+ * @param size Location of the size of the content
+ * @param SHA Location of the SHA of the image (SHA256_DIGEST_LENGTH bytes)
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_locate(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, unsigned char *SHA,
+              imgst_file *imgst_file);
+
+/**
+ * @brief Locates the content of an image as do_locate does, and pins it: do_compact copies
+ *        nothing over it until do_unpin, so that it can be read from the file meanwhile
+ *        (by sendfile, say). Requires do_enable_locking.
+ *
+ * @param img_id The ID of the image to be located.
+ * @param resolution The desired resolution for the image.
+ * @param offset Location of the offset of the content in the file
+ * @param size Location of the size of the content
+ * @param SHA Location of the SHA of the image (SHA256_DIGEST_LENGTH bytes)
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error (then only shall do_unpin be called).
+ */
+int do_pin(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, unsigned char *SHA,
+           imgst_file *imgst_file);
+
+/**
+ * @brief Releases a content pinned by do_pin.
+ *
+ * @param offset The offset given by do_pin
+ * @param size The size given by do_pin
+ * @param imgst_file The main in-memory data structure
+ */
+void do_unpin(uint64_t offset, uint32_t size, imgst_file *imgst_file);
+
+/**
+ * @brief Insert image in the imgStore file, growing it (see do_grow) if it is full;
+ *        undone as by do_delete (but for its content) if its metadata cannot be written back
  *
  * @param buffer Pointer to the raw image content
  * @param size Image size
@@ -258,8 +639,56 @@ int do_read(const char *img_id, int resolution, char **image_buffer, uint32_t *i
  */
 int do_insert(const char *buffer, size_t size, const char *img_id, imgst_file *imgst_file);
 
+/**
+ * @brief Inserts several images in the imgStore file, as many do_insert would, but hashing
+ *        and probing the images on nb_threads threads, then appending their contents one after
+ *        the other and writing the header and the updated metadata once, at the end.
+ *        Each image is inserted or not independently of the others (see the err of each item),
+ *        but should the writing back (or the logging) fail, all of them are undone as by do_delete.
+ *
+ * @param items Images to insert
+ * @param nb_items Number of images
+ * @param nb_threads Number of threads hashing and probing the images, 0 to do it on the calling thread
+ * @param imgst_file Image database
+ * @return ERR_NONE if all images were inserted, the first error met else.
+ */
+int do_insert_batch(imgst_insert_item *items, size_t nb_items, size_t nb_threads, imgst_file *imgst_file);
+
+/**
+ * @brief Starts a batch of images to insert: do_insert_batch, for callers still producing
+ *        the images (e.g. reading them from the disk). Each image added to the batch is hashed
+ *        and probed on the threads of the batch while the caller produces the next ones.
+ *
+ * @param capacity Maximum number of images of the batch
+ * @param nb_threads Number of threads hashing and probing the images, 0 to do it in do_insert_batch_add
+ * @param batch Where to store the batch, freed by do_insert_batch_finish
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_batch_start(size_t capacity, size_t nb_threads, imgst_insert_batch **batch);
+
+/**
+ * @brief Adds an image to a batch, and queues its hashing and probing.
+ *
+ * @param batch Batch holding less than its capacity
+ * @param item Image to insert, which shall stay valid until do_insert_batch_finish sets its err
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_batch_add(imgst_insert_batch *batch, imgst_insert_item *item);
+
+/**
+ * @brief Waits for the images of a batch to be hashed and probed, inserts them as
+ *        do_insert_batch does, then frees the batch.
+ *
+ * @param batch Batch to insert
+ * @param imgst_file Image database
+ * @return ERR_NONE if all images were inserted, the first error met else.
+ */
+int do_insert_batch_finish(imgst_insert_batch *batch, imgst_file *imgst_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
+ *        to a new store, which then replaces the old one. The contents are copied as raw
+ *        bytes (shared ones once), their metadata carried over: nothing is decoded nor hashed.
  *
  * @param imgst_path The path to the imgStore file
  * @param imgst_tmp_bkp_path The path to the a (to be created) temporary imgStore backup file
@@ -267,6 +696,47 @@ int do_insert(const char *buffer, size_t size, const char *img_id, imgst_file *i
  */
 int do_gbcollect(const char *imgst_path, const char *imgst_tmp_bkp_path);
 
+/**
+ * @brief Compacts the image contents in place, one bounded step at a time: slides the live
+ *        contents toward the start of the data region, then truncates the file once they are
+ *        all packed. The contents are copied by batches without any lock, then their offsets
+ *        are switched under the write lock, so that the database keeps serving do_read (and even
+ *        do_insert and do_delete) between and during the steps. One step at a time per database.
+ *        Offsets obtained from do_locate before a step are no longer valid after it, but
+ *        those of do_pin are: the step stops early rather than copy over a pinned content.
+ *
+ * @param imgst_file Image database, opened for writing
+ * @param budget Number of bytes to copy in this step; at least one content is moved anyway
+ * @param done Set to true once the contents are all packed (and the file truncated)
+ * @return Some error code. 0 if no error.
+ */
+int do_compact(imgst_file *imgst_file, uint64_t budget, bool *done);
+
+/**
+ * @brief Computes the space usage of an imgStore, to tell whether do_gbcollect or do_compact
+ *        is worth running. Only the metadata is read (one pass), not the image contents.
+ *
+ * @param imgst_file Image database
+ * @param stats Where to store the statistics
+ * @return Some error code. 0 if no error.
+ */
+int do_stats(const imgst_file *imgst_file, imgst_stats *stats);
+
+/**
+ * @brief Adds free metadata slots to an imgStore, online: they are appended to the file
+ *        as a new metadata segment, chained to the previous ones, and nothing is moved.
+ *        do_insert calls it when the imgStore is full. A store read through a mapping
+ *        (see do_open_mapped) is read in memory from then on. The first growth sets the type
+ *        of the store to CAT_TXT_GROWN, which the opening functions check, so that a reader
+ *        which does not know the segments rejects the store; versions of this library which
+ *        check no type misread it, until do_gbcollect flattens it back into a CAT_TXT store.
+ *
+ * @param imgst_file Image database, opened for writing
+ * @param nb_files Number of slots to add; max_files shall not exceed MAX_GROWN_FILES
+ * @return Some error code. 0 if no error.
+ */
+int do_grow(imgst_file *imgst_file, uint32_t nb_files);
+
 #ifdef __cplusplus
 }
 #endif
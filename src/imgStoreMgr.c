@@ -7,18 +7,55 @@
  * @author Mia Primorac
  */
 
+#define _POSIX_C_SOURCE 200809L // for scandir, getline, strdup, sysconf
+
 #include "util.h" // for _unused
 #include "imgStore.h"
+#include "buffer_pool.h"
 #include "error.h"
 #include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vips/vips.h>
 
+#ifndef COMPACT_BUDGET
+/**
+ * Default number of KiB of image contents moved per do_compact step, in compact.
+ */
+#define COMPACT_BUDGET 4096
+#endif
+
+#ifndef INSERT_DIR_BATCH
+/**
+ * Number of images read from the disk, then inserted by one call to do_insert_batch, in insert-dir.
+ */
+#define INSERT_DIR_BATCH 256
+#endif
+
+/**
+ * @brief Opens an imgst_file; if it is opened for writing, its updates go through the
+ *        write-ahead log (see do_enable_wal), so that a crash leaves each of them done or undone.
+ *
+ * @param filename Path to the store
+ * @param open_mode Mode of fopen
+ * @param imgst_file Set to the opened database, to close with do_close
+ * @return some error code, 0 if no error
+ */
+static int open_store(const char *filename, const char *open_mode, imgst_file *imgst_file) {
+    M_EXIT_IF_ERR(do_open_mapped(filename, open_mode, imgst_file));
+    if (strchr(open_mode, '+') != NULL) {
+        M_EXIT_IF_ERR_DO_SOMETHING(do_enable_wal(imgst_file, filename), do_close(imgst_file));
+    }
+    return ERR_NONE;
+}
+
 /**
  * @brief EXECUTE_COMMAND_EXPANDED opens an imgst_file, verifies something, performs an action, and then closes the file
  */
 #define EXECUTE_COMMAND_EXPANDED(filename, open_mode, imgst_file, command, verification, err_code, fmt, err_value, n, ...) \
     do {                                                                                                 \
-        (*err_value) = do_open((filename), (open_mode), &(imgst_file));                                  \
+        (*err_value) = open_store((filename), (open_mode), &(imgst_file));                                      \
         if ((*err_value) == ERR_NONE) {                                                                  \
             M_REQ_CLEAN((verification), (err_code), (fmt), (n), __VA_ARGS__);                            \
             (*err_value) = (command);                                                                    \
@@ -231,9 +268,15 @@ int help(int args, char *argv[]) {
     printf("      read an image from the imgStore and save it to a file.\n");
     printf("      default resolution is \"original\".\n");
     printf("  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.\n");
+    printf("  insert-dir <imgstore_filename> <dirname>: insert all the images of a directory in the imgStore,\n");
+    printf("      with their file names without extension as imgIDs.\n");
+    printf("      if dirname is \"-\", reads lines \"<imgID> <filename>\" from the standard input instead.\n");
     printf("  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n");
     printf("gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a "
            "temporary filename for copying the imgStore.\n");
+    printf("  compact <imgstore_filename> [budget]: compact imgStore in place, moving at most budget KiB per step.\n");
+    printf("      default budget is %d KiB.\n", COMPACT_BUDGET);
+    printf("  stats <imgstore_filename>: display the space used by live, shared and dead image contents.\n");
     return ERR_NONE;
 }
 
@@ -276,13 +319,203 @@ int do_insert_cmd(int args, char *argv[]) {
 
     imgst_file imgst_file;
     EXECUTE_COMMAND_EXPANDED(imgst_filename, "r+b", imgst_file, do_insert(buffer, buffer_size, imgID, &imgst_file),
-                             imgst_file.header.num_files < imgst_file.header.max_files, ERR_MAX_FILES,
-                             "imgst_file full in do_insert_cmd", &err_val, 1, buffer);
+                             1, 0, "", &err_val, 1, buffer);
 
     FREE(buffer);
     return err_val;
 }
 
+/**
+ * @brief An image of insert-dir: its future imgID and where to read it.
+ */
+struct disk_image {
+    char *img_id;
+    char *path;
+};
+
+/**
+ * @brief Lists the regular files of a directory, in alphabetical order, imgIDs being
+ *        their names without extension.
+ *
+ * @param dirname Directory to list
+ * @param images Where to store the array of images, to free with free_disk_images
+ * @param nb_images Where to store the number of images
+ * @return some error code, 0 if no error
+ */
+static int list_directory(const char *dirname, struct disk_image **images, size_t *nb_images);
+
+/**
+ * @brief Lists the images of a manifest: lines "<imgID> <filename>", blank lines being skipped.
+ *
+ * @param manifest File to read the lines from
+ * @param images Where to store the array of images, to free with free_disk_images
+ * @param nb_images Where to store the number of images
+ * @return some error code, 0 if no error
+ */
+static int read_manifest(FILE *manifest, struct disk_image **images, size_t *nb_images);
+
+/**
+ * @brief Adds an image at the end of an array of images, taking ownership of img_id and path.
+ */
+static int add_disk_image(struct disk_image **images, size_t *nb_images, size_t *capacity, char *img_id, char *path);
+
+static void free_disk_images(struct disk_image *images, size_t nb_images);
+
+/**
+ * @brief Reads then inserts images by batches of INSERT_DIR_BATCH, hashing each image while the
+ *        next ones are read, and reporting the images not inserted.
+ *
+ * @return ERR_NONE if all images were inserted, the first error met else
+ */
+static int insert_disk_images(const struct disk_image *images, size_t nb_images, imgst_file *imgst_file);
+
+/********************************************************************//**
+ * Inserts all the images of a directory (or of a manifest) into the imgStore.
+ */
+int do_insert_dir_cmd(int args, char *argv[]) {
+
+    M_REQ(!(args < 3), ERR_NOT_ENOUGH_ARGUMENTS, "Not enough args provided for insert-dir");
+
+    const char *imgst_filename = argv[1];
+    const char *dirname = argv[2];
+
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(dirname);
+
+    struct disk_image *images = NULL;
+    size_t nb_images = 0;
+    int err = strcmp(dirname, "-") == 0 ? read_manifest(stdin, &images, &nb_images)
+                                        : list_directory(dirname, &images, &nb_images);
+    M_EXIT_IF_ERR(err);
+
+    imgst_file imgst_file;
+    M_EXIT_IF_ERR_DO_SOMETHING(open_store(imgst_filename, "r+b", &imgst_file), free_disk_images(images, nb_images));
+    err = insert_disk_images(images, nb_images, &imgst_file);
+    do_close(&imgst_file);
+
+    free_disk_images(images, nb_images);
+    return err;
+}
+
+static int list_directory(const char *dirname, struct disk_image **images, size_t *nb_images) {
+    struct dirent **entries = NULL;
+    const int nb_entries = scandir(dirname, &entries, NULL, alphasort);
+    M_REQ(nb_entries >= 0, ERR_IO, "couldn't list directory in insert-dir");
+
+    size_t capacity = 0;
+    int err = ERR_NONE;
+    for (int i = 0; i < nb_entries; ++i) {
+        const char *name = entries[i]->d_name;
+        char *path = malloc(strlen(dirname) + strlen(name) + 2);
+        struct stat path_stat;
+        if (path == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else if (name[0] != '.' && (sprintf(path, "%s/%s", dirname, name), stat(path, &path_stat) == 0)
+                   && S_ISREG(path_stat.st_mode)) {
+            char *img_id = strdup(name);
+            char *extension = img_id == NULL ? NULL : strrchr(img_id, '.');
+            if (extension != NULL && extension != img_id) *extension = '\0';
+            err = add_disk_image(images, nb_images, &capacity, img_id, path);
+            path = NULL;
+        }
+        free(path);
+        free(entries[i]);
+        if (err != ERR_NONE) {
+            while (++i < nb_entries) free(entries[i]);
+        }
+    }
+    free(entries);
+
+    M_EXIT_IF_ERR_DO_SOMETHING(err, free_disk_images(*images, *nb_images));
+    return ERR_NONE;
+}
+
+static int read_manifest(FILE *manifest, struct disk_image **images, size_t *nb_images) {
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int err = ERR_NONE;
+    while (err == ERR_NONE && getline(&line, &line_size, manifest) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *img_id = line + strspn(line, " \t");
+        const size_t img_id_len = strcspn(img_id, " \t");
+        if (img_id_len == 0) continue;
+
+        const char *path = img_id + img_id_len + strspn(img_id + img_id_len, " \t");
+        if (*path == '\0') {
+            err = ERR_NOT_ENOUGH_ARGUMENTS;
+        } else {
+            char *id_copy = strdup(img_id);
+            if (id_copy != NULL) id_copy[img_id_len] = '\0';
+            err = add_disk_image(images, nb_images, &capacity, id_copy, strdup(path));
+        }
+    }
+    free(line);
+
+    M_EXIT_IF_ERR_DO_SOMETHING(err, free_disk_images(*images, *nb_images));
+    return ERR_NONE;
+}
+
+static int add_disk_image(struct disk_image **images, size_t *nb_images, size_t *capacity, char *img_id, char *path) {
+    M_REQ_CLEAN(img_id != NULL && path != NULL, ERR_OUT_OF_MEMORY, "out of memory in insert-dir", 2, img_id, path);
+    if (*nb_images == *capacity) {
+        const size_t new_capacity = *capacity == 0 ? INSERT_DIR_BATCH : 2 * *capacity;
+        struct disk_image *grown = realloc(*images, new_capacity * sizeof(struct disk_image));
+        M_REQ_CLEAN(grown != NULL, ERR_OUT_OF_MEMORY, "out of memory in insert-dir", 2, img_id, path);
+        *images = grown;
+        *capacity = new_capacity;
+    }
+    (*images)[*nb_images].img_id = img_id;
+    (*images)[*nb_images].path = path;
+    ++*nb_images;
+    return ERR_NONE;
+}
+
+static void free_disk_images(struct disk_image *images, size_t nb_images) {
+    for (size_t i = 0; i < nb_images; ++i) {
+        free(images[i].img_id);
+        free(images[i].path);
+    }
+    free(images);
+}
+
+static int insert_disk_images(const struct disk_image *images, size_t nb_images, imgst_file *imgst_file) {
+    const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t nb_threads = nb_cpus > 1 ? (size_t) nb_cpus : 0;
+
+    imgst_insert_item items[INSERT_DIR_BATCH];
+    int first_err = ERR_NONE;
+    for (size_t first = 0; first < nb_images; first += INSERT_DIR_BATCH) {
+        imgst_insert_batch *batch = NULL;
+        M_EXIT_IF_ERR(do_insert_batch_start(INSERT_DIR_BATCH, nb_threads, &batch));
+
+        // each image is hashed while the next ones are read
+        size_t nb_items = 0;
+        for (size_t i = first; i < nb_images && i < first + INSERT_DIR_BATCH; ++i) {
+            char *buffer = NULL;
+            size_t size = 0;
+            const int err = read_disk_image(images[i].path, &buffer, &size);
+            if (err != ERR_NONE) {
+                fprintf(stderr, "%s: %s\n", images[i].path, ERR_MESSAGES[err]);
+                if (first_err == ERR_NONE) first_err = err;
+                continue;
+            }
+            items[nb_items] = (imgst_insert_item) { buffer, size, images[i].img_id, ERR_NONE };
+            (void) do_insert_batch_add(batch, &items[nb_items++]); // cannot fail: at most INSERT_DIR_BATCH items
+        }
+
+        const int err = do_insert_batch_finish(batch, imgst_file);
+        if (first_err == ERR_NONE) first_err = err;
+        for (size_t i = 0; i < nb_items; ++i) {
+            if (items[i].err != ERR_NONE) {
+                fprintf(stderr, "%s: %s\n", items[i].img_id, ERR_MESSAGES[items[i].err]);
+            }
+            free((char *) items[i].buffer);
+        }
+    }
+    return first_err;
+}
+
 /********************************************************************//**
  * Reads an image from the imgStore.
  */
@@ -301,26 +534,32 @@ int do_read_cmd(int args, char *argv[]) {
 
     char *buffer = NULL;
     uint32_t size;
+    uint64_t offset;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
 
     imgst_file imgst_file;
     int err;
 
-    M_REQ((err = do_open(imgst_filename, "r+b", &imgst_file)) == ERR_NONE, err, "could not open file in do_read_cmd");
+    M_REQ((err = open_store(imgst_filename, "r+b", &imgst_file)) == ERR_NONE, err, "could not open file in do_read_cmd");
     M_EXIT_IF_ERR_DO_SOMETHING((err = resolution_atoi(resolution)) != ERR_RESOLUTIONS ? ERR_NONE : err, do_close(&imgst_file));
     int size_code = err;
 
-    M_EXIT_IF_ERR_DO_SOMETHING((err = do_read(imgID, err, &buffer, &size, &imgst_file)), do_close(&imgst_file));
+    // the size first (creating the resolution if needed), to read into a recycled buffer
+    M_EXIT_IF_ERR_DO_SOMETHING((err = do_locate(imgID, size_code, &offset, &size, SHA, &imgst_file)), do_close(&imgst_file));
+    M_EXIT_IF_ERR_DO_SOMETHING((buffer = buffer_get(size)) != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY, do_close(&imgst_file));
+    M_EXIT_IF_ERR_DO_SOMETHING((err = do_read_into(imgID, size_code, buffer, size, &size, &imgst_file)),
+                               GROUP_CALLS(buffer_put(buffer), do_close(&imgst_file)));
 
     char *disk_image_name = calloc(MAX_IMG_ID + APPEND_CHARS + 1, sizeof(char));
     const char * resolution_names[NB_RES];
     resolution_names[RES_ORIG] = "orig"; resolution_names[RES_THUMB] = "thumb"; resolution_names[RES_SMALL] = "small";
     M_EXIT_IF_ERR_DO_SOMETHING((err = create_name(imgID, resolution_names[size_code], disk_image_name)),
-                               GROUP_CALLS(GROUP_CALLS(FREE(disk_image_name), FREE(buffer)), do_close(&imgst_file)));
+                               GROUP_CALLS(GROUP_CALLS(FREE(disk_image_name), buffer_put(buffer)), do_close(&imgst_file)));
 
     M_EXIT_IF_ERR_DO_SOMETHING((err = write_disk_image(disk_image_name, &buffer, size)),
-                               GROUP_CALLS(GROUP_CALLS(FREE(disk_image_name), FREE(buffer)), do_close(&imgst_file)));
+                               GROUP_CALLS(GROUP_CALLS(FREE(disk_image_name), buffer_put(buffer)), do_close(&imgst_file)));
 
-    FREE(buffer);
+    buffer_put(buffer);
     FREE(disk_image_name);
 
     do_close(&imgst_file);
@@ -336,15 +575,56 @@ int do_gc_cmd(int args, char *argv[]){
     M_REQUIRE_NON_NULL(tmp_imgst_filename);
 
     int err;
-    M_REQ((err = do_gbcollect(imgst_filename, tmp_imgst_filename) == ERR_NONE), err, "could not collect file in do_gc_cmd");
+    M_REQ((err = do_gbcollect(imgst_filename, tmp_imgst_filename)) == ERR_NONE, err, "could not collect file in do_gc_cmd");
+
+    return err;
+}
+
+/********************************************************************//**
+ * Compacts the imgStore in place, step by step.
+ */
+int do_compact_cmd(int args, char *argv[]) {
+    M_REQ(!(args < 2), ERR_NOT_ENOUGH_ARGUMENTS, "Not enough args provided for compact");
+    const char *imgst_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgst_filename);
+
+    const uint64_t budget = args >= 3 ? atouint32(argv[2]) : COMPACT_BUDGET;
+    M_REQ(budget > 0, ERR_INVALID_ARGUMENT, "invalid budget in do_compact_cmd");
 
+    imgst_file imgst_file;
+    int err = open_store(imgst_filename, "r+b", &imgst_file);
+    M_EXIT_IF_ERR(err);
+    bool done = false;
+    while (err == ERR_NONE && !done) {
+        err = do_compact(&imgst_file, budget * 1024, &done);
+    }
+    do_close(&imgst_file);
     return err;
 }
 
+/********************************************************************//**
+ * Displays the space usage of the imgStore.
+ */
+int do_stats_cmd(int args, char *argv[]) {
+    M_REQ(!(args < 2), ERR_NOT_ENOUGH_ARGUMENTS, "Not enough args provided for stats");
+    const char *filename = argv[1];
+    M_REQUIRE_NON_NULL(filename);
+
+    struct imgst_file myfile;
+    M_EXIT_IF_ERR(do_open_mapped(filename, "rb", &myfile));
+    imgst_stats stats;
+    const int err = do_stats(&myfile, &stats);
+    do_close(&myfile);
+    M_EXIT_IF_ERR(err);
+
+    print_stats(&stats);
+    return ERR_NONE;
+}
+
 /************************************************************************/
 
 #define MAX_FUN_NAME_SIZE 32
-#define NUM_FUNCTIONS 7
+#define NUM_FUNCTIONS 10
 
 typedef int(*command)(int, char *[]);
 
@@ -373,7 +653,10 @@ static const command_mapping command_list[NUM_FUNCTIONS] = {
         {"help",   help},
         {"read",   do_read_cmd},
         {"insert", do_insert_cmd},
-        {"gc",     do_gc_cmd}
+        {"insert-dir", do_insert_dir_cmd},
+        {"gc",     do_gc_cmd},
+        {"compact", do_compact_cmd},
+        {"stats",  do_stats_cmd}
 };
 
 /********************************************************************//**
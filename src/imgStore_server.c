@@ -1,8 +1,23 @@
+#define _POSIX_C_SOURCE 200809L // for fileno
+
 #include "libmongoose/mongoose.h"
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "blob_cache.h"
+#include "thread_pool.h"
+#include "util.h" // for atouint32
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/sendfile.h>
 
 static const char *s_listening_address = "http://localhost:8000";
 
+// loopback address on which workers wake up the event loop
+static const char *s_wakeup_address = "udp://127.0.0.1:0";
+
 static int s_signo;
 
 static void signal_handler(int signo) {
@@ -11,8 +26,44 @@ static void signal_handler(int signo) {
 
 static const char *s_web_directory = ".";
 
+#ifndef IMGST_SERVER_WORKERS
+#define IMGST_SERVER_WORKERS 4 // threads reading (and resizing) images
+#endif
+
+#ifndef IMGST_SERVER_COMPACT_PERIOD
+#define IMGST_SERVER_COMPACT_PERIOD 10 // ms between compaction steps, run by the workers
+#endif
+
+#ifndef IMGST_SERVER_CACHE_CONTROL
+// an ID may be deleted then reused for another image: caches revalidate, and mostly get 304s
+#define IMGST_SERVER_CACHE_CONTROL "no-cache"
+#endif
+
+#ifndef IMGST_SERVER_CACHE_SIZE
+// bytes of image contents kept in memory (see blob_cache.h), 0 not to cache them
+#define IMGST_SERVER_CACHE_SIZE (64 << 20)
+#endif
+
+#ifndef IMGST_SERVER_CACHE_SHARDS
+#define IMGST_SERVER_CACHE_SHARDS 8 // of the cache, each one with its own lock
+#endif
+
+#ifndef IMGST_SERVER_CACHE_MAX_BLOB
+// larger contents are not cached: they are sent straight from the file (see send_body)
+#define IMGST_SERVER_CACHE_MAX_BLOB (256 << 10)
+#endif
+
+#ifndef IMGST_SERVER_CHANGE_LOG
+// insertions and deletions kept for the clients listing the changes since their last listing
+#define IMGST_SERVER_CHANGE_LOG 4096
+#endif
+
 #define ERROR_STATUS_CODE 500
 #define DEF_STATUS_CODE 200
+#define NOT_MODIFIED_STATUS_CODE 304
+
+#define MAX_IF_NONE_MATCH 511 // longer If-None-Match headers are truncated (possibly missing a 304)
+#define ETAG_SIZE (2 * SHA256_DIGEST_LENGTH + 4) // quotes, hex SHA, '-' and resolution
 
 /**
  * @brief Handle wrong arguments
@@ -21,17 +72,97 @@ static const char *s_web_directory = ".";
  * @param error Error code
  */
 void mg_error_msg(struct mg_connection* nc, int error) {
-    mg_http_reply(nc, ERROR_STATUS_CODE, "Error: ", "%d\n", error);
+    mg_http_reply(nc, ERROR_STATUS_CODE, "", "Error: %s\n", ERR_MESSAGES[error - ERR_NONE]);
 }
 
-//TODO this trash
-static int mg_parse_arg();
-/*
- *M_REQUIRE_CUSTOM_RET(res_buffer != NULL,, mg_error_msg(nc, ERR_OUT_OF_MEMORY));
-    M_REQUIRE_CUSTOM_RET(mg_http_get_var(&hm->query, "res", res_buffer, RES_STRING_MAX_SIZE + 1) > 0,,
-                         GROUP_CALLS(FREE(res_buffer), mg_error_msg(nc, ERR_INVALID_ARGUMENT)));
+// ======================================================================
+/**
+ * @brief State shared by the event loop and the workers.
+ */
+struct server {
+    imgst_file database;
+    struct mg_mgr mgr;
+
+    /**
+     * Workers running read_image on read_jobs.
+     */
+    struct thread_pool *workers;
+
+    /**
+     * Contents recently read, filled by the workers and looked up by the event loop, NULL if disabled.
+     */
+    struct blob_cache *cache;
+
+    /**
+     * Read jobs done by the workers, waiting for the event loop to reply, protected by done_mutex.
+     */
+    struct read_job *done;
+    pthread_mutex_t done_mutex;
+
+    /**
+     * Socket connected to the wakeup listener of mgr, -1 if not opened.
+     */
+    int wakeup_fd;
+
+    /**
+     * Bytes of image contents moved per compaction step (see do_compact), 0 not to compact.
+     * Set from the -compact option.
+     */
+    uint64_t compact_budget;
+
+    /**
+     * Whether a compaction step is queued or running on the workers (see compact_step).
+     * The contents it could move are pinned while they are sent from the file (see do_pin).
+     */
+    atomic_bool compacting;
 
+    /**
+     * Whether the database was compacted (or compaction failed) at compacted_version:
+     * compaction resumes once the version changes. Written by compact_step, the version
+     * being read by the event loop while no step is queued.
+     */
+    atomic_bool compacted;
+    uint32_t compacted_version;
+};
+
+/**
+ * @brief A read request, handed to a worker then back to the event loop.
+ */
+struct read_job {
+    struct server *server;
+    unsigned long conn_id; // connection to reply to, if it still exists by then
+    char img_id[MAX_IMG_ID + 1];
+    int resolution;
+    char if_none_match[MAX_IF_NONE_MATCH + 1]; // of the request, "" if none
+
+    struct blob_key key; // of the content in the cache, its slot INDEX_NOT_FOUND if not to be cached
+
+    int err;
+    uint64_t offset; // of the image in the database file
+    uint32_t size;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    const struct blob *blob; // content in memory, NULL to send it from the file
+    bool pinned; // offset and size still pinned (see do_pin), until a body_transfer takes them over
+
+    struct read_job *next; // in server->done
+};
+
+/**
+ * @brief The body of an image reply, still to be sent from the database file to a connection.
  */
+struct body_transfer {
+    struct server *server;
+    uint64_t offset;    // of the next byte to send in the database file
+    uint32_t remaining; // number of bytes still to send
+    uint64_t pinned_offset; // of the content, pinned until the transfer ends
+    uint32_t pinned_size;
+};
+
+static void imgst_event_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data);
+
+static void make_etag(const unsigned char *SHA, int resolution, char *etag);
+
+static void reply_image(struct mg_connection *nc, struct read_job *job, const char *etag);
 
 // ======================================================================
 /**
@@ -48,50 +179,397 @@ create_match_cmd(read)
 
 create_match_cmd(delete)
 
+create_match_cmd(cache)
+
+#define UINT32_STRING_MAX_SIZE 10
 /**
- * @brief Call do_list and send result to incoming connection
+ * @brief Reads an optional unsigned integer from the query string of a request
+ *
+ * @param hm HTTP message received
+ * @param name Name of the variable
+ * @param value Set to the value of the variable, unchanged if it is not given
+ * @param given If not NULL, set to whether the variable is given
+ * @return error code, ERR_NONE if the variable is absent or valid
+ */
+static int get_uint32_var(struct mg_http_message *hm, const char *name, uint32_t *value, bool *given) {
+    char buffer[UINT32_STRING_MAX_SIZE + 1] = "";
+    const int length = mg_http_get_var(&hm->query, name, buffer, UINT32_STRING_MAX_SIZE + 1);
+    if (given != NULL) *given = length != -1 && length != -4;
+    if (length == -1 || length == -4) return ERR_NONE; // no query, or not in it
+
+    errno = 0;
+    M_REQ(length > 0 && (*value = atouint32(buffer), errno == 0), ERR_INVALID_ARGUMENT, "invalid number in the query");
+    return ERR_NONE;
+}
+
+/**
+ * @brief Writer of do_list_json sending each chunk of the listing as an HTTP chunk
+ *
+ * @param chunk Next bytes of the listing
+ * @param size Number of bytes of chunk
+ * @param arg Connection to send it to
+ * @return ERR_NONE
+ */
+static int write_chunk(const char *chunk, size_t size, void *arg) {
+    mg_http_write_chunk((struct mg_connection *) arg, chunk, size);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Call do_list_changes with the since of the request if it has one, do_list_json
+ *        with its offset, limit and prefix otherwise, and send the result to incoming
+ *        connection as it is written
  *
  * @param nc Incoming connection
  * @param imgst_file Main data structure
+ * @param hm HTTP message received
+ */
+static void handle_list_call(struct mg_connection *nc, imgst_file *imgst_file, struct mg_http_message *hm) {
+    char prefix[MAX_IMG_ID + 1] = "";
+    struct imgst_list_query query = { prefix, 0, 0 };
+    uint32_t since = 0;
+    bool incremental = false;
+    M_REQUIRE_CUSTOM_RET(get_uint32_var(hm, "since", &since, &incremental) == ERR_NONE
+                         && get_uint32_var(hm, "offset", &query.offset, NULL) == ERR_NONE
+                         && get_uint32_var(hm, "limit", &query.limit, NULL) == ERR_NONE
+                         && mg_http_get_var(&hm->query, "prefix", prefix, MAX_IMG_ID + 1) != -3,,
+                         mg_error_msg(nc, ERR_INVALID_ARGUMENT));
+
+    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n",
+              DEF_STATUS_CODE);
+    const int err = incremental ? do_list_changes(imgst_file, since, write_chunk, nc)
+                                : do_list_json(imgst_file, &query, write_chunk, nc);
+    if (err != ERR_NONE) {
+        nc->is_closing = 1; // the client sees a truncated body
+        return;
+    }
+    mg_http_write_chunk(nc, "", 0);
+}
+
+/**
+ * @brief Reply the counters of the cache, in JSON
+ *
+ * @param nc Incoming connection
+ * @param cache Cache of the server, NULL if disabled
  */
-static void handle_list_call(struct mg_connection *nc, imgst_file *imgst_file) {
-    mg_http_reply(nc, DEF_STATUS_CODE, "", "%s", do_list(imgst_file, JSON));
+static void handle_cache_call(struct mg_connection *nc, struct blob_cache *cache) {
+    struct blob_cache_stats stats = { 0, 0, 0, 0, 0, 0 };
+    if (cache != NULL) blob_cache_get_stats(cache, &stats);
+    mg_http_reply(nc, DEF_STATUS_CODE, "Content-Type: application/json\r\n",
+                  "{\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 ", \"evictions\": %" PRIu64
+                  ", \"entries\": %zu, \"bytes\": %zu, \"budget\": %zu}\n",
+                  stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes, stats.budget);
+}
+
+/**
+ * @brief Reads a located content in memory, and caches it
+ *
+ * @param server Server state, with a cache
+ * @param job Read job whose content was located
+ * @return the content, or NULL if it could not be read (it is then sent from the file)
+ */
+static const struct blob *cache_content(struct server *server, const struct read_job *job) {
+    struct blob *blob = blob_alloc(job->size);
+    if (blob == NULL) return NULL;
+
+    if (read_at(&server->database, blob->data, job->size, job->offset) != ERR_NONE) {
+        blob_release(blob);
+        return NULL;
+    }
+    blob->key = job->key;
+    memcpy(blob->SHA, job->SHA, SHA256_DIGEST_LENGTH);
+    blob_cache_put(server->cache, blob);
+    return blob;
+}
+
+/**
+ * @brief Looks the content requested by a job up in the cache, recording its key in the job
+ *
+ * @param server Server state, with a cache
+ * @param job Read job, with its img_id and resolution
+ * @return the cached content, NULL if it is not cached
+ */
+static const struct blob *find_cached(struct server *server, struct read_job *job) {
+    // the version changes with any insertion or deletion: an entry of the current one is up to date
+    lock_read(&server->database);
+    job->key.slot = index_find_id(&server->database, job->img_id, INDEX_NOT_FOUND);
+    job->key.version = server->database.header.imgst_version;
+    lock_release(&server->database);
+
+    return job->key.slot != INDEX_NOT_FOUND ? blob_cache_get(server->cache, &job->key) : NULL;
+}
+
+/**
+ * @brief Worker side of a read: locates the image (resizing it if needed), reads it in the cache if it is
+ *        small enough, and hands the job back to the event loop
+ *
+ * @param arg The read_job
+ */
+static void read_image(void *arg) {
+    struct read_job *job = arg;
+    struct server *server = job->server;
+
+    job->err = do_pin(job->img_id, job->resolution, &job->offset, &job->size, job->SHA,
+                      &server->database);
+    job->pinned = job->err == ERR_NONE;
+    if (job->err == ERR_NONE && server->cache != NULL && job->key.slot != INDEX_NOT_FOUND
+        && job->size <= IMGST_SERVER_CACHE_MAX_BLOB) {
+        job->blob = cache_content(server, job);
+    }
+    if (job->blob != NULL) {
+        do_unpin(job->offset, job->size, &server->database);
+        job->pinned = false;
+    }
+
+    pthread_mutex_lock(&server->done_mutex);
+    job->next = server->done;
+    server->done = job;
+    pthread_mutex_unlock(&server->done_mutex);
+
+    // any datagram wakes the event loop up: if the socket is full, one is already pending
+    send(server->wakeup_fd, "", 1, MSG_DONTWAIT);
 }
 
 #define RES_STRING_MAX_SIZE 12
 /**
- * @brief Read an image from given database, send result to incoming connection
+ * @brief Read an image from given database, send result to incoming connection at once if it is cached,
+ *        else once a worker has read it
  *
  * @param nc Incoming connection
- * @param imgst_file Main data structure
+ * @param server Server state, with the database
  * @param hm HTTP message received
  */
-static void handle_read_call(struct mg_connection *nc, imgst_file *imgst_file, struct mg_http_message *hm) {
+static void handle_read_call(struct mg_connection *nc, struct server *server, struct mg_http_message *hm) {
 
-    char *res_buffer = calloc(RES_STRING_MAX_SIZE + 1, sizeof(char));
-    M_REQUIRE_CUSTOM_RET(res_buffer != NULL,, mg_error_msg(nc, ERR_OUT_OF_MEMORY));
+    char res_buffer[RES_STRING_MAX_SIZE + 1] = "";
     M_REQUIRE_CUSTOM_RET(mg_http_get_var(&hm->query, "res", res_buffer, RES_STRING_MAX_SIZE + 1) > 0,,
-                         GROUP_CALLS(FREE(res_buffer), mg_error_msg(nc, ERR_INVALID_ARGUMENT)));
-    int size_code = resolution_atoi(res_buffer);
-    FREE(res_buffer);
+                         mg_error_msg(nc, ERR_INVALID_ARGUMENT));
+    const int resolution = resolution_atoi(res_buffer);
+    M_REQUIRE_CUSTOM_RET(resolution != ERR_RESOLUTIONS,, mg_error_msg(nc, ERR_RESOLUTIONS));
+
+    struct read_job *job = calloc(1, sizeof(struct read_job));
+    M_REQUIRE_CUSTOM_RET(job != NULL,, mg_error_msg(nc, ERR_OUT_OF_MEMORY));
+    M_REQUIRE_CUSTOM_RET(mg_http_get_var(&hm->query, "img_id", job->img_id, MAX_IMG_ID + 1) > 0,,
+                         GROUP_CALLS(free(job), mg_error_msg(nc, ERR_INVALID_IMGID)));
+
+    const struct mg_str *if_none_match = mg_http_get_header(hm, "If-None-Match");
+    if (if_none_match != NULL) {
+        const size_t length = if_none_match->len < MAX_IF_NONE_MATCH ? if_none_match->len : MAX_IF_NONE_MATCH;
+        memcpy(job->if_none_match, if_none_match->ptr, length);
+    }
+
+    job->server = server;
+    job->conn_id = nc->id;
+    job->resolution = resolution;
+    job->key = (struct blob_key) { INDEX_NOT_FOUND, resolution, 0 };
 
+    if (server->cache != NULL && (job->blob = find_cached(server, job)) != NULL) {
+        job->size = job->blob->size;
+        memcpy(job->SHA, job->blob->SHA, SHA256_DIGEST_LENGTH);
+        char etag[ETAG_SIZE + 1];
+        make_etag(job->SHA, job->resolution, etag);
+        reply_image(nc, job, etag);
+        blob_release(job->blob);
+        free(job);
+        return;
+    }
 
+    M_REQUIRE_CUSTOM_RET(thread_pool_submit(server->workers, read_image, job) == ERR_NONE,,
+                         GROUP_CALLS(free(job), mg_error_msg(nc, ERR_OUT_OF_MEMORY)));
 }
 
+#define BODY_CHUNK_SIZE 16384 // bytes copied at once when the socket is full
+/**
+ * @brief Sends as much of a body as the socket takes, straight from the database file with sendfile.
+ *        When the socket is full, one chunk is copied to the send buffer of the connection instead,
+ *        so that mongoose polls for writability and the transfer goes on once it is flushed.
+ *
+ * @param nc Connection whose send buffer is empty
+ * @param transfer Body to send
+ * @return error code, ERR_NONE if no error happened (the transfer may not be done)
+ */
+static int send_body(struct mg_connection *nc, struct body_transfer *transfer) {
+    const int store_fd = fileno(transfer->server->database.file);
+
+    while (transfer->remaining > 0) {
+        off_t offset = (off_t) transfer->offset;
+        const ssize_t sent = sendfile((int) (long) nc->fd, store_fd, &offset, transfer->remaining);
+        if (sent > 0) {
+            transfer->offset += (uint64_t) sent;
+            transfer->remaining -= (uint32_t) sent;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            const size_t chunk = transfer->remaining < BODY_CHUNK_SIZE ? transfer->remaining : BODY_CHUNK_SIZE;
+            mg_iobuf_resize(&nc->send, chunk);
+            M_REQ(nc->send.size >= chunk, ERR_OUT_OF_MEMORY, "unable to buffer the image body");
+            M_EXIT_IF_ERR(read_at(&transfer->server->database, nc->send.buf, chunk, transfer->offset));
+            nc->send.len = chunk;
+            transfer->offset += chunk;
+            transfer->remaining -= (uint32_t) chunk;
+            return ERR_NONE;
+        } else {
+            return ERR_IO;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Releases a body transfer, done or not, and the pin of its content.
+ */
+static void end_transfer(struct body_transfer *transfer) {
+    do_unpin(transfer->pinned_offset, transfer->pinned_size, &transfer->server->database);
+    free(transfer);
+}
+
+/**
+ * @brief Handles the events of a connection while the body of an image is sent to it,
+ *        giving the connection back to imgst_event_handler once done.
+ */
+static void body_event_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data) {
+    struct body_transfer *transfer = (struct body_transfer *) fn_data;
+
+    if ((ev == MG_EV_WRITE || ev == MG_EV_POLL) && nc->send.len == 0) {
+        if (send_body(nc, transfer) != ERR_NONE) {
+            nc->is_closing = 1;
+        } else if (transfer->remaining == 0 && nc->send.len == 0) {
+            nc->fn = imgst_event_handler;
+            nc->fn_data = transfer->server;
+            end_transfer(transfer);
+        }
+    } else if (ev == MG_EV_CLOSE) {
+        end_transfer(transfer);
+    }
+    (void) ev_data;
+}
+
+/**
+ * @brief Writes the entity tag of an image at some resolution: its content only depends on both,
+ *        resized versions never changing once stored.
+ *
+ * @param SHA SHA of the image
+ * @param resolution Resolution of the content
+ * @param etag Destination of ETAG_SIZE + 1 characters
+ */
+static void make_etag(const unsigned char *SHA, int resolution, char *etag) {
+    etag[0] = '"';
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        sprintf(&etag[1 + i * 2], "%02x", SHA[i]);
+    }
+    sprintf(&etag[1 + 2 * SHA256_DIGEST_LENGTH], "-%d\"", resolution);
+}
+
+/**
+ * @brief Tells whether an If-None-Match header matches an entity tag ("*", or one of its tags,
+ *        weak comparison being the one to use for If-None-Match).
+ *
+ * @param if_none_match Value of the header
+ * @param etag Quoted entity tag, as written by make_etag
+ * @return true if the client already has the content
+ */
+static bool etag_matches(const char *if_none_match, const char *etag) {
+    return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag) != NULL;
+}
+
+/**
+ * @brief Replies with an image, cached or located by a worker: 304 if the client has it already,
+ *        else its header, the body following from memory or from the database file
+ *
+ * @param nc Connection to reply to
+ * @param job Read job done
+ * @param etag Entity tag of the image
+ */
+static void reply_image(struct mg_connection *nc, struct read_job *job, const char *etag) {
+    if (etag_matches(job->if_none_match, etag)) {
+        mg_printf(nc, "HTTP/1.1 %d Not Modified\r\nETag: %s\r\nCache-Control: %s\r\nContent-Length: 0\r\n\r\n",
+                  NOT_MODIFIED_STATUS_CODE, etag, IMGST_SERVER_CACHE_CONTROL);
+        return;
+    }
+
+    struct body_transfer *transfer = NULL;
+    if (job->blob == NULL) {
+        transfer = calloc(1, sizeof(struct body_transfer));
+        M_REQUIRE_CUSTOM_RET(transfer != NULL,, mg_error_msg(nc, ERR_OUT_OF_MEMORY));
+    }
+
+    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Type: image/jpeg\r\nETag: %s\r\nCache-Control: %s\r\n"
+              "Content-Length: %" PRIu32 "\r\n\r\n",
+              DEF_STATUS_CODE, etag, IMGST_SERVER_CACHE_CONTROL, job->size);
+    if (job->blob != NULL) {
+        mg_send(nc, job->blob->data, job->blob->size);
+        return;
+    }
+    // the body follows once the header is flushed (see body_event_handler)
+    transfer->server = job->server;
+    transfer->offset = job->offset;
+    transfer->remaining = job->size;
+    transfer->pinned_offset = job->offset;
+    transfer->pinned_size = job->size;
+    job->pinned = false;
+    nc->fn = body_event_handler;
+    nc->fn_data = transfer;
+}
+
+/**
+ * @brief Replies to the read requests done by the workers, whose connections are still open
+ *
+ * @param server Server state
+ */
+static void reply_done_reads(struct server *server) {
+    pthread_mutex_lock(&server->done_mutex);
+    struct read_job *job = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->done_mutex);
+
+    while (job != NULL) {
+        struct mg_connection *nc = server->mgr.conns;
+        while (nc != NULL && nc->id != job->conn_id) nc = nc->next;
+
+        if (nc == NULL) {
+            // client gone, nothing to do
+        } else if (job->err != ERR_NONE) {
+            mg_error_msg(nc, job->err);
+        } else {
+            char etag[ETAG_SIZE + 1];
+            make_etag(job->SHA, job->resolution, etag);
+            reply_image(nc, job, etag);
+        }
+
+        struct read_job *next = job->next;
+        if (job->pinned) do_unpin(job->offset, job->size, &server->database);
+        blob_release(job->blob);
+        free(job);
+        job = next;
+    }
+}
+
+/**
+ * @brief Handles the datagrams sent by the workers when they are done with a job.
+ */
+static void wakeup_event_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data) {
+    if (ev == MG_EV_READ) {
+        nc->recv.len = 0;
+        reply_done_reads((struct server *) fn_data);
+    }
+    (void) ev_data;
+}
 
 /**
  * @brief Handles server events (eg HTTP requests).
  * For more check https://cesanta.com/docs/#event-handler-function
  */
 static void imgst_event_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data) {
-    struct imgst_file *imgst_file = (struct imgst_file *) fn_data;
+    struct server *server = (struct server *) fn_data;
     switch (ev) {
         case MG_EV_HTTP_MSG: {
             struct mg_http_message *hm = (struct mg_http_message *) ev_data;
             if (match_list(hm)) {
-                handle_list_call(nc, imgst_file);  // Serve REST
+                handle_list_call(nc, &server->database, hm);  // Serve REST
             } else if (match_read(hm)) {
-
+                handle_read_call(nc, server, hm);
+            } else if (match_cache(hm)) {
+                handle_cache_call(nc, server->cache);
             } else {
                 struct mg_http_serve_opts opts = {.root_dir = s_web_directory};
                 mg_http_serve_dir(nc, ev_data, &opts);
@@ -100,33 +578,147 @@ static void imgst_event_handler(struct mg_connection *nc, int ev, void *ev_data,
     }
 }
 
+// ======================================================================
+/**
+ * @brief Opens the loopback socket pair by which workers wake the event loop up.
+ *
+ * @param server Server whose mgr is initialised
+ * @return error code, ERR_NONE if no error happened
+ */
+static int open_wakeup(struct server *server) {
+    struct mg_connection *listener = mg_listen(&server->mgr, s_wakeup_address, wakeup_event_handler, server);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(listener, ERR_IO);
+
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    M_REQ(getsockname((int) (long) listener->fd, (struct sockaddr *) &address, &length) == 0, ERR_IO,
+          "unable to get the wakeup address");
+
+    server->wakeup_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    M_REQ(server->wakeup_fd >= 0, ERR_IO, "unable to open the wakeup socket");
+    M_REQ(connect(server->wakeup_fd, (struct sockaddr *) &address, length) == 0, ERR_IO,
+          "unable to connect the wakeup socket");
+    return ERR_NONE;
+}
+
+/**
+ * @brief Stops the workers (after their current jobs) and releases the server.
+ *
+ * @param server Server, possibly partly started
+ */
+static void stop_server(struct server *server) {
+    thread_pool_destroy(server->workers);
+    server->workers = NULL;
+    reply_done_reads(server); // frees them, connections being closed by mg_mgr_free below
+
+    if (server->cache != NULL) {
+        struct blob_cache_stats stats;
+        blob_cache_get_stats(server->cache, &stats);
+        printf("Cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+               stats.hits, stats.misses, stats.evictions);
+        blob_cache_destroy(server->cache);
+        server->cache = NULL;
+    }
+
+    if (server->wakeup_fd >= 0) close(server->wakeup_fd);
+    mg_mgr_free(&server->mgr);
+    pthread_mutex_destroy(&server->done_mutex);
+    do_close(&server->database);
+}
+
+/**
+ * @brief Worker side of compaction: runs one step of it, while the event loop goes on serving.
+ *
+ * @param arg The server
+ */
+static void compact_step(void *arg) {
+    struct server *server = arg;
+
+    lock_read(&server->database);
+    const uint32_t version = server->database.header.imgst_version;
+    lock_release(&server->database);
+
+    bool done = false;
+    const int err = do_compact(&server->database, server->compact_budget, &done);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "Compaction stopped: %s\n", ERR_MESSAGES[err]);
+    }
+    if (done || err != ERR_NONE) {
+        server->compacted_version = version;
+        atomic_store(&server->compacted, true);
+    }
+    atomic_store(&server->compacting, false);
+}
+
+/**
+ * @brief Hands the next compaction step to the workers, unless one is queued already, or
+ *        the database has not changed since it was compacted.
+ *
+ * @param server Server state
+ */
+static void compact_in_background(struct server *server) {
+    if (server->compact_budget == 0 || atomic_load(&server->compacting)) return;
+
+    if (atomic_load(&server->compacted)) {
+        lock_read(&server->database);
+        const bool changed = server->database.header.imgst_version != server->compacted_version;
+        lock_release(&server->database);
+        if (!changed) return;
+        atomic_store(&server->compacted, false);
+    }
+
+    atomic_store(&server->compacting, true);
+    if (thread_pool_submit(server->workers, compact_step, server) != ERR_NONE) {
+        atomic_store(&server->compacting, false);
+    }
+}
+
 // ======================================================================
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Error: usage: %s imgstore_database\n", argv[0]);
+    struct server server = { .wakeup_fd = -1 };
+    // background compaction rewrites contents in place: only when asked to
+    if (argc == 4 && strcmp(argv[1], "-compact") == 0) {
+        server.compact_budget = (uint64_t) atouint32(argv[2]) * 1024;
+    }
+    if (argc != 2 && (argc != 4 || server.compact_budget == 0)) {
+        fprintf(stderr, "Error: usage: %s [-compact <budget KiB>] imgstore_database\n", argv[0]);
         return 1;
     }
-    const char *imgst_filename = argv[1];
-    imgst_file database;
+    const char *imgst_filename = argv[argc - 1];
     int err;
-    M_REQ((err = do_open(imgst_filename, "r+b", &database)) == ERR_NONE, err,
-          "could not open file in main_webserver");    /* Create server */
+    M_REQ((err = do_open_mapped(imgst_filename, "r+b", &server.database)) == ERR_NONE, err,
+          "could not open file in main_webserver");
+    // the lazy resizes (and compaction steps) survive a crash completely or not at all
+    M_EXIT_IF_ERR_DO_SOMETHING(do_enable_wal(&server.database, imgst_filename), do_close(&server.database));
+    M_EXIT_IF_ERR_DO_SOMETHING(do_enable_locking(&server.database), do_close(&server.database));
+    M_EXIT_IF_ERR_DO_SOMETHING(do_enable_change_log(&server.database, IMGST_SERVER_CHANGE_LOG),
+                               do_close(&server.database));
 
-    struct mg_mgr mgr;
-    mg_mgr_init(&mgr);
+    pthread_mutex_init(&server.done_mutex, NULL);
+    mg_mgr_init(&server.mgr);
 
-    M_EXIT_IF_ERR_DO_SOMETHING(mg_http_listen(&mgr, s_listening_address, imgst_event_handler, &database) != NULL ? ERR_NONE : ERR_IO,
-                               GROUP_CALLS(mg_mgr_free(&mgr), do_close(&database)));
+    /* Create server */
+    M_EXIT_IF_ERR_DO_SOMETHING(thread_pool_create(IMGST_SERVER_WORKERS, &server.workers), stop_server(&server));
+    if (IMGST_SERVER_CACHE_SIZE > 0) {
+        M_EXIT_IF_ERR_DO_SOMETHING(blob_cache_create(IMGST_SERVER_CACHE_SIZE, IMGST_SERVER_CACHE_SHARDS, &server.cache),
+                                   stop_server(&server));
+    }
+    M_EXIT_IF_ERR_DO_SOMETHING(open_wakeup(&server), stop_server(&server));
+    M_EXIT_IF_ERR_DO_SOMETHING(mg_http_listen(&server.mgr, s_listening_address, imgst_event_handler, &server) != NULL ? ERR_NONE : ERR_IO,
+                               stop_server(&server));
     printf("Starting imgStore server on %s", s_listening_address);
-    print_header(&database.header);
+    print_header(&server.database.header);
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     /* Poll */
-    while (s_signo == 0) mg_mgr_poll(&mgr, 1000);
+    while (s_signo == 0) {
+        const bool compacting = server.compact_budget > 0 && !atomic_load(&server.compacted);
+        mg_mgr_poll(&server.mgr, compacting ? IMGST_SERVER_COMPACT_PERIOD : 1000);
+        compact_in_background(&server);
+    }
     /* Cleanup */
-    mg_mgr_free(&mgr);
-    do_close(&database);
+    stop_server(&server);
 
     return 0;
-}
\ No newline at end of file
+}
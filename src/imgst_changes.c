@@ -0,0 +1,58 @@
+/**
+ * @file imgst_changes.c
+ * @brief imgStore library: log of the latest insertions and deletions.
+ */
+
+#include "imgst_changes.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/********************************************************************//**
+ * Keeps the last capacity insertions and deletions of imgst_file.
+ */
+int do_enable_change_log(imgst_file *imgst_file, size_t capacity) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQ(capacity > 0, ERR_INVALID_ARGUMENT, "a change log holds at least one change");
+    M_EXIT_NO_ERR_IF(imgst_file->changes != NULL);
+
+    struct imgst_changes *changes = calloc(1, sizeof(struct imgst_changes));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(changes, ERR_OUT_OF_MEMORY);
+    changes->entries = calloc(capacity, sizeof(struct imgst_change));
+    M_REQUIRE_CUSTOM_RET(changes->entries != NULL, ERR_OUT_OF_MEMORY, free(changes));
+
+    changes->capacity = capacity;
+    changes->since = imgst_file->header.imgst_version;
+    imgst_file->changes = changes;
+    return ERR_NONE;
+}
+
+void changes_record(imgst_file *imgst_file, uint32_t slot, bool deleted) {
+    struct imgst_changes *changes = imgst_file->changes;
+    if (changes == NULL) return;
+
+    struct imgst_change *change = NULL;
+    if (changes->count < changes->capacity) {
+        change = &changes->entries[(changes->first + changes->count++) % changes->capacity];
+    } else {
+        // overwrites the oldest one
+        change = &changes->entries[changes->first];
+        changes->since = change->version;
+        changes->first = (changes->first + 1) % changes->capacity;
+    }
+    change->version = imgst_file->header.imgst_version;
+    change->deleted = deleted;
+    strncpy(change->img_id, imgst_file->metadata[slot].img_id, MAX_IMG_ID);
+    change->img_id[MAX_IMG_ID] = '\0';
+}
+
+const struct imgst_change *changes_at(const struct imgst_changes *changes, size_t n) {
+    return &changes->entries[(changes->first + n) % changes->capacity];
+}
+
+void changes_free(imgst_file *imgst_file) {
+    if (imgst_file->changes == NULL) return;
+    free(imgst_file->changes->entries);
+    free(imgst_file->changes);
+    imgst_file->changes = NULL;
+}
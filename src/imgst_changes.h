@@ -0,0 +1,60 @@
+/**
+ * @file imgst_changes.h
+ * @brief In-memory log of the latest insertions and deletions of an imgStore.
+ *
+ * The log is opt-in (see do_enable_change_log): while imgst_file->changes is NULL,
+ * nothing is recorded. Its entries form a ring of fixed capacity, the newest change
+ * overwriting the oldest one: the changes since a version are all known as long as
+ * none of them was overwritten. The log is recorded and read under the lock of imgst_file.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#include "imgStore.h"
+
+/**
+ * @brief One insertion or deletion.
+ */
+struct imgst_change {
+    uint32_t version; // imgst_version right after the change
+    bool deleted;     // inserted otherwise
+    char img_id[MAX_IMG_ID + 1];
+};
+
+/**
+ * @brief The log of imgst_file->changes.
+ */
+struct imgst_changes {
+    struct imgst_change *entries; // ring of capacity entries, the oldest one at first
+    size_t capacity;
+    size_t first;
+    size_t count;
+    uint32_t since; // the changes made after this version are all in the log
+};
+
+/**
+ * @brief Logs the insertion or deletion of an image, imgst_version being already updated
+ *        (does nothing if the log is not enabled).
+ *
+ * @param imgst_file Database being worked on, locked for writing
+ * @param slot Index of the metadata of the image
+ * @param deleted Whether the image was deleted, inserted otherwise
+ */
+void changes_record(imgst_file *imgst_file, uint32_t slot, bool deleted);
+
+/**
+ * @brief Gives a change of the log.
+ *
+ * @param changes The log
+ * @param n Rank of the change, 0 for the oldest one, less than changes->count
+ * @return the change
+ */
+const struct imgst_change *changes_at(const struct imgst_changes *changes, size_t n);
+
+/**
+ * @brief Releases the log of imgst_file (does nothing if it was not enabled).
+ *
+ * @param imgst_file Database whose log is to be freed
+ */
+void changes_free(imgst_file *imgst_file);
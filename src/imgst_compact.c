@@ -0,0 +1,433 @@
+/**
+ * @file imgst_compact.c
+ * @brief imgStore library: in-place, online compaction of the image contents (see do_compact).
+ *
+ * The live contents (those referenced by a valid metadata, shared ones counting once)
+ * are slid, in offset order, toward the start of the data region (around the metadata
+ * segments, which stay where they are, see do_grow). The extents are listed and sorted
+ * once per do_compact, then walked in order by batches of contents: each batch is copied
+ * into dead space, without any lock, synced once, then the offsets of all its contents
+ * are switched under the write lock and made durable at once, before the space they leave
+ * can be reused. The images sharing a content are found through the SHA index. A batch
+ * that does not fit in the gap before it is first copied to the end of the file, then
+ * back into the gap, so that no copy ever overwrites bytes still referenced. Nor pinned
+ * (see do_pin): a step stops early rather than copy over a content still being read.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, fdatasync, ftruncate
+
+#include "imgStore.h"
+#include "buffer_pool.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_segment.h"
+#include "imgst_wal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef IMGST_COMPACT_CHUNK
+/**
+ * Number of bytes copied at once when moving an image content.
+ */
+#define IMGST_COMPACT_CHUNK (256 * 1024)
+#endif
+
+/**
+ * @brief A live image content, or a metadata segment: where it is and how long it is.
+ */
+struct extent {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t slot; // of an image referencing the content, when the extents were listed
+    int res;       // resolution of the content in that slot
+    bool pinned;   // a metadata segment, which stays where it is
+};
+
+/**
+ * @brief A content of the current batch, and where it goes.
+ */
+struct move {
+    struct extent from;
+    uint64_t to;
+    size_t rank; // of the content in the sorted extents
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // of the images referencing it
+};
+
+/**
+ * @brief State of one do_compact call: the sorted extents, walked once, and the current batch.
+ */
+struct compaction {
+    struct extent *extents;
+    size_t nb_extents;
+    size_t next;         // first extent not walked through yet
+    uint64_t packed_end; // end of the packed prefix of the data region
+
+    struct move *moves;
+    size_t nb_moves;
+    size_t moves_capacity;
+
+    bool blocked; // by a pinned content: the step stops there
+};
+
+/**
+ * @brief Lists the live contents (shared ones once) and the metadata segments in offset order,
+ *        and starts the walk at the start of the data region.
+ *
+ * @param imgst_file Database being compacted, locked for reading (at least)
+ * @param compaction State whose extents are (re)built
+ * @return error code, ERR_NONE if no error happened
+ */
+static int list_extents(const imgst_file *imgst_file, struct compaction *compaction);
+
+/**
+ * @brief Increasing order of offsets of extents, for qsort.
+ */
+static int compare_extents(const void *a, const void *b);
+
+/**
+ * @brief Walks on through the extents: extends the packed prefix over the ones already packed,
+ *        then fills the batch with the contents after it, up to budget bytes (at least one),
+ *        stopping at a metadata segment.
+ *
+ * @param imgst_file Database being compacted, locked for reading (at least)
+ * @param compaction State of the walk
+ * @param budget Number of bytes to move
+ * @param total Set to the number of bytes of the batch, 0 if it is empty (nothing left to move)
+ * @return error code, ERR_NONE if no error happened
+ */
+static int plan_moves(const imgst_file *imgst_file, struct compaction *compaction, uint64_t budget, uint64_t *total);
+
+/**
+ * @brief Finds the SHA of the images still referencing a content.
+ *
+ * @param imgst_file Database being compacted, locked for reading (at least)
+ * @param content Content listed by list_extents
+ * @param SHA Where to store the SHA
+ * @return true if some image still references the content
+ */
+static bool content_owner(const imgst_file *imgst_file, const struct extent *content, unsigned char *SHA);
+
+/**
+ * @brief Copies size bytes from offset from to offset to, both in the file of imgst_file.
+ *        The destination shall not be referenced by any metadata.
+ */
+static int copy_content(imgst_file *imgst_file, uint64_t from, uint64_t to, uint32_t size);
+
+/**
+ * @brief Copies the contents of the batch to consecutive offsets from to on, which become their destinations.
+ *
+ * @param imgst_file Database being compacted, not locked
+ * @param compaction State with the batch
+ * @param to Destination of the first content
+ * @return error code, ERR_NONE if no error happened
+ */
+static int copy_moves(imgst_file *imgst_file, struct compaction *compaction, uint64_t to);
+
+/**
+ * @brief Tells whether the bytes from to on can be copied over, blocking the walk if not.
+ *
+ * @param imgst_file Database being compacted, not locked
+ * @param compaction State of the walk
+ * @param from Offset of the first byte
+ * @param to Offset after the last byte
+ * @return true if no pinned content overlaps them
+ */
+static bool can_overwrite(const imgst_file *imgst_file, struct compaction *compaction, uint64_t from, uint64_t to);
+
+/**
+ * @brief Makes the metadata referencing the contents of the batch reference their copies instead,
+ *        durably: one sync before (the copies), one after (the metadata, through the log if any),
+ *        the write lock being only held in between (and for the commit of the log).
+ *
+ * @param imgst_file Database being compacted, not locked
+ * @param compaction State with the batch, copied
+ * @return error code, ERR_NONE if no error happened
+ */
+static int switch_offsets(imgst_file *imgst_file, const struct compaction *compaction);
+
+/**
+ * @brief Moves the next batch of contents into the packed prefix, or truncates the file
+ *        after the packed prefix if there is no content left to move.
+ *
+ * @param imgst_file Database being compacted, not locked
+ * @param compaction State of the walk
+ * @param budget Number of bytes to move
+ * @param copied Incremented by the number of bytes copied
+ * @param done Set to true if the contents were all packed
+ * @return error code, ERR_NONE if no error happened
+ */
+static int compact_once(imgst_file *imgst_file, struct compaction *compaction, uint64_t budget,
+                        uint64_t *copied, bool *done);
+
+int do_compact(imgst_file *imgst_file, uint64_t budget, bool *done) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(done);
+
+    struct compaction compaction = { NULL, 0, 0, 0, NULL, 0, 0, false };
+    lock_read(imgst_file);
+    int err = list_extents(imgst_file, &compaction);
+    lock_release(imgst_file);
+
+    // at least one content is moved per call, whatever its size
+    *done = false;
+    uint64_t copied = 0;
+    while (err == ERR_NONE && !*done && !compaction.blocked && (copied == 0 || copied < budget)) {
+        err = compact_once(imgst_file, &compaction, copied < budget ? budget - copied : 0, &copied, done);
+    }
+
+    free(compaction.extents);
+    free(compaction.moves);
+    return err;
+}
+
+static int compact_once(imgst_file *imgst_file, struct compaction *compaction, uint64_t budget,
+                        uint64_t *copied, bool *done) {
+    uint64_t total = 0;
+    lock_read(imgst_file);
+    int err = plan_moves(imgst_file, compaction, budget, &total);
+    lock_release(imgst_file);
+    M_EXIT_IF_ERR(err);
+    // the deletions the plan saw are durable before their contents get overwritten
+    M_EXIT_IF_ERR(wal_flush(imgst_file));
+
+    if (total == 0) {
+        // contents may have been appended meanwhile: then this is not the end yet
+        M_EXIT_IF_ERR(wal_flush(imgst_file));
+        lock_write(imgst_file);
+        err = list_extents(imgst_file, compaction);
+        if (err == ERR_NONE) err = plan_moves(imgst_file, compaction, budget, &total);
+        // a deleted content may still be sent from there, or its deletion not be durable yet
+        if (err == ERR_NONE && total == 0 && imgst_file->data_end > compaction->packed_end
+            && can_overwrite(imgst_file, compaction, compaction->packed_end, imgst_file->data_end)
+            && !(compaction->blocked = wal_pending(imgst_file))) {
+            err = ftruncate(fileno(imgst_file->file), (off_t) compaction->packed_end) == 0 ? ERR_NONE : ERR_IO;
+            if (err == ERR_NONE) imgst_file->data_end = compaction->packed_end;
+        }
+        lock_release(imgst_file);
+        *done = err == ERR_NONE && total == 0 && !compaction->blocked;
+        M_EXIT_NO_ERR_IF(err != ERR_NONE || total == 0);
+    }
+
+    const uint64_t packed_end = compaction->packed_end;
+    M_EXIT_NO_ERR_IF(!can_overwrite(imgst_file, compaction, packed_end, packed_end + total));
+    if (compaction->moves[0].from.offset - packed_end >= total) {
+        M_EXIT_IF_ERR(copy_moves(imgst_file, compaction, packed_end));
+        M_EXIT_IF_ERR(switch_offsets(imgst_file, compaction));
+        *copied += total;
+        compaction->packed_end += total;
+        return ERR_NONE;
+    }
+
+    // too short a gap: through the end of the file, which is then given back
+    lock_write(imgst_file);
+    const uint64_t spare = imgst_file->data_end;
+    imgst_file->data_end += total;
+    lock_release(imgst_file);
+
+    M_EXIT_IF_ERR(copy_moves(imgst_file, compaction, spare));
+    M_EXIT_IF_ERR(switch_offsets(imgst_file, compaction));
+    *copied += total;
+    // pinned meanwhile, before being switched: the contents stay at the end of the file, for a later step
+    M_EXIT_NO_ERR_IF(!can_overwrite(imgst_file, compaction, packed_end, packed_end + total));
+    for (size_t i = 0; i < compaction->nb_moves; ++i) {
+        compaction->moves[i].from.offset = compaction->moves[i].to;
+    }
+    M_EXIT_IF_ERR(copy_moves(imgst_file, compaction, packed_end));
+    M_EXIT_IF_ERR(switch_offsets(imgst_file, compaction));
+    *copied += total;
+    compaction->packed_end += total;
+
+    lock_write(imgst_file);
+    if (imgst_file->data_end == spare + total) imgst_file->data_end = spare;
+    lock_release(imgst_file);
+    return ERR_NONE;
+}
+
+static int compare_extents(const void *a, const void *b) {
+    const uint64_t first = ((const struct extent *) a)->offset;
+    const uint64_t second = ((const struct extent *) b)->offset;
+    return (first > second) - (first < second);
+}
+
+static int list_extents(const imgst_file *imgst_file, struct compaction *compaction) {
+    const uint32_t max_files = imgst_file->header.max_files;
+    struct extent *extents = realloc(compaction->extents,
+                                     ((size_t) max_files * NB_RES + imgst_file->nb_segments) * sizeof(struct extent));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(extents, ERR_OUT_OF_MEMORY);
+    compaction->extents = extents;
+
+    size_t nb_extents = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        const img_metadata *metadata = &imgst_file->metadata[i];
+        for (int res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; ++res) {
+            if (metadata->size[res] > 0 && metadata->offset[res] > 0) {
+                extents[nb_extents++] = (struct extent) { metadata->offset[res], metadata->size[res], i, res, false };
+            }
+        }
+    }
+    for (uint32_t i = 0; i < imgst_file->nb_segments; ++i) {
+        const struct imgst_segment_info *segment = &imgst_file->segments[i];
+        extents[nb_extents++] = (struct extent) {
+            segment->offset, (uint32_t) (sizeof(struct imgst_segment) + segment->nb_files * sizeof(struct img_metadata)),
+            0, 0, true
+        };
+    }
+    qsort(extents, nb_extents, sizeof(struct extent), compare_extents);
+
+    // shared (deduplicated) contents appear once per slot: same offset, same size
+    size_t kept = 0;
+    for (size_t i = 0; i < nb_extents; ++i) {
+        if (kept == 0 || extents[i].offset != extents[kept - 1].offset) extents[kept++] = extents[i];
+    }
+
+    compaction->nb_extents = kept;
+    compaction->next = 0;
+    compaction->packed_end = sizeof(struct imgst_header)
+                             + (uint64_t) table_files(&imgst_file->header) * sizeof(struct img_metadata);
+    compaction->nb_moves = 0;
+    return ERR_NONE;
+}
+
+static int plan_moves(const imgst_file *imgst_file, struct compaction *compaction, uint64_t budget, uint64_t *total) {
+    compaction->nb_moves = 0;
+    *total = 0;
+
+    for (; compaction->next < compaction->nb_extents; ++compaction->next) {
+        const struct extent *extent = &compaction->extents[compaction->next];
+        if (extent->pinned) {
+            if (compaction->nb_moves > 0) break;
+            // a hole before a segment stays
+            if (extent->offset + extent->size > compaction->packed_end) {
+                compaction->packed_end = extent->offset + extent->size;
+            }
+        } else if (compaction->nb_moves == 0 && extent->offset <= compaction->packed_end) {
+            // already packed
+            if (extent->offset + extent->size > compaction->packed_end) {
+                compaction->packed_end = extent->offset + extent->size;
+            }
+        } else {
+            if (compaction->nb_moves > 0 && *total + extent->size > budget) break;
+
+            unsigned char SHA[SHA256_DIGEST_LENGTH];
+            if (!content_owner(imgst_file, extent, SHA)) continue; // deleted since listed: a hole now
+
+            if (compaction->nb_moves == compaction->moves_capacity) {
+                const size_t capacity = compaction->moves_capacity == 0 ? 16 : 2 * compaction->moves_capacity;
+                struct move *moves = realloc(compaction->moves, capacity * sizeof(struct move));
+                M_REQUIRE_NON_NULL_CUSTOM_ERR(moves, ERR_OUT_OF_MEMORY);
+                compaction->moves = moves;
+                compaction->moves_capacity = capacity;
+            }
+            struct move *move = &compaction->moves[compaction->nb_moves++];
+            move->from = *extent;
+            move->to = 0;
+            move->rank = compaction->next;
+            memcpy(move->SHA, SHA, SHA256_DIGEST_LENGTH);
+            *total += extent->size;
+        }
+    }
+    M_EXIT_NO_ERR_IF(compaction->nb_moves == 0);
+
+    // the longest prefix of the batch that fits in the gap before it is moved straight there,
+    // if it is at least half of it (else the whole batch goes through the end of the file)
+    const uint64_t gap = compaction->moves[0].from.offset - compaction->packed_end;
+    uint64_t fitting = 0;
+    size_t nb_fitting = 0;
+    while (nb_fitting < compaction->nb_moves && fitting + compaction->moves[nb_fitting].from.size <= gap) {
+        fitting += compaction->moves[nb_fitting++].from.size;
+    }
+    if (nb_fitting > 0 && nb_fitting < compaction->nb_moves && 2 * fitting >= *total) {
+        compaction->next = compaction->moves[nb_fitting].rank;
+        compaction->nb_moves = nb_fitting;
+        *total = fitting;
+    }
+    return ERR_NONE;
+}
+
+static bool content_owner(const imgst_file *imgst_file, const struct extent *content, unsigned char *SHA) {
+    const img_metadata *metadata = content->slot < imgst_file->header.max_files ? &imgst_file->metadata[content->slot] : NULL;
+    if (metadata != NULL && metadata->is_valid == NON_EMPTY
+        && metadata->offset[content->res] == content->offset && metadata->size[content->res] == content->size) {
+        memcpy(SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+        return true;
+    }
+
+    // that image is gone, but a copy of it may still reference the content
+    for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
+        metadata = &imgst_file->metadata[i];
+        for (int res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; ++res) {
+            if (metadata->offset[res] == content->offset && metadata->size[res] == content->size) {
+                memcpy(SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int copy_content(imgst_file *imgst_file, uint64_t from, uint64_t to, uint32_t size) {
+    const size_t chunk_size = size < IMGST_COMPACT_CHUNK ? size : IMGST_COMPACT_CHUNK;
+    char *chunk = buffer_get(chunk_size);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(chunk, ERR_OUT_OF_MEMORY);
+
+    int err = ERR_NONE;
+    for (uint32_t done = 0; err == ERR_NONE && done < size; done += (uint32_t) chunk_size) {
+        const size_t length = size - done < chunk_size ? size - done : chunk_size;
+        err = read_at(imgst_file, chunk, length, from + done);
+        if (err == ERR_NONE) err = write_at(imgst_file, chunk, length, to + done);
+    }
+    buffer_put(chunk);
+    return err;
+}
+
+static int copy_moves(imgst_file *imgst_file, struct compaction *compaction, uint64_t to) {
+    for (size_t i = 0; i < compaction->nb_moves; ++i) {
+        struct move *move = &compaction->moves[i];
+        M_EXIT_IF_ERR(copy_content(imgst_file, move->from.offset, to, move->from.size));
+        move->to = to;
+        to += move->from.size;
+    }
+    return ERR_NONE;
+}
+
+static bool can_overwrite(const imgst_file *imgst_file, struct compaction *compaction, uint64_t from, uint64_t to) {
+    compaction->blocked = pinned_within(imgst_file, from, to);
+    return !compaction->blocked;
+}
+
+static int switch_offsets(imgst_file *imgst_file, const struct compaction *compaction) {
+    // the copies are on disk before anything references them (a flush of the log syncs them first)
+    M_REQ(imgst_file->wal != NULL || fdatasync(fileno(imgst_file->file)) == 0, ERR_IO,
+          "unable to sync the store in do_compact");
+
+    lock_write(imgst_file);
+    int err = ERR_NONE;
+    for (size_t i = 0; err == ERR_NONE && i < compaction->nb_moves; ++i) {
+        const struct move *move = &compaction->moves[i];
+        for (uint32_t slot = index_next_sha(imgst_file, move->SHA, 0); err == ERR_NONE && slot != INDEX_NOT_FOUND;
+             slot = index_next_sha(imgst_file, move->SHA, slot + 1)) {
+            img_metadata *metadata = &imgst_file->metadata[slot];
+            bool switched = false;
+            for (int res = 0; res < NB_RES; ++res) {
+                if (metadata->offset[res] == move->from.offset && metadata->size[res] == move->from.size) {
+                    metadata->offset[res] = move->to;
+                    switched = true;
+                }
+            }
+            if (switched) err = write_metadata(imgst_file, slot);
+        }
+    }
+    if (err == ERR_NONE) err = wal_commit(imgst_file);
+    lock_release(imgst_file);
+
+    // and no longer reference the originals when their space gets reused
+    M_EXIT_IF_ERR(err);
+    if (imgst_file->wal != NULL) return wal_flush(imgst_file);
+    M_REQ(fdatasync(fileno(imgst_file->file)) == 0, ERR_IO, "unable to sync the store in do_compact");
+    return ERR_NONE;
+}
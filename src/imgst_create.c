@@ -4,6 +4,9 @@
  */
 
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
 #include "error.h"
 
 #include <string.h> // for strncpy
@@ -22,12 +25,23 @@ int do_create(const char *imgst_filename, struct imgst_file *imgst_file) {
     strncpy(imgst_file->header.imgst_name, CAT_TXT, MAX_IMGST_NAME);
     imgst_file->header.imgst_name[MAX_IMGST_NAME] = '\0';
 
-    FILE *file = fopen(imgst_filename, "wb");
+    FILE *file = fopen(imgst_filename, "w+b"); // read back by lazily_resize
     M_REQUIRE_NON_NULL_CUSTOM_ERR(file, ERR_IO);
+    // the log of a former store of that name must not be replayed on this one
+    M_EXIT_IF_ERR_DO_SOMETHING(wal_remove(imgst_filename), fclose(file));
 
     imgst_file->file = file;
-    imgst_file->header.unused_32 = 0;
-    imgst_file->header.unused_64 = 0;
+    imgst_file->mapping = NULL;
+    imgst_file->mapping_size = 0;
+    imgst_file->mapping_shared = false;
+    imgst_file->lock = NULL;
+    imgst_file->pregen = NULL;
+    imgst_file->wal = NULL;
+    imgst_file->changes = NULL;
+    imgst_file->segments = NULL;
+    imgst_file->nb_segments = 0;
+    imgst_file->header.table_files = 0;
+    imgst_file->header.next_segment = 0;
     imgst_file->header.imgst_version = 0;
     imgst_file->header.num_files = 0;
 
@@ -39,11 +53,16 @@ int do_create(const char *imgst_filename, struct imgst_file *imgst_file) {
     imgst_file->metadata = calloc(imgst_file->header.max_files, sizeof(struct img_metadata));
     M_EXIT_IF_ERR_DO_SOMETHING(imgst_file->metadata == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE, fclose(file));
 
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        M_EXIT_IF_ERR_DO_SOMETHING(fwrite(&imgst_file->metadata[i], sizeof(imgst_file->metadata[i]), 1, file) == 1 ? ERR_NONE : ERR_IO,
-                                   GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
-        size_written += 1;
-    }
+    M_EXIT_IF_ERR_DO_SOMETHING(write_metadata_table(imgst_file, file),
+                               GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
+    size_written += imgst_file->header.max_files;
+
+    // later transfers bypass stdio
+    M_EXIT_IF_ERR_DO_SOMETHING(fflush(file) == 0 ? ERR_NONE : ERR_IO,
+                               GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
+    imgst_file->data_end = sizeof(struct imgst_header) + (uint64_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+
+    M_EXIT_IF_ERR_DO_SOMETHING(index_build(imgst_file), GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
 
     printf("%lu item(s) written \n", size_written);
     print_header(&imgst_file->header);
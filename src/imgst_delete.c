@@ -1,8 +1,23 @@
 #include "imgStore.h"
+#include "imgst_changes.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_wal.h"
 #include "error.h"
 
 #include <stdio.h> // for sprintf
 
+/**
+ * @brief Body of do_delete, the write lock being held; commits the log, if enabled
+ */
+static int delete(const char *imgID, struct imgst_file *imgst_file);
+
+/**
+ * @brief Body of do_delete_range, the write lock being held; commits the log, if enabled
+ */
+static int delete_range(const char *first, const char *last, struct imgst_file *imgst_file, uint32_t *nb_deleted);
+
 /********************************************************************//**
  * Delete an image from an imgst_file.
  */
@@ -10,30 +25,80 @@ int do_delete(const char *imgID, struct imgst_file *imgst_file) {
 
     M_REQUIRE_NON_NULL(imgID);
     M_REQUIRE_NON_NULL(imgst_file);
+
+    lock_write(imgst_file);
+    const int err = delete(imgID, imgst_file);
+    lock_release(imgst_file);
+    M_EXIT_IF_ERR(err);
+    return wal_flush(imgst_file);
+}
+
+/********************************************************************//**
+ * Delete the images of a range of img_ids from an imgst_file.
+ */
+int do_delete_range(const char *first, const char *last, struct imgst_file *imgst_file, uint32_t *nb_deleted) {
+
     M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(nb_deleted);
+
+    lock_write(imgst_file);
+    const int err = delete_range(first, last, imgst_file, nb_deleted);
+    lock_release(imgst_file);
+    M_EXIT_IF_ERR(err);
+    return wal_flush(imgst_file);
+}
+
+static int delete(const char *imgID, struct imgst_file *imgst_file) {
 
     if (imgst_file->header.num_files == 0) {
         return ERR_FILE_NOT_FOUND;
     }
 
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        if (imgst_file->metadata[i].is_valid == NON_EMPTY && strcmp(imgst_file->metadata[i].img_id, imgID) == 0) {
+    const uint32_t i = index_find_id(imgst_file, imgID, INDEX_NOT_FOUND);
+    if (i == INDEX_NOT_FOUND) {
+        return ERR_FILE_NOT_FOUND;
+    }
 
-            imgst_file->metadata[i].is_valid = EMPTY;
+    index_remove(imgst_file, i);
+    imgst_file->metadata[i].is_valid = EMPTY;
 
-            M_REQ(fseek(imgst_file->file, sizeof(imgst_file->header) + i * sizeof(struct img_metadata), SEEK_SET) == 0,
-                    ERR_IO, "fseek for metadata failed in do_delete");
-            M_WRITE(imgst_file->metadata[i], imgst_file->file, "unable to write metadata in do_delete");
+    int err = write_metadata(imgst_file, i);
+    M_REQ(err == ERR_NONE, err, "unable to write metadata in do_delete");
 
-            imgst_file->header.imgst_version += 1;
-            imgst_file->header.num_files -= 1;
+    imgst_file->header.imgst_version += 1;
+    changes_record(imgst_file, i, true);
+    imgst_file->header.num_files -= 1;
 
-            M_REQ(fseek(imgst_file->file, 0, SEEK_SET) == 0, ERR_IO, "fseek for header failed in do_delete");
-            M_WRITE(imgst_file->header, imgst_file->file, "unable to write header in do_delete");
+    err = write_header(imgst_file);
+    M_REQ(err == ERR_NONE, err, "unable to write header in do_delete");
 
-            return ERR_NONE; //since we only delete the first image
-        }
+    return wal_commit(imgst_file);
+}
+
+static int delete_range(const char *first, const char *last, struct imgst_file *imgst_file, uint32_t *nb_deleted) {
+    struct index_cursor cursor;
+    index_seek(imgst_file, first, last, &cursor);
+    const struct index_cursor from = cursor;
+
+    // the images stay in the indexes (and the walk) until they are all deleted
+    int err = ERR_NONE;
+    *nb_deleted = 0;
+    uint32_t i = 0;
+    while (err == ERR_NONE && (i = index_next(imgst_file, &cursor)) != INDEX_NOT_FOUND) {
+        imgst_file->metadata[i].is_valid = EMPTY;
+        imgst_file->header.imgst_version += 1;
+        imgst_file->header.num_files -= 1;
+        changes_record(imgst_file, i, true);
+        ++*nb_deleted;
+        err = write_metadata(imgst_file, i);
     }
+    index_remove_range(imgst_file, &from, *nb_deleted);
+    M_REQ(err == ERR_NONE, err, "unable to write metadata in do_delete_range");
+    M_EXIT_NO_ERR_IF(*nb_deleted == 0);
+
+    err = write_header(imgst_file);
+    M_REQ(err == ERR_NONE, err, "unable to write header in do_delete_range");
 
-    return ERR_FILE_NOT_FOUND;
+    return wal_commit(imgst_file);
 }
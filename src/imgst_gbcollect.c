@@ -1,48 +1,158 @@
+/**
+ * @file imgst_gbcollect.c
+ * @brief imgStore library: do_gbcollect implementation.
+ *
+ * The valid images are copied to a new store, slot after slot, as raw bytes: their
+ * metadata (SHA, original resolution, resized versions) is carried over as it is,
+ * nothing is decoded nor hashed again. A content shared by several images (see
+ * do_name_and_content_dedup) is copied once, and all of them reference the copy.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, fdatasync
+
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
 #include "error.h"
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * @brief A content referenced by a valid image of the old store.
+ */
+struct reference {
+    uint64_t offset; // in the old store
+    uint32_t size;
+    uint32_t owner;  // first reference to the same content, in copy order
+    uint64_t to;     // offset in the new store
+};
+
+/**
+ * @brief Increasing order of offsets then of positions (in copy order) of references, for qsort.
+ */
+static int compare_references(const void *a, const void *b);
 
 /**
- * @brief Removes the deleted images by moving the existing ones
+ * @brief Copies the valid images of old into the empty store temp, in slot order,
+ *        each shared content once.
+ *
+ * @param old Database collected
+ * @param temp Database just created with the same configuration
+ * @return error code, ERR_NONE if no error happened
+ */
+static int copy_images(const imgst_file *old, imgst_file *temp);
+
+/********************************************************************//**
+ * Removes the deleted images by moving the existing ones
  */
 int do_gbcollect(const char *imgst_path, const char *imgst_tmp_bkp_path) {
     M_REQUIRE_NON_NULL(imgst_path);
     M_REQUIRE_NON_NULL(imgst_tmp_bkp_path);
 
-    imgst_file old, temp;
+    imgst_file old;
     int err;
 
-    M_REQUIRE((err = do_open(imgst_path, "r+b", &old))==ERR_NONE, err,
+    // writable, so that a pending log gets checkpointed into the old store
+    M_REQUIRE((err = do_open(imgst_path, "r+b", &old)) == ERR_NONE, err,
               "Failed to open imgst file to collect at %s", imgst_path);
-    M_REQUIRE((err=do_create(imgst_tmp_bkp_path, &temp))==ERR_NONE, err,
-              "Failed to create temporary imgst file at %s", imgst_tmp_bkp_path);
 
-    uint32_t    im_size;
-    char*       image_buffer;
+    imgst_file temp = { NULL, old.header, NULL };
+    M_EXIT_IF_ERR_DO_SOMETHING(err = do_create(imgst_tmp_bkp_path, &temp), do_close(&old));
+
+    err = copy_images(&old, &temp);
+    if (err == ERR_NONE) {
+        err = fdatasync(fileno(temp.file)) == 0 ? ERR_NONE : ERR_IO;
+    }
+    do_close(&temp);
+    do_close(&old);
+    M_EXIT_IF_ERR_DO_SOMETHING(err, remove(imgst_tmp_bkp_path));
 
-    for (size_t i = 0; i < old.header.num_files; ++i) {
+    // the (empty) log of the old store shall not be replayed onto the new one
+    M_EXIT_IF_ERR(wal_remove(imgst_path));
+    M_REQUIRE(rename(imgst_tmp_bkp_path, imgst_path) == 0, ERR_IO,
+              "Failed to rename temp file at : %s", imgst_tmp_bkp_path);
 
-        char* name;
-        M_REQUIRE_NON_NULL(name = old.metadata[i].img_id);
-        if (old.metadata[i].is_valid == EMPTY)
-            continue;
-        for (size_t j = RES_ORIG; j < NB_RES;  ++j) {
-            if (old.metadata[i].size[j] != 0) {
+    return ERR_NONE;
+}
 
-                M_REQUIRE((err = do_read(name, j, &image_buffer, &im_size, &old)) == ERR_NONE,
-                          err, "Failed to read image : %s", old.metadata[i].img_id);
+static int compare_references(const void *a, const void *b) {
+    const struct reference *first = *(const struct reference * const *) a;
+    const struct reference *second = *(const struct reference * const *) b;
+    if (first->offset != second->offset) return (first->offset > second->offset) - (first->offset < second->offset);
+    return (first > second) - (first < second);
+}
 
-                M_REQUIRE((err = do_insert(image_buffer, im_size, name, &temp)) == ERR_NONE, err,
-                          "Failed to insert image : %s", old.metadata[i].img_id);
+static int copy_images(const imgst_file *old, imgst_file *temp) {
+    const uint32_t max_files = old->header.max_files;
+    struct reference *references = calloc((size_t) max_files * NB_RES, sizeof(struct reference));
+    struct reference **sorted = calloc((size_t) max_files * NB_RES, sizeof(struct reference *));
+    M_REQ_CLEAN(references != NULL && sorted != NULL, ERR_OUT_OF_MEMORY, "out of memory in do_gbcollect",
+                2, references, sorted);
+
+    // copy order: slot after slot, original first (as do_insert then do_read would lay them out)
+    static const int copy_order[NB_RES] = { RES_ORIG, RES_THUMB, RES_SMALL };
+    uint32_t nb_references = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        const img_metadata *metadata = &old->metadata[i];
+        for (int r = 0; metadata->is_valid == NON_EMPTY && r < NB_RES; ++r) {
+            const int res = copy_order[r];
+            if (metadata->size[res] > 0 && metadata->offset[res] > 0) {
+                references[nb_references] = (struct reference) { metadata->offset[res], metadata->size[res], nb_references, 0 };
+                sorted[nb_references] = &references[nb_references];
+                ++nb_references;
             }
         }
     }
 
-    FREE(image_buffer);
+    // the first reference to each content owns it
+    qsort(sorted, nb_references, sizeof(struct reference *), compare_references);
+    for (uint32_t i = 1; i < nb_references; ++i) {
+        if (sorted[i]->offset == sorted[i - 1]->offset && sorted[i]->size == sorted[i - 1]->size) {
+            sorted[i]->owner = sorted[i - 1]->owner;
+        }
+    }
+    free(sorted);
+
+    int err = ERR_NONE;
+    for (uint32_t i = 0; err == ERR_NONE && i < nb_references; ++i) {
+        struct reference *reference = &references[i];
+        if (reference->owner != i) {
+            reference->to = references[reference->owner].to;
+        } else {
+            reference->to = temp->data_end;
+            err = copy_at(old, reference->offset, temp, reference->to, reference->size);
+            temp->data_end += reference->size;
+        }
+    }
 
-    M_REQUIRE(remove(imgst_path) != 0, ERR_IO, "Failed to remove old file at : %s", imgst_path);
-    M_REQUIRE(rename(imgst_tmp_bkp_path, imgst_path) != 0, ERR_IO, "Failed to rename temp file at : %s", imgst_tmp_bkp_path);
-    do_close(&old) ;
+    // same walk again: the valid images fill the first slots of the new store
+    uint32_t slot = 0;
+    nb_references = 0;
+    for (uint32_t i = 0; err == ERR_NONE && i < max_files; ++i) {
+        if (old->metadata[i].is_valid != NON_EMPTY) continue;
+        img_metadata *metadata = &temp->metadata[slot];
+        *metadata = old->metadata[i];
+        for (int r = 0; r < NB_RES; ++r) {
+            const int res = copy_order[r];
+            if (metadata->size[res] > 0 && metadata->offset[res] > 0) {
+                metadata->offset[res] = references[nb_references++].to;
+            } else {
+                metadata->offset[res] = 0;
+                metadata->size[res] = 0;
+            }
+        }
+        index_insert(temp, slot);
+        ++slot;
+    }
+    free(references);
+    M_EXIT_IF_ERR(err);
 
-    return ERR_NONE;
+    // as if the images had just been inserted
+    temp->header.num_files = slot;
+    temp->header.imgst_version = slot;
+    M_EXIT_IF_ERR(write_metadata_range(temp, 0, slot));
+    return write_header(temp);
 }
@@ -0,0 +1,910 @@
+/**
+ * @file imgst_index.c
+ * @brief imgStore library: open-addressing hash indexes from img_id and SHA to metadata slot,
+ *        B+-tree of the valid slots in img_id order, and bitmap of the free metadata slots.
+ *
+ * Linear probing over power-of-two tables at most half full; removals use
+ * backward shifting, so that no tombstone ever lengthens the probe sequences.
+ * The SHA table is a multimap, as deduplicated images share the same SHA.
+ *
+ * Free slots are tracked by a two-level bitmap (one bit per slot, one summary bit
+ * per full word) plus a hint on the first word which may have a free slot, so that
+ * the lowest free slot is found without rescanning the metadata.
+ *
+ * The img_id order is a B+-tree whose nodes count the slots below them, so that
+ * insertions, removals, seeks by img_id and skips by rank all cost O(log n); walks in
+ * img_id order then go leaf by leaf, in O(1) per image, without any sort at listing time.
+ * Nodes left small by removals are merged with a neighbour, empty ones freed.
+ */
+
+#include "imgst_index.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EMPTY_BUCKET 0
+#define MIN_BUCKETS 16
+
+#define ORDER_FANOUT 64 // slots per leaf, children per inner node of the img_id order
+
+#define WORD_BITS 64
+#define NB_WORDS(nb_bits) (((nb_bits) + WORD_BITS - 1) / WORD_BITS)
+#define BIT(i) ((uint64_t) 1 << ((i) % WORD_BITS))
+
+/**
+ * Key an index is built upon.
+ */
+enum index_key {
+    KEY_ID,
+    KEY_SHA
+};
+
+/**
+ * Hash table of metadata slots. Buckets hold slot + 1, EMPTY_BUCKET meaning free.
+ */
+struct imgst_index {
+    uint32_t *buckets;
+    uint32_t mask;
+    enum index_key key;
+};
+
+/**
+ * Node of the img_id order.
+ */
+struct order_node {
+    uint32_t count;                       // slots of a leaf, children of an inner node
+    uint32_t size;                        // slots in the subtree
+    bool leaf;
+    uint32_t first[ORDER_FANOUT];         // slots of a leaf, in order; first slot of each child
+    struct order_node *children[];        // of an inner node only
+};
+
+/**
+ * Valid slots sorted by img_id, then by slot.
+ */
+struct imgst_id_order {
+    struct order_node *root;
+};
+
+/**
+ * An img_id and its slot, while the img_id order is being built.
+ */
+struct id_entry {
+    const char *img_id;
+    uint32_t slot;
+};
+
+/**
+ * Bitmap of the used metadata slots. Bits past max_files are set, so that they are never found free.
+ */
+struct imgst_free_slots {
+    uint64_t *used;     // one bit per slot
+    uint64_t *full;     // one bit per word of used, set when all its slots are used
+    uint32_t nb_words;  // number of words of used
+    uint32_t hint;      // no word of used before this one has a free slot
+};
+
+/**
+ * @brief FNV-1a hash of an image id
+ *
+ * @param img_id Image ID to hash
+ * @return the hash value
+ */
+static uint32_t hash_id(const char *img_id);
+
+/**
+ * @brief Hash of a SHA-256 digest: its first bytes are already uniformly distributed
+ *
+ * @param SHA Digest to hash
+ * @return the hash value
+ */
+static uint32_t hash_sha(const unsigned char *SHA);
+
+/**
+ * @brief Computes the bucket the key of some metadata should ideally be stored in
+ *
+ * @param index Hash table
+ * @param metadata Metadata whose key is hashed
+ * @return the home bucket of the metadata
+ */
+static uint32_t home_bucket(const struct imgst_index *index, const img_metadata *metadata);
+
+/**
+ * @brief Allocates an empty table large enough for max_files entries
+ *
+ * @param max_files Maximum number of entries
+ * @param key Key of the new index
+ * @return the new index, NULL if out of memory
+ */
+static struct imgst_index *new_index(uint32_t max_files, enum index_key key);
+
+/**
+ * @brief Releases some index
+ *
+ * @param index Index to free, may be NULL
+ */
+static void delete_index(struct imgst_index *index);
+
+/**
+ * @brief Allocates the bitmap of max_files slots, all free
+ *
+ * @param max_files Number of slots
+ * @return the new bitmap, NULL if out of memory
+ */
+static struct imgst_free_slots *new_free_slots(uint32_t max_files);
+
+/**
+ * @brief Releases some bitmap
+ *
+ * @param slots Bitmap to free, may be NULL
+ */
+static void delete_free_slots(struct imgst_free_slots *slots);
+
+/**
+ * @brief Marks a slot as used (or free) in the bitmap
+ */
+static void set_used(struct imgst_free_slots *slots, uint32_t slot, bool used);
+
+/**
+ * @brief Compares the img_id and slot of some valid image to an img_id and slot
+ *
+ * @return <0, 0 or >0 as the image comes before, at or after (img_id, slot) in img_id order
+ */
+static int compare_id(const img_metadata *metadata, uint32_t slot, const char *img_id, uint32_t other);
+
+/**
+ * @brief Compares two struct id_entry, for qsort
+ */
+static int compare_entries(const void *a, const void *b);
+
+/**
+ * @brief Builds the img_id order of the valid slots of imgst_file
+ *
+ * @return the new order, NULL if out of memory
+ */
+static struct imgst_id_order *new_id_order(const imgst_file *imgst_file);
+
+/**
+ * @brief Releases some img_id order
+ *
+ * @param order Order to free, may be NULL
+ */
+static void delete_id_order(struct imgst_id_order *order);
+
+/**
+ * @brief Allocates an empty node of the img_id order
+ *
+ * @return the new node, NULL if out of memory
+ */
+static struct order_node *new_node(bool leaf);
+
+/**
+ * @brief Releases a node of the img_id order and its subtree
+ */
+static void delete_node(struct order_node *node);
+
+/**
+ * @brief Finds the child of an inner node under which (img_id, slot) is, or would be
+ */
+static uint32_t node_child(const imgst_file *imgst_file, const struct order_node *node, const char *img_id,
+                           uint32_t slot);
+
+/**
+ * @brief Finds the first position of a leaf which does not come before (img_id, slot)
+ */
+static uint32_t leaf_position(const imgst_file *imgst_file, const struct order_node *leaf, const char *img_id,
+                              uint32_t slot);
+
+/**
+ * @brief Moves the upper half of a full child of an inner node to a new child, right after it
+ *
+ * @return error code, ERR_NONE if no error happened
+ */
+static int split_child(struct order_node *parent, uint32_t i);
+
+/**
+ * @brief Merges a small child of an inner node with a neighbour, if they fit in one node
+ */
+static void merge_child(struct order_node *parent, uint32_t i);
+
+/**
+ * @brief Removes a child from an inner node (without freeing it)
+ */
+static void remove_child(struct order_node *parent, uint32_t i);
+
+/**
+ * @brief Finds the first rank of the img_id order which does not come before (img_id, slot)
+ */
+static uint32_t order_find(const imgst_file *imgst_file, const char *img_id, uint32_t slot);
+
+/**
+ * @brief Finds the leaf holding a rank of the img_id order, and the position of the rank in it
+ *
+ * @return the leaf, NULL past the last rank
+ */
+static const struct order_node *order_leaf(const struct imgst_id_order *order, uint32_t rank, uint32_t *position);
+
+/**
+ * @brief Registers a slot in the img_id order (which is dropped if out of memory, see index_seek)
+ */
+static void order_insert(imgst_file *imgst_file, uint32_t slot);
+
+/**
+ * @brief Registers a slot in a subtree whose root is not full, splitting its full nodes on the way
+ *
+ * @return error code, ERR_NONE if no error happened
+ */
+static int node_insert(const imgst_file *imgst_file, struct order_node *node, uint32_t slot);
+
+/**
+ * @brief Unregisters a slot from the img_id order
+ */
+static void order_remove(imgst_file *imgst_file, uint32_t slot);
+
+/**
+ * @brief Unregisters a slot from a subtree, merging or freeing the nodes it leaves small or empty
+ *
+ * @return whether the slot was found
+ */
+static bool node_remove(const imgst_file *imgst_file, struct order_node *node, uint32_t slot);
+
+/**
+ * @brief Registers a slot in one table
+ */
+static void table_insert(struct imgst_index *index, const img_metadata *metadata, uint32_t slot);
+
+/**
+ * @brief Unregisters a slot from one table
+ */
+static void table_remove(struct imgst_index *index, const img_metadata *metadata, uint32_t slot);
+
+/**
+ * @brief Build the indexes of all valid slots.
+ */
+int index_build(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+
+    imgst_file->id_index = new_index(imgst_file->header.max_files, KEY_ID);
+    imgst_file->sha_index = new_index(imgst_file->header.max_files, KEY_SHA);
+    imgst_file->free_slots = new_free_slots(imgst_file->header.max_files);
+    imgst_file->id_order = NULL; // sorted once, after the insertions below
+    if (imgst_file->id_index == NULL || imgst_file->sha_index == NULL || imgst_file->free_slots == NULL) {
+        index_free(imgst_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
+        if (imgst_file->metadata[i].is_valid == NON_EMPTY) {
+            index_insert(imgst_file, i);
+        }
+    }
+
+    imgst_file->id_order = new_id_order(imgst_file);
+    if (imgst_file->id_order == NULL) {
+        index_free(imgst_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    return ERR_NONE;
+}
+
+void index_free(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file, "null argument in index_free");
+
+    delete_index(imgst_file->id_index);
+    delete_index(imgst_file->sha_index);
+    delete_free_slots(imgst_file->free_slots);
+    delete_id_order(imgst_file->id_order);
+    imgst_file->id_index = NULL;
+    imgst_file->sha_index = NULL;
+    imgst_file->free_slots = NULL;
+    imgst_file->id_order = NULL;
+}
+
+uint32_t index_find_id(const imgst_file *imgst_file, const char *img_id, uint32_t except) {
+    const struct imgst_index *index = imgst_file->id_index;
+
+    if (index == NULL) {
+        for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
+            if (imgst_file->metadata[i].is_valid == NON_EMPTY && i != except &&
+                strncmp(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID) == 0) {
+                return i;
+            }
+        }
+        return INDEX_NOT_FOUND;
+    }
+
+    for (uint32_t b = hash_id(img_id) & index->mask; index->buckets[b] != EMPTY_BUCKET; b = (b + 1) & index->mask) {
+        const uint32_t slot = index->buckets[b] - 1;
+        if (slot != except && strncmp(imgst_file->metadata[slot].img_id, img_id, MAX_IMG_ID) == 0) {
+            return slot;
+        }
+    }
+
+    return INDEX_NOT_FOUND;
+}
+
+uint32_t index_find_sha(const imgst_file *imgst_file, const unsigned char *SHA, uint32_t except) {
+    const struct imgst_index *index = imgst_file->sha_index;
+    uint32_t found = INDEX_NOT_FOUND;
+
+    if (index == NULL) {
+        for (uint32_t i = 0; i < imgst_file->header.max_files && found == INDEX_NOT_FOUND; ++i) {
+            if (imgst_file->metadata[i].is_valid == NON_EMPTY && i != except &&
+                memcmp(imgst_file->metadata[i].SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+                found = i;
+            }
+        }
+        return found;
+    }
+
+    // any copy will do: the first one of the cluster, without walking the others
+    for (uint32_t b = hash_sha(SHA) & index->mask; index->buckets[b] != EMPTY_BUCKET; b = (b + 1) & index->mask) {
+        const uint32_t slot = index->buckets[b] - 1;
+        if (slot != except && memcmp(imgst_file->metadata[slot].SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+            return slot;
+        }
+    }
+
+    return INDEX_NOT_FOUND;
+}
+
+uint32_t index_next_sha(const imgst_file *imgst_file, const unsigned char *SHA, uint32_t from) {
+    const struct imgst_index *index = imgst_file->sha_index;
+    uint32_t found = INDEX_NOT_FOUND;
+
+    if (index == NULL) {
+        for (uint32_t i = from; i < imgst_file->header.max_files && found == INDEX_NOT_FOUND; ++i) {
+            if (imgst_file->metadata[i].is_valid == NON_EMPTY &&
+                memcmp(imgst_file->metadata[i].SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+                found = i;
+            }
+        }
+        return found;
+    }
+
+    for (uint32_t b = hash_sha(SHA) & index->mask; index->buckets[b] != EMPTY_BUCKET; b = (b + 1) & index->mask) {
+        const uint32_t slot = index->buckets[b] - 1;
+        if (slot >= from && slot < found &&
+            memcmp(imgst_file->metadata[slot].SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+            found = slot;
+        }
+    }
+
+    return found;
+}
+
+uint32_t index_find_free(imgst_file *imgst_file) {
+    struct imgst_free_slots *slots = imgst_file->free_slots;
+
+    if (slots == NULL) {
+        for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
+            if (imgst_file->metadata[i].is_valid == EMPTY) {
+                return i;
+            }
+        }
+        return INDEX_NOT_FOUND;
+    }
+
+    const uint32_t nb_summaries = NB_WORDS(slots->nb_words);
+    for (uint32_t s = slots->hint / WORD_BITS; s < nb_summaries; ++s) {
+        if (~slots->full[s] != 0) {
+            const uint32_t word = s * WORD_BITS + (uint32_t) __builtin_ctzll(~slots->full[s]);
+            slots->hint = word;
+            return word * WORD_BITS + (uint32_t) __builtin_ctzll(~slots->used[word]);
+        }
+    }
+
+    slots->hint = slots->nb_words;
+    return INDEX_NOT_FOUND;
+}
+
+void index_seek(const imgst_file *imgst_file, const char *first, const char *last, struct index_cursor *cursor) {
+    cursor->first = first;
+    cursor->last = last;
+    cursor->position = imgst_file->id_order != NULL && first != NULL ? order_find(imgst_file, first, 0) : 0;
+    cursor->leaf = NULL; // found by the first index_next
+    cursor->offset = 0;
+}
+
+uint32_t index_next(const imgst_file *imgst_file, struct index_cursor *cursor) {
+    const struct imgst_id_order *order = imgst_file->id_order;
+
+    if (order == NULL) {
+        for (uint32_t i = cursor->position; i < imgst_file->header.max_files; ++i) {
+            const img_metadata *metadata = &imgst_file->metadata[i];
+            if (metadata->is_valid == NON_EMPTY
+                && (cursor->first == NULL || strncmp(metadata->img_id, cursor->first, MAX_IMG_ID) >= 0)
+                && (cursor->last == NULL || strncmp(metadata->img_id, cursor->last, MAX_IMG_ID) <= 0)) {
+                cursor->position = i + 1;
+                return i;
+            }
+        }
+        cursor->position = imgst_file->header.max_files;
+        return INDEX_NOT_FOUND;
+    }
+
+    if (cursor->leaf == NULL || cursor->offset == cursor->leaf->count) {
+        cursor->leaf = order_leaf(order, cursor->position, &cursor->offset);
+        if (cursor->leaf == NULL) return INDEX_NOT_FOUND;
+    }
+    const uint32_t slot = cursor->leaf->first[cursor->offset];
+    if (cursor->last != NULL && strncmp(imgst_file->metadata[slot].img_id, cursor->last, MAX_IMG_ID) > 0) {
+        return INDEX_NOT_FOUND;
+    }
+    ++cursor->offset;
+    ++cursor->position;
+    return slot;
+}
+
+void index_skip(const imgst_file *imgst_file, struct index_cursor *cursor, uint32_t count) {
+    const struct imgst_id_order *order = imgst_file->id_order;
+
+    if (order == NULL) {
+        for (uint32_t i = 0; i < count && index_next(imgst_file, cursor) != INDEX_NOT_FOUND; ++i);
+        return;
+    }
+    // past last, if so, index_next tells it
+    const uint32_t size = order->root->size;
+    cursor->position = count < size - cursor->position ? cursor->position + count : size;
+    cursor->leaf = NULL;
+}
+
+void index_insert(imgst_file *imgst_file, uint32_t slot) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file->id_index, "no index to insert into");
+
+    table_insert(imgst_file->id_index, imgst_file->metadata, slot);
+    table_insert(imgst_file->sha_index, imgst_file->metadata, slot);
+    set_used(imgst_file->free_slots, slot, true);
+    if (imgst_file->id_order != NULL) { // NULL while index_build runs
+        order_insert(imgst_file, slot);
+    }
+}
+
+void index_remove(imgst_file *imgst_file, uint32_t slot) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file->id_index, "no index to remove from");
+
+    table_remove(imgst_file->id_index, imgst_file->metadata, slot);
+    table_remove(imgst_file->sha_index, imgst_file->metadata, slot);
+    set_used(imgst_file->free_slots, slot, false);
+    order_remove(imgst_file, slot);
+}
+
+void index_remove_range(imgst_file *imgst_file, const struct index_cursor *from, uint32_t count) {
+    if (imgst_file->id_order == NULL || count > imgst_file->id_order->root->size - from->position) {
+        return; // not from index_seek
+    }
+
+    // each removal brings the next image of the range to the same rank
+    for (uint32_t i = 0; i < count && imgst_file->id_order != NULL; ++i) {
+        uint32_t position = 0;
+        const struct order_node *leaf = order_leaf(imgst_file->id_order, from->position, &position);
+        const uint32_t slot = leaf->first[position];
+        table_remove(imgst_file->id_index, imgst_file->metadata, slot);
+        table_remove(imgst_file->sha_index, imgst_file->metadata, slot);
+        set_used(imgst_file->free_slots, slot, false);
+        order_remove(imgst_file, slot);
+    }
+}
+
+static int compare_id(const img_metadata *metadata, uint32_t slot, const char *img_id, uint32_t other) {
+    const int cmp = strncmp(metadata[slot].img_id, img_id, MAX_IMG_ID);
+    return cmp != 0 ? cmp : (slot > other) - (slot < other);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct id_entry *first = a;
+    const struct id_entry *second = b;
+    const int cmp = strncmp(first->img_id, second->img_id, MAX_IMG_ID);
+    return cmp != 0 ? cmp : (first->slot > second->slot) - (first->slot < second->slot);
+}
+
+static struct imgst_id_order *new_id_order(const imgst_file *imgst_file) {
+    const uint32_t max_files = imgst_file->header.max_files;
+    struct imgst_id_order *order = calloc(1, sizeof(struct imgst_id_order));
+    struct id_entry *entries = calloc(max_files > 0 ? max_files : 1, sizeof(struct id_entry));
+    M_REQUIRE_CUSTOM_RET(order != NULL && entries != NULL, NULL, GROUP_CALLS(free(entries), free(order)));
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (imgst_file->metadata[i].is_valid == NON_EMPTY) {
+            entries[count++] = (struct id_entry) { imgst_file->metadata[i].img_id, i };
+        }
+    }
+    qsort(entries, count, sizeof(struct id_entry), compare_entries);
+
+    // full leaves, then as few inner nodes above them as possible
+    uint32_t nb_nodes = count > 0 ? (count - 1) / ORDER_FANOUT + 1 : 1;
+    struct order_node **level = calloc(nb_nodes, sizeof(struct order_node *));
+    bool built = level != NULL;
+    for (uint32_t n = 0; built && n < nb_nodes; ++n) {
+        struct order_node *leaf = level[n] = new_node(true);
+        built = leaf != NULL;
+        for (uint32_t rank = n * ORDER_FANOUT; built && rank < count && leaf->count < ORDER_FANOUT; ++rank) {
+            leaf->first[leaf->count++] = entries[rank].slot;
+        }
+        if (built) leaf->size = leaf->count;
+    }
+    free(entries);
+
+    while (built && nb_nodes > 1) {
+        const uint32_t nb_parents = (nb_nodes - 1) / ORDER_FANOUT + 1;
+        for (uint32_t p = 0; built && p < nb_parents; ++p) {
+            struct order_node *parent = new_node(false);
+            built = parent != NULL;
+            for (uint32_t n = p * ORDER_FANOUT; built && n < nb_nodes && parent->count < ORDER_FANOUT; ++n) {
+                parent->first[parent->count] = level[n]->first[0];
+                parent->children[parent->count++] = level[n];
+                parent->size += level[n]->size;
+                level[n] = NULL;
+            }
+            if (built) level[p] = parent;
+        }
+        if (built) nb_nodes = nb_parents;
+    }
+
+    if (!built) {
+        for (uint32_t n = 0; level != NULL && n < nb_nodes; ++n) {
+            delete_node(level[n]); // the parents built own the nodes they adopted
+        }
+        free(level);
+        free(order);
+        return NULL;
+    }
+    order->root = level[0];
+    free(level);
+    return order;
+}
+
+static void delete_id_order(struct imgst_id_order *order) {
+    if (order != NULL) {
+        delete_node(order->root);
+        free(order);
+    }
+}
+
+static struct order_node *new_node(bool leaf) {
+    struct order_node *node = calloc(1, sizeof(struct order_node)
+                                     + (leaf ? 0 : ORDER_FANOUT * sizeof(struct order_node *)));
+    if (node != NULL) node->leaf = leaf;
+    return node;
+}
+
+static void delete_node(struct order_node *node) {
+    if (node == NULL) return;
+    for (uint32_t i = 0; !node->leaf && i < node->count; ++i) {
+        delete_node(node->children[i]);
+    }
+    free(node);
+}
+
+static uint32_t node_child(const imgst_file *imgst_file, const struct order_node *node, const char *img_id,
+                           uint32_t slot) {
+    // the last child whose first slot does not come after (img_id, slot), the first one if none
+    uint32_t low = 1;
+    uint32_t high = node->count;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (compare_id(imgst_file->metadata, node->first[middle], img_id, slot) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low - 1;
+}
+
+static uint32_t leaf_position(const imgst_file *imgst_file, const struct order_node *leaf, const char *img_id,
+                              uint32_t slot) {
+    uint32_t low = 0;
+    uint32_t high = leaf->count;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (compare_id(imgst_file->metadata, leaf->first[middle], img_id, slot) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static uint32_t order_find(const imgst_file *imgst_file, const char *img_id, uint32_t slot) {
+    const struct order_node *node = imgst_file->id_order->root;
+    uint32_t rank = 0;
+    while (!node->leaf) {
+        const uint32_t child = node_child(imgst_file, node, img_id, slot);
+        for (uint32_t i = 0; i < child; ++i) {
+            rank += node->children[i]->size;
+        }
+        node = node->children[child];
+    }
+    return rank + leaf_position(imgst_file, node, img_id, slot);
+}
+
+static const struct order_node *order_leaf(const struct imgst_id_order *order, uint32_t rank, uint32_t *position) {
+    const struct order_node *node = order->root;
+    if (rank >= node->size) return NULL;
+
+    while (!node->leaf) {
+        uint32_t child = 0;
+        while (rank >= node->children[child]->size) {
+            rank -= node->children[child++]->size;
+        }
+        node = node->children[child];
+    }
+    *position = rank;
+    return node;
+}
+
+static int split_child(struct order_node *parent, uint32_t i) {
+    struct order_node *child = parent->children[i];
+    struct order_node *right = new_node(child->leaf);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(right, ERR_OUT_OF_MEMORY);
+
+    const uint32_t half = child->count / 2;
+    right->count = child->count - half;
+    memcpy(right->first, &child->first[half], right->count * sizeof(uint32_t));
+    if (child->leaf) {
+        right->size = right->count;
+    } else {
+        memcpy(right->children, &child->children[half], right->count * sizeof(struct order_node *));
+        for (uint32_t c = 0; c < right->count; ++c) {
+            right->size += right->children[c]->size;
+        }
+    }
+    child->count = half;
+    child->size -= right->size;
+
+    memmove(&parent->first[i + 2], &parent->first[i + 1], (parent->count - i - 1) * sizeof(uint32_t));
+    memmove(&parent->children[i + 2], &parent->children[i + 1],
+            (parent->count - i - 1) * sizeof(struct order_node *));
+    parent->first[i + 1] = right->first[0];
+    parent->children[i + 1] = right;
+    ++parent->count;
+    return ERR_NONE;
+}
+
+static void merge_child(struct order_node *parent, uint32_t i) {
+    if (parent->count < 2) return;
+
+    const uint32_t left_i = i + 1 < parent->count ? i : i - 1;
+    struct order_node *left = parent->children[left_i];
+    struct order_node *right = parent->children[left_i + 1];
+    if (left->count + right->count > ORDER_FANOUT) return;
+
+    memcpy(&left->first[left->count], right->first, right->count * sizeof(uint32_t));
+    if (!left->leaf) {
+        memcpy(&left->children[left->count], right->children, right->count * sizeof(struct order_node *));
+    }
+    left->count += right->count;
+    left->size += right->size;
+    free(right); // its children, if any, now belong to left
+    remove_child(parent, left_i + 1);
+}
+
+static void remove_child(struct order_node *parent, uint32_t i) {
+    memmove(&parent->first[i], &parent->first[i + 1], (parent->count - i - 1) * sizeof(uint32_t));
+    memmove(&parent->children[i], &parent->children[i + 1], (parent->count - i - 1) * sizeof(struct order_node *));
+    --parent->count;
+}
+
+static void order_insert(imgst_file *imgst_file, uint32_t slot) {
+    struct imgst_id_order *order = imgst_file->id_order;
+    int err = ERR_NONE;
+
+    // a full root gets a parent, so that it can be split
+    if (order->root->count == ORDER_FANOUT) {
+        struct order_node *root = new_node(false);
+        if (root == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            root->count = 1;
+            root->size = order->root->size;
+            root->first[0] = order->root->first[0];
+            root->children[0] = order->root;
+            order->root = root;
+            err = split_child(root, 0);
+        }
+    }
+    if (err == ERR_NONE) {
+        err = node_insert(imgst_file, order->root, slot);
+    }
+    if (err != ERR_NONE) {
+        // walks fall back to the scan of the metadata
+        delete_id_order(order);
+        imgst_file->id_order = NULL;
+    }
+}
+
+static int node_insert(const imgst_file *imgst_file, struct order_node *node, uint32_t slot) {
+    const char *img_id = imgst_file->metadata[slot].img_id;
+
+    if (node->leaf) {
+        const uint32_t position = leaf_position(imgst_file, node, img_id, slot);
+        if (position < node->count && node->first[position] == slot) return ERR_NONE; // already there
+
+        memmove(&node->first[position + 1], &node->first[position], (node->count - position) * sizeof(uint32_t));
+        node->first[position] = slot;
+        ++node->count;
+        ++node->size;
+        return ERR_NONE;
+    }
+
+    uint32_t i = node_child(imgst_file, node, img_id, slot);
+    if (node->children[i]->count == ORDER_FANOUT) {
+        M_EXIT_IF_ERR(split_child(node, i));
+        if (compare_id(imgst_file->metadata, node->first[i + 1], img_id, slot) <= 0) ++i;
+    }
+    struct order_node *child = node->children[i];
+    const uint32_t before = child->size;
+    M_EXIT_IF_ERR(node_insert(imgst_file, child, slot));
+    node->size += child->size - before;
+    node->first[i] = child->first[0];
+    return ERR_NONE;
+}
+
+static void order_remove(imgst_file *imgst_file, uint32_t slot) {
+    struct imgst_id_order *order = imgst_file->id_order;
+    if (order == NULL || !node_remove(imgst_file, order->root, slot)) return;
+
+    // a root left with one child gives way to it, an empty one to an empty leaf
+    while (!order->root->leaf && order->root->count == 1) {
+        struct order_node *root = order->root;
+        order->root = root->children[0];
+        free(root);
+    }
+    if (!order->root->leaf && order->root->count == 0) {
+        struct order_node *leaf = new_node(true);
+        if (leaf == NULL) {
+            delete_id_order(order);
+            imgst_file->id_order = NULL;
+            return;
+        }
+        free(order->root);
+        order->root = leaf;
+    }
+}
+
+static bool node_remove(const imgst_file *imgst_file, struct order_node *node, uint32_t slot) {
+    const char *img_id = imgst_file->metadata[slot].img_id;
+
+    if (node->leaf) {
+        const uint32_t position = leaf_position(imgst_file, node, img_id, slot);
+        if (position == node->count || node->first[position] != slot) return false; // slot was not indexed
+
+        memmove(&node->first[position], &node->first[position + 1],
+                (node->count - position - 1) * sizeof(uint32_t));
+        --node->count;
+        --node->size;
+        return true;
+    }
+
+    const uint32_t i = node_child(imgst_file, node, img_id, slot);
+    struct order_node *child = node->children[i];
+    if (!node_remove(imgst_file, child, slot)) return false;
+
+    --node->size;
+    if (child->count == 0) {
+        delete_node(child);
+        remove_child(node, i);
+    } else {
+        node->first[i] = child->first[0];
+        if (child->count < ORDER_FANOUT / 4) merge_child(node, i);
+    }
+    return true;
+}
+
+static struct imgst_free_slots *new_free_slots(uint32_t max_files) {
+    struct imgst_free_slots *slots = calloc(1, sizeof(struct imgst_free_slots));
+    M_REQUIRE_CUSTOM_RET(slots != NULL, NULL, /**/);
+
+    slots->nb_words = NB_WORDS(max_files);
+    slots->used = calloc(slots->nb_words + 1, sizeof(uint64_t));
+    slots->full = calloc(NB_WORDS(slots->nb_words) + 1, sizeof(uint64_t));
+    M_REQUIRE_CUSTOM_RET(slots->used != NULL && slots->full != NULL, NULL, delete_free_slots(slots));
+
+    // slots and words past the end are never free
+    for (uint64_t i = max_files; i < (uint64_t) slots->nb_words * WORD_BITS; ++i) {
+        set_used(slots, (uint32_t) i, true);
+    }
+    for (uint64_t w = slots->nb_words; w < (uint64_t) NB_WORDS(slots->nb_words) * WORD_BITS; ++w) {
+        slots->full[w / WORD_BITS] |= BIT(w);
+    }
+
+    return slots;
+}
+
+static void delete_free_slots(struct imgst_free_slots *slots) {
+    if (slots != NULL) {
+        free(slots->used);
+        free(slots->full);
+        free(slots);
+    }
+}
+
+static void set_used(struct imgst_free_slots *slots, uint32_t slot, bool used) {
+    const uint32_t word = slot / WORD_BITS;
+
+    if (used) {
+        slots->used[word] |= BIT(slot);
+        if (~slots->used[word] == 0) {
+            slots->full[word / WORD_BITS] |= BIT(word);
+        }
+    } else {
+        slots->used[word] &= ~BIT(slot);
+        slots->full[word / WORD_BITS] &= ~BIT(word);
+        if (word < slots->hint) {
+            slots->hint = word;
+        }
+    }
+}
+
+static void table_insert(struct imgst_index *index, const img_metadata *metadata, uint32_t slot) {
+    uint32_t b = home_bucket(index, &metadata[slot]);
+    while (index->buckets[b] != EMPTY_BUCKET) {
+        b = (b + 1) & index->mask;
+    }
+    index->buckets[b] = slot + 1;
+}
+
+static void table_remove(struct imgst_index *index, const img_metadata *metadata, uint32_t slot) {
+    uint32_t hole = home_bucket(index, &metadata[slot]);
+    while (index->buckets[hole] != slot + 1) {
+        if (index->buckets[hole] == EMPTY_BUCKET) return; // slot was not indexed
+        hole = (hole + 1) & index->mask;
+    }
+
+    // shift back the following entries of the cluster which may not stay behind the hole
+    for (uint32_t b = (hole + 1) & index->mask; index->buckets[b] != EMPTY_BUCKET; b = (b + 1) & index->mask) {
+        const uint32_t home = home_bucket(index, &metadata[index->buckets[b] - 1]);
+        if (((b - home) & index->mask) >= ((b - hole) & index->mask)) {
+            index->buckets[hole] = index->buckets[b];
+            hole = b;
+        }
+    }
+    index->buckets[hole] = EMPTY_BUCKET;
+}
+
+static struct imgst_index *new_index(uint32_t max_files, enum index_key key) {
+    uint32_t nb_buckets = MIN_BUCKETS;
+    while (nb_buckets < 2 * (uint64_t) max_files) {
+        nb_buckets <<= 1;
+    }
+
+    struct imgst_index *index = calloc(1, sizeof(struct imgst_index));
+    M_REQUIRE_CUSTOM_RET(index != NULL, NULL, /**/);
+    index->buckets = calloc(nb_buckets, sizeof(uint32_t));
+    M_REQUIRE_CUSTOM_RET(index->buckets != NULL, NULL, free(index));
+    index->mask = nb_buckets - 1;
+    index->key = key;
+
+    return index;
+}
+
+static void delete_index(struct imgst_index *index) {
+    if (index != NULL) {
+        free(index->buckets);
+        free(index);
+    }
+}
+
+static uint32_t hash_id(const char *img_id) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash = (hash ^ (unsigned char) img_id[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_sha(const unsigned char *SHA) {
+    uint32_t hash;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+static uint32_t home_bucket(const struct imgst_index *index, const img_metadata *metadata) {
+    return (index->key == KEY_ID ? hash_id(metadata->img_id) : hash_sha(metadata->SHA)) & index->mask;
+}
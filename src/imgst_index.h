@@ -0,0 +1,144 @@
+/**
+ * @file imgst_index.h
+ * @brief In-memory indexes over the metadata of an imgStore.
+ *
+ * The hash indexes (by img_id and by SHA) only store metadata slot numbers: keys are
+ * read back from imgst_file->metadata, so they stay valid as long as the metadata
+ * array does. So does the B+-tree of the valid slots in img_id order, walked with an
+ * index_cursor. Along with the set of free slots, they are built by do_open/do_create
+ * and maintained by do_insert/do_delete, in O(1) per update, O(log n) for the img_id order.
+ */
+#pragma once
+
+#include "imgStore.h"
+
+/**
+ * @brief Returned by the lookup functions when no valid slot matches.
+ */
+#define INDEX_NOT_FOUND UINT32_MAX
+
+/**
+ * @brief Walk through the valid images whose img_id is within a range (see index_seek).
+ */
+struct index_cursor {
+    const char *first;  // NULL: from the first image
+    const char *last;   // NULL: up to the last image
+    uint32_t position;  // rank in img_id order, or slot if the indexes are not built
+    const struct order_node *leaf; // of the img_id order, holding position; NULL if not found yet
+    uint32_t offset;    // of position in leaf
+};
+
+/**
+ * @brief Builds the indexes of all valid images of imgst_file.
+ *
+ * @param imgst_file Database whose header and metadata are already loaded
+ * @return error code, ERR_NONE if no error happened
+ */
+int index_build(imgst_file *imgst_file);
+
+/**
+ * @brief Releases the indexes of imgst_file (does nothing if none was built).
+ *
+ * @param imgst_file Database whose indexes are to be freed
+ */
+void index_free(imgst_file *imgst_file);
+
+/**
+ * @brief Finds the slot of the valid image called img_id.
+ *        Falls back to a linear scan of the metadata if no index was built.
+ *
+ * @param imgst_file Database to search into
+ * @param img_id Image ID sought after
+ * @param except Slot to ignore, INDEX_NOT_FOUND to consider them all
+ * @return slot of the image, INDEX_NOT_FOUND if none exists
+ */
+uint32_t index_find_id(const imgst_file *imgst_file, const char *img_id, uint32_t except);
+
+/**
+ * @brief Finds a valid slot whose content has the given SHA: the first one probed, not necessarily
+ *        the first in slot order (see index_next_sha to walk them all in that order).
+ *        Falls back to a linear scan of the metadata if no index was built.
+ *
+ * @param imgst_file Database to search into
+ * @param SHA Digest of the content sought after
+ * @param except Slot to ignore (typically the one being de-duplicated)
+ * @return slot of a copy of the content, INDEX_NOT_FOUND if none exists
+ */
+uint32_t index_find_sha(const imgst_file *imgst_file, const unsigned char *SHA, uint32_t except);
+
+/**
+ * @brief Finds the first valid slot, from a given one on (in slot order), whose content has the
+ *        given SHA: called with from = 0, then the slot found + 1, it lists all the copies of a content.
+ *        Falls back to a linear scan of the metadata if no index was built.
+ *
+ * @param imgst_file Database to search into
+ * @param SHA Digest of the content sought after
+ * @param from Lowest slot to consider
+ * @return slot of the next copy of the content, INDEX_NOT_FOUND if none exists
+ */
+uint32_t index_next_sha(const imgst_file *imgst_file, const unsigned char *SHA, uint32_t from);
+
+/**
+ * @brief Finds the first free metadata slot.
+ *        Falls back to a linear scan of the metadata if no index was built.
+ *
+ * @param imgst_file Database to search into
+ * @return the lowest free slot, INDEX_NOT_FOUND if the imgStore is full
+ */
+uint32_t index_find_free(imgst_file *imgst_file);
+
+/**
+ * @brief Starts a walk through the valid images whose img_id is between first and last
+ *        (both included), in img_id order, in O(log n). Falls back to a linear scan
+ *        of the metadata, in slot order, if no index was built.
+ *
+ * @param imgst_file Database to walk through, which shall not change during the walk
+ * @param first Lowest img_id of the range, NULL for no lower bound
+ * @param last Highest img_id of the range, NULL for no upper bound
+ * @param cursor Set to the start of the walk
+ */
+void index_seek(const imgst_file *imgst_file, const char *first, const char *last, struct index_cursor *cursor);
+
+/**
+ * @brief Gives the next image of a walk, in amortized O(1) if the indexes are built.
+ *
+ * @param imgst_file Database being walked through
+ * @param cursor Walk started by index_seek
+ * @return slot of the image, INDEX_NOT_FOUND past the last one
+ */
+uint32_t index_next(const imgst_file *imgst_file, struct index_cursor *cursor);
+
+/**
+ * @brief Skips some images of a walk, in O(log n) if the indexes are built.
+ *
+ * @param imgst_file Database being walked through
+ * @param cursor Walk started by index_seek
+ * @param count Number of images to skip
+ */
+void index_skip(const imgst_file *imgst_file, struct index_cursor *cursor, uint32_t count);
+
+/**
+ * @brief Registers a (now valid) metadata slot in the indexes.
+ *
+ * @param imgst_file Database being worked on
+ * @param slot Index of the metadata to register
+ */
+void index_insert(imgst_file *imgst_file, uint32_t slot);
+
+/**
+ * @brief Unregisters a metadata slot from the indexes. Shall be called before its img_id or SHA is modified.
+ *
+ * @param imgst_file Database being worked on
+ * @param slot Index of the metadata to unregister
+ */
+void index_remove(imgst_file *imgst_file, uint32_t slot);
+
+/**
+ * @brief Unregisters the first images of a walk from the indexes, as many index_remove
+ *        would, but finding each one by its rank (does nothing if no index was built).
+ *
+ * @param imgst_file Database being worked on
+ * @param from Cursor as set by index_seek, the walk being not started
+ * @param count Number of images to unregister, as given by index_next from that cursor
+ */
+void index_remove_range(imgst_file *imgst_file, const struct index_cursor *from, uint32_t count);
@@ -1,14 +1,41 @@
 #include <stdbool.h>
 #include "imgStore.h"
+#include "imgst_changes.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_pregen.h"
+#include "imgst_segment.h"
+#include "imgst_wal.h"
 #include "dedup.h"
 #include "image_content.h"
+#include "thread_pool.h"
+
+#include <openssl/evp.h>
+#include <stdlib.h>
+#include <string.h>
 
 /**
- * @brief Finds the first metadata for which valid bit is 0, if none is: returns -1
- * @param imgst_file
- * @return size_t
+ * @brief An image to insert, with what it brings to its metadata once computed by prepare.
  */
-static uint32_t find_first_free_meta(const imgst_file *imgst_file);
+struct prepared_image {
+    const char *buffer;
+    size_t size;
+    const char *img_id;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t height;
+    uint32_t width;
+    uint32_t slot; // once inserted
+    int err;
+};
+
+struct imgst_insert_batch {
+    struct thread_pool *pool; // preparing the images, NULL to prepare them on the adding thread
+    struct prepared_image *images;
+    imgst_insert_item **items;
+    size_t nb_items;
+    size_t capacity;
+};
 
 /**
  * @brief Tests whether some passed image has a duplicate by checking its offset array
@@ -23,66 +50,307 @@ static bool image_has_no_duplicate(const img_metadata *img);
  */
 static void complete_init(img_metadata *target_img);
 
+/**
+ * @brief Checks the arguments of do_insert for one image.
+ */
+static int check_image(const struct prepared_image *image);
+
+/**
+ * @brief Checks an image to insert, then computes its SHA (by the EVP interface of OpenSSL,
+ *        which uses the SHA extensions of the CPU if any) and resolution, without any lock.
+ *
+ * @param arg The prepared_image, whose err is set
+ */
+static void prepare(void *arg);
+
+/**
+ * @brief Frees a batch, once its thread_pool is gone.
+ */
+static void free_batch(imgst_insert_batch *batch);
+
+/**
+ * @brief Fills a free metadata slot with a prepared image and appends its content if new,
+ *        the write lock being held. The header and the metadata are not written back.
+ *
+ * @param image Image prepared without error
+ * @param imgst_file Database being worked on
+ * @param insertion_index Where to store the index of the slot used
+ * @return error code, ERR_NONE if no error happened
+ */
+static int insert(const struct prepared_image *image, imgst_file *imgst_file, uint32_t *insertion_index);
+
+/**
+ * @brief Writes back the header, then the metadata of some slots by runs of consecutive slots,
+ *        and commits them as one group of the log, if enabled.
+ *
+ * @param imgst_file Database being worked on, the write lock being held
+ * @param slots Slots updated, sorted in place
+ * @param nb_slots Number of slots
+ * @return error code, ERR_NONE if no error happened
+ */
+static int write_back(imgst_file *imgst_file, uint32_t *slots, size_t nb_slots);
+
+/**
+ * @brief Undoes the insertion of the images inserted without error whose slots still hold them,
+ *        as do_delete would, once their writing back or their logging failed, then writes back
+ *        what it can (the error reported is the first one).
+ *
+ * @param imgst_file Database being worked on, the write lock being held
+ * @param images Images, of which those without error were inserted
+ * @param nb_images Number of images
+ * @param slots Room for nb_images slots
+ */
+static void roll_back(imgst_file *imgst_file, const struct prepared_image *images, size_t nb_images, uint32_t *slots);
+
+/**
+ * @brief Ascending order of metadata slots, for qsort.
+ */
+static int compare_slots(const void *a, const void *b);
+
 /**
  * @brief Insert image in the imgStore file
  */
 int do_insert(const char *buffer, size_t size, const char *img_id, imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
 
+    struct prepared_image image = { buffer, size, img_id, { 0 }, 0, 0, 0, ERR_NONE };
+    prepare(&image);
+    M_EXIT_IF_ERR(image.err);
+
+    lock_write(imgst_file);
+    uint32_t insertion_index = 0;
+    int err = insert(&image, imgst_file, &image.slot);
+    if (err == ERR_NONE) {
+        insertion_index = image.slot;
+        err = write_back(imgst_file, &insertion_index, 1);
+        if (err != ERR_NONE) roll_back(imgst_file, &image, 1, &insertion_index);
+    }
+    lock_release(imgst_file);
+    if (err == ERR_NONE && (err = wal_flush(imgst_file)) != ERR_NONE) {
+        lock_write(imgst_file);
+        roll_back(imgst_file, &image, 1, &insertion_index);
+        lock_release(imgst_file);
+    }
+
+    if (err == ERR_NONE) {
+        pregen_schedule(imgst_file, img_id);
+    }
+    return err;
+}
+
+/**
+ * @brief Insert several images in the imgStore file
+ */
+int do_insert_batch(imgst_insert_item *items, size_t nb_items, size_t nb_threads, imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(items);
     M_REQUIRE_NON_NULL(imgst_file);
-    M_REQUIRE_NON_NULL(buffer);
-    M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(imgst_file->metadata);
-    M_REQ(size >= 0, ERR_INVALID_ARGUMENT, "negative image size in do_insert");
-    M_REQ(strlen(img_id) < MAX_IMG_ID, ERR_INVALID_IMGID, "too long img id");
+    M_EXIT_NO_ERR_IF(nb_items == 0);
+
+    imgst_insert_batch *batch = NULL;
+    M_EXIT_IF_ERR(do_insert_batch_start(nb_items, nb_threads, &batch));
+    for (size_t i = 0; i < nb_items; ++i) {
+        (void) do_insert_batch_add(batch, &items[i]); // cannot fail: the batch holds nb_items
+    }
+    return do_insert_batch_finish(batch, imgst_file);
+}
+
+/**
+ * @brief Start a batch of images to insert
+ */
+int do_insert_batch_start(size_t capacity, size_t nb_threads, imgst_insert_batch **batch) {
+    M_REQUIRE_NON_NULL(batch);
+    M_REQ(capacity > 0, ERR_INVALID_ARGUMENT, "empty batch in do_insert_batch_start");
+
+    imgst_insert_batch *created = calloc(1, sizeof(imgst_insert_batch));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(created, ERR_OUT_OF_MEMORY);
+    created->images = calloc(capacity, sizeof(struct prepared_image));
+    created->items = calloc(capacity, sizeof(imgst_insert_item *));
+    created->capacity = capacity;
+    M_EXIT_IF_ERR_DO_SOMETHING(created->images != NULL && created->items != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY,
+                               free_batch(created));
+
+    // without threads, images are prepared right away by do_insert_batch_add
+    if (nb_threads > 0 && thread_pool_create(nb_threads, &created->pool) != ERR_NONE) {
+        created->pool = NULL;
+    }
+    *batch = created;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Add an image to a batch, queueing its preparation
+ */
+int do_insert_batch_add(imgst_insert_batch *batch, imgst_insert_item *item) {
+    M_REQUIRE_NON_NULL(batch);
+    M_REQUIRE_NON_NULL(item);
+    M_REQ(batch->nb_items < batch->capacity, ERR_INVALID_ARGUMENT, "full batch in do_insert_batch_add");
+
+    struct prepared_image *image = &batch->images[batch->nb_items];
+    image->buffer = item->buffer;
+    image->size = item->size;
+    image->img_id = item->img_id;
+    batch->items[batch->nb_items++] = item;
+
+    // whatever cannot be queued is prepared right away
+    if (batch->pool == NULL || thread_pool_submit(batch->pool, prepare, image) != ERR_NONE) {
+        prepare(image);
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Insert the images of a batch in the imgStore file
+ */
+int do_insert_batch_finish(imgst_insert_batch *batch, imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(batch);
+    if (batch->pool != NULL) {
+        thread_pool_destroy(batch->pool); // once all the images are prepared
+        batch->pool = NULL;
+    }
+    M_EXIT_IF_ERR_DO_SOMETHING(imgst_file != NULL ? ERR_NONE : ERR_INVALID_ARGUMENT, free_batch(batch));
+
+    const size_t nb_items = batch->nb_items;
+    struct prepared_image *images = batch->images;
+    uint32_t *slots = calloc(nb_items + 1, sizeof(uint32_t));
+    M_EXIT_IF_ERR_DO_SOMETHING(slots != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY, free_batch(batch));
+
+    // contents are appended in the order of the items, the metadata written once at the end
+    lock_write(imgst_file);
+    size_t nb_inserted = 0;
+    for (size_t i = 0; i < nb_items; ++i) {
+        if (images[i].err == ERR_NONE
+            && (images[i].err = insert(&images[i], imgst_file, &images[i].slot)) == ERR_NONE) {
+            slots[nb_inserted++] = images[i].slot;
+        }
+    }
+    int write_err = write_back(imgst_file, slots, nb_inserted);
+    if (write_err != ERR_NONE) roll_back(imgst_file, images, nb_items, slots);
+    lock_release(imgst_file);
+    // once released, the batch may have been read: it is undone only if it cannot be made durable
+    if (write_err == ERR_NONE && (write_err = wal_flush(imgst_file)) != ERR_NONE) {
+        lock_write(imgst_file);
+        roll_back(imgst_file, images, nb_items, slots);
+        lock_release(imgst_file);
+    }
+
+    int err = ERR_NONE;
+    for (size_t i = 0; i < nb_items; ++i) {
+        imgst_insert_item *item = batch->items[i];
+        item->err = images[i].err == ERR_NONE ? write_err : images[i].err;
+        if (item->err == ERR_NONE) {
+            pregen_schedule(imgst_file, item->img_id);
+        } else if (err == ERR_NONE) {
+            err = item->err;
+        }
+    }
+
+    free(slots);
+    free_batch(batch);
+    return err;
+}
+
+static void free_batch(imgst_insert_batch *batch) {
+    free(batch->images);
+    free(batch->items);
+    free(batch);
+}
 
-    M_REQ(imgst_file->header.num_files < imgst_file->header.max_files, ERR_FULL_IMGSTORE, "imgStore full in do_insert");
+static int check_image(const struct prepared_image *image) {
+    M_REQUIRE_NON_NULL(image->buffer);
+    M_REQUIRE_NON_NULL(image->img_id);
+    M_REQ(image->size >= 0, ERR_INVALID_ARGUMENT, "negative image size in do_insert");
+    M_REQ(strlen(image->img_id) < MAX_IMG_ID, ERR_INVALID_IMGID, "too long img id");
+    return ERR_NONE;
+}
+
+static void prepare(void *arg) {
+    struct prepared_image *image = arg;
+    image->err = check_image(image);
+    if (image->err == ERR_NONE) {
+        image->err = EVP_Digest(image->buffer, image->size, image->SHA, NULL, EVP_sha256(), NULL) == 1
+                     ? get_resolution(&image->height, &image->width, image->buffer, image->size)
+                     : ERR_OUT_OF_MEMORY;
+    }
+}
+
+static int insert(const struct prepared_image *image, imgst_file *imgst_file, uint32_t *insertion_index) {
+
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    if (imgst_file->header.num_files >= imgst_file->header.max_files) {
+        // doubles the capacity, so that the number of segments stays logarithmic
+        const uint32_t room = imgst_file->header.max_files < MAX_GROWN_FILES
+                              ? MAX_GROWN_FILES - imgst_file->header.max_files : 0;
+        const uint32_t grow = imgst_file->header.max_files < room ? imgst_file->header.max_files : room;
+        M_REQ(grow > 0, ERR_FULL_IMGSTORE, "imgStore full in do_insert");
+        M_EXIT_IF_ERR(grow_metadata(imgst_file, grow));
+    }
 
     // I) Free spot finding and image loading
-    size_t insertion_index = find_first_free_meta(imgst_file);
-    M_REQ(insertion_index >= 0, ERR_FULL_IMGSTORE, "imgStore full in do_insert - detected after find_first_free_meta");
-    img_metadata *target_img = &imgst_file->metadata[insertion_index];
-    SHA256((const unsigned char *) buffer, size, target_img->SHA);
-    strncpy(target_img->img_id, img_id, MAX_IMG_ID);
-    target_img->size[RES_ORIG] = size;
+    *insertion_index = index_find_free(imgst_file);
+    M_REQ(*insertion_index != INDEX_NOT_FOUND, ERR_FULL_IMGSTORE, "imgStore full in do_insert - detected after index_find_free");
+    img_metadata *target_img = &imgst_file->metadata[*insertion_index];
+    memcpy(target_img->SHA, image->SHA, SHA256_DIGEST_LENGTH);
+    strncpy(target_img->img_id, image->img_id, MAX_IMG_ID);
+    target_img->size[RES_ORIG] = image->size;
     target_img->is_valid = NON_EMPTY;
 
     // II) Writing image, avoiding duplication
-    int possible_err = do_name_and_content_dedup(imgst_file, insertion_index);
-    M_REQ(possible_err == ERR_NONE, possible_err, "error in do_name_and_content_dedup, called by do_insert");
+    int possible_err = do_name_and_content_dedup(imgst_file, *insertion_index);
+    M_EXIT_IF_ERR_DO_SOMETHING(possible_err, target_img->is_valid = EMPTY);
     if (image_has_no_duplicate(target_img)) {
         complete_init(target_img);
-        M_REQ(fseek(imgst_file->file, 0, SEEK_END) == 0, ERR_IO, "couldn't fseek to end in line "__LINE__" in do_insert");
-        target_img->offset[RES_ORIG] = ftell(imgst_file->file);
-        M_REQ(fwrite(buffer, sizeof (char), size, imgst_file->file) == size, ERR_IO, "unable to write image content in do_insert");
+        possible_err = append_data(imgst_file, image->buffer, image->size, &target_img->offset[RES_ORIG]);
+        M_EXIT_IF_ERR_DO_SOMETHING(possible_err, target_img->is_valid = EMPTY);
     }
 
     // III) Updating database header & metadata information
-    uint32_t height = -1;
-    uint32_t width = -1;
-    possible_err = get_resolution(&height, &width, buffer, size);
-    M_REQ(possible_err == ERR_NONE, possible_err, "error in get_resolution called by do_insert");
-    target_img->res_orig[0] = width;
-    target_img->res_orig[1] = height;
+    target_img->res_orig[0] = image->width;
+    target_img->res_orig[1] = image->height;
 
     ++imgst_file->header.num_files;
     ++imgst_file->header.imgst_version;
-    M_REQ(fseek(imgst_file->file, 0, SEEK_SET) == 0, ERR_IO, "couldn't fseek to start in line "__LINE__" in do_insert");
-    M_WRITE(imgst_file->header, imgst_file->file, "unable to write header in do_insert");
-    M_REQ(fseek(imgst_file->file, sizeof(img_metadata) * insertion_index, SEEK_CUR) == 0, ERR_IO, "couldn't fseek to metadata in do_insert");
-    M_WRITE(*target_img, imgst_file->file, "unable to write metadata in do_insert");
+    changes_record(imgst_file, *insertion_index, false);
 
+    index_insert(imgst_file, *insertion_index);
     return ERR_NONE;
 }
 
-static uint32_t find_first_free_meta(const imgst_file *imgst_file) {
-
-    for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
-        if (imgst_file->metadata[i].is_valid == EMPTY) {
-            return i;
+static void roll_back(imgst_file *imgst_file, const struct prepared_image *images, size_t nb_images, uint32_t *slots) {
+    size_t nb_slots = 0;
+    for (size_t i = 0; i < nb_images; ++i) {
+        img_metadata *metadata = &imgst_file->metadata[images[i].slot];
+        // a slot which another writer emptied (or reused) meanwhile is left to it
+        if (images[i].err == ERR_NONE && metadata->is_valid == NON_EMPTY
+            && strncmp(metadata->img_id, images[i].img_id, MAX_IMG_ID) == 0) {
+            index_remove(imgst_file, images[i].slot);
+            metadata->is_valid = EMPTY;
+            imgst_file->header.imgst_version += 1;
+            changes_record(imgst_file, images[i].slot, true);
+            imgst_file->header.num_files -= 1;
+            slots[nb_slots++] = images[i].slot;
         }
     }
+    (void) write_back(imgst_file, slots, nb_slots);
+}
+
+static int compare_slots(const void *a, const void *b) {
+    const uint32_t first = *(const uint32_t *) a;
+    const uint32_t second = *(const uint32_t *) b;
+    return (first > second) - (first < second);
+}
 
-    return -1;
+static int write_back(imgst_file *imgst_file, uint32_t *slots, size_t nb_slots) {
+    M_EXIT_NO_ERR_IF(nb_slots == 0);
+    qsort(slots, nb_slots, sizeof(uint32_t), compare_slots);
+
+    int possible_err = ERR_NONE;
+    M_REQ((possible_err = write_header(imgst_file)) == ERR_NONE, possible_err, "unable to write header in do_insert");
+    for (size_t run = 0, end = 1; run < nb_slots; run = end++) {
+        while (end < nb_slots && slots[end] == slots[end - 1] + 1) ++end;
+        M_REQ((possible_err = write_metadata_range(imgst_file, slots[run], (uint32_t) (end - run))) == ERR_NONE,
+              possible_err, "unable to write metadata in do_insert");
+    }
+    return wal_commit(imgst_file);
 }
 
 static bool image_has_no_duplicate(const img_metadata *img) {
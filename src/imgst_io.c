@@ -0,0 +1,209 @@
+/**
+ * @file imgst_io.c
+ * @brief imgStore library: transfers of the header, metadata and image contents to and from the imgStore file.
+ *
+ * Compile with -DIMGST_MSYNC to have every update of a shared mapping synced to disk.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, pread, pwrite, msync, sysconf
+#define _GNU_SOURCE // for copy_file_range
+
+#include "imgst_io.h"
+#include "buffer_pool.h"
+#include "imgst_segment.h"
+#include "imgst_wal.h"
+
+#include <inttypes.h> // for PRIu64
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h> // for loff_t
+#include <unistd.h>
+
+#ifndef IMGST_COPY_CHUNK
+/**
+ * Number of bytes moved at once by copy_at, when it has to go through a buffer.
+ */
+#define IMGST_COPY_CHUNK (1024 * 1024)
+#endif
+
+/**
+ * @brief Syncs a byte range of the mapping to disk if IMGST_MSYNC is defined
+ *
+ * @param imgst_file Database whose mapping is synced
+ * @param start Offset of the first byte to sync
+ * @param length Number of bytes to sync
+ * @return error code, ERR_NONE if no error happened
+ */
+static int sync_mapping(imgst_file *imgst_file, size_t start, size_t length);
+
+int write_header(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    if (imgst_file->wal != NULL) {
+        return wal_log_header(imgst_file);
+    }
+
+    if (imgst_file->mapping != NULL && imgst_file->mapping_shared) {
+        memcpy(imgst_file->mapping, &imgst_file->header, sizeof(struct imgst_header));
+        return sync_mapping(imgst_file, 0, sizeof(struct imgst_header));
+    }
+
+    return write_at(imgst_file, &imgst_file->header, sizeof(struct imgst_header), 0);
+}
+
+int write_metadata(imgst_file *imgst_file, uint32_t slot) {
+    return write_metadata_range(imgst_file, slot, 1);
+}
+
+int write_metadata_range(imgst_file *imgst_file, uint32_t first, uint32_t count) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+
+    if (imgst_file->wal != NULL) {
+        for (uint32_t slot = first; slot < first + count; ++slot) {
+            M_EXIT_IF_ERR(wal_log_metadata(imgst_file, slot));
+        }
+        return ERR_NONE;
+    }
+
+    if (imgst_file->mapping != NULL && imgst_file->mapping_shared) {
+        return sync_mapping(imgst_file, sizeof(struct imgst_header) + first * sizeof(struct img_metadata),
+                            count * sizeof(struct img_metadata));
+    }
+
+    // one transfer per segment the range spans
+    for (uint32_t run = 0; count > 0; first += run, count -= run) {
+        const uint64_t offset = metadata_offset(imgst_file, first, &run);
+        if (run > count) run = count;
+        M_EXIT_IF_ERR(write_at(imgst_file, &imgst_file->metadata[first], run * sizeof(struct img_metadata), offset));
+    }
+    return ERR_NONE;
+}
+
+int read_metadata_table(imgst_file *imgst_file, FILE *file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(file);
+
+    const size_t nb_files = table_files(&imgst_file->header);
+    for (size_t i = 0; i < nb_files; i += IMGST_IO_CHUNK) {
+        const size_t count = nb_files - i < IMGST_IO_CHUNK ? nb_files - i : IMGST_IO_CHUNK;
+        M_REQ(fread(&imgst_file->metadata[i], sizeof(struct img_metadata), count, file) == count,
+              ERR_IO, "unable to read metadata in read_metadata_table");
+    }
+    return ERR_NONE;
+}
+
+int write_metadata_table(const imgst_file *imgst_file, FILE *file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(file);
+
+    const size_t nb_files = table_files(&imgst_file->header);
+    for (size_t i = 0; i < nb_files; i += IMGST_IO_CHUNK) {
+        const size_t count = nb_files - i < IMGST_IO_CHUNK ? nb_files - i : IMGST_IO_CHUNK;
+        M_REQ(fwrite(&imgst_file->metadata[i], sizeof(struct img_metadata), count, file) == count,
+              ERR_IO, "unable to write metadata in write_metadata_table");
+    }
+    return ERR_NONE;
+}
+
+int read_at(const imgst_file *imgst_file, void *buffer, size_t size, uint64_t offset) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const int fd = fileno(imgst_file->file);
+    for (size_t done = 0; done < size;) {
+        const ssize_t got = pread(fd, (char *) buffer + done, size - done, (off_t) (offset + done));
+        if (got < 0 && errno == EINTR) continue;
+        M_REQUIRE(got > 0, ERR_IO, "unable to read %zu bytes at %" PRIu64 " in read_at", size, offset);
+        done += (size_t) got;
+    }
+    return ERR_NONE;
+}
+
+int write_at(imgst_file *imgst_file, const void *buffer, size_t size, uint64_t offset) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const int fd = fileno(imgst_file->file);
+    for (size_t done = 0; done < size;) {
+        const ssize_t put = pwrite(fd, (const char *) buffer + done, size - done, (off_t) (offset + done));
+        if (put < 0 && errno == EINTR) continue;
+        M_REQUIRE(put > 0, ERR_IO, "unable to write %zu bytes at %" PRIu64 " in write_at", size, offset);
+        done += (size_t) put;
+    }
+    return ERR_NONE;
+}
+
+int copy_at(const imgst_file *from, uint64_t from_offset, imgst_file *to, uint64_t to_offset, uint64_t size) {
+    M_REQUIRE_NON_NULL(from);
+    M_REQUIRE_NON_NULL(from->file);
+    M_REQUIRE_NON_NULL(to);
+    M_REQUIRE_NON_NULL(to->file);
+
+    const int from_fd = fileno(from->file);
+    const int to_fd = fileno(to->file);
+    uint64_t done = 0;
+    while (done < size) {
+        loff_t in = (loff_t) (from_offset + done);
+        loff_t out = (loff_t) (to_offset + done);
+        const ssize_t copied = copy_file_range(from_fd, &in, to_fd, &out, size - done, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) break;
+        M_REQUIRE(copied > 0, ERR_IO, "unable to copy %" PRIu64 " bytes at %" PRIu64 " in copy_at", size, from_offset);
+        done += (uint64_t) copied;
+    }
+    if (done == size) return ERR_NONE;
+
+    // not supported between these files: the old way
+    const size_t chunk_size = size - done < IMGST_COPY_CHUNK ? (size_t) (size - done) : IMGST_COPY_CHUNK;
+    char *chunk = buffer_get(chunk_size);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(chunk, ERR_OUT_OF_MEMORY);
+
+    int err = ERR_NONE;
+    for (; err == ERR_NONE && done < size; done += chunk_size) {
+        const size_t length = size - done < chunk_size ? (size_t) (size - done) : chunk_size;
+        err = read_at(from, chunk, length, from_offset + done);
+        if (err == ERR_NONE) err = write_at(to, chunk, length, to_offset + done);
+    }
+    buffer_put(chunk);
+    return err;
+}
+
+int append_data(imgst_file *imgst_file, const void *buffer, size_t size, uint64_t *offset) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(offset);
+
+    if (imgst_file->data_end == 0) { // hand-built imgst_file
+        struct stat file_stat;
+        M_REQ(fstat(fileno(imgst_file->file), &file_stat) == 0, ERR_IO, "fstat failed in append_data");
+        imgst_file->data_end = (uint64_t) file_stat.st_size;
+    }
+
+    const int err = write_at(imgst_file, buffer, size, imgst_file->data_end);
+    M_REQ(err == ERR_NONE, err, "unable to append data in append_data");
+    *offset = imgst_file->data_end;
+    imgst_file->data_end += size;
+    return ERR_NONE;
+}
+
+static int sync_mapping(imgst_file *imgst_file, size_t start, size_t length) {
+#ifdef IMGST_MSYNC
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t page_start = start - start % page_size;
+    M_REQ(msync((char *) imgst_file->mapping + page_start, start + length - page_start, MS_SYNC) == 0,
+          ERR_IO, "msync failed");
+#else
+    (void) imgst_file;
+    (void) start;
+    (void) length;
+#endif
+    return ERR_NONE;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file imgst_io.h
+ * @brief imgStore library: transfers of the header, metadata and image contents to and from the imgStore file.
+ *
+ * Whether the metadata was read in memory (do_open) or is mapped from the file
+ * (do_open_mapped), updates shall go through these functions once done in memory.
+ * With a write-ahead log (do_enable_wal), write_header and write_metadata log them instead.
+ *
+ * Once a store is opened, all transfers are positional (pread/pwrite on the
+ * descriptor of its file): they neither use nor move the position of the FILE,
+ * so that several threads may read from the same open store.
+ */
+#pragma once
+
+#include "imgStore.h"
+
+#ifndef IMGST_IO_CHUNK
+/**
+ * Number of metadata records transferred per call by read_metadata_table and write_metadata_table.
+ */
+#define IMGST_IO_CHUNK 4096
+#endif
+
+/**
+ * @brief Reads the metadata table of imgst_file (the one right after the header) from the
+ *        current position of file, IMGST_IO_CHUNK records at a time.
+ *
+ * @param imgst_file Database whose metadata (of at least table_files(&header) entries) is filled
+ * @param file File positioned at the start of the metadata table
+ * @return error code, ERR_NONE if no error happened
+ */
+int read_metadata_table(imgst_file *imgst_file, FILE *file);
+
+/**
+ * @brief Writes the metadata table of imgst_file (the one right after the header) at the
+ *        current position of file, IMGST_IO_CHUNK records at a time.
+ *
+ * @param imgst_file Database whose metadata (of at least table_files(&header) entries) is written
+ * @param file File positioned at the start of the metadata table
+ * @return error code, ERR_NONE if no error happened
+ */
+int write_metadata_table(const imgst_file *imgst_file, FILE *file);
+
+/**
+ * @brief Writes the in-memory header of imgst_file back to its file.
+ *
+ * @param imgst_file Database being worked on
+ * @return error code, ERR_NONE if no error happened
+ */
+int write_header(imgst_file *imgst_file);
+
+/**
+ * @brief Writes one in-memory metadata of imgst_file back to its file.
+ *        For a shared mapping, the metadata is already there and at most gets synced.
+ *
+ * @param imgst_file Database being worked on
+ * @param slot Index of the metadata to write
+ * @return error code, ERR_NONE if no error happened
+ */
+int write_metadata(imgst_file *imgst_file, uint32_t slot);
+
+/**
+ * @brief Same as write_metadata, for count consecutive metadata, in a single transfer
+ *        (one per metadata segment they span).
+ *
+ * @param imgst_file Database being worked on
+ * @param first Index of the first metadata to write
+ * @param count Number of metadata to write
+ * @return error code, ERR_NONE if no error happened
+ */
+int write_metadata_range(imgst_file *imgst_file, uint32_t first, uint32_t count);
+
+/**
+ * @brief Reads exactly size bytes at offset in the file of imgst_file.
+ *
+ * @param imgst_file Database being read
+ * @param buffer Destination of at least size bytes
+ * @param size Number of bytes to read
+ * @param offset Position in the file of the first byte to read
+ * @return error code, ERR_NONE if no error happened
+ */
+int read_at(const imgst_file *imgst_file, void *buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Writes exactly size bytes at offset in the file of imgst_file.
+ *
+ * @param imgst_file Database being written
+ * @param buffer Source of size bytes
+ * @param size Number of bytes to write
+ * @param offset Position in the file of the first byte to write
+ * @return error code, ERR_NONE if no error happened
+ */
+int write_at(imgst_file *imgst_file, const void *buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Copies size bytes at from_offset in the file of from to to_offset in the file of to,
+ *        within the kernel (copy_file_range) when it can, through a buffer else.
+ *        The two ranges shall not overlap if both files are the same.
+ *
+ * @param from Database read
+ * @param from_offset Position in its file of the first byte to copy
+ * @param to Database written
+ * @param to_offset Position in its file of the first byte copied
+ * @param size Number of bytes to copy
+ * @return error code, ERR_NONE if no error happened
+ */
+int copy_at(const imgst_file *from, uint64_t from_offset, imgst_file *to, uint64_t to_offset, uint64_t size);
+
+/**
+ * @brief Appends size bytes at the end of the file of imgst_file.
+ *
+ * @param imgst_file Database being written, whose data_end is moved past the new bytes
+ * @param buffer Source of size bytes
+ * @param size Number of bytes to write
+ * @param offset Set to the position in the file of the first byte written
+ * @return error code, ERR_NONE if no error happened
+ */
+int append_data(imgst_file *imgst_file, const void *buffer, size_t size, uint64_t *offset);
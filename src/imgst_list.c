@@ -1,7 +1,82 @@
+/**
+ * @file imgst_list.c
+ * @brief imgStore library: do_list, do_list_json and do_list_changes implementation.
+ *
+ * The JSON listing is written as it goes through the metadata, into a fixed buffer
+ * handed to the writer whenever it is full: nothing grows with the number of images
+ * but what the writer does with the chunks.
+ */
+
 #include "imgStore.h"
+#include "imgst_changes.h"
+#include "imgst_index.h"
+#include "imgst_lock.h"
 
+#include <inttypes.h> // for PRIu32
+#include <limits.h>   // for UCHAR_MAX
 #include <stdbool.h>
-#include <json-c/json.h>
+#include <stdio.h>  // for snprintf
+#include <string.h>
+
+#ifndef IMGST_LIST_CHUNK
+#define IMGST_LIST_CHUNK 4096 // bytes of JSON handed to the writer at once
+#endif
+
+/**
+ * @brief JSON being written, with its pending chunk.
+ */
+struct json_output {
+    imgst_list_writer write;
+    void *arg;
+    int err; // of the writer, the output stopping at the first one
+    size_t length;
+    char chunk[IMGST_LIST_CHUNK];
+};
+
+/**
+ * @brief A string being built by do_list, as the writer of do_list_json.
+ */
+struct json_string {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+};
+
+/**
+ * @brief Body of do_list, the lock being held
+ */
+static char *list(const struct imgst_file *imgst_file, do_list_mode mode);
+
+/**
+ * @brief Body of do_list_json, the lock being held
+ */
+static int list_json(const struct imgst_file *imgst_file, const struct imgst_list_query *query,
+                     struct json_output *output);
+
+/**
+ * @brief Body of do_list_changes, the lock being held
+ */
+static int list_changes(const struct imgst_file *imgst_file, uint32_t since, struct json_output *output);
+
+/**
+ * @brief Hands the pending chunk to the writer.
+ */
+static void flush(struct json_output *output);
+
+/**
+ * @brief Appends bytes to the output.
+ */
+static void put_bytes(struct json_output *output, const char *bytes, size_t size);
+
+/**
+ * @brief Appends a string to the output, quoted and escaped as a JSON string.
+ */
+static void put_string(struct json_output *output, const char *string, size_t max_length);
+
+/**
+ * @brief Writer of do_list_json appending to a struct json_string.
+ */
+static int append_to_string(const char *chunk, size_t size, void *arg);
 
 /********************************************************************//**
  * @brief Displays (on stdout) imgStore metadata.
@@ -10,6 +85,59 @@ char *do_list(const struct imgst_file *imgst_file, do_list_mode mode) {
 
     M_REQUIRE_CUSTOM_RET(imgst_file != NULL, NULL, /**/);
 
+    if (mode == JSON) {
+        // all of it, as one string
+        struct json_string string = { NULL, 0, 0 };
+        const struct imgst_list_query all = { NULL, 0, 0 };
+        const int err = do_list_json(imgst_file, &all, append_to_string, &string);
+        M_REQUIRE_CUSTOM_RET(err == ERR_NONE && string.buffer != NULL, NULL, free(string.buffer));
+        string.buffer[string.length] = '\0';
+        return string.buffer;
+    }
+
+    lock_read(imgst_file);
+    char *const listing = list(imgst_file, mode);
+    lock_release(imgst_file);
+    return listing;
+}
+
+/********************************************************************//**
+ * Writes the img_ids of some valid images, in JSON, chunk by chunk.
+ */
+int do_list_json(const struct imgst_file *imgst_file, const struct imgst_list_query *query,
+                 imgst_list_writer write, void *arg) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(query);
+    M_REQUIRE_NON_NULL(write);
+    // no img_id starts with a longer one, and the range of list_json would be empty
+    M_REQ(query->prefix == NULL || strlen(query->prefix) <= MAX_IMG_ID, ERR_INVALID_ARGUMENT,
+          "too long prefix in do_list_json");
+
+    struct json_output output = { write, arg, ERR_NONE, 0, "" };
+    lock_read(imgst_file);
+    const int err = list_json(imgst_file, query, &output);
+    lock_release(imgst_file);
+    return err;
+}
+
+/********************************************************************//**
+ * Writes the insertions and deletions made after a version, in JSON, chunk by chunk.
+ */
+int do_list_changes(const struct imgst_file *imgst_file, uint32_t since, imgst_list_writer write, void *arg) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->changes);
+    M_REQUIRE_NON_NULL(write);
+
+    struct json_output output = { write, arg, ERR_NONE, 0, "" };
+    lock_read(imgst_file);
+    const int err = list_changes(imgst_file, since, &output);
+    lock_release(imgst_file);
+    return err;
+}
+
+static char *list(const struct imgst_file *imgst_file, do_list_mode mode) {
+
     switch (mode) {
         case STDOUT:
 
@@ -28,36 +156,136 @@ char *do_list(const struct imgst_file *imgst_file, do_list_mode mode) {
             }
             return NULL;
 
-        case JSON: {
+        default:
+            return NULL;
+    }
+}
+
+static int list_json(const struct imgst_file *imgst_file, const struct imgst_list_query *query,
+                     struct json_output *output) {
+    struct index_cursor cursor;
+    char last[MAX_IMG_ID + 1]; // of the range, as long as the cursor
+    if (query->prefix == NULL || query->prefix[0] == '\0') {
+        index_seek(imgst_file, NULL, NULL, &cursor);
+    } else {
+        // the img_ids starting with prefix are the ones up to prefix followed by the highest chars
+        const size_t prefix_length = strlen(query->prefix);
+        memset(last, UCHAR_MAX, MAX_IMG_ID);
+        memcpy(last, query->prefix, prefix_length); // at most MAX_IMG_ID (see do_list_json)
+        last[MAX_IMG_ID] = '\0';
+        index_seek(imgst_file, query->prefix, last, &cursor);
+    }
+    index_skip(imgst_file, &cursor, query->offset);
 
-            json_object *arr_strings = json_object_new_array();
-            M_REQUIRE_CUSTOM_RET(arr_strings != NULL, "", /**/);
+    static const char start[] = "{\"Images\": [";
+    put_bytes(output, start, sizeof(start) - 1);
 
-            const img_metadata *end = imgst_file->metadata + imgst_file->header.max_files;
-            for (img_metadata *curr_meta = imgst_file->metadata; curr_meta < end; ++curr_meta) {
-                if (curr_meta->is_valid == NON_EMPTY)
-                    M_REQUIRE_CUSTOM_RET(
-                            json_object_array_add(arr_strings, json_object_new_string(curr_meta->img_id)) ==
-                            JSON_ERR_NONE,
-                            "", json_object_put(arr_strings));
-            }
-            json_object *obj_json = json_object_new_object();
-            M_REQUIRE_CUSTOM_RET(obj_json != NULL, "", json_object_put(obj_json));
+    uint32_t listed = 0;
+    bool more = false;
+    uint32_t slot = 0;
+    while (output->err == ERR_NONE && (slot = index_next(imgst_file, &cursor)) != INDEX_NOT_FOUND) {
+        if (query->limit != 0 && listed == query->limit) {
+            more = true;
+            break;
+        }
+        if (listed++ > 0) put_bytes(output, ", ", 2);
+        put_string(output, imgst_file->metadata[slot].img_id, MAX_IMG_ID);
+    }
+
+    char end[64];
+    const int length = snprintf(end, sizeof(end), "], \"More\": %s, \"Version\": %" PRIu32 "}",
+                                more ? "true" : "false", imgst_file->header.imgst_version);
+    put_bytes(output, end, (size_t) length);
+    flush(output);
+
+    M_REQUIRE(output->err == ERR_NONE, output->err, "unable to write the listing in do_list_json (%d)", output->err);
+    return ERR_NONE;
+}
+
+static int list_changes(const struct imgst_file *imgst_file, uint32_t since, struct json_output *output) {
+    const struct imgst_changes *changes = imgst_file->changes;
+    const uint32_t version = imgst_file->header.imgst_version;
+    const bool resync = since < changes->since || since > version;
 
-            M_REQUIRE_CUSTOM_RET(json_object_object_add(obj_json, "Images", arr_strings) == JSON_ERR_NONE, "",
-                                 GROUP_CALLS(json_object_put(obj_json), json_object_put(arr_strings)));
+    static const char start[] = "{\"Changes\": [";
+    put_bytes(output, start, sizeof(start) - 1);
 
-            const char *json_string = json_object_to_json_string(obj_json);
-            size_t string_length = strlen(json_string);
-            char *ret_string = calloc(string_length + 1, sizeof(char));
-            M_REQUIRE_CUSTOM_RET(ret_string != NULL, NULL, json_object_put(obj_json));
-            strncpy(ret_string, json_string, string_length);
+    if (!resync) {
+        // the changes after since are the last ones
+        size_t n = changes->count;
+        while (n > 0 && changes_at(changes, n - 1)->version > since) --n;
 
-            json_object_put(obj_json);
-            return ret_string;
+        for (size_t first = n; output->err == ERR_NONE && n < changes->count; ++n) {
+            const struct imgst_change *change = changes_at(changes, n);
+            static const char added[] = "{\"Added\": ";
+            static const char deleted[] = "{\"Deleted\": ";
+            if (n > first) put_bytes(output, ", ", 2);
+            put_bytes(output, change->deleted ? deleted : added, change->deleted ? sizeof(deleted) - 1 : sizeof(added) - 1);
+            put_string(output, change->img_id, MAX_IMG_ID);
+            put_bytes(output, "}", 1);
         }
+    }
 
-        default:
-            return NULL;
+    char end[64];
+    const int length = snprintf(end, sizeof(end), "], \"Version\": %" PRIu32 ", \"Resync\": %s}",
+                                version, resync ? "true" : "false");
+    put_bytes(output, end, (size_t) length);
+    flush(output);
+
+    M_REQUIRE(output->err == ERR_NONE, output->err, "unable to write the changes in do_list_changes (%d)", output->err);
+    return ERR_NONE;
+}
+
+static void flush(struct json_output *output) {
+    if (output->err == ERR_NONE && output->length > 0) {
+        output->err = output->write(output->chunk, output->length, output->arg);
+    }
+    output->length = 0;
+}
+
+static void put_bytes(struct json_output *output, const char *bytes, size_t size) {
+    while (size > 0) {
+        if (output->length == IMGST_LIST_CHUNK) flush(output);
+        const size_t room = IMGST_LIST_CHUNK - output->length;
+        const size_t length = size < room ? size : room;
+        memcpy(&output->chunk[output->length], bytes, length);
+        output->length += length;
+        bytes += length;
+        size -= length;
+    }
+}
+
+static void put_string(struct json_output *output, const char *string, size_t max_length) {
+    put_bytes(output, "\"", 1);
+    for (size_t i = 0; i < max_length && string[i] != '\0'; ++i) {
+        const unsigned char c = (unsigned char) string[i];
+        char escaped[8];
+        if (c == '"' || c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = (char) c;
+            put_bytes(output, escaped, 2);
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            put_bytes(output, escaped, 6);
+        } else {
+            put_bytes(output, (const char *) &c, 1);
+        }
+    }
+    put_bytes(output, "\"", 1);
+}
+
+static int append_to_string(const char *chunk, size_t size, void *arg) {
+    struct json_string *string = arg;
+    if (string->length + size + 1 > string->capacity) {
+        // doubles, with room for the final '\0'
+        size_t capacity = string->capacity > 0 ? string->capacity : IMGST_LIST_CHUNK;
+        while (string->length + size + 1 > capacity) capacity *= 2;
+        char *buffer = realloc(string->buffer, capacity);
+        M_REQUIRE_NON_NULL_CUSTOM_ERR(buffer, ERR_OUT_OF_MEMORY);
+        string->buffer = buffer;
+        string->capacity = capacity;
     }
+    memcpy(&string->buffer[string->length], chunk, size);
+    string->length += size;
+    return ERR_NONE;
 }
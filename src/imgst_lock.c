@@ -0,0 +1,128 @@
+/**
+ * @file imgst_lock.c
+ * @brief Reader/writer lock of an imgStore, over a pthread rwlock, and the pins of its contents.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t
+
+#include "imgst_lock.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/**
+ * @brief A pinned content, and how many times it is pinned.
+ */
+struct pin {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t count;
+};
+
+struct imgst_lock {
+    pthread_rwlock_t rwlock;
+
+    pthread_mutex_t pins_mutex; // of the pins, which readers take
+    struct pin *pins;           // few: one per content being sent, say
+    size_t nb_pins;
+    size_t pins_capacity;
+};
+
+int do_enable_locking(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_EXIT_NO_ERR_IF(imgst_file->lock != NULL);
+
+    struct imgst_lock *lock = calloc(1, sizeof(struct imgst_lock));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(lock, ERR_OUT_OF_MEMORY);
+    M_EXIT_IF_ERR_DO_SOMETHING(pthread_rwlock_init(&lock->rwlock, NULL) == 0 ? ERR_NONE : ERR_OUT_OF_MEMORY, free(lock));
+    M_EXIT_IF_ERR_DO_SOMETHING(pthread_mutex_init(&lock->pins_mutex, NULL) == 0 ? ERR_NONE : ERR_OUT_OF_MEMORY,
+                               GROUP_CALLS(pthread_rwlock_destroy(&lock->rwlock), free(lock)));
+
+    imgst_file->lock = lock;
+    return ERR_NONE;
+}
+
+void lock_read(const imgst_file *imgst_file) {
+    if (imgst_file->lock != NULL) {
+        pthread_rwlock_rdlock(&imgst_file->lock->rwlock);
+    }
+}
+
+void lock_write(const imgst_file *imgst_file) {
+    if (imgst_file->lock != NULL) {
+        pthread_rwlock_wrlock(&imgst_file->lock->rwlock);
+    }
+}
+
+void lock_release(const imgst_file *imgst_file) {
+    if (imgst_file->lock != NULL) {
+        pthread_rwlock_unlock(&imgst_file->lock->rwlock);
+    }
+}
+
+int pin_content(const imgst_file *imgst_file, uint64_t offset, uint32_t size) {
+    struct imgst_lock *lock = imgst_file->lock;
+    M_EXIT_NO_ERR_IF(lock == NULL);
+
+    int err = ERR_NONE;
+    pthread_mutex_lock(&lock->pins_mutex);
+    size_t i = 0;
+    while (i < lock->nb_pins && (lock->pins[i].offset != offset || lock->pins[i].size != size)) ++i;
+    if (i < lock->nb_pins) {
+        ++lock->pins[i].count;
+    } else {
+        if (lock->nb_pins == lock->pins_capacity) {
+            const size_t capacity = lock->pins_capacity == 0 ? 16 : 2 * lock->pins_capacity;
+            struct pin *pins = realloc(lock->pins, capacity * sizeof(struct pin));
+            if (pins != NULL) {
+                lock->pins = pins;
+                lock->pins_capacity = capacity;
+            }
+        }
+        if (lock->nb_pins < lock->pins_capacity) {
+            lock->pins[lock->nb_pins++] = (struct pin) { offset, size, 1 };
+        } else {
+            err = ERR_OUT_OF_MEMORY;
+        }
+    }
+    pthread_mutex_unlock(&lock->pins_mutex);
+    return err;
+}
+
+void unpin_content(const imgst_file *imgst_file, uint64_t offset, uint32_t size) {
+    struct imgst_lock *lock = imgst_file->lock;
+    if (lock == NULL) return;
+
+    pthread_mutex_lock(&lock->pins_mutex);
+    for (size_t i = 0; i < lock->nb_pins; ++i) {
+        if (lock->pins[i].offset == offset && lock->pins[i].size == size) {
+            if (--lock->pins[i].count == 0) lock->pins[i] = lock->pins[--lock->nb_pins];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock->pins_mutex);
+}
+
+bool pinned_within(const imgst_file *imgst_file, uint64_t from, uint64_t to) {
+    struct imgst_lock *lock = imgst_file->lock;
+    if (lock == NULL) return false;
+
+    bool pinned = false;
+    pthread_mutex_lock(&lock->pins_mutex);
+    for (size_t i = 0; i < lock->nb_pins && !pinned; ++i) {
+        pinned = lock->pins[i].offset < to && lock->pins[i].offset + lock->pins[i].size > from;
+    }
+    pthread_mutex_unlock(&lock->pins_mutex);
+    return pinned;
+}
+
+void lock_free(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file, "null argument in lock_free");
+
+    if (imgst_file->lock != NULL) {
+        pthread_rwlock_destroy(&imgst_file->lock->rwlock);
+        pthread_mutex_destroy(&imgst_file->lock->pins_mutex);
+        free(imgst_file->lock->pins);
+        FREE(imgst_file->lock);
+    }
+}
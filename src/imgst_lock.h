@@ -0,0 +1,74 @@
+/**
+ * @file imgst_lock.h
+ * @brief Reader/writer lock of an imgStore, for use from several threads.
+ *
+ * Locking is opt-in (see do_enable_locking): while imgst_file->lock is NULL,
+ * all these functions do nothing. Readers (do_read, do_list) share the lock,
+ * writers (do_insert, do_delete, lazily_resize) hold it exclusively.
+ * The lock is not recursive: library functions taking it must not call each other.
+ *
+ * Along with the lock come the pins of the contents read straight from the file
+ * (see do_pin), which do_compact copies nothing over.
+ */
+#pragma once
+
+#include "imgStore.h"
+
+#include <stdbool.h>
+
+/**
+ * @brief Takes the lock of imgst_file in shared mode.
+ *
+ * @param imgst_file Database to be read
+ */
+void lock_read(const imgst_file *imgst_file);
+
+/**
+ * @brief Takes the lock of imgst_file in exclusive mode.
+ *
+ * @param imgst_file Database to be modified
+ */
+void lock_write(const imgst_file *imgst_file);
+
+/**
+ * @brief Releases the lock of imgst_file, whatever its mode.
+ *
+ * @param imgst_file Database previously locked by this thread
+ */
+void lock_release(const imgst_file *imgst_file);
+
+/**
+ * @brief Pins a content of imgst_file (once more if it is already pinned).
+ *
+ * @param imgst_file Database locked by this thread, the content being referenced by its metadata
+ * @param offset Offset of the content
+ * @param size Size of the content
+ * @return error code, ERR_NONE if no error happened
+ */
+int pin_content(const imgst_file *imgst_file, uint64_t offset, uint32_t size);
+
+/**
+ * @brief Releases a pin taken by pin_content.
+ *
+ * @param imgst_file Database whose content was pinned
+ * @param offset Offset of the content
+ * @param size Size of the content
+ */
+void unpin_content(const imgst_file *imgst_file, uint64_t offset, uint32_t size);
+
+/**
+ * @brief Tells whether a pinned content overlaps some bytes of the file of imgst_file.
+ *
+ * @param imgst_file Database being compacted
+ * @param from Offset of the first byte
+ * @param to Offset after the last byte
+ * @return true if some pinned content overlaps the bytes
+ */
+bool pinned_within(const imgst_file *imgst_file, uint64_t from, uint64_t to);
+
+/**
+ * @brief Destroys the lock of imgst_file (does nothing if locking was not enabled).
+ *
+ * @param imgst_file Database no longer used by any thread
+ */
+void lock_free(imgst_file *imgst_file);
@@ -0,0 +1,155 @@
+/**
+ * @file imgst_pregen.c
+ * @brief Background generation of the resized versions of inserted images, over a thread_pool.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pthread_t
+
+#include "imgst_pregen.h"
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Computation of one version of an image, queued or running.
+ */
+struct pregen_job {
+    imgst_file *imgst_file;
+    char img_id[MAX_IMG_ID + 1];
+    int resolution;
+    bool running;
+    pthread_t runner; // if running
+    struct pregen_job *next;
+};
+
+struct imgst_pregen {
+    struct thread_pool *pool;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_done;
+    struct pregen_job *jobs; // queued or running, protected by mutex
+};
+
+/**
+ * @brief Finds the job computing some version of an image, the mutex of pregen being held.
+ *
+ * @return the job, NULL if none
+ */
+static struct pregen_job *find_job(const struct imgst_pregen *pregen, const char *img_id, int resolution);
+
+/**
+ * @brief Removes a job from the jobs of pregen and wakes up its waiters, the mutex of pregen being held.
+ */
+static void remove_job(struct imgst_pregen *pregen, const struct pregen_job *job);
+
+/**
+ * @brief Body of the background threads: computes the version of the image of a pregen_job.
+ *
+ * @param arg The pregen_job, freed once done
+ */
+static void run_job(void *arg);
+
+int do_enable_pregen(imgst_file *imgst_file, size_t nb_threads) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_EXIT_NO_ERR_IF(imgst_file->pregen != NULL);
+    M_EXIT_IF_ERR(do_enable_locking(imgst_file));
+
+    struct imgst_pregen *pregen = calloc(1, sizeof(struct imgst_pregen));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(pregen, ERR_OUT_OF_MEMORY);
+    M_EXIT_IF_ERR_DO_SOMETHING(thread_pool_create(nb_threads, &pregen->pool), free(pregen));
+
+    pthread_mutex_init(&pregen->mutex, NULL);
+    pthread_cond_init(&pregen->job_done, NULL);
+    imgst_file->pregen = pregen;
+    return ERR_NONE;
+}
+
+void pregen_schedule(imgst_file *imgst_file, const char *img_id) {
+    struct imgst_pregen *pregen = imgst_file->pregen;
+    if (pregen == NULL) return;
+
+    const int resolutions[] = { RES_THUMB, RES_SMALL };
+    for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); ++i) {
+        pthread_mutex_lock(&pregen->mutex);
+        struct pregen_job *job = NULL;
+        if (find_job(pregen, img_id, resolutions[i]) == NULL && (job = calloc(1, sizeof(struct pregen_job))) != NULL) {
+            job->imgst_file = imgst_file;
+            strncpy(job->img_id, img_id, MAX_IMG_ID);
+            job->resolution = resolutions[i];
+            job->next = pregen->jobs;
+            pregen->jobs = job;
+        }
+        pthread_mutex_unlock(&pregen->mutex);
+
+        // if it cannot be queued, the first read will compute it
+        if (job != NULL && thread_pool_submit(pregen->pool, run_job, job) != ERR_NONE) {
+            pthread_mutex_lock(&pregen->mutex);
+            remove_job(pregen, job);
+            pthread_mutex_unlock(&pregen->mutex);
+            free(job);
+        }
+    }
+}
+
+void pregen_wait(const imgst_file *imgst_file, const char *img_id, int resolution) {
+    struct imgst_pregen *pregen = imgst_file->pregen;
+    if (pregen == NULL) return;
+
+    pthread_mutex_lock(&pregen->mutex);
+    const struct pregen_job *job = NULL;
+    while ((job = find_job(pregen, img_id, resolution)) != NULL
+           && !(job->running && pthread_equal(job->runner, pthread_self()))) {
+        pthread_cond_wait(&pregen->job_done, &pregen->mutex);
+    }
+    pthread_mutex_unlock(&pregen->mutex);
+}
+
+void pregen_free(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file, "null argument in pregen_free");
+
+    struct imgst_pregen *pregen = imgst_file->pregen;
+    if (pregen != NULL) {
+        thread_pool_destroy(pregen->pool); // after the queued jobs, which still need imgst_file->pregen
+        pthread_cond_destroy(&pregen->job_done);
+        pthread_mutex_destroy(&pregen->mutex);
+        FREE(imgst_file->pregen);
+    }
+}
+
+static struct pregen_job *find_job(const struct imgst_pregen *pregen, const char *img_id, int resolution) {
+    struct pregen_job *job = pregen->jobs;
+    while (job != NULL && (job->resolution != resolution || strncmp(job->img_id, img_id, MAX_IMG_ID) != 0)) {
+        job = job->next;
+    }
+    return job;
+}
+
+static void remove_job(struct imgst_pregen *pregen, const struct pregen_job *job) {
+    struct pregen_job **link = &pregen->jobs;
+    while (*link != NULL && *link != job) link = &(*link)->next;
+    if (*link != NULL) *link = job->next;
+    pthread_cond_broadcast(&pregen->job_done);
+}
+
+static void run_job(void *arg) {
+    struct pregen_job *job = arg;
+    struct imgst_pregen *pregen = job->imgst_file->pregen;
+
+    pthread_mutex_lock(&pregen->mutex);
+    job->running = true;
+    job->runner = pthread_self();
+    pthread_mutex_unlock(&pregen->mutex);
+
+    // the image may have been deleted meanwhile: nothing to do then
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    (void) do_locate(job->img_id, job->resolution, &offset, &size, SHA, job->imgst_file);
+
+    pthread_mutex_lock(&pregen->mutex);
+    remove_job(pregen, job);
+    pthread_mutex_unlock(&pregen->mutex);
+    free(job);
+}
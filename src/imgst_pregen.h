@@ -0,0 +1,38 @@
+/**
+ * @file imgst_pregen.h
+ * @brief Background generation of the resized versions of inserted images.
+ *
+ * Pre-generation is opt-in (see do_enable_pregen): while imgst_file->pregen is NULL,
+ * all these functions do nothing. Each (image ID, resolution) is computed by at most
+ * one job at a time, and reads of a version being computed wait for its job.
+ */
+#pragma once
+
+#include "imgStore.h"
+
+/**
+ * @brief Queues the computation of the thumbnail and small versions of an image,
+ *        skipping those already queued or being computed.
+ *
+ * @param imgst_file Database in which the image was just inserted, not locked by this thread
+ * @param img_id ID of the image
+ */
+void pregen_schedule(imgst_file *imgst_file, const char *img_id);
+
+/**
+ * @brief Waits until no background job is computing some version of an image.
+ *        Returns at once when called from the job itself.
+ *
+ * @param imgst_file Database of the image, not locked by this thread
+ * @param img_id ID of the image
+ * @param resolution Resolution of the version
+ */
+void pregen_wait(const imgst_file *imgst_file, const char *img_id, int resolution);
+
+/**
+ * @brief Runs the queued jobs, then stops the background threads
+ *        (does nothing if pre-generation was not enabled).
+ *
+ * @param imgst_file Database still open, no longer used by other threads
+ */
+void pregen_free(imgst_file *imgst_file);
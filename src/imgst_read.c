@@ -1,14 +1,43 @@
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_pregen.h"
 #include "image_content.h"
 
+#include <stdbool.h>
+#include <string.h> // for memcpy
+
+/**
+ * @brief Copies the content of an image at some resolution from the database file into a buffer
+ * @param index slot of the image, whose content at resolution exists
+ * @param resolution the resolution in which the image is wanted
+ * @param buffer the buffer that will hold the image
+ * @param capacity the size of buffer
+ * @param image_size will hold the size of the image, even if buffer is too small
+ * @param imgst_file the database in which the image is, locked in any mode
+ * @return an error code, ERR_NONE if everything worked
+ */
+static int read_content(uint32_t index, int resolution, char *buffer, size_t capacity, uint32_t *image_size,
+                        imgst_file *imgst_file);
+
+/**
+ * @brief Finds the slot of an image, creating its content at some resolution if it does not exist yet
+ * @param img_id the name of the image wanted
+ * @param resolution the resolution in which the image is wanted
+ * @param index will hold the slot of the image, whose content at resolution then exists
+ * @param imgst_file the database in which the image should be, locked for reading
+ *        (possibly relocked for writing, but locked in some mode on return)
+ * @return an error code, ERR_NONE if everything worked
+ */
+static int locate_content(const char *img_id, int resolution, uint32_t *index, imgst_file *imgst_file);
+
 /**
- * @brief Finds the first index of an image in the database with the same id as img_id
- *
- * @param imgst_file Main datastucture
- * @param img_id Name sought after
- * @return Index of the first image with id equal to img_id, -1 if none exists
+ * @brief Body of do_locate and do_pin
+ * @param pin whether to pin the content located
  */
-static size_t find_name_matching(imgst_file *imgst_file, const char *img_id);
+static int locate(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, unsigned char *SHA,
+                  imgst_file *imgst_file, bool pin);
 
 /**
  * Reads an image given its ID, its resolution and the database file it is in
@@ -21,39 +50,139 @@ static size_t find_name_matching(imgst_file *imgst_file, const char *img_id);
  */
 int do_read(const char *img_id, int resolution, char **image_buffer, uint32_t *image_size, imgst_file *imgst_file) {
     M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
     M_REQUIRE_NON_NULL(imgst_file);
 
-    int err;
-    size_t index;
+    uint32_t index = INDEX_NOT_FOUND;
+
+    lock_read(imgst_file);
+    int err = locate_content(img_id, resolution, &index, imgst_file);
+    if (err == ERR_NONE) {
+        // not zeroed: the content overwrites it all
+        const uint32_t size = imgst_file->metadata[index].size[resolution];
+        *image_buffer = malloc(size);
+        err = *image_buffer == NULL ? ERR_OUT_OF_MEMORY
+              : read_content(index, resolution, *image_buffer, size, image_size, imgst_file);
+        if (err != ERR_NONE) FREE(*image_buffer);
+    }
+    lock_release(imgst_file);
 
-    M_REQ((index = find_name_matching(imgst_file, img_id)) != -1, ERR_FILE_NOT_FOUND, "error in do_read : imgID not found");
+    M_REQUIRE(err == ERR_NONE, err, "error in do_read with the image %s", img_id);
+    return ERR_NONE;
+}
 
-    if (imgst_file->metadata[index].size[resolution] == 0) {
-        M_REQUIRE((err = lazily_resize(resolution, imgst_file, index)) == ERR_NONE, err,
-                  "error in do_read : lazily_resize failed with the image %s", img_id);
+int do_read_into(const char *img_id, int resolution, char *buffer, size_t capacity, uint32_t *image_size,
+                 imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    uint32_t index = INDEX_NOT_FOUND;
+
+    lock_read(imgst_file);
+    int err = locate_content(img_id, resolution, &index, imgst_file);
+    if (err == ERR_NONE) {
+        err = read_content(index, resolution, buffer, capacity, image_size, imgst_file);
     }
+    lock_release(imgst_file);
+
+    M_REQUIRE(err == ERR_NONE, err, "error in do_read_into with the image %s", img_id);
+    return ERR_NONE;
+}
+
+int do_locate(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, unsigned char *SHA,
+              imgst_file *imgst_file) {
+    return locate(img_id, resolution, offset, size, SHA, imgst_file, false);
+}
+
+int do_pin(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, unsigned char *SHA,
+           imgst_file *imgst_file) {
+    return locate(img_id, resolution, offset, size, SHA, imgst_file, true);
+}
+
+void do_unpin(uint64_t offset, uint32_t size, imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file, "null argument in do_unpin");
+    unpin_content(imgst_file, offset, size);
+}
 
-    uint64_t offset = imgst_file->metadata[index].offset[resolution];
-    *image_size = imgst_file->metadata[index].size[resolution];
+static int locate(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, unsigned char *SHA,
+                  imgst_file *imgst_file, bool pin) {
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(offset);
+    M_REQUIRE_NON_NULL(size);
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(imgst_file);
 
-    char *data = (char *) calloc(*image_size, sizeof(char));
-    M_REQUIRE_NON_NULL_CUSTOM_ERR(data, ERR_OUT_OF_MEMORY);
-    M_REQ_CLEAN(fseek(imgst_file->file, offset, SEEK_SET) == 0,
-                ERR_IO, "unable to fseek in imgst read", 1, data);
-    M_REQ_CLEAN(fread(data, *image_size, 1, imgst_file->file) == 1,
-                ERR_IO, "unable to read wanted image in do_read", 1, data);
+    uint32_t index = INDEX_NOT_FOUND;
 
-    *image_buffer = data;
+    lock_read(imgst_file);
+    int err = locate_content(img_id, resolution, &index, imgst_file);
+    if (err == ERR_NONE) {
+        *offset = imgst_file->metadata[index].offset[resolution];
+        *size = imgst_file->metadata[index].size[resolution];
+        memcpy(SHA, imgst_file->metadata[index].SHA, SHA256_DIGEST_LENGTH);
+        // while the content is still referenced: do_compact cannot have taken its place yet
+        if (pin) err = pin_content(imgst_file, *offset, *size);
+    }
+    lock_release(imgst_file);
 
+    M_REQUIRE(err == ERR_NONE, err, "error in do_locate with the image %s", img_id);
     return ERR_NONE;
 }
 
-static size_t find_name_matching(imgst_file *imgst_file, const char *img_id) {
+static int locate_content(const char *img_id, int resolution, uint32_t *index, imgst_file *imgst_file) {
+    int err = ERR_NONE;
+    *index = index_find_id(imgst_file, img_id, INDEX_NOT_FOUND);
+
+    if (*index != INDEX_NOT_FOUND && imgst_file->metadata[*index].size[resolution] == 0
+        && imgst_file->pregen != NULL) {
+        // a background job may be computing it: rather wait for it than compute it twice
+        lock_release(imgst_file);
+        pregen_wait(imgst_file, img_id, resolution);
+        lock_read(imgst_file);
+        *index = index_find_id(imgst_file, img_id, INDEX_NOT_FOUND);
+    }
 
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        if (imgst_file->metadata[i].is_valid == NON_EMPTY && strncmp(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID) == 0) {
-            return i;
+    if (*index != INDEX_NOT_FOUND && imgst_file->metadata[*index].size[resolution] == 0) {
+        // the resized image is computed under the shared lock, only storing it needs the lock exclusively
+        unsigned char SHA[SHA256_DIGEST_LENGTH];
+        memcpy(SHA, imgst_file->metadata[*index].SHA, SHA256_DIGEST_LENGTH);
+        void *resized = NULL;
+        size_t resized_size = 0;
+        err = lazily_resize_compute(resolution, imgst_file, *index, &resized, &resized_size);
+
+        lock_release(imgst_file);
+        lock_write(imgst_file);
+
+        // the image may have been deleted, or replaced by another one of the same ID, meanwhile
+        *index = index_find_id(imgst_file, img_id, INDEX_NOT_FOUND);
+        if (err == ERR_NONE && *index != INDEX_NOT_FOUND) {
+            err = memcmp(SHA, imgst_file->metadata[*index].SHA, SHA256_DIGEST_LENGTH) == 0
+                  ? lazily_resize_store(resolution, imgst_file, *index, resized, resized_size)
+                  : lazily_resize_locked(resolution, imgst_file, *index);
         }
+        free(resized);
+    }
+
+    if (err == ERR_NONE && *index == INDEX_NOT_FOUND) {
+        err = ERR_FILE_NOT_FOUND;
     }
-    return -1;
+    return err;
+}
+
+static int read_content(uint32_t index, int resolution, char *buffer, size_t capacity, uint32_t *image_size,
+                        imgst_file *imgst_file) {
+    const uint64_t offset = imgst_file->metadata[index].offset[resolution];
+    const uint32_t size = imgst_file->metadata[index].size[resolution];
+
+    *image_size = size;
+    M_REQ(size <= capacity, ERR_INVALID_ARGUMENT, "buffer too small for the wanted image in do_read_into");
+
+    int err;
+    M_REQ((err = read_at(imgst_file, buffer, size, offset)) == ERR_NONE,
+          err, "unable to read wanted image in do_read");
+
+    return ERR_NONE;
 }
@@ -0,0 +1,211 @@
+/**
+ * @file imgst_segment.c
+ * @brief imgStore library: metadata segments, and do_grow implementation.
+ *
+ * A segment is appended to the file, zeroed, and synced before it is chained
+ * from the previous one (or from the header), and the chain is synced before
+ * the new slots are used: a crash in between leaves at worst an unreferenced
+ * segment, which do_compact and do_gbcollect reclaim as dead space.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, fdatasync
+
+#include "imgst_segment.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "error.h"
+
+#include <stddef.h> // for offsetof
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * @brief Writes the chain to a new segment, and the new size of the metadata, in place.
+ *
+ * @param imgst_file Database being grown, whose in-memory header is not updated yet
+ * @param offset Where the new segment is
+ * @param max_files Number of slots once grown
+ * @return error code, ERR_NONE if no error happened
+ */
+static int link_segment(imgst_file *imgst_file, uint64_t offset, uint32_t max_files);
+
+uint32_t table_files(const imgst_header *header) {
+    return header->table_files != 0 ? header->table_files : header->max_files;
+}
+
+int check_header(const imgst_header *header) {
+    M_REQUIRE_NON_NULL(header);
+    M_REQ(strncmp(header->imgst_name, CAT_TXT, MAX_IMGST_NAME + 1) == 0
+          || strncmp(header->imgst_name, CAT_TXT_GROWN, MAX_IMGST_NAME + 1) == 0,
+          ERR_IO, "unknown type of imgStore");
+    M_REQ(table_files(header) <= MAX_GROWN_FILES, ERR_IO, "too many files in the header");
+    return ERR_NONE;
+}
+
+uint64_t metadata_offset(const imgst_file *imgst_file, uint32_t slot, uint32_t *run) {
+    const uint32_t table = table_files(&imgst_file->header);
+    for (uint32_t i = 0; slot >= table && i < imgst_file->nb_segments; ++i) {
+        const struct imgst_segment_info *segment = &imgst_file->segments[i];
+        if (slot - segment->first_slot < segment->nb_files) {
+            if (run != NULL) *run = segment->first_slot + segment->nb_files - slot;
+            return segment->offset + sizeof(struct imgst_segment)
+                   + (uint64_t) (slot - segment->first_slot) * sizeof(struct img_metadata);
+        }
+    }
+    if (run != NULL) *run = slot < table ? table - slot : 1;
+    return sizeof(struct imgst_header) + (uint64_t) slot * sizeof(struct img_metadata);
+}
+
+int read_segments(imgst_file *imgst_file, uint64_t file_size) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+
+    imgst_file->segments = NULL;
+    imgst_file->nb_segments = 0;
+    uint32_t max_files = table_files(&imgst_file->header);
+    M_REQ(max_files <= MAX_GROWN_FILES, ERR_IO, "too many files in the header");
+    uint64_t previous = sizeof(struct imgst_header) + (uint64_t) max_files * sizeof(struct img_metadata);
+
+    int err = ERR_NONE;
+    for (uint64_t next = imgst_file->header.next_segment; err == ERR_NONE && next != 0;) {
+        // segments are appended: each one lies after the previous, which rules out cycles
+        imgst_segment segment = { 0, 0, 0 };
+        err = next >= previous && next + sizeof(struct imgst_segment) <= file_size ? ERR_NONE : ERR_IO;
+        if (err == ERR_NONE) err = read_at(imgst_file, &segment, sizeof(struct imgst_segment), next);
+        const uint64_t size = (uint64_t) segment.nb_files * sizeof(struct img_metadata);
+        if (err == ERR_NONE) {
+            err = segment.nb_files > 0 && segment.nb_files <= MAX_GROWN_FILES - max_files
+                  && next + sizeof(struct imgst_segment) + size <= file_size ? ERR_NONE : ERR_IO;
+        }
+
+        struct imgst_segment_info *segments = NULL;
+        img_metadata *metadata = NULL;
+        if (err == ERR_NONE) {
+            segments = realloc(imgst_file->segments, (imgst_file->nb_segments + 1) * sizeof(struct imgst_segment_info));
+            if (segments != NULL) imgst_file->segments = segments;
+            metadata = realloc(imgst_file->metadata, (size_t) (max_files + segment.nb_files) * sizeof(struct img_metadata));
+            if (metadata != NULL) imgst_file->metadata = metadata;
+            err = segments != NULL && metadata != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+        }
+        if (err == ERR_NONE) {
+            err = read_at(imgst_file, &imgst_file->metadata[max_files], size, next + sizeof(struct imgst_segment));
+        }
+        if (err == ERR_NONE) {
+            imgst_file->segments[imgst_file->nb_segments++] = (struct imgst_segment_info) { next, max_files, segment.nb_files };
+            max_files += segment.nb_files;
+            previous = next + sizeof(struct imgst_segment) + size;
+            next = segment.next;
+        }
+    }
+    M_EXIT_IF_ERR_DO_SOMETHING(err, free_segments(imgst_file));
+
+    // whatever the header says, should the crash have come between the chain and it
+    imgst_file->header.max_files = max_files;
+    return ERR_NONE;
+}
+
+void free_segments(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL_RET_VOID(imgst_file, "null argument in free_segments");
+    FREE(imgst_file->segments);
+    imgst_file->nb_segments = 0;
+}
+
+/********************************************************************//**
+ * Adds free metadata slots to an imgStore.
+ */
+int do_grow(imgst_file *imgst_file, uint32_t nb_files) {
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    lock_write(imgst_file);
+    const int err = grow_metadata(imgst_file, nb_files);
+    lock_release(imgst_file);
+    return err;
+}
+
+static int link_segment(imgst_file *imgst_file, uint64_t offset, uint32_t max_files) {
+    imgst_header header = imgst_file->header;
+    header.max_files = max_files;
+    if (imgst_file->nb_segments == 0) {
+        // the new type on disk before the chain, for a reader which checks it (see check_header)
+        strncpy(header.imgst_name, CAT_TXT_GROWN, MAX_IMGST_NAME);
+        header.imgst_name[MAX_IMGST_NAME] = '\0';
+        M_EXIT_IF_ERR(write_at(imgst_file, header.imgst_name, sizeof(header.imgst_name),
+                               offsetof(struct imgst_header, imgst_name)));
+        M_REQ(fdatasync(fileno(imgst_file->file)) == 0, ERR_IO, "unable to sync the store in do_grow");
+        header.table_files = table_files(&imgst_file->header);
+        header.next_segment = offset;
+    } else {
+        const struct imgst_segment_info *last = &imgst_file->segments[imgst_file->nb_segments - 1];
+        M_EXIT_IF_ERR(write_at(imgst_file, &offset, sizeof(offset), last->offset + offsetof(struct imgst_segment, next)));
+    }
+
+    // the fields which describe the layout only: the others are written (or logged) as usual
+    const size_t start = offsetof(struct imgst_header, max_files);
+    M_EXIT_IF_ERR(write_at(imgst_file, (const char *) &header + start, sizeof(struct imgst_header) - start, start));
+    M_REQ(fdatasync(fileno(imgst_file->file)) == 0, ERR_IO, "unable to sync the store in do_grow");
+
+    memcpy(imgst_file->header.imgst_name, header.imgst_name, sizeof(header.imgst_name));
+    imgst_file->header.max_files = header.max_files;
+    imgst_file->header.table_files = header.table_files;
+    imgst_file->header.next_segment = header.next_segment;
+    return ERR_NONE;
+}
+
+int grow_metadata(imgst_file *imgst_file, uint32_t nb_files) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    const uint32_t old_files = imgst_file->header.max_files;
+    M_REQ(nb_files > 0 && old_files <= MAX_GROWN_FILES && nb_files <= MAX_GROWN_FILES - old_files,
+          ERR_MAX_FILES, "too many files in do_grow");
+
+    // room in memory first: larger arrays are harmless should the rest fail
+    struct imgst_segment_info *segments = realloc(imgst_file->segments,
+                                                  (imgst_file->nb_segments + 1) * sizeof(struct imgst_segment_info));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(segments, ERR_OUT_OF_MEMORY);
+    imgst_file->segments = segments;
+
+    const size_t max_files = (size_t) old_files + nb_files;
+    img_metadata *metadata = NULL;
+    if (imgst_file->mapping != NULL) {
+        // a mapping cannot hold the segments next to the table: from now on, in memory
+        metadata = calloc(max_files, sizeof(struct img_metadata));
+        M_REQUIRE_NON_NULL_CUSTOM_ERR(metadata, ERR_OUT_OF_MEMORY);
+        memcpy(metadata, imgst_file->metadata, old_files * sizeof(struct img_metadata));
+    } else {
+        metadata = realloc(imgst_file->metadata, max_files * sizeof(struct img_metadata));
+        M_REQUIRE_NON_NULL_CUSTOM_ERR(metadata, ERR_OUT_OF_MEMORY);
+        memset(metadata + old_files, 0, nb_files * sizeof(struct img_metadata));
+        imgst_file->metadata = metadata;
+    }
+
+    // the empty segment on disk before anything references it
+    const imgst_segment segment = { 0, nb_files, 0 };
+    uint64_t offset = 0;
+    uint64_t slots_offset = 0;
+    int err = append_data(imgst_file, &segment, sizeof(struct imgst_segment), &offset);
+    if (err == ERR_NONE) err = append_data(imgst_file, metadata + old_files, nb_files * sizeof(struct img_metadata), &slots_offset);
+    if (err == ERR_NONE) err = fdatasync(fileno(imgst_file->file)) == 0 ? ERR_NONE : ERR_IO;
+    if (err == ERR_NONE) err = link_segment(imgst_file, offset, (uint32_t) max_files);
+    if (err != ERR_NONE) {
+        if (imgst_file->mapping != NULL) free(metadata);
+        return err;
+    }
+
+    if (imgst_file->mapping != NULL) {
+        munmap(imgst_file->mapping, imgst_file->mapping_size);
+        imgst_file->mapping = NULL;
+        imgst_file->metadata = metadata;
+    }
+    imgst_file->segments[imgst_file->nb_segments++] = (struct imgst_segment_info) { offset, old_files, nb_files };
+
+    // the indexes are sized for max_files
+    if (imgst_file->id_index != NULL) {
+        index_free(imgst_file);
+        M_EXIT_IF_ERR(index_build(imgst_file));
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file imgst_segment.h
+ * @brief imgStore library: metadata segments, through which the metadata table grows (see do_grow).
+ *
+ * In memory, the metadata of all segments forms one array of header.max_files entries;
+ * on disk, the first table_files ones follow the header, and the others lie in segments
+ * appended to the file, each one chained from the previous (from the header for the first).
+ * The chain is the authority on the number of slots: it is written in place, and synced,
+ * before anything uses the new slots, and it is not logged (see imgst_wal.h).
+ */
+#pragma once
+
+#include "imgStore.h"
+
+/**
+ * @brief Where a metadata segment lies, and which slots it holds.
+ */
+struct imgst_segment_info {
+    uint64_t offset;      // of its struct imgst_segment
+    uint32_t first_slot;
+    uint32_t nb_files;
+};
+
+/**
+ * @brief Number of metadata in the table right after the header.
+ *
+ * @param header Header of the database
+ * @return header->table_files, or header->max_files for a store which never grew
+ */
+uint32_t table_files(const imgst_header *header);
+
+/**
+ * @brief Checks that a header just read is of a type this library knows, and that its
+ *        table is not larger than MAX_GROWN_FILES, before anything is sized after it.
+ *
+ * The first do_grow sets imgst_name to CAT_TXT_GROWN, so that a reader which
+ * checks the type rejects a layout it does not know instead of misreading it.
+ *
+ * @param header Header of the database
+ * @return error code, ERR_NONE if the header is CAT_TXT or CAT_TXT_GROWN
+ */
+int check_header(const imgst_header *header);
+
+/**
+ * @brief Position in the file of the metadata of a slot.
+ *
+ * @param imgst_file Database being worked on
+ * @param slot Index of the metadata, less than header.max_files
+ * @param run If not NULL, set to the number of metadata stored contiguously from this one
+ * @return offset of the metadata in the file
+ */
+uint64_t metadata_offset(const imgst_file *imgst_file, uint32_t slot, uint32_t *run);
+
+/**
+ * @brief Reads the metadata segments chained after the table of a database just read in memory,
+ *        growing its metadata array and header.max_files accordingly.
+ *
+ * @param imgst_file Database whose header and table were just read (not mapped)
+ * @param file_size Size of its file
+ * @return error code, ERR_NONE if no error happened
+ */
+int read_segments(imgst_file *imgst_file, uint64_t file_size);
+
+/**
+ * @brief Frees the locations of the metadata segments of a database (does nothing if there is none).
+ *
+ * @param imgst_file Database being closed
+ */
+void free_segments(imgst_file *imgst_file);
+
+/**
+ * @brief Body of do_grow, the write lock being held.
+ *
+ * @param imgst_file Database opened for writing
+ * @param nb_files Number of slots to add
+ * @return error code, ERR_NONE if no error happened
+ */
+int grow_metadata(imgst_file *imgst_file, uint32_t nb_files);
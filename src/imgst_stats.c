@@ -0,0 +1,114 @@
+/**
+ * @file imgst_stats.c
+ * @brief imgStore library: do_stats implementation.
+ *
+ * The contents referenced by the valid images are gathered in one pass over the metadata,
+ * then sorted by offset: a shared content appears once per image referencing it, at the
+ * same offset, and whatever lies between the contents (and the metadata segments) is dead.
+ */
+
+#include "imgStore.h"
+#include "imgst_lock.h"
+#include "imgst_segment.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h> // for memset
+
+/**
+ * @brief A content referenced by a valid image, or a metadata segment.
+ */
+struct extent {
+    uint64_t offset;
+    uint32_t size;
+    bool segment;
+};
+
+/**
+ * @brief Increasing order of offsets of extents, for qsort.
+ */
+static int compare_extents(const void *a, const void *b);
+
+/**
+ * @brief Body of do_stats, the lock being held
+ */
+static int compute_stats(const imgst_file *imgst_file, imgst_stats *stats);
+
+/**
+ * @brief Accounts for an unreferenced range of the data region.
+ */
+static void add_hole(imgst_stats *stats, uint64_t start, uint64_t end);
+
+int do_stats(const imgst_file *imgst_file, imgst_stats *stats) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(stats);
+
+    lock_read(imgst_file);
+    const int err = compute_stats(imgst_file, stats);
+    lock_release(imgst_file);
+    return err;
+}
+
+static int compare_extents(const void *a, const void *b) {
+    const uint64_t first = ((const struct extent *) a)->offset;
+    const uint64_t second = ((const struct extent *) b)->offset;
+    return (first > second) - (first < second);
+}
+
+static void add_hole(imgst_stats *stats, uint64_t start, uint64_t end) {
+    if (end <= start) return;
+    stats->dead_bytes += end - start;
+    ++stats->nb_holes;
+    if (end - start > stats->largest_hole) stats->largest_hole = end - start;
+}
+
+static int compute_stats(const imgst_file *imgst_file, imgst_stats *stats) {
+    const uint32_t max_files = imgst_file->header.max_files;
+    struct extent *extents = calloc((size_t) max_files * NB_RES + imgst_file->nb_segments, sizeof(struct extent));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(extents, ERR_OUT_OF_MEMORY);
+    memset(stats, 0, sizeof(*stats));
+
+    size_t nb_extents = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        const img_metadata *metadata = &imgst_file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) {
+            ++stats->free_slots;
+            continue;
+        }
+        ++stats->num_files;
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->size[res] > 0 && metadata->offset[res] > 0) {
+                stats->live_bytes[res] += metadata->size[res];
+                extents[nb_extents++] = (struct extent) { metadata->offset[res], metadata->size[res], false };
+            }
+        }
+    }
+    for (uint32_t i = 0; i < imgst_file->nb_segments; ++i) {
+        const struct imgst_segment_info *segment = &imgst_file->segments[i];
+        extents[nb_extents++] = (struct extent) {
+            segment->offset, (uint32_t) (sizeof(struct imgst_segment) + segment->nb_files * sizeof(struct img_metadata)), true
+        };
+    }
+    qsort(extents, nb_extents, sizeof(struct extent), compare_extents);
+
+    const uint64_t data_start = sizeof(struct imgst_header) + (uint64_t) table_files(&imgst_file->header) * sizeof(struct img_metadata);
+    const uint64_t data_end = imgst_file->data_end > data_start ? imgst_file->data_end : data_start;
+    stats->data_bytes = data_end - data_start;
+
+    uint64_t end = data_start; // of the contents seen so far
+    for (size_t i = 0; i < nb_extents; ++i) {
+        if (i > 0 && extents[i].offset == extents[i - 1].offset) continue; // shared
+        add_hole(stats, end, extents[i].offset);
+        if (!extents[i].segment) stats->stored_bytes += extents[i].size;
+        if (extents[i].offset + extents[i].size > end) end = extents[i].offset + extents[i].size;
+    }
+    add_hole(stats, end, data_end);
+    free(extents);
+
+    for (int res = 0; res < NB_RES; ++res) {
+        stats->dedup_bytes += stats->live_bytes[res];
+    }
+    stats->dedup_bytes -= stats->stored_bytes;
+    return ERR_NONE;
+}
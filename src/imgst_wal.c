@@ -0,0 +1,578 @@
+/**
+ * @file imgst_wal.c
+ * @brief imgStore library: write-ahead log of the header and metadata updates.
+ *
+ * A group in the log is a sequence of records, each a struct wal_record followed by
+ * its payload (a struct img_metadata, or a struct imgst_header for the last one),
+ * then a payload-less WAL_COMMIT record whose slot is the number of records of the
+ * group and whose checksum is the FNV-1a hash of all their bytes.
+ *
+ * Committed groups are queued in memory under the write lock of the store. They reach
+ * the log in flushes, outside the lock: the first thread to flush writes and syncs the
+ * groups queued by all, the threads arriving meanwhile wait for it, then for the next
+ * flush if theirs started too late to include their groups.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, pread, pwrite, fdatasync, ftruncate
+
+#include "imgst_wal.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_segment.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WAL_SUFFIX ".wal"
+
+#define WAL_METADATA 1
+#define WAL_HEADER 2
+#define WAL_COMMIT 3
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct wal_record {
+    uint32_t type;
+    uint32_t slot;     // of a WAL_METADATA, number of records for a WAL_COMMIT
+    uint64_t checksum; // of a WAL_COMMIT, 0 otherwise
+};
+
+struct imgst_wal {
+    int fd;
+    uint64_t size; // of the log file
+
+    char *group; // records queued, but the header one
+    size_t group_len;
+    size_t group_capacity;
+    uint32_t nb_records;
+    bool header_queued;
+
+    uint32_t *dirty; // slots updated since the last checkpoint (possibly repeated)
+    size_t nb_dirty;
+    size_t dirty_capacity;
+    bool header_dirty;
+
+    pthread_mutex_t mutex; // of what follows
+    pthread_cond_t flushed;
+    char *queued; // committed groups, not yet in the log
+    size_t queued_len;
+    size_t queued_capacity;
+    char *writing; // groups being flushed, swapped with queued
+    size_t writing_capacity;
+    uint64_t nb_queued;  // bytes of groups committed since the log was enabled
+    uint64_t nb_durable; // bytes of them synced to the log
+    bool flushing;       // the log is being written, by a flush or a checkpoint
+    int err;             // of a failed flush: what the log holds is no longer known
+};
+
+/**
+ * @brief Allocates the path of the log of a store, to be freed by the caller.
+ *
+ * @param imgst_filename Path to the store
+ * @return the path, NULL if out of memory
+ */
+static char *wal_path(const char *imgst_filename);
+
+/**
+ * @brief Frees a log and what it holds (its file is not closed).
+ */
+static void wal_destroy(struct imgst_wal *wal);
+
+/**
+ * @brief Extends the FNV-1a hash of some bytes.
+ */
+static void wal_destroy(struct imgst_wal *wal) {
+    pthread_cond_destroy(&wal->flushed);
+    pthread_mutex_destroy(&wal->mutex);
+    free(wal->group);
+    free(wal->dirty);
+    free(wal->queued);
+    free(wal->writing);
+    free(wal);
+}
+
+static uint64_t checksum(uint64_t hash, const void *bytes, size_t size);
+
+/**
+ * @brief Appends a record and its payload to the queued group.
+ *
+ * @return error code, ERR_NONE if no error happened
+ */
+static int queue_record(struct imgst_wal *wal, uint32_t type, uint32_t slot, const void *payload, size_t size);
+
+/**
+ * @brief Syncs the image contents appended to the store, then appends some groups
+ *        to the log and syncs it.
+ *
+ * @param imgst_file Database whose log is enabled
+ * @param groups Groups to append
+ * @param size Number of bytes of the groups
+ * @param at Size of the log
+ * @return error code, ERR_NONE if no error happened
+ */
+static int append_groups(imgst_file *imgst_file, const char *groups, size_t size, uint64_t at);
+
+/**
+ * @brief Flushes the groups queued so far, or waits for the flush in progress to do so.
+ *
+ * @param imgst_file Database whose log is enabled, not locked by the caller
+ * @return error code, ERR_NONE if no error happened
+ */
+static int flush_queued(imgst_file *imgst_file);
+
+/**
+ * @brief Writes the header and the given metadata of imgst_file in place, and syncs the store.
+ *        For a shared mapping, the metadata is there already: the whole mapping is synced instead.
+ *
+ * @param imgst_file Database being written
+ * @param slots Slots to write
+ * @param nb_slots Number of slots
+ * @return error code, ERR_NONE if no error happened
+ */
+static int write_in_place(imgst_file *imgst_file, const uint32_t *slots, size_t nb_slots);
+
+/**
+ * @brief Writes the updates logged since the last checkpoint in place, then empties the log,
+ *        unless it holds less than min_size bytes.
+ *
+ * @param imgst_file Database whose log is enabled, whose queued groups were all flushed,
+ *        and on which no other commit can be queued meanwhile
+ * @param min_size Size of the log below which nothing is done
+ * @return error code, ERR_NONE if no error happened
+ */
+static int checkpoint(imgst_file *imgst_file, uint64_t min_size);
+
+/**
+ * @brief Applies in memory the committed groups of some log content.
+ *
+ * @param imgst_file Database to update
+ * @param log Content of the log
+ * @param size Size of the content
+ * @param slots Set to the slots updated, to be freed by the caller
+ * @param nb_slots Set to the number of slots updated
+ * @return error code, ERR_NONE if no error happened
+ */
+static int replay(imgst_file *imgst_file, const char *log, size_t size, uint32_t **slots, size_t *nb_slots);
+
+/**
+ * @brief Reads a whole file from its descriptor.
+ *
+ * @param fd File to read
+ * @param content Set to the content, to be freed by the caller
+ * @param size Set to the size of the content
+ * @return error code, ERR_NONE if no error happened
+ */
+static int read_log(int fd, char **content, size_t *size);
+
+int do_enable_wal(imgst_file *imgst_file, const char *imgst_filename) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_EXIT_NO_ERR_IF(imgst_file->wal != NULL);
+
+    char *path = wal_path(imgst_filename);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(path, ERR_OUT_OF_MEMORY);
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    M_REQ(fd >= 0, ERR_IO, "unable to open the log in do_enable_wal");
+
+    // a log left there was not recovered (store opened read-only)
+    struct stat log_stat;
+    M_EXIT_IF_ERR_DO_SOMETHING(fstat(fd, &log_stat) == 0 && log_stat.st_size == 0 ? ERR_NONE : ERR_IO, close(fd));
+
+    struct imgst_wal *wal = calloc(1, sizeof(struct imgst_wal));
+    M_EXIT_IF_ERR_DO_SOMETHING(wal == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE, close(fd));
+    wal->fd = fd;
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->flushed, NULL);
+
+    // stores into a shared mapping would reach the file before being logged
+    if (imgst_file->mapping != NULL && imgst_file->mapping_shared) {
+        M_EXIT_IF_ERR_DO_SOMETHING(msync(imgst_file->mapping, imgst_file->mapping_size, MS_SYNC) == 0
+                                   && mmap(imgst_file->mapping, imgst_file->mapping_size, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_FIXED, fileno(imgst_file->file), 0) != MAP_FAILED
+                                   ? ERR_NONE : ERR_IO, GROUP_CALLS(close(fd), wal_destroy(wal)));
+        imgst_file->mapping_shared = false;
+    }
+
+    imgst_file->wal = wal;
+    return ERR_NONE;
+}
+
+int do_sync(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_EXIT_NO_ERR_IF(imgst_file->wal == NULL);
+
+    lock_write(imgst_file);
+    const int err = wal_commit(imgst_file);
+    lock_release(imgst_file);
+    M_EXIT_IF_ERR(err);
+    return wal_flush(imgst_file);
+}
+
+int wal_log_header(imgst_file *imgst_file) {
+    imgst_file->wal->header_queued = true;
+    imgst_file->wal->header_dirty = true;
+    return ERR_NONE;
+}
+
+int wal_log_metadata(imgst_file *imgst_file, uint32_t slot) {
+    struct imgst_wal *wal = imgst_file->wal;
+
+    if (wal->nb_dirty == wal->dirty_capacity) {
+        const size_t capacity = wal->dirty_capacity == 0 ? IMGST_WAL_GROUP : 2 * wal->dirty_capacity;
+        uint32_t *dirty = realloc(wal->dirty, capacity * sizeof(uint32_t));
+        M_REQUIRE_NON_NULL_CUSTOM_ERR(dirty, ERR_OUT_OF_MEMORY);
+        wal->dirty = dirty;
+        wal->dirty_capacity = capacity;
+    }
+
+    M_EXIT_IF_ERR(queue_record(wal, WAL_METADATA, slot, &imgst_file->metadata[slot], sizeof(struct img_metadata)));
+    wal->dirty[wal->nb_dirty++] = slot;
+    return ERR_NONE;
+}
+
+int wal_commit(imgst_file *imgst_file) {
+    struct imgst_wal *wal = imgst_file->wal;
+    M_EXIT_NO_ERR_IF(wal == NULL || (wal->nb_records == 0 && !wal->header_queued));
+
+    if (wal->header_queued) {
+        M_EXIT_IF_ERR(queue_record(wal, WAL_HEADER, 0, &imgst_file->header, sizeof(struct imgst_header)));
+    }
+    const struct wal_record commit = {
+        WAL_COMMIT, wal->nb_records, checksum(FNV_OFFSET_BASIS, wal->group, wal->group_len)
+    };
+    M_EXIT_IF_ERR(queue_record(wal, WAL_COMMIT, 0, NULL, 0));
+    memcpy(wal->group + wal->group_len - sizeof(struct wal_record), &commit, sizeof(struct wal_record));
+
+    pthread_mutex_lock(&wal->mutex);
+    int err = wal->err;
+    const size_t needed = wal->queued_len + wal->group_len;
+    if (err == ERR_NONE && needed > wal->queued_capacity) {
+        size_t capacity = wal->queued_capacity == 0 ? wal->group_capacity : wal->queued_capacity;
+        while (capacity < needed) capacity *= 2;
+        char *queued = realloc(wal->queued, capacity);
+        if (queued == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            wal->queued = queued;
+            wal->queued_capacity = capacity;
+        }
+    }
+    if (err == ERR_NONE) {
+        memcpy(wal->queued + wal->queued_len, wal->group, wal->group_len);
+        wal->queued_len = needed;
+        wal->nb_queued += wal->group_len;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    wal->group_len = 0;
+    wal->nb_records = 0;
+    wal->header_queued = false;
+    return err;
+}
+
+int wal_flush(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    struct imgst_wal *wal = imgst_file->wal;
+    M_EXIT_NO_ERR_IF(wal == NULL);
+
+    M_EXIT_IF_ERR(flush_queued(imgst_file));
+    pthread_mutex_lock(&wal->mutex);
+    const bool full = wal->size >= IMGST_WAL_CHECKPOINT;
+    pthread_mutex_unlock(&wal->mutex);
+    M_EXIT_NO_ERR_IF(!full);
+
+    // no commit can be queued under the shared lock: once flushed, what is in memory is in the log
+    lock_read(imgst_file);
+    int err = flush_queued(imgst_file);
+    if (err == ERR_NONE) err = checkpoint(imgst_file, IMGST_WAL_CHECKPOINT);
+    lock_release(imgst_file);
+    return err;
+}
+
+bool wal_pending(imgst_file *imgst_file) {
+    struct imgst_wal *wal = imgst_file->wal;
+    if (wal == NULL) return false;
+
+    pthread_mutex_lock(&wal->mutex);
+    const bool pending = wal->nb_durable < wal->nb_queued;
+    pthread_mutex_unlock(&wal->mutex);
+    return pending;
+}
+
+int wal_recover(const char *imgst_filename, imgst_file *imgst_file, bool writable) {
+    char *path = wal_path(imgst_filename);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(path, ERR_OUT_OF_MEMORY);
+    const int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    free(path);
+    M_EXIT_NO_ERR_IF(fd < 0 && errno == ENOENT);
+    M_REQ(fd >= 0, ERR_IO, "unable to open the log in wal_recover");
+
+    char *log = NULL;
+    size_t size = 0;
+    uint32_t *slots = NULL;
+    size_t nb_slots = 0;
+    int err = read_log(fd, &log, &size);
+    if (err == ERR_NONE) {
+        err = replay(imgst_file, log, size, &slots, &nb_slots);
+    }
+    if (err == ERR_NONE && writable && size > 0) {
+        err = write_in_place(imgst_file, slots, nb_slots);
+        if (err == ERR_NONE && (ftruncate(fd, 0) != 0 || fdatasync(fd) != 0)) err = ERR_IO;
+    }
+
+    free(slots);
+    free(log);
+    close(fd);
+    return err;
+}
+
+int wal_remove(const char *imgst_filename) {
+    char *path = wal_path(imgst_filename);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(path, ERR_OUT_OF_MEMORY);
+    const int err = unlink(path) == 0 || errno == ENOENT ? ERR_NONE : ERR_IO;
+    free(path);
+    return err;
+}
+
+int wal_free(imgst_file *imgst_file) {
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_EXIT_NO_ERR_IF(imgst_file->wal == NULL);
+
+    int err = wal_commit(imgst_file);
+    if (err == ERR_NONE) {
+        err = flush_queued(imgst_file);
+    }
+    if (err == ERR_NONE) {
+        err = checkpoint(imgst_file, 0);
+    }
+
+    close(imgst_file->wal->fd);
+    wal_destroy(imgst_file->wal);
+    imgst_file->wal = NULL;
+    return err;
+}
+
+static char *wal_path(const char *imgst_filename) {
+    char *path = malloc(strlen(imgst_filename) + sizeof(WAL_SUFFIX));
+    if (path != NULL) {
+        strcpy(path, imgst_filename);
+        strcat(path, WAL_SUFFIX);
+    }
+    return path;
+}
+
+static uint64_t checksum(uint64_t hash, const void *bytes, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ ((const unsigned char *) bytes)[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static int queue_record(struct imgst_wal *wal, uint32_t type, uint32_t slot, const void *payload, size_t size) {
+    const size_t needed = wal->group_len + sizeof(struct wal_record) + size;
+    if (needed > wal->group_capacity) {
+        size_t capacity = wal->group_capacity == 0 ? IMGST_WAL_GROUP * sizeof(struct img_metadata) : wal->group_capacity;
+        while (capacity < needed) capacity *= 2;
+        char *group = realloc(wal->group, capacity);
+        M_REQUIRE_NON_NULL_CUSTOM_ERR(group, ERR_OUT_OF_MEMORY);
+        wal->group = group;
+        wal->group_capacity = capacity;
+    }
+
+    const struct wal_record record = { type, slot, 0 };
+    memcpy(wal->group + wal->group_len, &record, sizeof(struct wal_record));
+    if (size > 0) {
+        memcpy(wal->group + wal->group_len + sizeof(struct wal_record), payload, size);
+    }
+    wal->group_len = needed;
+    if (type != WAL_COMMIT) ++wal->nb_records;
+    return ERR_NONE;
+}
+
+static int append_groups(imgst_file *imgst_file, const char *groups, size_t size, uint64_t at) {
+    const int fd = imgst_file->wal->fd;
+
+    // the image contents the records point to must be on disk before them
+    M_REQ(fdatasync(fileno(imgst_file->file)) == 0, ERR_IO, "unable to sync the store in wal_flush");
+    for (size_t done = 0; done < size;) {
+        const ssize_t put = pwrite(fd, groups + done, size - done, (off_t) (at + done));
+        if (put < 0 && errno == EINTR) continue;
+        M_REQ(put > 0, ERR_IO, "unable to append to the log in wal_flush");
+        done += (size_t) put;
+    }
+    M_REQ(fdatasync(fd) == 0, ERR_IO, "unable to sync the log in wal_flush");
+    return ERR_NONE;
+}
+
+static int flush_queued(imgst_file *imgst_file) {
+    struct imgst_wal *wal = imgst_file->wal;
+
+    pthread_mutex_lock(&wal->mutex);
+    const uint64_t target = wal->nb_queued;
+    while (wal->err == ERR_NONE && wal->nb_durable < target) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed, &wal->mutex);
+            continue;
+        }
+
+        // takes all the groups queued, by this thread and the others
+        wal->flushing = true;
+        char *groups = wal->queued;
+        const size_t capacity = wal->queued_capacity;
+        const size_t size = wal->queued_len;
+        const uint64_t end = wal->nb_queued;
+        const uint64_t at = wal->size;
+        wal->queued = wal->writing;
+        wal->queued_capacity = wal->writing_capacity;
+        wal->queued_len = 0;
+        wal->writing = groups;
+        wal->writing_capacity = capacity;
+        pthread_mutex_unlock(&wal->mutex);
+
+        const int err = append_groups(imgst_file, groups, size, at);
+
+        pthread_mutex_lock(&wal->mutex);
+        if (err == ERR_NONE) {
+            wal->size += size;
+            wal->nb_durable = end;
+        } else {
+            wal->err = err;
+        }
+        wal->flushing = false;
+        pthread_cond_broadcast(&wal->flushed);
+    }
+    const int err = wal->err;
+    pthread_mutex_unlock(&wal->mutex);
+    return err;
+}
+
+static int write_in_place(imgst_file *imgst_file, const uint32_t *slots, size_t nb_slots) {
+    M_EXIT_IF_ERR(write_at(imgst_file, &imgst_file->header, sizeof(struct imgst_header), 0));
+
+    if (imgst_file->mapping != NULL && imgst_file->mapping_shared) {
+        M_REQ(msync(imgst_file->mapping, imgst_file->mapping_size, MS_SYNC) == 0, ERR_IO, "msync failed");
+    } else {
+        for (size_t i = 0; i < nb_slots; ++i) {
+            const uint64_t offset = metadata_offset(imgst_file, slots[i], NULL);
+            M_EXIT_IF_ERR(write_at(imgst_file, &imgst_file->metadata[slots[i]], sizeof(struct img_metadata), offset));
+        }
+    }
+
+    M_REQ(fdatasync(fileno(imgst_file->file)) == 0, ERR_IO, "unable to sync the store");
+    return ERR_NONE;
+}
+
+static int checkpoint(imgst_file *imgst_file, uint64_t min_size) {
+    struct imgst_wal *wal = imgst_file->wal;
+
+    // another thread may be checkpointing too, or have done it
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->flushing) pthread_cond_wait(&wal->flushed, &wal->mutex);
+    const bool needed = wal->err == ERR_NONE && wal->size >= min_size && (wal->nb_dirty > 0 || wal->header_dirty);
+    wal->flushing = needed;
+    int err = wal->err;
+    pthread_mutex_unlock(&wal->mutex);
+    if (!needed) return err;
+
+    err = write_in_place(imgst_file, wal->dirty, wal->nb_dirty);
+    if (err == ERR_NONE && (ftruncate(wal->fd, 0) != 0 || fdatasync(wal->fd) != 0)) err = ERR_IO;
+
+    pthread_mutex_lock(&wal->mutex);
+    if (err == ERR_NONE) {
+        wal->size = 0;
+        wal->nb_dirty = 0;
+        wal->header_dirty = false;
+    } else {
+        wal->err = err;
+    }
+    wal->flushing = false;
+    pthread_cond_broadcast(&wal->flushed);
+    pthread_mutex_unlock(&wal->mutex);
+    return err;
+}
+
+static int replay(imgst_file *imgst_file, const char *log, size_t size, uint32_t **slots, size_t *nb_slots) {
+    *slots = NULL;
+    *nb_slots = 0;
+    M_EXIT_NO_ERR_IF(size == 0);
+
+    // at most one slot per metadata record
+    *slots = calloc(size / (sizeof(struct wal_record) + sizeof(struct img_metadata)) + 1, sizeof(uint32_t));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(*slots, ERR_OUT_OF_MEMORY);
+
+    size_t group_start = 0;
+    size_t pos = 0;
+    uint32_t nb_records = 0;
+    struct wal_record record;
+    while (pos + sizeof(struct wal_record) <= size) {
+        memcpy(&record, log + pos, sizeof(struct wal_record));
+
+        if (record.type == WAL_COMMIT) {
+            if (record.slot != nb_records
+                || record.checksum != checksum(FNV_OFFSET_BASIS, log + group_start, pos - group_start)) {
+                break; // torn write
+            }
+
+            // the group is complete: apply it
+            for (size_t at = group_start; at < pos;) {
+                memcpy(&record, log + at, sizeof(struct wal_record));
+                at += sizeof(struct wal_record);
+                if (record.type == WAL_HEADER) {
+                    // the layout is written in place, never logged (see imgst_segment.h)
+                    const imgst_header layout = imgst_file->header;
+                    memcpy(&imgst_file->header, log + at, sizeof(struct imgst_header));
+                    memcpy(imgst_file->header.imgst_name, layout.imgst_name, sizeof(layout.imgst_name));
+                    imgst_file->header.max_files = layout.max_files;
+                    imgst_file->header.table_files = layout.table_files;
+                    imgst_file->header.next_segment = layout.next_segment;
+                    at += sizeof(struct imgst_header);
+                } else {
+                    M_REQ(record.slot < imgst_file->header.max_files, ERR_IO, "invalid slot in the log");
+                    memcpy(&imgst_file->metadata[record.slot], log + at, sizeof(struct img_metadata));
+                    (*slots)[(*nb_slots)++] = record.slot;
+                    at += sizeof(struct img_metadata);
+                }
+            }
+
+            pos += sizeof(struct wal_record);
+            group_start = pos;
+            nb_records = 0;
+        } else {
+            const size_t payload = record.type == WAL_HEADER ? sizeof(struct imgst_header)
+                                   : record.type == WAL_METADATA ? sizeof(struct img_metadata) : size;
+            if (pos + sizeof(struct wal_record) + payload > size) break; // torn write
+            pos += sizeof(struct wal_record) + payload;
+            ++nb_records;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int read_log(int fd, char **content, size_t *size) {
+    struct stat log_stat;
+    M_REQ(fstat(fd, &log_stat) == 0, ERR_IO, "unable to stat the log");
+
+    const size_t log_size = (size_t) log_stat.st_size;
+    char *log = malloc(log_size + 1);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(log, ERR_OUT_OF_MEMORY);
+
+    for (size_t done = 0; done < log_size;) {
+        const ssize_t got = pread(fd, log + done, log_size - done, (off_t) done);
+        if (got < 0 && errno == EINTR) continue;
+        M_REQ_CLEAN(got > 0, ERR_IO, "unable to read the log", 1, log);
+        done += (size_t) got;
+    }
+
+    *content = log;
+    *size = log_size;
+    return ERR_NONE;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file imgst_wal.h
+ * @brief imgStore library: write-ahead log of the header and metadata updates.
+ *
+ * The log is opt-in (see do_enable_wal) and lives next to the store, in
+ * "<imgst_filename>.wal". While it is enabled, write_header and write_metadata
+ * no longer write in place: they queue records, which each mutating operation
+ * (insert, delete, lazy resize, compaction step) commits as one group when it
+ * completes, the group ending with a commit record holding a checksum of the group.
+ * Committing only queues the group, under the write lock; the operation then
+ * flushes it once the lock is released (see wal_flush), in one write and sync of
+ * the log shared by all the groups queued meanwhile. The updates reach the store
+ * itself at checkpoints, once the log exceeds IMGST_WAL_CHECKPOINT bytes.
+ *
+ * On opening, the committed groups of a log left by a crash are replayed;
+ * a group without a valid commit record is ignored, so that each group is
+ * applied completely or not at all.
+ */
+#pragma once
+
+#include "imgStore.h"
+
+#include <stdbool.h>
+
+#ifndef IMGST_WAL_GROUP
+/**
+ * Number of metadata records the queued group has room for at first (it grows as needed).
+ */
+#define IMGST_WAL_GROUP 64
+#endif
+
+#ifndef IMGST_WAL_CHECKPOINT
+/**
+ * Size of the log, in bytes, above which a commit is followed by a checkpoint.
+ */
+#define IMGST_WAL_CHECKPOINT (1 << 20)
+#endif
+
+/**
+ * @brief Queues the current header of imgst_file, to be logged at the next commit.
+ *
+ * @param imgst_file Database whose log is enabled, locked for writing
+ * @return error code, ERR_NONE if no error happened
+ */
+int wal_log_header(imgst_file *imgst_file);
+
+/**
+ * @brief Queues the current metadata of a slot, to be logged at the next commit.
+ *
+ * @param imgst_file Database whose log is enabled, locked for writing
+ * @param slot Index of the metadata updated
+ * @return error code, ERR_NONE if no error happened
+ */
+int wal_log_metadata(imgst_file *imgst_file, uint32_t slot);
+
+/**
+ * @brief Ends the group of the queued records with its commit record, and queues it
+ *        to be flushed. Called once a whole operation is queued, so that a crash never
+ *        leaves half of it in the store.
+ *
+ * @param imgst_file Database locked for writing (nothing to do if its log is not enabled)
+ * @return error code, ERR_NONE if no error happened
+ */
+int wal_commit(imgst_file *imgst_file);
+
+/**
+ * @brief Makes the groups committed so far durable: syncs the image contents appended
+ *        to the store, then appends the groups to the log and syncs it. A thread finding
+ *        a flush in progress waits for it rather than syncing again, then flushes what
+ *        was committed meanwhile, for itself and the other waiting threads.
+ *        Checkpoints if the log got too long.
+ *
+ * @param imgst_file Database not locked by the caller (nothing to do if its log is not enabled)
+ * @return error code, ERR_NONE if no error happened; once a flush failed, all the
+ *         following ones fail too
+ */
+int wal_flush(imgst_file *imgst_file);
+
+/**
+ * @brief Tells whether groups were committed but not flushed yet.
+ *
+ * @param imgst_file Database (none if its log is not enabled)
+ * @return true if some committed group is not durable yet
+ */
+bool wal_pending(imgst_file *imgst_file);
+
+/**
+ * @brief Replays the committed groups of the log of a store just read, if any,
+ *        before its indexes are built. If the store is writable, the replayed updates
+ *        are written in place and the log is emptied.
+ *
+ * @param imgst_filename Path to the store
+ * @param imgst_file Database whose header and metadata were just read or mapped
+ * @param writable Whether the store was opened for writing
+ * @return error code, ERR_NONE if no error happened
+ */
+int wal_recover(const char *imgst_filename, imgst_file *imgst_file, bool writable);
+
+/**
+ * @brief Removes the log of a store, if any (when a new store replaces it).
+ *
+ * @param imgst_filename Path to the store
+ * @return error code, ERR_NONE if no error happened
+ */
+int wal_remove(const char *imgst_filename);
+
+/**
+ * @brief Commits and flushes the queued records, checkpoints and closes the log
+ *        (does nothing if the log was not enabled).
+ *
+ * @param imgst_file Database still open, no longer used by other threads
+ * @return error code, ERR_NONE if no error happened
+ */
+int wal_free(imgst_file *imgst_file);
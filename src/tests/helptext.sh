@@ -18,10 +18,16 @@ helptxt_next="$helptxt_next
   read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:
       read an image from the imgStore and save it to a file.
       default resolution is \"original\".
-  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore."
+  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.
+  insert-dir <imgstore_filename> <dirname>: insert all the images of a directory in the imgStore,
+      with their file names without extension as imgIDs.
+      if dirname is \"-\", reads lines \"<imgID> <filename>\" from the standard input instead."
 helptxt_next="$helptxt_next
   delete <imgstore_filename> <imgID>: delete image imgID from imgStore."
 helptxt_next="$helptxt_next
-  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore."
+  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.
+  compact <imgstore_filename> [budget]: compact imgStore in place, moving at most budget KiB per step.
+      default budget is 4096 KiB.
+  stats <imgstore_filename>: display the space used by live, shared and dead image contents."
 helptxt="$helptxt
 $helptxt_next"
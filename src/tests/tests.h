@@ -12,6 +12,7 @@
 #include <check.h>
 
 #include "error.h"
+#include "imgStore.h"
 
 #define ck_assert_invalid_arg(value) \
     ck_assert_int_eq(value, ERR_INVALID_ARGUMENT)
@@ -47,3 +48,23 @@ int main(void) \
  \
     return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE; \
 }
+
+/**
+ * @brief Creates an empty imgStore with the default resized resolutions and closes it.
+ *
+ * @param path Name of the imgStore file to create
+ * @param max_files Number of metadata slots
+ * @return the error code of do_create
+ */
+static inline int create_test_store(const char *path, uint32_t max_files)
+{
+    imgst_file created = {
+        NULL,
+        { .max_files = max_files,
+          .res_resized = { DEFAULT_RES_THUMB, DEFAULT_RES_THUMB, DEFAULT_RES_SMALL, DEFAULT_RES_SMALL } },
+        NULL
+    };
+    const int err = do_create(path, &created);
+    if (err == ERR_NONE) do_close(&created);
+    return err;
+}
@@ -0,0 +1,175 @@
+/**
+ * @file unit-test-blob_cache.c
+ * @brief Unit tests for the LRU cache of image contents of the server
+ *
+ * @date 2021
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "blob_cache.h"
+
+#define BLOB_SIZE 100
+
+// ------------------------------------------------------------
+/**
+ * @brief Caches a content of BLOB_SIZE bytes filled with fill, under key (slot, RES_THUMB, version).
+ */
+static void put(struct blob_cache *cache, uint32_t slot, uint64_t version, char fill)
+{
+    struct blob *blob = blob_alloc(BLOB_SIZE);
+    ck_assert_ptr_nonnull(blob);
+    blob->key = (struct blob_key) { slot, RES_THUMB, version };
+    memset(blob->SHA, fill, SHA256_DIGEST_LENGTH);
+    memset(blob->data, fill, BLOB_SIZE);
+    blob_cache_put(cache, blob);
+    blob_release(blob);
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Tells whether a content is cached under key (slot, RES_THUMB, version), checking it holds fill.
+ */
+static int cached(struct blob_cache *cache, uint32_t slot, uint64_t version, char fill)
+{
+    const struct blob_key key = { slot, RES_THUMB, version };
+    const struct blob *blob = blob_cache_get(cache, &key);
+    if (blob == NULL) return 0;
+    ck_assert_int_eq(blob->size, BLOB_SIZE);
+    ck_assert_int_eq(blob->data[0], fill);
+    ck_assert_int_eq(blob->data[BLOB_SIZE - 1], fill);
+    blob_release(blob);
+    return 1;
+}
+
+// ======================================================================
+START_TEST(hits_and_misses)
+{
+    struct blob_cache *cache = NULL;
+    ck_assert_err_none(blob_cache_create(10 * BLOB_SIZE, 1, &cache));
+
+    put(cache, 1, 0, 'a');
+    put(cache, 2, 0, 'b');
+    ck_assert(cached(cache, 1, 0, 'a'));
+    ck_assert(cached(cache, 2, 0, 'b'));
+    ck_assert(!cached(cache, 3, 0, 'c'));
+    ck_assert(!cached(cache, 1, 1, 'a')); // another version of the database
+
+    const struct blob_key small = { 1, RES_SMALL, 0 };
+    ck_assert_ptr_null(blob_cache_get(cache, &small));
+
+    // the same key replaces the former content
+    put(cache, 1, 0, 'z');
+    ck_assert(cached(cache, 1, 0, 'z'));
+
+    struct blob_cache_stats stats;
+    blob_cache_get_stats(cache, &stats);
+    ck_assert_int_eq(stats.hits, 3);
+    ck_assert_int_eq(stats.misses, 3);
+    ck_assert_int_eq(stats.entries, 2);
+    ck_assert_int_eq(stats.bytes, 2 * BLOB_SIZE);
+    ck_assert_int_eq(stats.budget, 10 * BLOB_SIZE);
+
+    blob_cache_destroy(cache);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(least_recently_used_are_evicted)
+{
+    struct blob_cache *cache = NULL;
+    ck_assert_err_none(blob_cache_create(3 * BLOB_SIZE, 1, &cache));
+
+    put(cache, 1, 0, 'a');
+    put(cache, 2, 0, 'b');
+    put(cache, 3, 0, 'c');
+    ck_assert(cached(cache, 1, 0, 'a')); // 2 is now the least recently used
+    put(cache, 4, 0, 'd');
+
+    ck_assert(!cached(cache, 2, 0, 'b'));
+    ck_assert(cached(cache, 1, 0, 'a'));
+    ck_assert(cached(cache, 3, 0, 'c'));
+    ck_assert(cached(cache, 4, 0, 'd'));
+
+    struct blob_cache_stats stats;
+    blob_cache_get_stats(cache, &stats);
+    ck_assert_int_eq(stats.evictions, 1);
+    ck_assert_int_eq(stats.bytes, 3 * BLOB_SIZE);
+
+    // a content larger than the budget is not cached
+    struct blob *large = blob_alloc(4 * BLOB_SIZE);
+    ck_assert_ptr_nonnull(large);
+    large->key = (struct blob_key) { 5, RES_ORIG, 0 };
+    blob_cache_put(cache, large);
+    ck_assert_ptr_null(blob_cache_get(cache, &large->key));
+    blob_release(large);
+
+    blob_cache_destroy(cache);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(evicted_contents_stay_valid_while_referenced)
+{
+    struct blob_cache *cache = NULL;
+    ck_assert_err_none(blob_cache_create(BLOB_SIZE, 1, &cache));
+
+    put(cache, 1, 0, 'a');
+    const struct blob_key key = { 1, RES_THUMB, 0 };
+    const struct blob *held = blob_cache_get(cache, &key);
+    ck_assert_ptr_nonnull(held);
+
+    put(cache, 2, 0, 'b'); // evicts the held one
+    ck_assert(!cached(cache, 1, 0, 'a'));
+    ck_assert_int_eq(held->data[BLOB_SIZE / 2], 'a');
+    blob_release(held);
+
+    blob_cache_destroy(cache);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(many_entries_over_shards)
+{
+    struct blob_cache *cache = NULL;
+    ck_assert_err_none(blob_cache_create(4000 * BLOB_SIZE, 4, &cache));
+
+    for (uint32_t slot = 0; slot < 1000; ++slot) {
+        put(cache, slot, 7, (char) ('a' + slot % 26));
+    }
+    for (uint32_t slot = 0; slot < 1000; ++slot) {
+        ck_assert(cached(cache, slot, 7, (char) ('a' + slot % 26)));
+    }
+
+    struct blob_cache_stats stats;
+    blob_cache_get_stats(cache, &stats);
+    ck_assert_int_eq(stats.entries, 1000);
+    ck_assert_int_eq(stats.hits, 1000);
+
+    ck_assert_invalid_arg(blob_cache_create(BLOB_SIZE, 0, &cache));
+    ck_assert_invalid_arg(blob_cache_create(BLOB_SIZE, 1, NULL));
+    blob_cache_destroy(cache);
+}
+END_TEST
+
+// ======================================================================
+Suite* blob_cache_test_suite()
+{
+    Suite* s = suite_create("Tests of the blob cache");
+
+    Add_Case(s, tc1, "blob cache tests");
+    tcase_add_test(tc1, hits_and_misses);
+    tcase_add_test(tc1, least_recently_used_are_evicted);
+    tcase_add_test(tc1, evicted_contents_stay_valid_while_referenced);
+    tcase_add_test(tc1, many_entries_over_shards);
+
+    return s;
+}
+
+TEST_SUITE(blob_cache_test_suite)
@@ -0,0 +1,293 @@
+/**
+ * @file unit-test-compact.c
+ * @brief Unit tests for the in-place compaction of the image contents (see do_compact)
+ *
+ * Contents are laid out with holes (deleted images), shared (deduplicated) contents
+ * and resized versions, then compacted by small steps while a reader thread keeps
+ * reading them; they shall all read the same before, during and after, the file
+ * ending right after them. Pinned contents (see do_pin) are not copied over.
+ *
+ * @date 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L // for stat
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_io.h"
+#include "imgst_index.h"
+
+#define STORE_FILE "unit-test-compact.imgst"
+#define MAX_FILES 16
+#define BUDGET 256
+
+#define DATA_START (sizeof(struct imgst_header) + MAX_FILES * sizeof(struct img_metadata))
+
+// ======================================================================
+struct content {
+    const char *img_id;
+    int resolution;
+    uint32_t size;
+    char fill;
+};
+
+// what remains once "dead" and "gone" are deleted: "copy" shares the content of "third"
+static const struct content live[] = {
+    { "second", RES_ORIG, 5000, 'b' },
+    { "second", RES_THUMB, 50, 't' },
+    { "third", RES_ORIG, 300, 'c' },
+    { "copy", RES_ORIG, 300, 'c' },
+};
+#define NB_LIVE (sizeof(live) / sizeof(live[0]))
+#define LIVE_BYTES (5000 + 50 + 300)
+
+struct reader {
+    imgst_file *store;
+    atomic_int stop;
+    int errors;
+    long reads;
+};
+
+// ------------------------------------------------------------
+static void append_content(imgst_file *store, uint32_t slot, const char *img_id, int resolution, uint32_t size, char fill)
+{
+    char *buffer = malloc(size);
+    ck_assert_ptr_nonnull(buffer);
+    memset(buffer, fill, size);
+
+    img_metadata *metadata = &store->metadata[slot];
+    ck_assert_err_none(append_data(store, buffer, size, &metadata->offset[resolution]));
+    metadata->size[resolution] = size;
+    if (metadata->is_valid == EMPTY) {
+        strncpy(metadata->img_id, img_id, MAX_IMG_ID);
+        metadata->is_valid = NON_EMPTY;
+        ++store->header.num_files;
+        index_insert(store, slot);
+    }
+    ck_assert_err_none(write_metadata(store, slot));
+    free(buffer);
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Lays out: dead (100), second (5000), gone (4000), third (300), thumbnail of second (50),
+ *        then makes copy share the content of third and deletes dead and gone.
+ */
+static void fill_store(imgst_file *store)
+{
+    append_content(store, 0, "dead", RES_ORIG, 100, 'a');
+    append_content(store, 1, "second", RES_ORIG, 5000, 'b');
+    append_content(store, 2, "gone", RES_ORIG, 4000, 'd');
+    append_content(store, 3, "third", RES_ORIG, 300, 'c');
+    append_content(store, 1, "second", RES_THUMB, 50, 't');
+
+    store->metadata[4] = store->metadata[3];
+    strncpy(store->metadata[4].img_id, "copy", MAX_IMG_ID);
+    ++store->header.num_files;
+    index_insert(store, 4);
+    ck_assert_err_none(write_metadata(store, 4));
+
+    ck_assert_err_none(do_delete("dead", store));
+    ck_assert_err_none(do_delete("gone", store));
+}
+
+// ------------------------------------------------------------
+static int content_matches(imgst_file *store, const struct content *content)
+{
+    char *buffer = NULL;
+    uint32_t size = 0;
+    if (do_read(content->img_id, content->resolution, &buffer, &size, store) != ERR_NONE) return 0;
+
+    int matches = size == content->size;
+    for (uint32_t i = 0; matches && i < size; ++i) {
+        matches = buffer[i] == content->fill;
+    }
+    free(buffer);
+    return matches;
+}
+
+// ------------------------------------------------------------
+static void *read_contents(void *arg)
+{
+    struct reader *reader = arg;
+    while (!atomic_load(&reader->stop)) {
+        for (size_t i = 0; i < NB_LIVE; ++i) {
+            if (!content_matches(reader->store, &live[i])) ++reader->errors;
+            ++reader->reads;
+        }
+    }
+    return NULL;
+}
+
+// ------------------------------------------------------------
+static void check_packed(imgst_file *store)
+{
+    for (size_t i = 0; i < NB_LIVE; ++i) {
+        ck_assert(content_matches(store, &live[i]));
+    }
+    ck_assert_int_eq(store->metadata[3].offset[RES_ORIG], store->metadata[4].offset[RES_ORIG]);
+    ck_assert_int_eq(store->data_end, DATA_START + LIVE_BYTES);
+
+    struct stat file_stat;
+    ck_assert_int_eq(stat(STORE_FILE, &file_stat), 0);
+    ck_assert_int_eq(file_stat.st_size, DATA_START + LIVE_BYTES);
+}
+
+// ======================================================================
+START_TEST(compaction_by_steps)
+{
+    // read in memory, mapped, mapped with a write-ahead log
+    for (int mode = 0; mode < 3; ++mode) {
+        ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+        imgst_file store;
+        ck_assert_err_none(mode == 0 ? do_open(STORE_FILE, "r+b", &store) : do_open_mapped(STORE_FILE, "r+b", &store));
+        if (mode == 2) ck_assert_err_none(do_enable_wal(&store, STORE_FILE));
+        ck_assert_err_none(do_enable_locking(&store));
+        fill_store(&store);
+
+        struct reader reader = { &store, 0, 0, 0 };
+        pthread_t thread;
+        ck_assert_int_eq(pthread_create(&thread, NULL, read_contents, &reader), 0);
+
+        bool done = false;
+        int steps = 0;
+        while (!done) {
+            ck_assert_err_none(do_compact(&store, BUDGET, &done));
+            ck_assert_int_lt(++steps, 100);
+        }
+        ck_assert_int_gt(steps, 2); // bounded by the budget
+
+        atomic_store(&reader.stop, 1);
+        pthread_join(thread, NULL);
+        ck_assert_int_eq(reader.errors, 0);
+        ck_assert_int_gt(reader.reads, 0);
+
+        check_packed(&store);
+        ck_assert_err_none(do_compact(&store, BUDGET, &done)); // nothing left to do
+        ck_assert(done);
+        do_close(&store);
+
+        imgst_file reopened;
+        ck_assert_err_none(do_open(STORE_FILE, "r+b", &reopened));
+        check_packed(&reopened);
+        do_close(&reopened);
+    }
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(one_step_moves_a_batch)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+
+    // a small hole, then many contents: too many to fit in it one by one
+    char img_id[MAX_IMG_ID];
+    append_content(&store, 0, "dead", RES_ORIG, 10, 'a');
+    for (uint32_t slot = 1; slot < MAX_FILES; ++slot) {
+        snprintf(img_id, MAX_IMG_ID, "img%" PRIu32, slot);
+        append_content(&store, slot, img_id, RES_ORIG, 100, (char) ('a' + slot));
+    }
+    ck_assert_err_none(do_delete("dead", &store));
+
+    bool done = false;
+    ck_assert_err_none(do_compact(&store, 1 << 20, &done));
+    ck_assert(done);
+    ck_assert_int_eq(store.data_end, DATA_START + (MAX_FILES - 1) * 100);
+    for (uint32_t slot = 1; slot < MAX_FILES; ++slot) {
+        snprintf(img_id, MAX_IMG_ID, "img%" PRIu32, slot);
+        const struct content content = { img_id, RES_ORIG, 100, (char) ('a' + slot) };
+        ck_assert(content_matches(&store, &content));
+        ck_assert_int_eq(store.metadata[slot].offset[RES_ORIG], DATA_START + (slot - 1) * 100);
+    }
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(pinned_contents_are_not_overwritten)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    ck_assert_err_none(do_enable_locking(&store));
+    fill_store(&store);
+
+    // as if it were being sent: the packed prefix would take its place
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    ck_assert_err_none(do_pin("second", RES_ORIG, &offset, &size, SHA, &store));
+
+    bool done = false;
+    for (int step = 0; step < 10; ++step) {
+        ck_assert_err_none(do_compact(&store, BUDGET, &done));
+        ck_assert(!done);
+    }
+    char *content = malloc(size);
+    ck_assert_ptr_nonnull(content);
+    ck_assert_err_none(read_at(&store, content, size, offset));
+    for (uint32_t i = 0; i < size; ++i) {
+        ck_assert_int_eq(content[i], 'b');
+    }
+    free(content);
+    ck_assert(content_matches(&store, &live[0]));
+
+    do_unpin(offset, size, &store);
+    for (int steps = 0; !done; ++steps) {
+        ck_assert_err_none(do_compact(&store, BUDGET, &done));
+        ck_assert_int_lt(steps, 100);
+    }
+    check_packed(&store);
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(error_cases)
+{
+    bool done = false;
+    ck_assert_invalid_arg(do_compact(NULL, BUDGET, &done));
+
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    ck_assert_invalid_arg(do_compact(&store, BUDGET, NULL));
+
+    // an empty store is already packed
+    ck_assert_err_none(do_compact(&store, BUDGET, &done));
+    ck_assert(done);
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+Suite* compact_test_suite()
+{
+    Suite* s = suite_create("Tests of do_compact");
+
+    Add_Case(s, tc1, "compaction tests");
+    tcase_add_test(tc1, compaction_by_steps);
+    tcase_add_test(tc1, one_step_moves_a_batch);
+    tcase_add_test(tc1, pinned_contents_are_not_overwritten);
+    tcase_add_test(tc1, error_cases);
+
+    return s;
+}
+
+TEST_SUITE(compact_test_suite)
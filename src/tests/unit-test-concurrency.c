@@ -0,0 +1,425 @@
+/**
+ * @file unit-test-concurrency.c
+ * @brief Stress test of an imgStore shared by several threads (see do_enable_locking)
+ *
+ * Writers insert (and delete some of) their own images while readers read
+ * and list whatever is there; the metadata is then checked, in memory and
+ * once reopened from disk. Also checks the background generation of resized
+ * images (see do_enable_pregen) and the insertion of images by batches,
+ * hashed and probed on several threads (see do_insert_batch), which are
+ * undone when they cannot be written back.
+ *
+ * @date 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L // for rand_r
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <check.h>
+#include <inttypes.h>
+#include <vips/vips.h>
+
+#include "tests.h"
+#include "imgStore.h"
+
+#define STORE_FILE "unit-test-concurrency.imgst"
+#define IMAGE_FILE "tests/data/papillon.jpg"
+
+#define MAX_FILES 256
+#define NB_WRITERS 4
+#define NB_READERS 4
+#define IMAGES_PER_WRITER 48 // every third one is deleted right after the next insertion
+
+// ======================================================================
+struct shared {
+    imgst_file store;
+    char *image;
+    size_t image_size;
+    atomic_int writers_left;
+};
+
+struct worker {
+    struct shared *shared;
+    uint32_t id;
+    unsigned int seed;
+    int errors;   // unexpected error codes or contents
+    long reads;   // successful reads
+};
+
+// ------------------------------------------------------------
+static void image_id(char *id, uint32_t writer, uint32_t k)
+{
+    snprintf(id, MAX_IMG_ID, "w%" PRIu32 "-%" PRIu32, writer, k);
+}
+
+// ------------------------------------------------------------
+static int is_deleted(uint32_t k)
+{
+    return k % 3 == 2;
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Makes the content of image k of a writer unique, by appending its identity after the JPEG.
+ */
+static char *image_content(const struct shared *shared, uint32_t writer, uint32_t k)
+{
+    char *content = malloc(shared->image_size + 2 * sizeof(uint32_t));
+    if (content != NULL) {
+        memcpy(content, shared->image, shared->image_size);
+        memcpy(content + shared->image_size, &writer, sizeof(writer));
+        memcpy(content + shared->image_size + sizeof(writer), &k, sizeof(k));
+    }
+    return content;
+}
+
+// ------------------------------------------------------------
+static void *write_images(void *arg)
+{
+    struct worker *worker = arg;
+    struct shared *shared = worker->shared;
+    char id[MAX_IMG_ID];
+
+    for (uint32_t k = 0; k < IMAGES_PER_WRITER; ++k) {
+        char *content = image_content(shared, worker->id, k);
+        image_id(id, worker->id, k);
+        if (content == NULL
+            || do_insert(content, shared->image_size + 2 * sizeof(uint32_t), id, &shared->store) != ERR_NONE) {
+            ++worker->errors;
+        }
+        free(content);
+
+        if (k > 0 && is_deleted(k - 1)) {
+            image_id(id, worker->id, k - 1);
+            if (do_delete(id, &shared->store) != ERR_NONE) ++worker->errors;
+        }
+    }
+    if (is_deleted(IMAGES_PER_WRITER - 1)) {
+        image_id(id, worker->id, IMAGES_PER_WRITER - 1);
+        if (do_delete(id, &shared->store) != ERR_NONE) ++worker->errors;
+    }
+
+    atomic_fetch_sub(&shared->writers_left, 1);
+    return NULL;
+}
+
+// ------------------------------------------------------------
+static void *read_images(void *arg)
+{
+    struct worker *worker = arg;
+    struct shared *shared = worker->shared;
+    char id[MAX_IMG_ID];
+
+    while (atomic_load(&shared->writers_left) > 0) {
+        const uint32_t writer = (uint32_t) rand_r(&worker->seed) % NB_WRITERS;
+        const uint32_t k = (uint32_t) rand_r(&worker->seed) % IMAGES_PER_WRITER;
+        const int resolution = rand_r(&worker->seed) % 4 == 0 ? RES_THUMB : RES_ORIG;
+        image_id(id, writer, k);
+
+        char *buffer = NULL;
+        uint32_t size = 0;
+        const int err = do_read(id, resolution, &buffer, &size, &shared->store);
+        if (err == ERR_NONE) {
+            ++worker->reads;
+            if (resolution == RES_ORIG) {
+                char *expected = image_content(shared, writer, k);
+                if (expected == NULL || size != shared->image_size + 2 * sizeof(uint32_t)
+                    || memcmp(buffer, expected, size) != 0) {
+                    ++worker->errors;
+                }
+                free(expected);
+            } else if (size == 0) {
+                ++worker->errors;
+            }
+            free(buffer);
+        } else if (err != ERR_FILE_NOT_FOUND) { // not inserted yet, or deleted
+            ++worker->errors;
+        }
+
+        if (rand_r(&worker->seed) % 16 == 0) {
+            free(do_list(&shared->store, JSON));
+        }
+    }
+    return NULL;
+}
+
+// ------------------------------------------------------------
+static void load_image(struct shared *shared)
+{
+    FILE *file = fopen(IMAGE_FILE, "rb");
+    ck_assert_ptr_nonnull(file);
+    ck_assert_int_eq(fseek(file, 0, SEEK_END), 0);
+    shared->image_size = (size_t) ftell(file);
+    rewind(file);
+    ck_assert_ptr_nonnull(shared->image = malloc(shared->image_size));
+    ck_assert_int_eq(fread(shared->image, shared->image_size, 1, file), 1);
+    fclose(file);
+}
+
+// ------------------------------------------------------------
+static void check_metadata(const imgst_file *store)
+{
+    char id[MAX_IMG_ID];
+    ck_assert_int_eq(store->header.num_files, NB_WRITERS * (IMAGES_PER_WRITER - IMAGES_PER_WRITER / 3));
+
+    uint32_t nb_valid = 0;
+    for (uint32_t i = 0; i < store->header.max_files; ++i) {
+        if (store->metadata[i].is_valid == NON_EMPTY) {
+            ++nb_valid;
+            for (uint32_t j = i + 1; j < store->header.max_files; ++j) {
+                ck_assert(store->metadata[j].is_valid == EMPTY
+                          || strcmp(store->metadata[i].img_id, store->metadata[j].img_id) != 0);
+            }
+        }
+    }
+    ck_assert_int_eq(nb_valid, store->header.num_files);
+
+    for (uint32_t writer = 0; writer < NB_WRITERS; ++writer) {
+        for (uint32_t k = 0; k < IMAGES_PER_WRITER; ++k) {
+            image_id(id, writer, k);
+            uint32_t found = 0;
+            for (uint32_t i = 0; i < store->header.max_files; ++i) {
+                found += store->metadata[i].is_valid == NON_EMPTY && strcmp(store->metadata[i].img_id, id) == 0;
+            }
+            ck_assert_int_eq(found, is_deleted(k) ? 0 : 1);
+        }
+    }
+}
+
+// ======================================================================
+START_TEST(readers_and_writers)
+{
+    ck_assert_int_eq(vips_init("unit-test-concurrency"), 0);
+
+    struct shared shared = { .writers_left = NB_WRITERS };
+    load_image(&shared);
+
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &shared.store));
+    ck_assert_err_none(do_enable_locking(&shared.store));
+
+    pthread_t threads[NB_WRITERS + NB_READERS];
+    struct worker workers[NB_WRITERS + NB_READERS];
+    for (uint32_t i = 0; i < NB_WRITERS + NB_READERS; ++i) {
+        workers[i] = (struct worker) { .shared = &shared, .id = i, .seed = i + 1 };
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, i < NB_WRITERS ? write_images : read_images, &workers[i]), 0);
+    }
+
+    int errors = 0;
+    long reads = 0;
+    for (uint32_t i = 0; i < NB_WRITERS + NB_READERS; ++i) {
+        ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+        errors += workers[i].errors;
+        reads += workers[i].reads;
+    }
+    ck_assert_int_eq(errors, 0);
+    ck_assert_int_gt(reads, 0);
+
+    check_metadata(&shared.store);
+    const uint32_t version = shared.store.header.imgst_version;
+    do_close(&shared.store);
+    ck_assert_ptr_null(shared.store.lock);
+
+    // everything made it to the file
+    imgst_file reopened;
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &reopened));
+    ck_assert_int_eq(reopened.header.imgst_version, version);
+    check_metadata(&reopened);
+    do_close(&reopened);
+
+    free(shared.image);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(pregenerated_versions)
+{
+    ck_assert_int_eq(vips_init("unit-test-concurrency"), 0);
+
+    struct shared shared = { .writers_left = 0 };
+    load_image(&shared);
+
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &shared.store));
+    ck_assert_err_none(do_enable_pregen(&shared.store, 2));
+    ck_assert_ptr_nonnull(shared.store.lock);
+
+    char id[MAX_IMG_ID];
+    for (uint32_t k = 0; k < IMAGES_PER_WRITER; ++k) {
+        char *content = image_content(&shared, 0, k);
+        ck_assert_ptr_nonnull(content);
+        image_id(id, 0, k);
+        ck_assert_err_none(do_insert(content, shared.image_size + 2 * sizeof(uint32_t), id, &shared.store));
+        free(content);
+
+        // either waits for the background job, or finds it done, or computes it first
+        char *buffer = NULL;
+        uint32_t size = 0;
+        ck_assert_err_none(do_read(id, RES_THUMB, &buffer, &size, &shared.store));
+        ck_assert_int_gt(size, 0);
+        free(buffer);
+    }
+    do_close(&shared.store); // waits for the queued jobs
+    ck_assert_ptr_null(shared.store.pregen);
+
+    // all versions were computed, each only once
+    imgst_file reopened;
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &reopened));
+    ck_assert_int_eq(reopened.header.num_files, IMAGES_PER_WRITER);
+    uint64_t expected_end = sizeof(struct imgst_header) + MAX_FILES * sizeof(struct img_metadata);
+    for (uint32_t i = 0; i < reopened.header.max_files; ++i) {
+        if (reopened.metadata[i].is_valid == NON_EMPTY) {
+            for (int res = 0; res < NB_RES; ++res) {
+                ck_assert_int_gt(reopened.metadata[i].size[res], 0);
+                expected_end += reopened.metadata[i].size[res];
+            }
+        }
+    }
+    ck_assert_int_eq(reopened.data_end, expected_end);
+    do_close(&reopened);
+
+    free(shared.image);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(batch_insert)
+{
+    ck_assert_int_eq(vips_init("unit-test-concurrency"), 0);
+
+    struct shared shared = { .writers_left = 0 };
+    load_image(&shared);
+
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &shared.store));
+
+    // unique images, then the content of the first under a new id, an existing id and no content
+    const size_t size = shared.image_size + 2 * sizeof(uint32_t);
+    imgst_insert_item items[IMAGES_PER_WRITER + 3];
+    char ids[IMAGES_PER_WRITER + 3][MAX_IMG_ID];
+    for (uint32_t k = 0; k < IMAGES_PER_WRITER + 3; ++k) {
+        image_id(ids[k], 0, k);
+        items[k] = (imgst_insert_item) { image_content(&shared, 0, k < IMAGES_PER_WRITER ? k : 0), size, ids[k], -1 };
+        ck_assert_ptr_nonnull(items[k].buffer);
+    }
+    image_id(ids[IMAGES_PER_WRITER + 1], 0, 1);
+    free((char *) items[IMAGES_PER_WRITER + 2].buffer);
+    items[IMAGES_PER_WRITER + 2].buffer = NULL;
+
+    ck_assert_int_eq(do_insert_batch(items, IMAGES_PER_WRITER + 3, 4, &shared.store), ERR_DUPLICATE_ID);
+    for (uint32_t k = 0; k <= IMAGES_PER_WRITER; ++k) {
+        ck_assert_err_none(items[k].err);
+    }
+    ck_assert_int_eq(items[IMAGES_PER_WRITER + 1].err, ERR_DUPLICATE_ID);
+    ck_assert_int_eq(items[IMAGES_PER_WRITER + 2].err, ERR_INVALID_ARGUMENT);
+    for (uint32_t k = 0; k < IMAGES_PER_WRITER + 3; ++k) {
+        free((char *) items[k].buffer);
+    }
+    ck_assert_err_none(do_insert_batch(items, 0, 4, &shared.store));
+    do_close(&shared.store);
+
+    // contents appended once each, in order, and all the metadata written back
+    imgst_file reopened;
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &reopened));
+    ck_assert_int_eq(reopened.header.num_files, IMAGES_PER_WRITER + 1);
+    ck_assert_int_eq(reopened.header.imgst_version, IMAGES_PER_WRITER + 1);
+    const uint64_t data_start = sizeof(struct imgst_header) + MAX_FILES * sizeof(struct img_metadata);
+    ck_assert_int_eq(reopened.data_end, data_start + IMAGES_PER_WRITER * size);
+    uint64_t first_offset = 0, copy_offset = 0;
+    for (uint32_t i = 0; i < reopened.header.max_files; ++i) {
+        const img_metadata *metadata = &reopened.metadata[i];
+        if (metadata->is_valid == NON_EMPTY) {
+            ck_assert_int_eq(metadata->res_orig[0], 1200);
+            ck_assert_int_eq(metadata->res_orig[1], 800);
+            if (strcmp(metadata->img_id, ids[0]) == 0) first_offset = metadata->offset[RES_ORIG];
+            if (strcmp(metadata->img_id, ids[IMAGES_PER_WRITER]) == 0) copy_offset = metadata->offset[RES_ORIG];
+        }
+    }
+    ck_assert_int_eq(first_offset, data_start);
+    ck_assert_int_eq(copy_offset, data_start);
+    do_close(&reopened);
+
+    // a batch holds no more than its capacity, and is freed by do_insert_batch_finish whatever happens
+    imgst_insert_batch *batch = NULL;
+    imgst_insert_item item = { shared.image, shared.image_size, "one", -1 };
+    ck_assert_invalid_arg(do_insert_batch_start(0, 2, &batch));
+    ck_assert_err_none(do_insert_batch_start(1, 2, &batch));
+    ck_assert_err_none(do_insert_batch_add(batch, &item));
+    ck_assert_invalid_arg(do_insert_batch_add(batch, &item));
+    ck_assert_invalid_arg(do_insert_batch_finish(batch, NULL));
+
+    free(shared.image);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(failed_writes_are_undone)
+{
+    ck_assert_int_eq(vips_init("unit-test-concurrency"), 0);
+
+    struct shared shared = { .writers_left = 0 };
+    load_image(&shared);
+
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &shared.store));
+    ck_assert_err_none(do_insert(shared.image, shared.image_size, "first", &shared.store));
+    do_close(&shared.store);
+
+    // copies of the first content append nothing: only the writing back fails, the store being read-only
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &shared.store));
+    ck_assert_int_eq(do_insert(shared.image, shared.image_size, "copy", &shared.store), ERR_IO);
+    imgst_insert_item items[2] = {
+        { shared.image, shared.image_size, "copy0", -1 },
+        { shared.image, shared.image_size, "copy1", -1 }
+    };
+    ck_assert_int_eq(do_insert_batch(items, 2, 2, &shared.store), ERR_IO);
+    ck_assert_int_eq(items[0].err, ERR_IO);
+    ck_assert_int_eq(items[1].err, ERR_IO);
+
+    // as if they had been deleted
+    ck_assert_int_eq(shared.store.header.num_files, 1);
+    ck_assert_int_eq(shared.store.header.imgst_version, 1 + 2 * 3);
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < shared.store.header.max_files; ++i) {
+        found += shared.store.metadata[i].is_valid == NON_EMPTY;
+    }
+    ck_assert_int_eq(found, 1);
+    char *buffer = NULL;
+    uint32_t size = 0;
+    ck_assert_int_eq(do_read("copy0", RES_ORIG, &buffer, &size, &shared.store), ERR_FILE_NOT_FOUND);
+    ck_assert_err_none(do_read("first", RES_ORIG, &buffer, &size, &shared.store));
+    ck_assert_int_eq(size, shared.image_size);
+    free(buffer);
+    do_close(&shared.store);
+
+    free(shared.image);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+Suite* concurrency_test_suite()
+{
+    Suite* s = suite_create("Tests of concurrent use of an imgStore");
+
+    Add_Case(s, tc1, "concurrency tests");
+    tcase_set_timeout(tc1, 60);
+    tcase_add_test(tc1, readers_and_writers);
+    tcase_add_test(tc1, pregenerated_versions);
+    tcase_add_test(tc1, batch_insert);
+    tcase_add_test(tc1, failed_writes_are_undone);
+
+    return s;
+}
+
+TEST_SUITE(concurrency_test_suite)
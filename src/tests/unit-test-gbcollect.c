@@ -0,0 +1,153 @@
+/**
+ * @file unit-test-gbcollect.c
+ * @brief Unit tests for the garbage collection of an imgStore (see do_gbcollect)
+ *
+ * Contents are laid out with holes (deleted images), a shared (deduplicated) content
+ * and a resized version; once collected, the images shall keep their metadata and
+ * contents, the shared one being stored once, and the file end right after them.
+ *
+ * @date 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L // for stat
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_io.h"
+#include "imgst_index.h"
+
+#define STORE_FILE "unit-test-gbcollect.imgst"
+#define TMP_FILE "unit-test-gbcollect.imgst.tmp"
+#define MAX_FILES 16
+
+#define DATA_START (sizeof(struct imgst_header) + MAX_FILES * sizeof(struct img_metadata))
+
+// ------------------------------------------------------------
+static void append_content(imgst_file *store, uint32_t slot, const char *img_id, int resolution, uint32_t size, char fill)
+{
+    char *buffer = malloc(size);
+    ck_assert_ptr_nonnull(buffer);
+    memset(buffer, fill, size);
+
+    img_metadata *metadata = &store->metadata[slot];
+    ck_assert_err_none(append_data(store, buffer, size, &metadata->offset[resolution]));
+    metadata->size[resolution] = size;
+    if (metadata->is_valid == EMPTY) {
+        strncpy(metadata->img_id, img_id, MAX_IMG_ID);
+        memset(metadata->SHA, fill, SHA256_DIGEST_LENGTH); // not checked: only carried over
+        metadata->res_orig[0] = size;
+        metadata->res_orig[1] = 2 * size;
+        metadata->is_valid = NON_EMPTY;
+        ++store->header.num_files;
+        index_insert(store, slot);
+    }
+    ck_assert_err_none(write_metadata(store, slot));
+    free(buffer);
+}
+
+// ------------------------------------------------------------
+static void check_content(imgst_file *store, const char *img_id, int resolution, uint32_t size, char fill)
+{
+    char *buffer = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read(img_id, resolution, &buffer, &read_size, store));
+    ck_assert_int_eq(read_size, size);
+    for (uint32_t i = 0; i < size; ++i) {
+        ck_assert_int_eq(buffer[i], fill);
+    }
+    free(buffer);
+}
+
+// ======================================================================
+START_TEST(collection_keeps_metadata)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    append_content(&store, 0, "dead", RES_ORIG, 100, 'a');
+    append_content(&store, 1, "second", RES_ORIG, 5000, 'b');
+    append_content(&store, 2, "third", RES_ORIG, 300, 'c');
+    append_content(&store, 1, "second", RES_THUMB, 50, 't');
+
+    // copy shares the content of second
+    store.metadata[3] = store.metadata[1];
+    strncpy(store.metadata[3].img_id, "copy", MAX_IMG_ID);
+    ++store.header.num_files;
+    index_insert(&store, 3);
+    ck_assert_err_none(write_metadata(&store, 3));
+    ck_assert_err_none(do_delete("dead", &store));
+    const img_metadata second = store.metadata[1];
+    do_close(&store);
+
+    for (int pass = 0; pass < 2; ++pass) { // shall be idempotent
+        ck_assert_err_none(do_gbcollect(STORE_FILE, TMP_FILE));
+
+        struct stat file_stat;
+        ck_assert_int_ne(stat(TMP_FILE, &file_stat), 0);
+        ck_assert_int_eq(stat(STORE_FILE, &file_stat), 0);
+        ck_assert_int_eq(file_stat.st_size, DATA_START + 5000 + 50 + 300);
+
+        ck_assert_err_none(do_open(STORE_FILE, "rb", &store));
+        ck_assert_int_eq(store.header.num_files, 3);
+        ck_assert_int_eq(store.header.max_files, MAX_FILES);
+
+        // slot order, the original first; the shared content once
+        ck_assert_str_eq(store.metadata[0].img_id, "second");
+        ck_assert_str_eq(store.metadata[1].img_id, "third");
+        ck_assert_str_eq(store.metadata[2].img_id, "copy");
+        ck_assert_int_eq(store.metadata[3].is_valid, EMPTY);
+        ck_assert_int_eq(store.metadata[0].offset[RES_ORIG], DATA_START);
+        ck_assert_int_eq(store.metadata[0].offset[RES_THUMB], DATA_START + 5000);
+        ck_assert_int_eq(store.metadata[1].offset[RES_ORIG], DATA_START + 5050);
+        ck_assert_int_eq(store.metadata[2].offset[RES_ORIG], DATA_START);
+        ck_assert_int_eq(store.metadata[2].offset[RES_THUMB], DATA_START + 5000);
+
+        for (int i = 0; i < 3; i += 2) {
+            ck_assert_int_eq(memcmp(store.metadata[i].SHA, second.SHA, SHA256_DIGEST_LENGTH), 0);
+            ck_assert_int_eq(store.metadata[i].res_orig[0], second.res_orig[0]);
+            ck_assert_int_eq(store.metadata[i].res_orig[1], second.res_orig[1]);
+            ck_assert_int_eq(store.metadata[i].size[RES_SMALL], 0);
+        }
+
+        check_content(&store, "second", RES_ORIG, 5000, 'b');
+        check_content(&store, "second", RES_THUMB, 50, 't');
+        check_content(&store, "copy", RES_THUMB, 50, 't');
+        check_content(&store, "third", RES_ORIG, 300, 'c');
+        do_close(&store);
+    }
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(error_cases)
+{
+    ck_assert_invalid_arg(do_gbcollect(NULL, TMP_FILE));
+    ck_assert_invalid_arg(do_gbcollect(STORE_FILE, NULL));
+
+    remove(STORE_FILE);
+    ck_assert_int_eq(do_gbcollect(STORE_FILE, TMP_FILE), ERR_IO);
+}
+END_TEST
+
+// ======================================================================
+Suite* gbcollect_test_suite()
+{
+    Suite* s = suite_create("Tests of do_gbcollect");
+
+    Add_Case(s, tc1, "gbcollect tests");
+    tcase_add_test(tc1, collection_keeps_metadata);
+    tcase_add_test(tc1, error_cases);
+
+    return s;
+}
+
+TEST_SUITE(gbcollect_test_suite)
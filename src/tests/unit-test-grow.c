@@ -0,0 +1,301 @@
+/**
+ * @file unit-test-grow.c
+ * @brief Unit tests for the growth of the metadata through chained segments (see do_grow)
+ *
+ * A small store is filled, grown twice and filled again; the slots of the segments
+ * shall survive reopening (in memory, through a mapping, after a crash with a log),
+ * do_compact shall leave the segments where they are, and do_gbcollect shall flatten them.
+ *
+ * @date 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fork
+
+#include <stddef.h> // for offsetof
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_io.h"
+#include "imgst_index.h"
+
+#define STORE_FILE "unit-test-grow.imgst"
+#define TMP_FILE "unit-test-grow.imgst.tmp"
+#define MAX_FILES 4
+#define GROWN_FILES (MAX_FILES + MAX_FILES + 2 * MAX_FILES)
+#define NB_IMAGES (MAX_FILES + MAX_FILES + 2)
+#define CONTENT_SIZE 100
+
+// ======================================================================
+/**
+ * @brief Adds images in slots first to first + count - 1, as do_insert would, with contents
+ *        filled with a byte of their own.
+ */
+static void add_images(imgst_file *store, uint32_t first, uint32_t count)
+{
+    char content[CONTENT_SIZE];
+    for (uint32_t i = first; i < first + count; ++i) {
+        img_metadata *metadata = &store->metadata[i];
+        memset(content, 'a' + (int) i, CONTENT_SIZE);
+        ck_assert_err_none(append_data(store, content, CONTENT_SIZE, &metadata->offset[RES_ORIG]));
+        snprintf(metadata->img_id, MAX_IMG_ID, "img%" PRIu32, i);
+        metadata->size[RES_ORIG] = CONTENT_SIZE;
+        metadata->is_valid = NON_EMPTY;
+        ++store->header.num_files;
+        ++store->header.imgst_version;
+        index_insert(store, i);
+        ck_assert_err_none(write_metadata(store, i));
+        ck_assert_err_none(write_header(store));
+    }
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Fills the table, grows by MAX_FILES then by 2 * MAX_FILES slots, and fills some of them.
+ */
+static void grow_store(imgst_file *store)
+{
+    add_images(store, 0, MAX_FILES);
+    ck_assert_err_none(do_grow(store, MAX_FILES));
+    ck_assert_int_eq(store->header.max_files, 2 * MAX_FILES);
+    add_images(store, MAX_FILES, MAX_FILES);
+    ck_assert_err_none(do_grow(store, 2 * MAX_FILES));
+    ck_assert_int_eq(store->header.max_files, GROWN_FILES);
+    add_images(store, 2 * MAX_FILES, NB_IMAGES - 2 * MAX_FILES);
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Checks that the images of slots 0 to NB_IMAGES - 1 (but the deleted ones) read as written.
+ */
+static void check_images(imgst_file *store, uint32_t deleted)
+{
+    ck_assert_int_eq(store->header.max_files, GROWN_FILES);
+    ck_assert_int_eq(store->header.num_files, NB_IMAGES - deleted);
+
+    char expected[CONTENT_SIZE];
+    char content[CONTENT_SIZE];
+    for (uint32_t i = 0; i < GROWN_FILES; ++i) {
+        const img_metadata *metadata = &store->metadata[i];
+        if (i >= NB_IMAGES || i < deleted) {
+            ck_assert_int_eq(metadata->is_valid, EMPTY);
+            continue;
+        }
+        char img_id[MAX_IMG_ID];
+        snprintf(img_id, MAX_IMG_ID, "img%" PRIu32, i);
+        ck_assert_int_eq(metadata->is_valid, NON_EMPTY);
+        ck_assert_str_eq(metadata->img_id, img_id);
+        memset(expected, 'a' + (int) i, CONTENT_SIZE);
+        ck_assert_err_none(read_at(store, content, CONTENT_SIZE, metadata->offset[RES_ORIG]));
+        ck_assert_int_eq(memcmp(content, expected, CONTENT_SIZE), 0);
+    }
+}
+
+// ------------------------------------------------------------
+static void check_reopened(uint32_t deleted)
+{
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &store));
+    check_images(&store, deleted);
+    do_close(&store);
+
+    // a store which grew cannot be mapped as a whole: read in memory instead
+    ck_assert_err_none(do_open_mapped(STORE_FILE, "rb", &store));
+    check_images(&store, deleted);
+    do_close(&store);
+}
+
+// ======================================================================
+START_TEST(grown_slots_survive_reopening)
+{
+    for (int mapped = 0; mapped <= 1; ++mapped) {
+        ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+        imgst_file store;
+        ck_assert_err_none(mapped ? do_open_mapped(STORE_FILE, "r+b", &store) : do_open(STORE_FILE, "r+b", &store));
+        grow_store(&store);
+        ck_assert_ptr_null(store.mapping);
+        check_images(&store, 0);
+        do_close(&store);
+
+        check_reopened(0);
+        ck_assert_err_none(do_open(STORE_FILE, "rb", &store));
+        ck_assert_int_eq(store.header.table_files, MAX_FILES);
+        ck_assert_int_ne(store.header.next_segment, 0);
+        ck_assert_int_eq(store.nb_segments, 2);
+        ck_assert_str_eq(store.header.imgst_name, CAT_TXT_GROWN);
+        do_close(&store);
+    }
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(grown_slots_survive_a_crash)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    const pid_t child = fork();
+    ck_assert_int_ge(child, 0);
+    if (child == 0) {
+        imgst_file store;
+        ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+        ck_assert_err_none(do_enable_wal(&store, STORE_FILE));
+        grow_store(&store);
+        ck_assert_err_none(do_sync(&store));
+        _exit(0);
+    }
+    int status = 0;
+    ck_assert_int_eq(waitpid(child, &status, 0), child);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    check_reopened(0);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(compact_and_stats_keep_segments)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    grow_store(&store);
+    const uint64_t first_segment = store.header.next_segment;
+    ck_assert_err_none(do_delete("img0", &store));
+    ck_assert_err_none(do_delete("img1", &store));
+
+    imgst_stats stats;
+    ck_assert_err_none(do_stats(&store, &stats));
+    ck_assert_int_eq(stats.num_files, NB_IMAGES - 2);
+    ck_assert_int_eq(stats.free_slots, GROWN_FILES - NB_IMAGES + 2);
+    ck_assert_int_eq(stats.stored_bytes, (NB_IMAGES - 2) * CONTENT_SIZE);
+    ck_assert_int_eq(stats.dead_bytes, 2 * CONTENT_SIZE);
+    ck_assert_int_eq(stats.data_bytes, NB_IMAGES * CONTENT_SIZE + 2 * sizeof(struct imgst_segment)
+                     + (GROWN_FILES - MAX_FILES) * sizeof(struct img_metadata));
+
+    bool done = false;
+    for (int steps = 0; !done && steps < 100; ++steps) {
+        ck_assert_err_none(do_compact(&store, CONTENT_SIZE, &done));
+    }
+    ck_assert(done);
+    ck_assert_int_eq(store.header.next_segment, first_segment);
+    check_images(&store, 2);
+    do_close(&store);
+    check_reopened(2);
+
+    // the hole before the first segment stays: it is the only one
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &store));
+    ck_assert_err_none(do_stats(&store, &stats));
+    ck_assert_int_eq(stats.nb_holes, 1);
+    ck_assert_int_eq(stats.dead_bytes, 2 * CONTENT_SIZE);
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(gbcollect_flattens_segments)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    grow_store(&store);
+    do_close(&store);
+
+    ck_assert_err_none(do_gbcollect(STORE_FILE, TMP_FILE));
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &store));
+    ck_assert_int_eq(store.header.table_files, 0);
+    ck_assert_int_eq(store.header.next_segment, 0);
+    ck_assert_int_eq(store.nb_segments, 0);
+    ck_assert_str_eq(store.header.imgst_name, CAT_TXT);
+    check_images(&store, 0);
+    do_close(&store);
+
+    // and the flat store maps again
+    ck_assert_err_none(do_open_mapped(STORE_FILE, "rb", &store));
+    ck_assert_ptr_nonnull(store.mapping);
+    check_images(&store, 0);
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ------------------------------------------------------------
+/**
+ * @brief Overwrites size bytes of the store file at offset.
+ */
+static void patch_store(const void *bytes, size_t size, long offset)
+{
+    FILE *file = fopen(STORE_FILE, "r+b");
+    ck_assert_ptr_nonnull(file);
+    ck_assert_int_eq(fseek(file, offset, SEEK_SET), 0);
+    ck_assert_int_eq(fwrite(bytes, size, 1, file), 1);
+    ck_assert_int_eq(fclose(file), 0);
+}
+
+// ======================================================================
+START_TEST(unknown_headers_are_rejected)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    grow_store(&store);
+    do_close(&store);
+
+    // a table larger than any store, which the segments would be counted from
+    const uint32_t table_files = MAX_GROWN_FILES + 1;
+    patch_store(&table_files, sizeof(table_files), (long) offsetof(struct imgst_header, table_files));
+    ck_assert_int_eq(do_open(STORE_FILE, "rb", &store), ERR_IO);
+    ck_assert_int_eq(do_open_mapped(STORE_FILE, "rb", &store), ERR_IO);
+
+    // a type of which the layout is unknown
+    const uint32_t good_table_files = MAX_FILES;
+    patch_store(&good_table_files, sizeof(good_table_files), (long) offsetof(struct imgst_header, table_files));
+    ck_assert_err_none(do_open(STORE_FILE, "rb", &store));
+    do_close(&store);
+    const char type[MAX_IMGST_NAME + 1] = "EPFL ImgStore binary, v3";
+    patch_store(type, sizeof(type), (long) offsetof(struct imgst_header, imgst_name));
+    ck_assert_int_eq(do_open(STORE_FILE, "rb", &store), ERR_IO);
+    ck_assert_int_eq(do_open_mapped(STORE_FILE, "rb", &store), ERR_IO);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(grow_arguments)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    ck_assert_int_eq(do_grow(&store, 0), ERR_MAX_FILES);
+    ck_assert_int_eq(do_grow(&store, MAX_GROWN_FILES), ERR_MAX_FILES);
+    ck_assert_int_eq(store.header.max_files, MAX_FILES);
+    ck_assert_invalid_arg(do_grow(NULL, MAX_FILES));
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+Suite* grow_test_suite()
+{
+    Suite* s = suite_create("Tests of do_grow");
+
+    Add_Case(s, tc1, "grow tests");
+    tcase_add_test(tc1, grown_slots_survive_reopening);
+    tcase_add_test(tc1, grown_slots_survive_a_crash);
+    tcase_add_test(tc1, compact_and_stats_keep_segments);
+    tcase_add_test(tc1, gbcollect_flattens_segments);
+    tcase_add_test(tc1, unknown_headers_are_rejected);
+    tcase_add_test(tc1, grow_arguments);
+
+    return s;
+}
+
+TEST_SUITE(grow_test_suite)
@@ -0,0 +1,109 @@
+/**
+ * @file unit-test-image_content.c
+ * @brief Unit tests for get_resolution, read from the JPEG frame header or by libvips
+ *
+ * @date 2021
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+#include <vips/vips.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "image_content.h"
+
+// ------------------------------------------------------------
+static char *load_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    ck_assert_ptr_nonnull(file);
+    ck_assert_int_eq(fseek(file, 0, SEEK_END), 0);
+    *size = (size_t) ftell(file);
+    rewind(file);
+    char *content = malloc(*size);
+    ck_assert_ptr_nonnull(content);
+    ck_assert_int_eq(fread(content, *size, 1, file), 1);
+    fclose(file);
+    return content;
+}
+
+// ------------------------------------------------------------
+static void check_resolution(const char *path, uint32_t expected_width, uint32_t expected_height)
+{
+    size_t size = 0;
+    char *content = load_file(path, &size);
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, content, size));
+    ck_assert_int_eq(width, expected_width);
+    ck_assert_int_eq(height, expected_height);
+
+    free(content);
+}
+
+// ======================================================================
+START_TEST(progressive_and_baseline)
+{
+    check_resolution("tests/data/papillon.jpg", 1200, 800);      // progressive (SOF2)
+    check_resolution("tests/data/papillon_small.jpg", 256, 171); // baseline (SOF0)
+    check_resolution("tests/data/coquelicots_thumb.jpg", 64, 42);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(handcrafted_headers)
+{
+    // SOI, padded APP0, a fill byte, SOF1 of 3x5 (height 5, width 3), then garbage never looked at
+    const char jpeg[] = {
+        '\xFF', '\xD8',
+        '\xFF', '\xE0', '\x00', '\x04', 'J', 'F',
+        '\xFF', '\xFF', '\xC1', '\x00', '\x0B', '\x08', '\x00', '\x05', '\x00', '\x03', '\x01', '\x01', '\x11', '\x00',
+        '\x42', '\x42'
+    };
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, jpeg, sizeof(jpeg)));
+    ck_assert_int_eq(width, 3);
+    ck_assert_int_eq(height, 5);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(not_a_jpeg)
+{
+    size_t size = 0;
+    char *content = load_file("tests/data/papillon.jpg", &size);
+    uint32_t height = 0, width = 0;
+
+    // cut in its header: neither the probe nor libvips can tell
+    ck_assert_int_eq(get_resolution(&height, &width, content, 100), ERR_IMGLIB);
+    // not even a start of image
+    ck_assert_int_eq(get_resolution(&height, &width, content + 2, size - 2), ERR_IMGLIB);
+
+    ck_assert_invalid_arg(get_resolution(NULL, &width, content, size));
+    free(content);
+}
+END_TEST
+
+// ======================================================================
+Suite* image_content_test_suite()
+{
+    if (vips_init("unit-test-image_content")) {
+        vips_error_exit("unable to start vips");
+    }
+
+    Suite* s = suite_create("Tests of get_resolution");
+
+    Add_Case(s, tc1, "get_resolution tests");
+    tcase_add_test(tc1, progressive_and_baseline);
+    tcase_add_test(tc1, handcrafted_headers);
+    tcase_add_test(tc1, not_a_jpeg);
+
+    return s;
+}
+
+TEST_SUITE(image_content_test_suite)
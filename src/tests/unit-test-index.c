@@ -0,0 +1,359 @@
+/**
+ * @file unit-test-index.c
+ * @brief Unit tests for the in-memory img_id and SHA indexes, the sorted img_ids, and the free slots set
+ *
+ * @date 2021
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_index.h"
+
+#define MAX_FILES 200
+
+// ======================================================================
+// tool macro
+#define init_imgst(X) \
+    struct imgst_file X = { \
+      .header.max_files   = MAX_FILES, \
+      .header.res_resized = { 64, 64, 256, 256} \
+    }; \
+    ck_assert_ptr_nonnull((X).metadata = calloc(X.header.max_files, sizeof(struct img_metadata)))
+
+// ------------------------------------------------------------
+static void release_imgst(struct imgst_file* imgst)
+{
+    index_free(imgst);
+    free(imgst->metadata);
+    imgst->metadata = NULL;
+}
+
+// ------------------------------------------------------------
+static void set_image(struct imgst_file* imgst, uint32_t index, const char* id)
+{
+    strncpy(imgst->metadata[index].img_id, id, MAX_IMG_ID);
+    imgst->metadata[index].is_valid = NON_EMPTY;
+}
+
+// ------------------------------------------------------------
+static void set_sha(struct imgst_file* imgst, uint32_t index, const char* sha)
+{
+    memcpy(imgst->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH); // not null-terminated
+}
+
+// ======================================================================
+START_TEST(find_after_build)
+{
+    init_imgst(imgst);
+
+    set_image(&imgst, 3, "pic1");
+    set_image(&imgst, 7, "pic2");
+    imgst.metadata[9].is_valid = EMPTY;
+    strncpy(imgst.metadata[9].img_id, "pic3", MAX_IMG_ID); // deleted image
+
+    ck_assert_err_none(index_build(&imgst));
+    ck_assert_ptr_nonnull(imgst.id_index);
+
+    ck_assert_int_eq(index_find_id(&imgst, "pic1", INDEX_NOT_FOUND), 3);
+    ck_assert_int_eq(index_find_id(&imgst, "pic2", INDEX_NOT_FOUND), 7);
+    ck_assert_int_eq(index_find_id(&imgst, "pic3", INDEX_NOT_FOUND), INDEX_NOT_FOUND);
+    ck_assert_int_eq(index_find_id(&imgst, "pic", INDEX_NOT_FOUND), INDEX_NOT_FOUND);
+
+    release_imgst(&imgst);
+    ck_assert_ptr_null(imgst.id_index);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(insert_and_remove_many)
+{
+    init_imgst(imgst);
+    ck_assert_err_none(index_build(&imgst));
+
+    char id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < MAX_FILES; ++i) {
+        snprintf(id, sizeof(id), "image%" PRIu32, i);
+        set_image(&imgst, i, id);
+        index_insert(&imgst, i);
+    }
+
+    // removing every third image shifts back the clusters they belonged to
+    for (uint32_t i = 0; i < MAX_FILES; i += 3) {
+        index_remove(&imgst, i);
+        imgst.metadata[i].is_valid = EMPTY;
+    }
+
+    for (uint32_t i = 0; i < MAX_FILES; ++i) {
+        snprintf(id, sizeof(id), "image%" PRIu32, i);
+        ck_assert_int_eq(index_find_id(&imgst, id, INDEX_NOT_FOUND), i % 3 == 0 ? INDEX_NOT_FOUND : i);
+    }
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(find_copy_by_sha)
+{
+    init_imgst(imgst);
+
+    const char* const sha  = "7fb206ca4d40af4f9a9da4ab170982fcdfac078f6cf642ff449ae0a65a59a502";
+    const char* const sha2 = "b7f02c6ad44a0ff49ad94aab719082cffdac70f86c6f24ff44a9ea056a5a9025";
+
+    set_image(&imgst, 8, "copy2"); set_sha(&imgst, 8, sha);
+    set_image(&imgst, 4, "copy1"); set_sha(&imgst, 4, sha);
+    set_image(&imgst, 6, "other"); set_sha(&imgst, 6, sha2);
+    set_sha(&imgst, 2, sha); // not valid
+
+    ck_assert_err_none(index_build(&imgst));
+
+    ck_assert_int_eq(index_find_sha(&imgst, imgst.metadata[8].SHA, 8), 4);
+    ck_assert_int_eq(index_find_sha(&imgst, imgst.metadata[8].SHA, 4), 8);
+    ck_assert_int_eq(index_find_sha(&imgst, imgst.metadata[6].SHA, 6), INDEX_NOT_FOUND);
+
+    index_remove(&imgst, 4);
+    imgst.metadata[4].is_valid = EMPTY;
+    ck_assert_int_eq(index_find_sha(&imgst, imgst.metadata[8].SHA, INDEX_NOT_FOUND), 8);
+
+    // same id as an other slot is seen, unless that slot is the one excluded
+    set_image(&imgst, 9, "copy2");
+    ck_assert_int_eq(index_find_id(&imgst, "copy2", 9), 8);
+    ck_assert_int_eq(index_find_id(&imgst, "copy2", 8), INDEX_NOT_FOUND);
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(lowest_free_slot)
+{
+    init_imgst(imgst);
+
+    char id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < MAX_FILES; ++i) {
+        if (i != 70 && i != 150) {
+            snprintf(id, sizeof(id), "image%" PRIu32, i);
+            set_image(&imgst, i, id);
+        }
+    }
+    ck_assert_err_none(index_build(&imgst));
+
+    ck_assert_int_eq(index_find_free(&imgst), 70);
+    set_image(&imgst, 70, "new");
+    index_insert(&imgst, 70);
+    ck_assert_int_eq(index_find_free(&imgst), 150);
+
+    // freeing a slot before the last one found
+    index_remove(&imgst, 3);
+    imgst.metadata[3].is_valid = EMPTY;
+    ck_assert_int_eq(index_find_free(&imgst), 3);
+
+    set_image(&imgst, 3, "new3");
+    index_insert(&imgst, 3);
+    set_image(&imgst, 150, "new150");
+    index_insert(&imgst, 150);
+    ck_assert_int_eq(index_find_free(&imgst), INDEX_NOT_FOUND); // MAX_FILES is not a multiple of 64
+
+    index_remove(&imgst, MAX_FILES - 1);
+    imgst.metadata[MAX_FILES - 1].is_valid = EMPTY;
+    ck_assert_int_eq(index_find_free(&imgst), MAX_FILES - 1);
+
+    release_imgst(&imgst);
+    ck_assert_ptr_null(imgst.free_slots);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(linear_fallback)
+{
+    init_imgst(imgst); // no index built
+
+    set_image(&imgst, 5, "pic1");
+    ck_assert_ptr_null(imgst.id_index);
+    ck_assert_int_eq(index_find_id(&imgst, "pic1", INDEX_NOT_FOUND), 5);
+    ck_assert_int_eq(index_find_id(&imgst, "pic2", INDEX_NOT_FOUND), INDEX_NOT_FOUND);
+    ck_assert_int_eq(index_find_free(&imgst), 0);
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ------------------------------------------------------------
+/**
+ * @brief Walks through the images between first and last, checking their slots are the expected ones.
+ */
+static void check_walk(const struct imgst_file* imgst, const char* first, const char* last,
+                       const uint32_t* expected, size_t nb_expected)
+{
+    struct index_cursor cursor;
+    index_seek(imgst, first, last, &cursor);
+    for (size_t i = 0; i < nb_expected; ++i) {
+        ck_assert_int_eq(index_next(imgst, &cursor), expected[i]);
+    }
+    ck_assert_int_eq(index_next(imgst, &cursor), INDEX_NOT_FOUND);
+}
+
+// ======================================================================
+START_TEST(walk_in_id_order)
+{
+    init_imgst(imgst);
+
+    set_image(&imgst, 0, "delta");
+    set_image(&imgst, 4, "alpha");
+    set_image(&imgst, 9, "charlie");
+    set_image(&imgst, 2, "bravo");
+    ck_assert_err_none(index_build(&imgst));
+
+    const uint32_t all[] = { 4, 2, 9, 0 };
+    check_walk(&imgst, NULL, NULL, all, 4);
+    const uint32_t middle[] = { 2, 9 };
+    check_walk(&imgst, "b", "charlie", middle, 2);
+    check_walk(&imgst, "bravo", "c", middle, 1);
+    check_walk(&imgst, "e", NULL, NULL, 0);
+
+    // insertions and removals keep the order
+    set_image(&imgst, 7, "beta");
+    index_insert(&imgst, 7);
+    index_remove(&imgst, 9);
+    imgst.metadata[9].is_valid = EMPTY;
+    const uint32_t changed[] = { 4, 7, 2, 0 };
+    check_walk(&imgst, NULL, NULL, changed, 4);
+
+    struct index_cursor cursor;
+    index_seek(&imgst, "b", NULL, &cursor);
+    index_skip(&imgst, &cursor, 2);
+    ck_assert_int_eq(index_next(&imgst, &cursor), 0);
+    index_skip(&imgst, &cursor, 10);
+    ck_assert_int_eq(index_next(&imgst, &cursor), INDEX_NOT_FOUND);
+
+    // removal of a whole range
+    index_seek(&imgst, "b", "bz", &cursor);
+    index_remove_range(&imgst, &cursor, 2);
+    imgst.metadata[7].is_valid = EMPTY;
+    imgst.metadata[2].is_valid = EMPTY;
+    const uint32_t left[] = { 4, 0 };
+    check_walk(&imgst, NULL, NULL, left, 2);
+    ck_assert_int_eq(index_find_id(&imgst, "beta", INDEX_NOT_FOUND), INDEX_NOT_FOUND);
+    ck_assert_int_eq(index_find_free(&imgst), 1);
+
+    // without index, in slot order
+    release_imgst(&imgst);
+    init_imgst(unindexed);
+    set_image(&unindexed, 0, "delta");
+    set_image(&unindexed, 4, "alpha");
+    set_image(&unindexed, 9, "charlie");
+    const uint32_t slots[] = { 0, 9 };
+    check_walk(&unindexed, "b", NULL, slots, 2);
+
+    release_imgst(&unindexed);
+}
+END_TEST
+
+// ------------------------------------------------------------
+/**
+ * @brief Compares two slots of big_store by img_id, then by slot, for qsort.
+ */
+static const struct imgst_file* big_store = NULL;
+static int compare_slots(const void* a, const void* b)
+{
+    const uint32_t first = *(const uint32_t*) a;
+    const uint32_t second = *(const uint32_t*) b;
+    const int cmp = strncmp(big_store->metadata[first].img_id, big_store->metadata[second].img_id, MAX_IMG_ID);
+    return cmp != 0 ? cmp : (first > second) - (first < second);
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Checks a whole walk, and a seek and skip in its middle, against a sort of the valid slots.
+ */
+static void check_order(const struct imgst_file* imgst, uint32_t* expected)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < imgst->header.max_files; ++i) {
+        if (imgst->metadata[i].is_valid == NON_EMPTY) expected[count++] = i;
+    }
+    big_store = imgst;
+    qsort(expected, count, sizeof(uint32_t), compare_slots);
+    check_walk(imgst, NULL, NULL, expected, count);
+
+    if (count > 2) {
+        struct index_cursor cursor;
+        index_seek(imgst, imgst->metadata[expected[count / 3]].img_id, NULL, &cursor);
+        index_skip(imgst, &cursor, count / 3);
+        ck_assert_int_eq(index_next(imgst, &cursor), expected[count / 3 + count / 3]);
+    }
+}
+
+// ======================================================================
+START_TEST(order_survives_many_updates)
+{
+    // enough images for a B+-tree of several levels, whose nodes get split and merged
+    struct imgst_file imgst = { .header.max_files = 20000 };
+    ck_assert_ptr_nonnull(imgst.metadata = calloc(imgst.header.max_files, sizeof(struct img_metadata)));
+    uint32_t* expected = calloc(imgst.header.max_files, sizeof(uint32_t));
+    ck_assert_ptr_nonnull(expected);
+
+    srand(2021);
+    char id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < imgst.header.max_files; i += 2) {
+        snprintf(id, sizeof(id), "id%05d", rand() % 50000);
+        set_image(&imgst, i, id);
+    }
+    ck_assert_err_none(index_build(&imgst));
+    check_order(&imgst, expected);
+
+    for (int round = 0; round < 4; ++round) {
+        for (uint32_t n = 0; n < 3 * imgst.header.max_files; ++n) {
+            const uint32_t slot = (uint32_t) rand() % imgst.header.max_files;
+            // mostly removals in odd rounds, mostly insertions in even ones
+            const int insert = round % 2 == 0 ? rand() % 4 != 0 : rand() % 4 == 0;
+            if (imgst.metadata[slot].is_valid == NON_EMPTY && !insert) {
+                index_remove(&imgst, slot);
+                imgst.metadata[slot].is_valid = EMPTY;
+            } else if (imgst.metadata[slot].is_valid != NON_EMPTY && insert) {
+                snprintf(id, sizeof(id), "id%05d", rand() % 50000);
+                set_image(&imgst, slot, id);
+                index_insert(&imgst, slot);
+            }
+        }
+        check_order(&imgst, expected);
+    }
+
+    // down to none
+    struct index_cursor cursor;
+    index_seek(&imgst, NULL, NULL, &cursor);
+    uint32_t count = 0;
+    while (index_next(&imgst, &cursor) != INDEX_NOT_FOUND) ++count;
+    index_seek(&imgst, NULL, NULL, &cursor);
+    index_remove_range(&imgst, &cursor, count);
+    ck_assert_int_eq(index_next(&imgst, &cursor), INDEX_NOT_FOUND);
+
+    free(expected);
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+Suite* index_test_suite()
+{
+    Suite* s = suite_create("Tests of img_id index");
+
+    Add_Case(s, tc1, "index tests");
+    tcase_add_test(tc1, find_after_build);
+    tcase_add_test(tc1, insert_and_remove_many);
+    tcase_add_test(tc1, find_copy_by_sha);
+    tcase_add_test(tc1, lowest_free_slot);
+    tcase_add_test(tc1, linear_fallback);
+    tcase_add_test(tc1, walk_in_id_order);
+    tcase_add_test(tc1, order_survives_many_updates);
+
+    return s;
+}
+
+TEST_SUITE(index_test_suite)
@@ -0,0 +1,299 @@
+/**
+ * @file unit-test-list.c
+ * @brief Unit tests for the JSON listings of the images and of their changes, and for
+ *        the deletion of ranges of images (see do_list_json, do_list_changes and do_delete_range)
+ *
+ * @date 2021
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_changes.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+
+#define STORE_FILE "unit-test-list.imgst"
+#define MAX_FILES 16
+#define LISTING_MAX 1024
+
+// ======================================================================
+/**
+ * @brief Output of a listing, with the number of chunks it was written in.
+ */
+struct listing {
+    char json[LISTING_MAX];
+    size_t length;
+    size_t nb_chunks;
+};
+
+static int append(const char *chunk, size_t size, void *arg)
+{
+    struct listing *listing = arg;
+    ck_assert_int_gt(size, 0);
+    ck_assert_int_lt(listing->length + size, LISTING_MAX);
+    memcpy(&listing->json[listing->length], chunk, size);
+    listing->length += size;
+    listing->json[listing->length] = '\0';
+    ++listing->nb_chunks;
+    return ERR_NONE;
+}
+
+static int refuse(const char *chunk, size_t size, void *arg)
+{
+    (void) chunk;
+    (void) size;
+    (void) arg;
+    return ERR_IO;
+}
+
+// ======================================================================
+/**
+ * @brief Lists store into listing, checking it succeeds.
+ */
+static void list(const imgst_file *store, const char *prefix, uint32_t offset, uint32_t limit,
+                 struct listing *listing)
+{
+    const struct imgst_list_query query = { prefix, offset, limit };
+    memset(listing, 0, sizeof(*listing));
+    ck_assert_err_none(do_list_json(store, &query, append, listing));
+}
+
+// ======================================================================
+static void add_image(imgst_file *store, uint32_t slot, const char *img_id)
+{
+    img_metadata *metadata = &store->metadata[slot];
+    strncpy(metadata->img_id, img_id, MAX_IMG_ID);
+    metadata->is_valid = NON_EMPTY;
+    ++store->header.num_files;
+    index_insert(store, slot);
+    ck_assert_err_none(write_metadata(store, slot));
+    ck_assert_err_none(write_header(store));
+}
+
+static void create_store(imgst_file *store)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", store));
+
+    add_image(store, 1, "pic1");
+    add_image(store, 3, "photo");
+    add_image(store, 4, "pic2");
+    add_image(store, 9, "pic3");
+}
+
+// ======================================================================
+START_TEST(list_all)
+{
+    imgst_file store;
+    create_store(&store);
+
+    struct listing listing;
+    list(&store, NULL, 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"photo\", \"pic1\", \"pic2\", \"pic3\"], \"More\": false, \"Version\": 0}");
+
+    // do_list gives the same, as one string
+    char *json = do_list(&store, JSON);
+    ck_assert_ptr_nonnull(json);
+    ck_assert_str_eq(json, listing.json);
+    free(json);
+
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(list_pages_and_prefix)
+{
+    imgst_file store;
+    create_store(&store);
+
+    struct listing listing;
+    list(&store, NULL, 0, 2, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"photo\", \"pic1\"], \"More\": true, \"Version\": 0}");
+    list(&store, NULL, 2, 2, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"pic2\", \"pic3\"], \"More\": false, \"Version\": 0}");
+    list(&store, NULL, 4, 2, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [], \"More\": false, \"Version\": 0}");
+
+    list(&store, "pic", 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"pic1\", \"pic2\", \"pic3\"], \"More\": false, \"Version\": 0}");
+    list(&store, "pic", 1, 1, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"pic2\"], \"More\": true, \"Version\": 0}");
+    list(&store, "none", 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [], \"More\": false, \"Version\": 0}");
+
+    // deleted images are not listed
+    index_remove(&store, 4);
+    store.metadata[4].is_valid = EMPTY;
+    list(&store, "pic", 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"pic1\", \"pic3\"], \"More\": false, \"Version\": 0}");
+
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(list_escapes_and_errors)
+{
+    imgst_file store;
+    create_store(&store);
+    add_image(&store, 12, "a\"b\\c\n");
+
+    struct listing listing;
+    list(&store, "a", 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"a\\\"b\\\\c\\u000a\"], \"More\": false, \"Version\": 0}");
+    ck_assert_int_eq(listing.nb_chunks, 1);
+
+    const struct imgst_list_query all = { NULL, 0, 0 };
+    ck_assert_int_eq(do_list_json(&store, &all, refuse, NULL), ERR_IO);
+    ck_assert_invalid_arg(do_list_json(NULL, &all, append, &listing));
+    ck_assert_invalid_arg(do_list_json(&store, NULL, append, &listing));
+    ck_assert_invalid_arg(do_list_json(&store, &all, NULL, &listing));
+    char too_long[MAX_IMG_ID + 2];
+    memset(too_long, 'a', MAX_IMG_ID + 1);
+    too_long[MAX_IMG_ID + 1] = '\0';
+    const struct imgst_list_query too_long_prefix = { too_long, 0, 0 };
+    ck_assert_invalid_arg(do_list_json(&store, &too_long_prefix, append, &listing));
+    too_long[MAX_IMG_ID] = '\0';
+    list(&store, too_long, 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [], \"More\": false, \"Version\": 0}");
+
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+/**
+ * @brief Inserts an image as do_insert does, as far as the metadata and the change log are concerned.
+ */
+static void insert_image(imgst_file *store, uint32_t slot, const char *img_id)
+{
+    add_image(store, slot, img_id);
+    ++store->header.imgst_version;
+    changes_record(store, slot, false);
+}
+
+static void list_changes(const imgst_file *store, uint32_t since, struct listing *listing)
+{
+    memset(listing, 0, sizeof(*listing));
+    ck_assert_err_none(do_list_changes(store, since, append, listing));
+}
+
+START_TEST(list_changes_since_versions)
+{
+    imgst_file store;
+    create_store(&store);
+    struct listing listing;
+    const struct imgst_list_query all = { NULL, 0, 0 };
+    ck_assert_invalid_arg(do_list_changes(&store, 0, append, &listing)); // not enabled
+
+    ck_assert_err_none(do_enable_change_log(&store, 3));
+    list_changes(&store, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Changes\": [], \"Version\": 0, \"Resync\": false}");
+
+    insert_image(&store, 5, "new1");
+    ck_assert_err_none(do_delete("pic2", &store));
+    list_changes(&store, 0, &listing);
+    ck_assert_str_eq(listing.json,
+                     "{\"Changes\": [{\"Added\": \"new1\"}, {\"Deleted\": \"pic2\"}], \"Version\": 2, \"Resync\": false}");
+    list_changes(&store, 1, &listing);
+    ck_assert_str_eq(listing.json, "{\"Changes\": [{\"Deleted\": \"pic2\"}], \"Version\": 2, \"Resync\": false}");
+    list_changes(&store, 2, &listing);
+    ck_assert_str_eq(listing.json, "{\"Changes\": [], \"Version\": 2, \"Resync\": false}");
+
+    // a version to come is unknown
+    list_changes(&store, 3, &listing);
+    ck_assert_str_eq(listing.json, "{\"Changes\": [], \"Version\": 2, \"Resync\": true}");
+
+    // the oldest changes are forgotten
+    insert_image(&store, 6, "new2");
+    insert_image(&store, 7, "new3");
+    list_changes(&store, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Changes\": [], \"Version\": 4, \"Resync\": true}");
+    list_changes(&store, 1, &listing);
+    ck_assert_str_eq(listing.json,
+                     "{\"Changes\": [{\"Deleted\": \"pic2\"}, {\"Added\": \"new2\"}, {\"Added\": \"new3\"}], "
+                     "\"Version\": 4, \"Resync\": false}");
+
+    // the full listing tells the version to list the changes since
+    memset(&listing, 0, sizeof(listing));
+    ck_assert_err_none(do_list_json(&store, &all, append, &listing));
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"new1\", \"new2\", \"new3\", \"photo\", \"pic1\", \"pic3\"], "
+                     "\"More\": false, \"Version\": 4}");
+
+    ck_assert_invalid_arg(do_enable_change_log(&store, 0));
+    ck_assert_invalid_arg(do_list_changes(NULL, 0, append, &listing));
+    ck_assert_invalid_arg(do_list_changes(&store, 0, NULL, &listing));
+
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(delete_ranges)
+{
+    imgst_file store;
+    create_store(&store);
+    ck_assert_err_none(do_enable_change_log(&store, 8));
+    struct listing listing;
+
+    uint32_t nb_deleted = 0;
+    ck_assert_err_none(do_delete_range("pic1", "pic2", &store, &nb_deleted));
+    ck_assert_int_eq(nb_deleted, 2);
+    list(&store, NULL, 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"photo\", \"pic3\"], \"More\": false, \"Version\": 2}");
+    list_changes(&store, 0, &listing);
+    ck_assert_str_eq(listing.json,
+                     "{\"Changes\": [{\"Deleted\": \"pic1\"}, {\"Deleted\": \"pic2\"}], \"Version\": 2, \"Resync\": false}");
+
+    // nothing in the range
+    ck_assert_err_none(do_delete_range("q", NULL, &store, &nb_deleted));
+    ck_assert_int_eq(nb_deleted, 0);
+    ck_assert_int_eq(store.header.imgst_version, 2);
+
+    ck_assert_err_none(do_delete_range(NULL, "pic", &store, &nb_deleted));
+    ck_assert_int_eq(nb_deleted, 1);
+    ck_assert_int_eq(store.header.num_files, 1);
+    ck_assert_int_eq(index_find_id(&store, "photo", INDEX_NOT_FOUND), INDEX_NOT_FOUND);
+
+    ck_assert_invalid_arg(do_delete_range(NULL, NULL, NULL, &nb_deleted));
+    ck_assert_invalid_arg(do_delete_range(NULL, NULL, &store, NULL));
+
+    // on the disk too
+    do_close(&store);
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+    list(&store, NULL, 0, 0, &listing);
+    ck_assert_str_eq(listing.json, "{\"Images\": [\"pic3\"], \"More\": false, \"Version\": 3}");
+
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+Suite* list_test_suite()
+{
+    Suite* s = suite_create("Tests of the JSON listing");
+
+    Add_Case(s, tc1, "list tests");
+    tcase_add_test(tc1, list_all);
+    tcase_add_test(tc1, list_pages_and_prefix);
+    tcase_add_test(tc1, list_escapes_and_errors);
+    tcase_add_test(tc1, list_changes_since_versions);
+    tcase_add_test(tc1, delete_ranges);
+
+    return s;
+}
+
+TEST_SUITE(list_test_suite)
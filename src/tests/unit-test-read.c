@@ -0,0 +1,132 @@
+/**
+ * @file unit-test-read.c
+ * @brief Unit tests for the reads into caller buffers (see do_read_into) and the buffer pool
+ *
+ * @date 2021
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_io.h"
+#include "imgst_index.h"
+#include "buffer_pool.h"
+
+#define STORE_FILE "unit-test-read.imgst"
+#define MAX_FILES 8
+#define CONTENT_SIZE 300
+
+// ======================================================================
+static void create_store(imgst_file *store)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", store));
+
+    // one image, whose thumbnail exists already (nothing to resize)
+    char content[CONTENT_SIZE];
+    memset(content, 't', CONTENT_SIZE);
+    img_metadata *metadata = &store->metadata[2];
+    ck_assert_err_none(append_data(store, content, CONTENT_SIZE, &metadata->offset[RES_THUMB]));
+    metadata->size[RES_THUMB] = CONTENT_SIZE;
+    ck_assert_err_none(append_data(store, content, CONTENT_SIZE, &metadata->offset[RES_ORIG]));
+    metadata->size[RES_ORIG] = CONTENT_SIZE;
+    strncpy(metadata->img_id, "pic", MAX_IMG_ID);
+    metadata->is_valid = NON_EMPTY;
+    ++store->header.num_files;
+    index_insert(store, 2);
+    ck_assert_err_none(write_metadata(store, 2));
+}
+
+// ======================================================================
+START_TEST(read_into_caller_buffer)
+{
+    imgst_file store;
+    create_store(&store);
+
+    char buffer[CONTENT_SIZE + 10];
+    memset(buffer, 0, sizeof(buffer));
+    uint32_t size = 0;
+    ck_assert_err_none(do_read_into("pic", RES_THUMB, buffer, sizeof(buffer), &size, &store));
+    ck_assert_int_eq(size, CONTENT_SIZE);
+    ck_assert_int_eq(buffer[0], 't');
+    ck_assert_int_eq(buffer[CONTENT_SIZE - 1], 't');
+    ck_assert_int_eq(buffer[CONTENT_SIZE], 0);
+
+    // exactly the size
+    ck_assert_err_none(do_read_into("pic", RES_THUMB, buffer, CONTENT_SIZE, &size, &store));
+
+    // too small: the size is told, for a retry
+    size = 0;
+    ck_assert_invalid_arg(do_read_into("pic", RES_THUMB, buffer, CONTENT_SIZE - 1, &size, &store));
+    ck_assert_int_eq(size, CONTENT_SIZE);
+
+    ck_assert_int_eq(do_read_into("nope", RES_THUMB, buffer, sizeof(buffer), &size, &store), ERR_FILE_NOT_FOUND);
+    ck_assert_invalid_arg(do_read_into("pic", RES_THUMB, NULL, sizeof(buffer), &size, &store));
+    ck_assert_invalid_arg(do_read_into("pic", RES_THUMB, buffer, sizeof(buffer), NULL, &store));
+
+    // do_read still hands a buffer of its own
+    char *read = NULL;
+    ck_assert_err_none(do_read("pic", RES_THUMB, &read, &size, &store));
+    ck_assert_int_eq(size, CONTENT_SIZE);
+    ck_assert_int_eq(memcmp(read, buffer, CONTENT_SIZE), 0);
+    free(read);
+
+    do_close(&store);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(pool_recycles_buffers)
+{
+    char *first = buffer_get(1000);
+    ck_assert_ptr_nonnull(first);
+    ck_assert_int_eq((uintptr_t) first % alignof(max_align_t), 0);
+    memset(first, 'x', 4096); // the whole class
+    buffer_put(first);
+
+    // same class: the same buffer again
+    char *second = buffer_get(4000);
+    ck_assert(second == first);
+
+    // another class
+    char *third = buffer_get(5000);
+    ck_assert_ptr_nonnull(third);
+    ck_assert(third != second);
+    memset(third, 'y', 8192);
+
+    // larger than the largest class: allocated, then freed
+    char *large = buffer_get(32 << 20);
+    ck_assert_ptr_nonnull(large);
+    large[(32 << 20) - 1] = 'z';
+    buffer_put(large);
+
+    buffer_put(second);
+    buffer_put(third);
+    buffer_put(NULL);
+    buffer_pool_trim();
+}
+END_TEST
+
+// ======================================================================
+Suite* read_test_suite()
+{
+    Suite* s = suite_create("Tests of do_read_into and of the buffer pool");
+
+    Add_Case(s, tc1, "read tests");
+    tcase_add_test(tc1, read_into_caller_buffer);
+    tcase_add_test(tc1, pool_recycles_buffers);
+
+    return s;
+}
+
+TEST_SUITE(read_test_suite)
@@ -0,0 +1,111 @@
+/**
+ * @file unit-test-stats.c
+ * @brief Unit tests for the space usage of an imgStore (see do_stats)
+ *
+ * @date 2021
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_io.h"
+#include "imgst_index.h"
+
+#define STORE_FILE "unit-test-stats.imgst"
+#define MAX_FILES 16
+
+#define DATA_START (sizeof(struct imgst_header) + MAX_FILES * sizeof(struct img_metadata))
+
+// ------------------------------------------------------------
+static void append_content(imgst_file *store, uint32_t slot, const char *img_id, int resolution, uint32_t size)
+{
+    char *buffer = calloc(size, 1);
+    ck_assert_ptr_nonnull(buffer);
+
+    img_metadata *metadata = &store->metadata[slot];
+    ck_assert_err_none(append_data(store, buffer, size, &metadata->offset[resolution]));
+    metadata->size[resolution] = size;
+    if (metadata->is_valid == EMPTY) {
+        strncpy(metadata->img_id, img_id, MAX_IMG_ID);
+        metadata->is_valid = NON_EMPTY;
+        ++store->header.num_files;
+        index_insert(store, slot);
+    }
+    ck_assert_err_none(write_metadata(store, slot));
+    free(buffer);
+}
+
+// ======================================================================
+START_TEST(space_usage)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    ck_assert_err_none(do_open(STORE_FILE, "r+b", &store));
+
+    imgst_stats stats;
+    ck_assert_err_none(do_stats(&store, &stats));
+    ck_assert_int_eq(stats.num_files, 0);
+    ck_assert_int_eq(stats.free_slots, MAX_FILES);
+    ck_assert_int_eq(stats.data_bytes, 0);
+    ck_assert_int_eq(stats.dead_bytes, 0);
+    ck_assert_int_eq(stats.nb_holes, 0);
+
+    // dead (100), second (5000), gone (4000), third (300), thumbnail of second (50), copy of third
+    append_content(&store, 0, "dead", RES_ORIG, 100);
+    append_content(&store, 1, "second", RES_ORIG, 5000);
+    append_content(&store, 2, "gone", RES_ORIG, 4000);
+    append_content(&store, 3, "third", RES_ORIG, 300);
+    append_content(&store, 1, "second", RES_THUMB, 50);
+    store.metadata[4] = store.metadata[3];
+    strncpy(store.metadata[4].img_id, "copy", MAX_IMG_ID);
+    ++store.header.num_files;
+    index_insert(&store, 4);
+    ck_assert_err_none(write_metadata(&store, 4));
+    ck_assert_err_none(do_delete("dead", &store));
+    ck_assert_err_none(do_delete("gone", &store));
+
+    ck_assert_err_none(do_stats(&store, &stats));
+    ck_assert_int_eq(stats.num_files, 3);
+    ck_assert_int_eq(stats.free_slots, MAX_FILES - 3);
+    ck_assert_int_eq(stats.live_bytes[RES_ORIG], 5000 + 300 + 300);
+    ck_assert_int_eq(stats.live_bytes[RES_THUMB], 50);
+    ck_assert_int_eq(stats.live_bytes[RES_SMALL], 0);
+    ck_assert_int_eq(stats.stored_bytes, 5000 + 300 + 50);
+    ck_assert_int_eq(stats.dedup_bytes, 300);
+    ck_assert_int_eq(stats.data_bytes, 100 + 5000 + 4000 + 300 + 50);
+    ck_assert_int_eq(stats.dead_bytes, 100 + 4000);
+    ck_assert_int_eq(stats.nb_holes, 2);
+    ck_assert_int_eq(stats.largest_hole, 4000);
+    do_close(&store);
+
+    // from a read-only mapping, as imgStoreMgr stats does
+    ck_assert_err_none(do_open_mapped(STORE_FILE, "rb", &store));
+    imgst_stats mapped;
+    ck_assert_err_none(do_stats(&store, &mapped));
+    ck_assert_int_eq(memcmp(&stats, &mapped, sizeof(stats)), 0);
+    do_close(&store);
+
+    ck_assert_invalid_arg(do_stats(NULL, &stats));
+    ck_assert_invalid_arg(do_stats(&store, NULL));
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+Suite* stats_test_suite()
+{
+    Suite* s = suite_create("Tests of do_stats");
+
+    Add_Case(s, tc1, "stats tests");
+    tcase_add_test(tc1, space_usage);
+
+    return s;
+}
+
+TEST_SUITE(stats_test_suite)
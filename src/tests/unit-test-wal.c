@@ -0,0 +1,191 @@
+/**
+ * @file unit-test-wal.c
+ * @brief Unit tests for the write-ahead log of the header and metadata updates (see do_enable_wal)
+ *
+ * A child process updates a store through its log and exits without closing it,
+ * as a crash would; reopening the store shall then give the committed operations only.
+ *
+ * @date 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fork
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "imgst_io.h"
+#include "imgst_wal.h"
+
+#define STORE_FILE "unit-test-wal.imgst"
+#define LOG_FILE STORE_FILE ".wal"
+#define MAX_FILES 500
+#define CONTENT "not even an image"
+
+// ======================================================================
+static void open_store(imgst_file *store, int mapped)
+{
+    ck_assert_err_none(mapped ? do_open_mapped(STORE_FILE, "r+b", store) : do_open(STORE_FILE, "r+b", store));
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Adds images in slots first to first + count - 1, as one batch of do_insert_batch would,
+ *        but commits them only if asked to (1), and flushes them only if asked to (2).
+ */
+static void add_images(imgst_file *store, uint32_t first, uint32_t count, int commit)
+{
+    for (uint32_t i = first; i < first + count; ++i) {
+        img_metadata *metadata = &store->metadata[i];
+        ck_assert_err_none(append_data(store, CONTENT, sizeof(CONTENT), &metadata->offset[RES_ORIG]));
+        snprintf(metadata->img_id, MAX_IMG_ID, "img%" PRIu32, i);
+        metadata->size[RES_ORIG] = sizeof(CONTENT);
+        metadata->is_valid = NON_EMPTY;
+        ++store->header.num_files;
+        ++store->header.imgst_version;
+        ck_assert_err_none(write_metadata(store, i));
+        ck_assert_err_none(write_header(store));
+    }
+    if (commit >= 1) ck_assert_err_none(wal_commit(store));
+    if (commit >= 2) ck_assert_err_none(wal_flush(store));
+}
+
+// ------------------------------------------------------------
+static void check_images(uint32_t expected, int mapped)
+{
+    imgst_file store;
+    open_store(&store, mapped);
+    ck_assert_int_eq(store.header.num_files, expected);
+    ck_assert_int_eq(store.header.imgst_version, expected);
+    for (uint32_t i = 0; i < MAX_FILES; ++i) {
+        ck_assert_int_eq(store.metadata[i].is_valid, i < expected ? NON_EMPTY : EMPTY);
+    }
+    do_close(&store);
+
+    // recovery emptied the log
+    struct stat log_stat;
+    ck_assert(stat(LOG_FILE, &log_stat) != 0 || log_stat.st_size == 0);
+}
+
+// ------------------------------------------------------------
+/**
+ * @brief Adds flushed then unflushed images (committed or not) in a child process,
+ *        which syncs (or not) then exits without closing.
+ */
+static void crash_after(uint32_t flushed, uint32_t unflushed, int commit, int mapped, int sync)
+{
+    const pid_t child = fork();
+    ck_assert_int_ge(child, 0);
+    if (child == 0) {
+        imgst_file store;
+        open_store(&store, mapped);
+        ck_assert_err_none(do_enable_wal(&store, STORE_FILE));
+        add_images(&store, 0, flushed, 2);
+        add_images(&store, flushed, unflushed, commit);
+        if (sync) ck_assert_err_none(do_sync(&store));
+        _exit(0);
+    }
+    int status = 0;
+    ck_assert_int_eq(waitpid(child, &status, 0), child);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// ======================================================================
+START_TEST(operations_survive_a_crash_whole)
+{
+    for (int mapped = 0; mapped <= 1; ++mapped) {
+        ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+        // an operation larger than the initial group is still committed in one go
+        crash_after(IMGST_WAL_GROUP + IMGST_WAL_GROUP / 2, IMGST_WAL_GROUP, 0, mapped, 0);
+        check_images(IMGST_WAL_GROUP + IMGST_WAL_GROUP / 2, mapped); // the second one never committed
+    }
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(committed_groups_wait_for_a_flush)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    // the second group is queued, but never reaches the log
+    crash_after(IMGST_WAL_GROUP, IMGST_WAL_GROUP, 1, 0, 0);
+    check_images(IMGST_WAL_GROUP, 0);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(synced_updates_survive_a_crash)
+{
+    for (int mapped = 0; mapped <= 1; ++mapped) {
+        ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+        crash_after(0, IMGST_WAL_GROUP / 2, 0, mapped, 1);
+        check_images(IMGST_WAL_GROUP / 2, mapped);
+    }
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(torn_group_is_ignored)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    crash_after(IMGST_WAL_GROUP, 0, 0, 0, 0);
+
+    // the last bytes of the commit record never made it to the disk
+    struct stat log_stat;
+    ck_assert_int_eq(stat(LOG_FILE, &log_stat), 0);
+    ck_assert_int_eq(truncate(LOG_FILE, log_stat.st_size - 1), 0);
+
+    check_images(0, 0);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(close_checkpoints)
+{
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    imgst_file store;
+    open_store(&store, 1);
+    ck_assert_err_none(do_enable_wal(&store, STORE_FILE));
+    add_images(&store, 0, 3 * IMGST_WAL_GROUP, 2);
+    do_close(&store);
+    ck_assert_ptr_null(store.wal);
+
+    struct stat log_stat;
+    ck_assert_int_eq(stat(LOG_FILE, &log_stat), 0);
+    ck_assert_int_eq(log_stat.st_size, 0);
+    check_images(3 * IMGST_WAL_GROUP, 0);
+
+    // a new store of the same name does not inherit the log
+    ck_assert_err_none(create_test_store(STORE_FILE, MAX_FILES));
+    ck_assert(stat(LOG_FILE, &log_stat) != 0);
+    remove(STORE_FILE);
+}
+END_TEST
+
+// ======================================================================
+Suite* wal_test_suite()
+{
+    Suite* s = suite_create("Tests of the write-ahead log");
+
+    Add_Case(s, tc1, "wal tests");
+    tcase_add_test(tc1, operations_survive_a_crash_whole);
+    tcase_add_test(tc1, committed_groups_wait_for_a_flush);
+    tcase_add_test(tc1, synced_updates_survive_a_crash);
+    tcase_add_test(tc1, torn_group_is_ignored);
+    tcase_add_test(tc1, close_checkpoints);
+
+    return s;
+}
+
+TEST_SUITE(wal_test_suite)
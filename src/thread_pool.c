@@ -0,0 +1,133 @@
+/**
+ * @file thread_pool.c
+ * @brief Fixed-size pool of threads running submitted jobs in FIFO order.
+ */
+
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct queued_job {
+    thread_pool_job job;
+    void *arg;
+    struct queued_job *next;
+};
+
+struct thread_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    struct queued_job *head;
+    struct queued_job *tail;
+    bool stopping;
+    size_t nb_threads;
+    pthread_t *threads;
+};
+
+/**
+ * @brief Loop of each thread: runs queued jobs until the pool stops and its queue is empty.
+ *
+ * @param arg The pool
+ * @return NULL
+ */
+static void *run_jobs(void *arg);
+
+/**
+ * @brief Wakes up the threads of pool, waits for them to end and frees pool.
+ *
+ * @param pool Pool whose first nb_started threads are running
+ * @param nb_started Number of threads to join
+ */
+static void stop_pool(struct thread_pool *pool, size_t nb_started);
+
+int thread_pool_create(size_t nb_threads, struct thread_pool **pool) {
+    M_REQUIRE_NON_NULL(pool);
+    M_REQ(nb_threads > 0, ERR_INVALID_ARGUMENT, "a thread pool needs at least one thread");
+
+    struct thread_pool *new_pool = calloc(1, sizeof(struct thread_pool));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(new_pool, ERR_OUT_OF_MEMORY);
+    new_pool->threads = calloc(nb_threads, sizeof(pthread_t));
+    M_EXIT_IF_ERR_DO_SOMETHING(new_pool->threads == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE, free(new_pool));
+
+    pthread_mutex_init(&new_pool->mutex, NULL);
+    pthread_cond_init(&new_pool->not_empty, NULL);
+    new_pool->nb_threads = nb_threads;
+
+    for (size_t i = 0; i < nb_threads; ++i) {
+        M_EXIT_IF_ERR_DO_SOMETHING(pthread_create(&new_pool->threads[i], NULL, run_jobs, new_pool) == 0
+                                   ? ERR_NONE : ERR_OUT_OF_MEMORY, stop_pool(new_pool, i));
+    }
+
+    *pool = new_pool;
+    return ERR_NONE;
+}
+
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job job, void *arg) {
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(job);
+
+    struct queued_job *queued = malloc(sizeof(struct queued_job));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(queued, ERR_OUT_OF_MEMORY);
+    queued->job = job;
+    queued->arg = arg;
+    queued->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail == NULL) {
+        pool->head = queued;
+    } else {
+        pool->tail->next = queued;
+    }
+    pool->tail = queued;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ERR_NONE;
+}
+
+void thread_pool_destroy(struct thread_pool *pool) {
+    if (pool != NULL) {
+        stop_pool(pool, pool->nb_threads);
+    }
+}
+
+static void *run_jobs(void *arg) {
+    struct thread_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        if (pool->head == NULL) break; // stopping, and nothing left to do
+
+        struct queued_job *queued = pool->head;
+        pool->head = queued->next;
+        if (pool->head == NULL) pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->mutex);
+        queued->job(queued->arg);
+        free(queued);
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+static void stop_pool(struct thread_pool *pool, size_t nb_started) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < nb_started; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,42 @@
+/**
+ * @file thread_pool.h
+ * @brief Fixed-size pool of threads running submitted jobs in FIFO order.
+ */
+#pragma once
+
+#include "error.h"
+
+#include <stddef.h> // for size_t
+
+/**
+ * @brief A job: a function called, by one of the threads of the pool, on its argument.
+ */
+typedef void (*thread_pool_job)(void *arg);
+
+struct thread_pool;
+
+/**
+ * @brief Starts a pool of nb_threads threads, waiting for jobs.
+ *
+ * @param nb_threads Number of threads, at least 1
+ * @param pool Set to the new pool
+ * @return error code, ERR_NONE if no error happened
+ */
+int thread_pool_create(size_t nb_threads, struct thread_pool **pool);
+
+/**
+ * @brief Queues a job, to be run by the first available thread of pool.
+ *
+ * @param pool Pool to run the job
+ * @param job Function to call
+ * @param arg Argument passed to job, owned by the job from now on
+ * @return error code, ERR_NONE if no error happened (job will run)
+ */
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job job, void *arg);
+
+/**
+ * @brief Runs the jobs still queued, then stops the threads and frees pool.
+ *
+ * @param pool Pool to destroy (nothing is done if NULL)
+ */
+void thread_pool_destroy(struct thread_pool *pool);
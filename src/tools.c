@@ -5,12 +5,25 @@
  * @author Mia Primorac
  */
 
+#define _POSIX_C_SOURCE 200809L // for fileno
+
 #include "imgStore.h"
+#include "buffer_pool.h"
+#include "imgst_changes.h"
+#include "imgst_index.h"
+#include "imgst_io.h"
+#include "imgst_lock.h"
+#include "imgst_pregen.h"
+#include "imgst_segment.h"
+#include "imgst_wal.h"
 #include "error.h"
 
 #include <stdio.h> // for sprintf
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <stdlib.h>
+#include <string.h> // for strpbrk
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /********************************************************************//**
  * Human-readable SHA
@@ -81,6 +94,28 @@ void print_metadata(const struct img_metadata *metadata) {
 
 }
 
+/********************************************************************//**
+ * Space usage display.
+ */
+void print_stats(const struct imgst_stats *stats) {
+
+    M_REQUIRE_NON_NULL_RET_VOID(stats, "null argument in print_stats");
+
+    FILE *out = stdout;
+    const uint64_t live = stats->live_bytes[RES_ORIG] + stats->live_bytes[RES_THUMB] + stats->live_bytes[RES_SMALL];
+
+    fprintf(out, "IMAGE COUNT: %"  PRIu32 "\t\tFREE SLOTS: %" PRIu32 "\n", stats->num_files, stats->free_slots);
+    fprintf(out, "LIVE ORIG. : %"  PRIu64 "\n", stats->live_bytes[RES_ORIG]);
+    fprintf(out, "LIVE THUMB.: %"  PRIu64 "\n", stats->live_bytes[RES_THUMB]);
+    fprintf(out, "LIVE SMALL : %"  PRIu64 "\n", stats->live_bytes[RES_SMALL]);
+    fprintf(out, "LIVE TOTAL : %"  PRIu64 "\t\tSAVED BY DEDUP: %" PRIu64 "\n", live, stats->dedup_bytes);
+    fprintf(out, "STORED: %"       PRIu64 "\t\tDATA: %" PRIu64 "\n", stats->stored_bytes, stats->data_bytes);
+    fprintf(out, "DEAD: %"         PRIu64 " (%.1f%%)\n", stats->dead_bytes,
+            stats->data_bytes > 0 ? 100.0 * (double) stats->dead_bytes / (double) stats->data_bytes : 0.0);
+    fprintf(out, "HOLES: %"        PRIu32 "\t\tLARGEST HOLE: %" PRIu64 "\n", stats->nb_holes, stats->largest_hole);
+
+}
+
 /********************************************************************//**
  * Read a header and metadata into an imgst_file.
  */
@@ -95,18 +130,94 @@ int do_open(const char *imgst_filename, const char *open_mode, struct imgst_file
 
     M_EXIT_IF_ERR_DO_SOMETHING(fread(&imgst_file->header, sizeof(imgst_file->header), 1, file) == 1 ? ERR_NONE : ERR_IO,
                                fclose(file));
+    M_EXIT_IF_ERR_DO_SOMETHING(check_header(&imgst_file->header), fclose(file));
 
-    imgst_file->metadata = calloc(sizeof(struct img_metadata), imgst_file->header.max_files);
+    imgst_file->metadata = calloc(sizeof(struct img_metadata), table_files(&imgst_file->header));
     M_EXIT_IF_ERR_DO_SOMETHING(imgst_file->metadata == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE, fclose(file));
 
 
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        M_EXIT_IF_ERR_DO_SOMETHING(
-                fread(&imgst_file->metadata[i], sizeof(imgst_file->metadata[i]), 1, file) == 1 ? ERR_NONE : ERR_IO,
-                GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
+    M_EXIT_IF_ERR_DO_SOMETHING(read_metadata_table(imgst_file, file),
+                               GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
+
+    struct stat file_stat;
+    M_EXIT_IF_ERR_DO_SOMETHING(fstat(fileno(file), &file_stat) == 0 ? ERR_NONE : ERR_IO,
+                               GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
+
+    imgst_file->file = file; // for read_segments and wal_recover
+    imgst_file->mapping = NULL;
+    M_EXIT_IF_ERR_DO_SOMETHING(read_segments(imgst_file, (uint64_t) file_stat.st_size),
+                               GROUP_CALLS(fclose(file), FREE(imgst_file->metadata)));
+
+    M_EXIT_IF_ERR_DO_SOMETHING(wal_recover(imgst_filename, imgst_file, strpbrk(open_mode, "+wa") != NULL),
+                               GROUP_CALLS(fclose(file), GROUP_CALLS(FREE(imgst_file->metadata),
+                                                                     free_segments(imgst_file))));
+
+    M_EXIT_IF_ERR_DO_SOMETHING(index_build(imgst_file),
+                               GROUP_CALLS(fclose(file), GROUP_CALLS(FREE(imgst_file->metadata),
+                                                                     free_segments(imgst_file))));
+
+    imgst_file->data_end = (uint64_t) file_stat.st_size;
+    imgst_file->lock = NULL;
+    imgst_file->pregen = NULL;
+    imgst_file->wal = NULL;
+    imgst_file->changes = NULL;
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Read a header and map the metadata into an imgst_file.
+ */
+int do_open_mapped(const char *imgst_filename, const char *open_mode, struct imgst_file *imgst_file) {
+
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(open_mode);
+
+    FILE *file = fopen(imgst_filename, open_mode);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(file, ERR_IO);
+
+    M_EXIT_IF_ERR_DO_SOMETHING(fread(&imgst_file->header, sizeof(imgst_file->header), 1, file) == 1 ? ERR_NONE : ERR_IO,
+                               fclose(file));
+    M_EXIT_IF_ERR_DO_SOMETHING(check_header(&imgst_file->header), fclose(file));
+
+    // the metadata segments do not lie next to the table: read them all in memory
+    if (imgst_file->header.next_segment != 0) {
+        fclose(file);
+        return do_open(imgst_filename, open_mode, imgst_file);
     }
 
-    imgst_file->file = file;
+    // mapping past the end of the file would fault on access instead of failing here
+    const size_t mapping_size = sizeof(struct imgst_header)
+                                + (size_t) table_files(&imgst_file->header) * sizeof(struct img_metadata);
+    struct stat file_stat;
+    M_EXIT_IF_ERR_DO_SOMETHING(fstat(fileno(file), &file_stat) == 0 && (size_t) file_stat.st_size >= mapping_size
+                               ? ERR_NONE : ERR_IO, fclose(file));
+
+    // a private mapping keeps in-memory updates of a read-only store from faulting
+    const bool shared = strpbrk(open_mode, "+wa") != NULL;
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE,
+                         fileno(file), 0);
+    M_EXIT_IF_ERR_DO_SOMETHING(mapping == MAP_FAILED ? ERR_IO : ERR_NONE, fclose(file));
+
+    imgst_file->metadata = (img_metadata *) ((char *) mapping + sizeof(struct imgst_header));
+    imgst_file->file = file; // for wal_recover
+    imgst_file->mapping = mapping;
+    imgst_file->mapping_size = mapping_size;
+    imgst_file->mapping_shared = shared;
+    imgst_file->segments = NULL;
+    imgst_file->nb_segments = 0;
+    M_EXIT_IF_ERR_DO_SOMETHING(wal_recover(imgst_filename, imgst_file, shared),
+                               GROUP_CALLS(fclose(file), GROUP_CALLS(munmap(mapping, mapping_size),
+                                                                     imgst_file->metadata = NULL)));
+    M_EXIT_IF_ERR_DO_SOMETHING(index_build(imgst_file),
+                               GROUP_CALLS(fclose(file), GROUP_CALLS(munmap(mapping, mapping_size),
+                                                                     imgst_file->metadata = NULL)));
+
+    imgst_file->lock = NULL;
+    imgst_file->pregen = NULL;
+    imgst_file->wal = NULL;
+    imgst_file->changes = NULL;
+    imgst_file->data_end = (uint64_t) file_stat.st_size;
     return ERR_NONE;
 }
 
@@ -118,9 +229,20 @@ void do_close(struct imgst_file *imgst_file) {
     M_REQUIRE_NON_NULL_RET_VOID(imgst_file, "null argument in do_close");
     M_REQUIRE_NON_NULL_RET_VOID(imgst_file->file, "null file in do_close");
 
+    pregen_free(imgst_file); // the queued resizings still use the file
+    wal_free(imgst_file);
     fclose(imgst_file->file);
-
-    if (imgst_file->metadata != NULL) {
+    index_free(imgst_file);
+    lock_free(imgst_file);
+    changes_free(imgst_file);
+    free_segments(imgst_file);
+    buffer_pool_trim(); // what the operations on the store kept
+
+    if (imgst_file->mapping != NULL) {
+        munmap(imgst_file->mapping, imgst_file->mapping_size);
+        imgst_file->mapping = NULL;
+        imgst_file->metadata = NULL;
+    } else if (imgst_file->metadata != NULL) {
         free(imgst_file->metadata);
         imgst_file->metadata = NULL;
     }